@@ -1,4 +1,5 @@
 #include "common.h"
+#include "MlpSetHashFamily.h"
 #include "gtest/gtest.h"
 
 namespace BucketCuckoo
@@ -153,63 +154,7 @@ struct Bucket
 	}		
 };
 
-namespace XXH
-{
-
-static const uint32_t XXH_SEED1 = 1192827283U;
-static const uint32_t XXH_SEED2 = 534897851U;
-
-static const uint32_t PRIME32_1 = 2654435761U;
-static const uint32_t PRIME32_2 = 2246822519U;
-static const uint32_t PRIME32_3 = 3266489917U;
-static const uint32_t PRIME32_4 = 668265263U;
-static const uint32_t PRIME32_5 = 374761393U;
-
-#define XXH_rotl32(x,r) ((x << r) | (x >> (32 - r)))
-
-uint32_t XXH32_avalanche(uint32_t h32)
-{
-    h32 ^= h32 >> 15;
-    h32 *= PRIME32_2;
-    h32 ^= h32 >> 13;
-    h32 *= PRIME32_3;
-    h32 ^= h32 >> 16;
-    return h32;
-}
-
-uint32_t XXH32_CoreLogic(uint64_t key, uint32_t len, uint32_t seed, uint32_t multiplier)
-{
-	key >>= (8-len)*8;
-	key <<= (8-len)*8;
-	uint32_t low = key;
-	uint32_t high = key >> 32;
-	uint32_t h32 = PRIME32_5 + seed + len;
-	h32 ^= high * multiplier; 
-	h32 = XXH_rotl32(h32, 17) * PRIME32_4;
-	if (len > 4)
-	{
-		h32 ^= low * multiplier; 
-		h32 = XXH_rotl32(h32, 17) * PRIME32_4;
-	}
-	return XXH32_avalanche(h32);
-}
-
-uint32_t HashFn1(uint64_t key, uint32_t len)
-{
-	return XXH32_CoreLogic(key, len, XXH_SEED1, PRIME32_1);
-}
-
-uint32_t HashFn2(uint64_t key, uint32_t len)
-{
-	return XXH32_CoreLogic(key, len, XXH_SEED2, PRIME32_3);
-}
-
-uint32_t HashFn3(uint64_t key, uint32_t len)
-{
-	return XXH32_CoreLogic(key, len, 0 /*seed*/, PRIME32_3);
-}
-
-}	// namespace XXH
+using MlpSetUInt64::XXHashFamily;
 
 const int HtSize = 8388608;
 
@@ -227,8 +172,8 @@ int CuckooDisplacement(uint32_t pos, uint64_t value, int size, int round, bool&
 	{
 		sumMoves++;
 		pair<uint64_t, int> victim = ht[pos].PopItemForInsert(value, size);
-		uint32_t h1 = XXH::HashFn1(victim.first, 8) % HtSize;
-		uint32_t h2 = XXH::HashFn2(victim.first, 8) % HtSize;
+		uint32_t h1 = XXHashFamily::HashFn1(victim.first, 8) % HtSize;
+		uint32_t h2 = XXHashFamily::HashFn2(victim.first, 8) % HtSize;
 		if (h1 == h2) { h2 = (h2 + 1) % HtSize; }
 		assert(h1 == pos || h2 == pos);
 		if (h1 == pos) h1 = h2;
@@ -249,8 +194,8 @@ void Insert(uint64_t value, int size, bool& exist, bool& failed)
 {
 	failed = false;
 	exist = false;
-	uint32_t h1 = XXH::HashFn1(value, 8) % HtSize;
-	uint32_t h2 = XXH::HashFn2(value, 8) % HtSize;
+	uint32_t h1 = XXHashFamily::HashFn1(value, 8) % HtSize;
+	uint32_t h2 = XXHashFamily::HashFn2(value, 8) % HtSize;
 	if (h1 == h2) { h2 = (h2 + 1) % HtSize; }
 	if (ht[h1].Exist(value) || ht[h2].Exist(value))
 	{
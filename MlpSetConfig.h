@@ -0,0 +1,158 @@
+#pragma once
+
+#include "common.h"
+#include "MlpSetHashFamily.h"
+#include "MlpSetNuma.h"
+
+namespace MlpSetUInt64
+{
+
+// Allocation policies of the memory chunk holding the flat bitmaps and the hash table of MlpSet
+// An allocation policy provides:
+//    static void* Allocate(uint64_t size)
+//        returns size bytes of zero-filled memory, aligned to at least 4KB
+//    static void Free(void* ptr, uint64_t size)
+//        frees memory returned by Allocate(size)
+//
+
+// hugetlbfs pages of hugePageSize bytes (2MB or 1GB)
+// The pages must be reserved beforehand (/sys/kernel/mm/hugepages/hugepages-<size>kB/nr_hugepages), Allocate fails otherwise
+//
+template<uint64_t hugePageSize>
+struct HugeTLBAllocator
+{
+	static_assert(hugePageSize == (1ULL << 21) || hugePageSize == (1ULL << 30), "hugePageSize must be 2MB or 1GB");
+
+	static void* Allocate(uint64_t size)
+	{
+		void* ptr = mmap(NULL,
+		                 size,
+		                 PROT_READ | PROT_WRITE,
+		                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (__builtin_ctzll(hugePageSize) << MAP_HUGE_SHIFT),
+		                 -1 /*fd*/,
+		                 0 /*offset*/);
+		ReleaseAssert(ptr != MAP_FAILED);
+		return ptr;
+	}
+
+	static void Free(void* ptr, uint64_t size)
+	{
+		// According to manual, the munmap length must be a multiple of HugePageSize
+		//
+		int ret = munmap(ptr, (size - 1) / hugePageSize * hugePageSize + hugePageSize);
+		ReleaseAssert(ret == 0);
+	}
+};
+
+// Normal pages, with transparent hugepages requested by madvise
+// Does not need reserved hugepages, but whether the memory is backed by hugepages is up to the kernel
+// (khugepaged may take a while to collapse the pages)
+//
+struct TransparentHugePageAllocator
+{
+	static void* Allocate(uint64_t size)
+	{
+		void* ptr = mmap(NULL,
+		                 size,
+		                 PROT_READ | PROT_WRITE,
+		                 MAP_PRIVATE | MAP_ANONYMOUS,
+		                 -1 /*fd*/,
+		                 0 /*offset*/);
+		ReleaseAssert(ptr != MAP_FAILED);
+		// failure is harmless (e.g. THP disabled), we just get normal pages
+		//
+		madvise(ptr, size, MADV_HUGEPAGE);
+		return ptr;
+	}
+
+	static void Free(void* ptr, uint64_t size)
+	{
+		int ret = munmap(ptr, size);
+		ReleaseAssert(ret == 0);
+	}
+};
+
+// BaseAllocator, with the memory placed by the NUMA policy of the allocating thread:
+// on the node of the enclosing NumaAllocationScope, or interleaved over all nodes outside of any scope
+// (so that the ~2 DRAM round trips of a query are not all remote for half of the cores), see NumaTopology::BindMemory
+//
+template<class BaseAllocator>
+struct NumaAllocator
+{
+	static void* Allocate(uint64_t size)
+	{
+		void* ptr = BaseAllocator::Allocate(size);
+		NumaTopology::BindMemory(ptr, size, NumaAllocationScope::GetNode());
+		return ptr;
+	}
+
+	static void Free(void* ptr, uint64_t size)
+	{
+		BaseAllocator::Free(ptr, size);
+	}
+};
+
+// The allocation policy used by default, hugetlbfs pages of HUGEPAGESIZE_BYTES (common.h)
+//
+typedef HugeTLBAllocator<HUGEPAGESIZE_BYTES> DefaultAllocator;
+
+// Whether the configurations that do not say otherwise collect statistics, controlled by ENABLE_STATS (common.h)
+//
+#ifdef ENABLE_STATS
+const bool x_defaultEnableStats = true;
+#else
+const bool x_defaultEnableStats = false;
+#endif
+
+// Compile-time configuration of MlpSet (the Config template parameter of BasicCuckooHashTable and BasicMlpSet)
+// A configuration provides:
+//    typedef ... HashFamily
+//        the hash functions of the Cuckoo hash table (see MlpSetHashFamily.h)
+//    typedef ... Allocator
+//        the allocation policy of the flat bitmaps and the hash table (see above)
+//    static const bool x_enableStats
+//        whether statistics are collected, if false all statistics code is compiled out
+//    static const int x_numFlatLevels
+//        # of flat levels of the tree (3 or 4) fixed at compile time, so that the hot paths test a constant,
+//        or 0 to choose it at Init time
+// MlpSetConfig builds a configuration from its parameters.
+// The members of MlpSet are defined in MlpSetUInt64.cpp (except the query path, see MlpSetUInt64Query.h), so every configuration in use
+// must be explicitly instantiated at the end of that file.
+//
+template<class HashFamilyT,
+         bool enableStats = x_defaultEnableStats,
+         int numFlatLevels = 0,
+         class AllocatorT = DefaultAllocator>
+struct MlpSetConfig
+{
+	static_assert(numFlatLevels == 0 || numFlatLevels == 3 || numFlatLevels == 4, "numFlatLevels must be 0, 3 or 4");
+
+	typedef HashFamilyT HashFamily;
+	typedef AllocatorT Allocator;
+	static const bool x_enableStats = enableStats;
+	static const int x_numFlatLevels = numFlatLevels;
+};
+
+// The configuration of MlpSet and CuckooHashTable
+//
+typedef MlpSetConfig<XXHashFamily> DefaultMlpSetConfig;
+
+// Predefined configurations (they are distinct types even if ENABLE_STATS makes the parameters coincide with the default)
+//
+// Statistics always on
+//
+struct StatsMlpSetConfig : public MlpSetConfig<XXHashFamily, true /*enableStats*/> { };
+
+// 4 flat levels fixed at compile time
+//
+struct FourFlatLevelsMlpSetConfig : public MlpSetConfig<XXHashFamily, x_defaultEnableStats, 4 /*numFlatLevels*/> { };
+
+// Transparent hugepages instead of hugetlbfs
+//
+struct TransparentHugePageMlpSetConfig : public MlpSetConfig<XXHashFamily, x_defaultEnableStats, 0, TransparentHugePageAllocator> { };
+
+// NUMA-aware placement of the default hugetlbfs pages
+//
+struct NumaMlpSetConfig : public MlpSetConfig<XXHashFamily, x_defaultEnableStats, 0, NumaAllocator<DefaultAllocator> > { };
+
+}	// namespace MlpSetUInt64
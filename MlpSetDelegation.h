@@ -0,0 +1,357 @@
+#pragma once
+
+#include "common.h"
+#include "MlpSetSharded.h"
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <pthread.h>
+
+namespace MlpSetUInt64
+{
+
+// A lock-free single-producer single-consumer ring of x_capacity (a power of 2) elements
+// The producer and consumer indices are on their own cache lines
+//
+template<class T, uint32_t x_capacity>
+class SpscRing
+{
+public:
+	static_assert((x_capacity & (x_capacity - 1)) == 0, "capacity must be a power of 2");
+
+	SpscRing() : m_head(0), m_tail(0) { }
+
+	// Producer side, returns false if the ring is full
+	//
+	bool TryPush(const T& value)
+	{
+		uint32_t tail = m_tail.load(std::memory_order_relaxed);
+		if (tail - m_head.load(std::memory_order_acquire) == x_capacity)
+		{
+			return false;
+		}
+		m_slots[tail & (x_capacity - 1)] = value;
+		m_tail.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer side, pops up to maxCount elements into out, returns the # of elements popped
+	//
+	uint32_t PopBatch(T* out, uint32_t maxCount)
+	{
+		uint32_t head = m_head.load(std::memory_order_relaxed);
+		uint32_t count = min(m_tail.load(std::memory_order_acquire) - head, maxCount);
+		rep(i, 0, int(count) - 1)
+		{
+			out[i] = m_slots[(head + i) & (x_capacity - 1)];
+		}
+		m_head.store(head + count, std::memory_order_release);
+		return count;
+	}
+
+private:
+	alignas(64) std::atomic<uint32_t> m_head;
+	alignas(64) std::atomic<uint32_t> m_tail;
+	alignas(64) T m_slots[x_capacity];
+};
+
+// A request to the owner of a shard
+// The request is owned by the client, which must keep it alive until IsDone()
+//
+struct DelegationRequest
+{
+	enum Type
+	{
+		INSERT,
+		EXIST,
+		LOWER_BOUND
+	};
+
+	DelegationRequest() : done(false) { }
+
+	bool IsDone() { return done.load(std::memory_order_acquire); }
+
+	Type type;
+	uint64_t key;
+	// INSERT: whether the key was inserted, EXIST: whether the key exists, LOWER_BOUND: whether a lower bound exists
+	//
+	bool found;
+	// LOWER_BOUND: the lower bound
+	//
+	uint64_t result;
+	std::atomic<bool> done;
+};
+
+// Delegation-based concurrency on top of the thread-per-shard mode of ShardedMlpSet
+//
+// Each shard is owned by one owner thread (pinned to a core), which is the only thread ever touching the shard,
+// so the shards need no locks at all. A client thread registers a Client, which has one SPSC request ring
+// per owner, and submits each request to the ring of the owner of the key's shard.
+// Owners poll the rings of all clients, and drain them in batches of up to x_batchSize requests.
+// Within a batch, the LowerBound requests are first all issued with the promise-returning LowerBound,
+// which prefetches the hash table slots of the answer, and only then resolved,
+// so the DRAM misses of the requests in a batch overlap (memory-level parallelism).
+// An Insert resolves the pending LowerBounds first, so the requests of a client are executed in order.
+//
+// A client can wait for each request (Insert/Exist/LowerBound), or keep several requests in flight
+// with Submit and Wait, which is what fills the batches of the owners.
+//
+template<class Config>
+class BasicDelegatedMlpSet
+{
+public:
+	static const int x_maxClients = 64;
+	static const uint32_t x_ringSize = 256;
+	static const uint32_t x_batchSize = 32;
+
+	typedef SpscRing<DelegationRequest*, x_ringSize> RequestRing;
+
+	// The handle of a client, must only be used by one thread at a time
+	//
+	class Client
+	{
+	public:
+		// Submit a request, the request must stay alive until IsDone() or Wait() returns
+		//
+		void Submit(DelegationRequest& req)
+		{
+			req.done.store(false, std::memory_order_relaxed);
+			RequestRing& ring = m_rings[m_set->m_shardedSet.ShardOf(req.key)];
+			SpinWaiter waiter;
+			while (!ring.TryPush(&req))
+			{
+				waiter.Wait();
+			}
+		}
+
+		void Wait(DelegationRequest& req)
+		{
+			SpinWaiter waiter;
+			while (!req.IsDone())
+			{
+				waiter.Wait();
+			}
+		}
+
+		bool Insert(uint64_t value)
+		{
+			DelegationRequest req;
+			req.type = DelegationRequest::INSERT;
+			req.key = value;
+			Submit(req);
+			Wait(req);
+			return req.found;
+		}
+
+		bool Exist(uint64_t value)
+		{
+			DelegationRequest req;
+			req.type = DelegationRequest::EXIST;
+			req.key = value;
+			Submit(req);
+			Wait(req);
+			return req.found;
+		}
+
+		uint64_t LowerBound(uint64_t value, bool& found)
+		{
+			DelegationRequest req;
+			req.type = DelegationRequest::LOWER_BOUND;
+			req.key = value;
+			Submit(req);
+			Wait(req);
+			found = req.found;
+			return req.result;
+		}
+
+	private:
+		friend class BasicDelegatedMlpSet;
+
+		BasicDelegatedMlpSet* m_set;
+		// one ring per owner
+		//
+		RequestRing* m_rings;
+	};
+
+	BasicDelegatedMlpSet()
+		: m_numOwners(0)
+		, m_numClients(0)
+		, m_stop(false)
+	{ }
+
+	~BasicDelegatedMlpSet()
+	{
+		Shutdown();
+		rep(i, 0, m_numClients.load(std::memory_order_relaxed) - 1)
+		{
+			Client* client = m_clients[i];
+			rep(k, 0, m_numOwners - 1)
+			{
+				client->m_rings[k].~RequestRing();
+			}
+			free(client->m_rings);
+			delete client;
+		}
+	}
+
+	// Initialize the set to hold at most maxSetSize elements, in numOwners shards (see ShardedMlpSet::Init),
+	// and start the owner threads. If pinThreads, owner i is pinned to core i (modulo the # of cores).
+	//
+	void Init(uint32_t maxSetSize, int numOwners, const uint64_t* sample, uint32_t sampleSize, bool pinThreads = true)
+	{
+		assert(m_numOwners == 0);
+		m_numOwners = numOwners;
+		m_shardedSet.Init(maxSetSize, numOwners, sample, sampleSize);
+		int numCores = max(1, int(std::thread::hardware_concurrency()));
+		rep(i, 0, numOwners - 1)
+		{
+			m_owners.push_back(std::thread([this, i]() { OwnerLoop(i); }));
+			if (pinThreads)
+			{
+				cpu_set_t cpuset;
+				CPU_ZERO(&cpuset);
+				CPU_SET(i % numCores, &cpuset);
+				int ret = pthread_setaffinity_np(m_owners.back().native_handle(), sizeof(cpu_set_t), &cpuset);
+				ReleaseAssert(ret == 0);
+			}
+		}
+	}
+
+	// Register a new client, thread-safe
+	//
+	Client* RegisterClient()
+	{
+		std::lock_guard<std::mutex> lock(m_registerMutex);
+		int id = m_numClients.load(std::memory_order_relaxed);
+		ReleaseAssert(id < x_maxClients);
+		Client* client = new Client();
+		client->m_set = this;
+		// operator new does not honor the alignment of RequestRing in C++14
+		//
+		client->m_rings = reinterpret_cast<RequestRing*>(aligned_alloc(alignof(RequestRing), sizeof(RequestRing) * m_numOwners));
+		ReleaseAssert(client->m_rings != nullptr);
+		rep(k, 0, m_numOwners - 1)
+		{
+			new (&client->m_rings[k]) RequestRing();
+		}
+		m_clients[id] = client;
+		m_numClients.store(id + 1, std::memory_order_release);
+		return client;
+	}
+
+	// Stop the owner threads, all submitted requests must have completed
+	//
+	void Shutdown()
+	{
+		m_stop.store(true, std::memory_order_release);
+		for (std::thread& t : m_owners)
+		{
+			t.join();
+		}
+		m_owners.clear();
+	}
+
+	int GetNumOwners() { return m_numOwners; }
+
+	// The underlying set, must not be accessed while the owner threads are running
+	//
+	BasicShardedMlpSet<Config>* GetShardedSet() { return &m_shardedSet; }
+
+private:
+	typedef typename BasicMlpSet<Config>::Promise Promise;
+
+	void OwnerLoop(int owner)
+	{
+		DelegationRequest* batch[x_batchSize];
+		SpinWaiter waiter;
+		int nextClient = 0;
+		while (!m_stop.load(std::memory_order_acquire))
+		{
+			// round-robin over the clients, starting from a different client each time so no client is starved
+			//
+			int numClients = m_numClients.load(std::memory_order_acquire);
+			uint32_t n = 0;
+			rep(i, 0, numClients - 1)
+			{
+				int c = (nextClient + i) % numClients;
+				n += m_clients[c]->m_rings[owner].PopBatch(batch + n, x_batchSize - n);
+				if (n == x_batchSize)
+				{
+					break;
+				}
+			}
+			nextClient = (numClients == 0) ? 0 : (nextClient + 1) % numClients;
+			if (n == 0)
+			{
+				waiter.Wait();
+				continue;
+			}
+			ProcessBatch(owner, batch, n);
+		}
+	}
+
+	void ProcessBatch(int owner, DelegationRequest** batch, uint32_t n)
+	{
+		BasicMlpSet<Config>* shard = m_shardedSet.GetShard(owner);
+		Promise promises[x_batchSize];
+		// the LowerBound requests in [pendingBegin, i) are issued but not resolved
+		//
+		uint32_t pendingBegin = 0;
+		rep(i, 0, int(n) - 1)
+		{
+			DelegationRequest* req = batch[i];
+			assert(m_shardedSet.ShardOf(req->key) == owner);
+			if (req->type == DelegationRequest::LOWER_BOUND)
+			{
+				promises[i] = shard->LowerBound(req->key);
+				continue;
+			}
+			if (req->type == DelegationRequest::INSERT)
+			{
+				ResolveLowerBounds(owner, batch, promises, pendingBegin, i);
+				pendingBegin = i + 1;
+				req->found = m_shardedSet.InsertUnlocked(req->key);
+			}
+			else
+			{
+				req->found = shard->Exist(req->key);
+			}
+			req->done.store(true, std::memory_order_release);
+		}
+		ResolveLowerBounds(owner, batch, promises, pendingBegin, n);
+	}
+
+	void ResolveLowerBounds(int owner, DelegationRequest** batch, Promise* promises, uint32_t begin, uint32_t end)
+	{
+		rep(i, int(begin), int(end) - 1)
+		{
+			DelegationRequest* req = batch[i];
+			if (req->type != DelegationRequest::LOWER_BOUND)
+			{
+				continue;
+			}
+			if (promises[i].IsValid())
+			{
+				req->found = true;
+				req->result = promises[i].Resolve();
+			}
+			else
+			{
+				req->result = m_shardedSet.NextShardMinimum(owner, req->found);
+			}
+			req->done.store(true, std::memory_order_release);
+		}
+	}
+
+	BasicShardedMlpSet<Config> m_shardedSet;
+	int m_numOwners;
+	vector<std::thread> m_owners;
+	std::mutex m_registerMutex;
+	Client* m_clients[x_maxClients];
+	std::atomic<int> m_numClients;
+	std::atomic<bool> m_stop;
+};
+
+typedef BasicDelegatedMlpSet<DefaultMlpSetConfig> DelegatedMlpSet;
+
+}	// namespace MlpSetUInt64
@@ -0,0 +1,324 @@
+#include "common.h"
+#include "MlpSetDelegation.h"
+#include "gtest/gtest.h"
+#include <thread>
+#include <mutex>
+#include <random>
+
+namespace {
+
+using MlpSetUInt64::DelegatedMlpSet;
+using MlpSetUInt64::DelegationRequest;
+using MlpSetUInt64::ShardedMlpSet;
+
+// Keys distributed as in WorkloadA: 2 bytes in [32, 96), then 6 bytes in [48, 53)
+//
+uint64_t GenWorkloadAKey(std::mt19937_64& rng)
+{
+	uint64_t key = 0;
+	rep(k, 0, 1) key = key * 256 + rng() % 64 + 32;
+	rep(k, 2, 7) key = key * 256 + rng() % 5 + 48;
+	return key;
+}
+
+TEST(MlpSetDelegation, CorrectnessTest)
+{
+	const int numOwners = 4;
+	const int numClients = 6;
+	const int numKeysPerClient = 20000;
+	const int numFinalKeys = 100000;
+	const int window = 16;
+	std::mt19937_64 rng(1);
+	vector<uint64_t> sample;
+	rep(i, 0, 9999) sample.push_back(GenWorkloadAKey(rng));
+
+	DelegatedMlpSet ds;
+	ds.Init(numClients * numKeysPerClient + numFinalKeys + 10, numOwners, sample.data(), sample.size());
+
+	// each client inserts its own keys, half synchronously and half through a window of in-flight requests,
+	// and reads its own writes
+	//
+	vector<vector<uint64_t> > keys(numClients);
+	set<uint64_t> S;
+	rep(c, 0, numClients - 1)
+	{
+		while (int(keys[c].size()) < numKeysPerClient)
+		{
+			uint64_t key = GenWorkloadAKey(rng);
+			if (S.insert(key).second)
+			{
+				keys[c].push_back(key);
+			}
+		}
+	}
+	vector<std::thread> threads;
+	rep(c, 0, numClients - 1)
+	{
+		threads.push_back(std::thread([&, c]() {
+			DelegatedMlpSet::Client* client = ds.RegisterClient();
+			std::mt19937_64 threadRng(c + 100);
+			int half = numKeysPerClient / 2;
+			rep(i, 0, half - 1)
+			{
+				ReleaseAssert(client->Insert(keys[c][i]));
+				uint64_t key = keys[c][threadRng() % (i + 1)];
+				ReleaseAssert(client->Exist(key));
+				bool found;
+				ReleaseAssert(client->LowerBound(key, found) == key && found);
+			}
+			DelegationRequest reqs[window * 3];
+			for (int i = half; i < numKeysPerClient; i += window)
+			{
+				int n = min(window, numKeysPerClient - i);
+				rep(k, 0, n - 1)
+				{
+					reqs[k * 3].type = DelegationRequest::INSERT;
+					reqs[k * 3].key = keys[c][i + k];
+					client->Submit(reqs[k * 3]);
+					// a lookup of the same key right behind the insert must see it
+					//
+					reqs[k * 3 + 1].type = DelegationRequest::EXIST;
+					reqs[k * 3 + 1].key = keys[c][i + k];
+					client->Submit(reqs[k * 3 + 1]);
+					reqs[k * 3 + 2].type = DelegationRequest::LOWER_BOUND;
+					reqs[k * 3 + 2].key = keys[c][i + k];
+					client->Submit(reqs[k * 3 + 2]);
+				}
+				rep(k, 0, n - 1)
+				{
+					rep(j, 0, 2) client->Wait(reqs[k * 3 + j]);
+					ReleaseAssert(reqs[k * 3].found && reqs[k * 3 + 1].found && reqs[k * 3 + 2].found);
+					ReleaseAssert(reqs[k * 3 + 2].result == keys[c][i + k]);
+				}
+			}
+		}));
+	}
+	for (std::thread& t : threads)
+	{
+		t.join();
+	}
+
+	// check against std::set from one more client, inserting keys (of the sampled distribution, which the shards are sized for)
+	// and querying random keys too
+	//
+	DelegatedMlpSet::Client* client = ds.RegisterClient();
+	rep(i, 0, numFinalKeys * 2 - 1)
+	{
+		bool insert = (i % 2 == 0);
+		uint64_t key = insert ? GenWorkloadAKey(rng) : rng();
+		auto it = S.lower_bound(key);
+		bool exists = (it != S.end() && *it == key);
+		ReleaseAssert(client->Exist(key) == exists);
+		if (insert)
+		{
+			ReleaseAssert(client->Insert(key) == !exists);
+			S.insert(key);
+		}
+		bool found;
+		uint64_t lb = client->LowerBound(key, found);
+		it = S.lower_bound(key);
+		ReleaseAssert(found == (it != S.end()));
+		if (found)
+		{
+			ReleaseAssert(lb == *it);
+		}
+	}
+}
+
+// One op of the mixed workload, 10% insertions of new keys, the rest split evenly between Exist and LowerBound
+//
+struct MixedOp
+{
+	DelegationRequest::Type type;
+	uint64_t key;
+};
+
+vector<MixedOp> GenMixedOps(std::mt19937_64& rng, int numOps, const vector<uint64_t>& loadedKeys)
+{
+	vector<MixedOp> ops;
+	rep(i, 0, numOps - 1)
+	{
+		MixedOp op;
+		int r = rng() % 100;
+		if (r < 10)
+		{
+			op.type = DelegationRequest::INSERT;
+			op.key = GenWorkloadAKey(rng);
+		}
+		else
+		{
+			op.type = (r % 2 == 0) ? DelegationRequest::EXIST : DelegationRequest::LOWER_BOUND;
+			op.key = (rng() % 2 == 0) ? loadedKeys[rng() % loadedKeys.size()] : GenWorkloadAKey(rng);
+		}
+		ops.push_back(op);
+	}
+	return ops;
+}
+
+// A single MlpSet behind a mutex
+//
+struct MutexMlpSet
+{
+	bool Insert(uint64_t key) { std::lock_guard<std::mutex> lock(mutex); return set.Insert(key); }
+	bool Exist(uint64_t key) { std::lock_guard<std::mutex> lock(mutex); return set.Exist(key); }
+	uint64_t LowerBound(uint64_t key, bool& found) { std::lock_guard<std::mutex> lock(mutex); return set.LowerBound(key, found); }
+
+	std::mutex mutex;
+	MlpSetUInt64::MlpSet set;
+};
+
+template<class Set>
+uint64_t ExecuteOp(Set& s, const MixedOp& op)
+{
+	bool found;
+	switch (op.type)
+	{
+		case DelegationRequest::INSERT: return s.Insert(op.key);
+		case DelegationRequest::EXIST: return s.Exist(op.key);
+		default: return s.LowerBound(op.key, found);
+	}
+}
+
+// Execute the ops synchronously, and record the latency of every x_latencySampleRate-th op
+//
+const int x_latencySampleRate = 8;
+
+template<class Set>
+void NO_INLINE RunSyncClient(Set& s, const MixedOp* ops, int numOps, vector<double>& latencies)
+{
+	rep(i, 0, numOps - 1)
+	{
+		if (i % x_latencySampleRate == 0)
+		{
+			fasttime_t start = gettime();
+			ExecuteOp(s, ops[i]);
+			latencies.push_back(tdiff(start, gettime()));
+		}
+		else
+		{
+			ExecuteOp(s, ops[i]);
+		}
+	}
+}
+
+// Execute the ops through a delegation client, with up to window requests in flight
+//
+void NO_INLINE RunAsyncClient(DelegatedMlpSet::Client* client, const MixedOp* ops, int numOps, int window)
+{
+	vector<DelegationRequest> reqs(window);
+	for (int i = 0; i < numOps; i += window)
+	{
+		int n = min(window, numOps - i);
+		rep(k, 0, n - 1)
+		{
+			reqs[k].type = ops[i + k].type;
+			reqs[k].key = ops[i + k].key;
+			client->Submit(reqs[k]);
+		}
+		rep(k, 0, n - 1)
+		{
+			client->Wait(reqs[k]);
+		}
+	}
+}
+
+// Run numClients client threads, each executing its share of ops with clientFn(client index, ops, numOps, latencies),
+// and print the throughput and latency
+//
+template<class ClientFn>
+void RunClients(const char* name, int numClients, const vector<MixedOp>& ops, ClientFn clientFn)
+{
+	int numOps = ops.size();
+	vector<vector<double> > latencies(numClients);
+	double t;
+	{
+		AutoTimer timer(&t);
+		vector<std::thread> threads;
+		rep(k, 0, numClients - 1)
+		{
+			int begin = int(uint64_t(numOps) * k / numClients);
+			int end = int(uint64_t(numOps) * (k + 1) / numClients);
+			threads.push_back(std::thread([&, k, begin, end]() {
+				clientFn(k, ops.data() + begin, end - begin, latencies[k]);
+			}));
+		}
+		for (std::thread& th : threads)
+		{
+			th.join();
+		}
+	}
+	vector<double> all;
+	for (vector<double>& l : latencies)
+	{
+		all.insert(all.end(), l.begin(), l.end());
+	}
+	if (all.empty())
+	{
+		printf("%s, %d clients: %.2lf Mops/s\n", name, numClients, numOps / t / 1e6);
+	}
+	else
+	{
+		sort(all.begin(), all.end());
+		printf("%s, %d clients: %.2lf Mops/s, latency p50 %.2lf us, p99 %.2lf us\n", name, numClients, numOps / t / 1e6,
+		       all[all.size() / 2] * 1e6, all[all.size() * 99 / 100] * 1e6);
+	}
+}
+
+TEST(MlpSetDelegation, ThroughputAndLatency)
+{
+	const int numLoaded = 1000000;
+	const int numOps = 1000000;
+	const int numOwners = 4;
+	const int window = 16;
+	printf("%d hardware threads, %d owners\n", int(std::thread::hardware_concurrency()), numOwners);
+	std::mt19937_64 rng(12345);
+	vector<uint64_t> loadedKeys;
+	rep(i, 0, numLoaded - 1) loadedKeys.push_back(GenWorkloadAKey(rng));
+	vector<MixedOp> ops = GenMixedOps(rng, numOps, loadedKeys);
+	uint32_t maxSetSize = numLoaded + numOps / 10 + 1000;
+
+	for (int numClients = 1; numClients <= 32; numClients *= 2)
+	{
+		printf("==== %d clients ====\n", numClients);
+		{
+			MutexMlpSet s;
+			s.set.Init(maxSetSize);
+			for (uint64_t key : loadedKeys) s.set.Insert(key);
+			RunClients("mutex", numClients, ops, [&](int, const MixedOp* o, int n, vector<double>& l) {
+				RunSyncClient(s, o, n, l);
+			});
+		}
+		{
+			ShardedMlpSet s;
+			s.Init(maxSetSize, numOwners, loadedKeys.data(), 10000);
+			for (uint64_t key : loadedKeys) s.Insert(key);
+			RunClients("sharded spinlock", numClients, ops, [&](int, const MixedOp* o, int n, vector<double>& l) {
+				RunSyncClient(s, o, n, l);
+			});
+		}
+		rep(async, 0, 1)
+		{
+			DelegatedMlpSet ds;
+			ds.Init(maxSetSize, numOwners, loadedKeys.data(), 10000);
+			vector<DelegatedMlpSet::Client*> clients;
+			rep(k, 0, numClients - 1) clients.push_back(ds.RegisterClient());
+			vector<MixedOp> load;
+			for (uint64_t key : loadedKeys) load.push_back(MixedOp { DelegationRequest::INSERT, key });
+			RunAsyncClient(clients[0], load.data(), load.size(), 64);
+			if (async)
+			{
+				RunClients("delegation, 16 in flight", numClients, ops, [&](int k, const MixedOp* o, int n, vector<double>&) {
+					RunAsyncClient(clients[k], o, n, window);
+				});
+			}
+			else
+			{
+				RunClients("delegation, synchronous", numClients, ops, [&](int k, const MixedOp* o, int n, vector<double>& l) {
+					RunSyncClient(*clients[k], o, n, l);
+				});
+			}
+		}
+	}
+}
+
+}	// annoymous namespace
@@ -0,0 +1,255 @@
+#pragma once
+
+#include "common.h"
+#include "MlpSetUInt64.h"
+#include "MlpSetLog.h"
+
+namespace MlpSetUInt64
+{
+
+// A set made durable by a redo log of its mutations and periodic checkpoints, stored in a directory
+//
+// Every insertion that changes the set is appended to the WriteAheadLog (see there for group commit).
+// Insert does not wait for its record to be durable: a caller that needs durability calls Sync
+// (or WaitDurable with the returned LSN), so any number of insertions share one sync.
+//
+// Directory layout: log files wal-<LSN of their first record>, and checkpoints checkpoint-<LSN>
+// holding the sorted keys of the set after all records before LSN.
+// A checkpoint first switches to a new log file starting at the checkpoint LSN, then writes the checkpoint,
+// then removes the files it makes obsolete, so a crash at any point leaves a checkpoint and the log files after it.
+// Open recovers the set by bulk loading the latest complete checkpoint and replaying the log on top of it,
+// a torn batch at the end of the last log file (written during a crash, so never reported durable) is cut off.
+//
+// Checkpoints are taken synchronously by the writer, blocking insertions while the keys are written out.
+//
+template<class Config>
+class BasicDurableMlpSet
+{
+public:
+	typedef BasicMlpSet<Config> Set;
+
+	BasicDurableMlpSet()
+		: m_checkpointInterval(0)
+		, m_recoveryThreads(1)
+		, m_lastCheckpointLsn(0)
+		, m_numCheckpoints(0)
+		, m_numRecoveredCheckpointKeys(0)
+		, m_numReplayedRecords(0)
+	{ }
+
+	~BasicDurableMlpSet()
+	{
+		if (m_log.IsOpen())
+		{
+			Close();
+		}
+	}
+
+	// Take a checkpoint once numRecords records were logged since the last one, 0 to only take checkpoints on request
+	//
+	void SetCheckpointInterval(uint64_t numRecords) { m_checkpointInterval = numRecords; }
+
+	// # of threads bulk loading the checkpoint during recovery
+	//
+	void SetRecoveryThreads(int numThreads) { m_recoveryThreads = numThreads; }
+
+	// The log, to configure it (sync mode, group commit) before Open
+	//
+	WriteAheadLog& GetLog() { return m_log; }
+
+	// Open the set stored in dir (creating dir if needed), recovering its content
+	//
+	void Open(const string& dir, uint32_t maxSetSize)
+	{
+		assert(!m_log.IsOpen());
+		m_dir = dir;
+		LogDirectory::Create(dir);
+
+		vector<uint64_t> keys;
+		uint64_t checkpointLsn = 0;
+		vector<pair<uint64_t, string> > checkpoints = LogDirectory::List(dir, x_checkpointPrefix);
+		repd(i, int(checkpoints.size()) - 1, 0)
+		{
+			if (CheckpointFile::Read(checkpoints[i].second, checkpointLsn, keys))
+			{
+				ReleaseAssert(checkpointLsn == checkpoints[i].first);
+				break;
+			}
+			checkpointLsn = 0;
+		}
+		m_set.Init(maxSetSize);
+		if (!keys.empty())
+		{
+			m_set.BulkLoadSorted(keys.data(), keys.size(), m_recoveryThreads);
+		}
+		m_numRecoveredCheckpointKeys = keys.size();
+		vector<uint64_t>().swap(keys);
+
+		// replay the log files holding records from checkpointLsn on, in order
+		//
+		uint64_t nextLsn = checkpointLsn;
+		m_numReplayedRecords = 0;
+		vector<pair<uint64_t, string> > logs = LogDirectory::List(dir, x_logPrefix);
+		rep(i, 0, int(logs.size()) - 1)
+		{
+			bool isLast = (i == int(logs.size()) - 1);
+			if (!isLast && logs[i + 1].first <= checkpointLsn)
+			{
+				continue;
+			}
+			uint64_t firstLsn, endLsn;
+			bool ok = WriteAheadLog::Replay(logs[i].second, [&](uint64_t lsn, const uint64_t* k, const uint8_t* ops, uint32_t n) {
+				rep(j, 0, int(n) - 1)
+				{
+					if (lsn + j >= checkpointLsn)
+					{
+						assert(ops[j] == WriteAheadLog::x_opInsert);
+						m_set.Insert(k[j]);
+						m_numReplayedRecords++;
+					}
+				}
+			}, isLast /*truncateTornTail*/, firstLsn, endLsn);
+			// a log file is only created empty by a crash before its header became durable, which is only possible for the last one
+			//
+			if (!ok)
+			{
+				ReleaseAssert(isLast && logs[i].first == nextLsn);
+				continue;
+			}
+			ReleaseAssert(firstLsn == logs[i].first && firstLsn <= nextLsn);
+			ReleaseAssert(isLast || endLsn == logs[i + 1].first);
+			nextLsn = max(nextLsn, endLsn);
+		}
+
+		// the last log file is left as it is and a new one is started, unless it has no records
+		//
+		string logPath = LogDirectory::FileName(dir, x_logPrefix, nextLsn);
+		unlink(logPath.c_str());
+		m_log.Open(logPath, nextLsn);
+		m_lastCheckpointLsn = checkpointLsn;
+		RemoveObsoleteFiles();
+	}
+
+	// Sync the log and close it
+	//
+	void Close()
+	{
+		m_log.Close();
+	}
+
+	// Insert value and log it, returns false if value was already in the set
+	//
+	bool Insert(uint64_t value)
+	{
+		if (!m_set.Insert(value))
+		{
+			return false;
+		}
+		m_log.Append(WriteAheadLog::x_opInsert, value);
+		if (m_checkpointInterval != 0 && m_log.GetNextLsn() - m_lastCheckpointLsn >= m_checkpointInterval)
+		{
+			Checkpoint();
+		}
+		return true;
+	}
+
+	bool Exist(uint64_t value) { return m_set.Exist(value); }
+	uint64_t LowerBound(uint64_t value, bool& found) { return m_set.LowerBound(value, found); }
+
+	// Wait until all insertions so far are durable
+	//
+	void Sync() { m_log.Sync(); }
+
+	// Wait until the record of LSN lsn is durable (the LSN after an insertion is GetNextLsn() - 1)
+	//
+	void WaitDurable(uint64_t lsn) { m_log.WaitDurable(lsn); }
+
+	uint64_t GetNextLsn() { return m_log.GetNextLsn(); }
+
+	// Write a checkpoint of the current content, after which the log before it is removed
+	//
+	void Checkpoint()
+	{
+		uint64_t lsn = m_log.GetNextLsn();
+		if (lsn == m_lastCheckpointLsn)
+		{
+			return;
+		}
+		// the log file is already a new one if nothing was logged since it was opened
+		//
+		if (m_log.GetFirstLsn() != lsn)
+		{
+			m_log.Close();
+			m_log.Open(LogDirectory::FileName(m_dir, x_logPrefix, lsn), lsn);
+			LogDirectory::Sync(m_dir);
+		}
+
+		CheckpointFile checkpoint;
+		checkpoint.Create(m_dir + "/" + x_checkpointPrefix + "tmp", lsn);
+		bool found;
+		uint64_t key = m_set.LowerBound(0, found);
+		while (found)
+		{
+			checkpoint.Add(key);
+			if (key == std::numeric_limits<uint64_t>::max())
+			{
+				break;
+			}
+			key = m_set.LowerBound(key + 1, found);
+		}
+		checkpoint.Commit(LogDirectory::FileName(m_dir, x_checkpointPrefix, lsn));
+		LogDirectory::Sync(m_dir);
+		m_lastCheckpointLsn = lsn;
+		m_numCheckpoints++;
+		RemoveObsoleteFiles();
+	}
+
+	Set* GetSet() { return &m_set; }
+
+	uint64_t GetNumCheckpoints() { return m_numCheckpoints; }
+
+	// What the last Open recovered: the # of keys in the checkpoint, and the # of log records replayed on top of it
+	//
+	uint64_t GetNumRecoveredCheckpointKeys() { return m_numRecoveredCheckpointKeys; }
+	uint64_t GetNumReplayedRecords() { return m_numReplayedRecords; }
+
+	static constexpr const char* x_logPrefix = "wal-";
+	static constexpr const char* x_checkpointPrefix = "checkpoint-";
+
+private:
+	// Remove the checkpoints other than the last one, and the log files whose records are all before it
+	//
+	void RemoveObsoleteFiles()
+	{
+		unlink((m_dir + "/" + x_checkpointPrefix + "tmp").c_str());
+		for (auto& checkpoint : LogDirectory::List(m_dir, x_checkpointPrefix))
+		{
+			if (checkpoint.first != m_lastCheckpointLsn)
+			{
+				unlink(checkpoint.second.c_str());
+			}
+		}
+		vector<pair<uint64_t, string> > logs = LogDirectory::List(m_dir, x_logPrefix);
+		rep(i, 0, int(logs.size()) - 2)
+		{
+			if (logs[i + 1].first <= m_lastCheckpointLsn)
+			{
+				unlink(logs[i].second.c_str());
+			}
+		}
+	}
+
+	Set m_set;
+	WriteAheadLog m_log;
+	string m_dir;
+	uint64_t m_checkpointInterval;
+	int m_recoveryThreads;
+	uint64_t m_lastCheckpointLsn;
+	uint64_t m_numCheckpoints;
+	uint64_t m_numRecoveredCheckpointKeys;
+	uint64_t m_numReplayedRecords;
+};
+
+typedef BasicDurableMlpSet<DefaultMlpSetConfig> DurableMlpSet;
+
+}	// namespace MlpSetUInt64
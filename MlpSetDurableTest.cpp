@@ -0,0 +1,337 @@
+#include "common.h"
+#include "MlpSetDurable.h"
+#include "gtest/gtest.h"
+#include <dirent.h>
+#include <random>
+#include <signal.h>
+#include <sys/wait.h>
+
+namespace {
+
+using MlpSetUInt64::WriteAheadLog;
+using MlpSetUInt64::DurableMlpSet;
+
+// Remove dir and the files in it, if it exists
+//
+void RemoveTestDirectory(const string& dir)
+{
+	DIR* d = opendir(dir.c_str());
+	if (d == nullptr)
+	{
+		return;
+	}
+	struct dirent* entry;
+	while ((entry = readdir(d)) != nullptr)
+	{
+		if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+		{
+			ReleaseAssert(unlink((dir + "/" + entry->d_name).c_str()) == 0);
+		}
+	}
+	closedir(d);
+	ReleaseAssert(rmdir(dir.c_str()) == 0);
+}
+
+string TestDirectory(const char* parent, const char* name)
+{
+	return string(parent) + "/mlpset-" + name + "-" + std::to_string(getpid());
+}
+
+// Distinct keys in random order
+//
+vector<uint64_t> GenDistinctKeys(int n, uint64_t seed)
+{
+	std::mt19937_64 rng(seed);
+	set<uint64_t> S;
+	vector<uint64_t> keys;
+	while (int(keys.size()) < n)
+	{
+		uint64_t key = rng() >> (rng() % 40);
+		if (S.insert(key).second)
+		{
+			keys.push_back(key);
+		}
+	}
+	return keys;
+}
+
+TEST(MlpSetDurable, LogReplayTornTail)
+{
+	string dir = TestDirectory("/tmp", "log");
+	RemoveTestDirectory(dir);
+	MlpSetUInt64::LogDirectory::Create(dir);
+	string path = MlpSetUInt64::LogDirectory::FileName(dir, "wal-", 1000);
+	const int n = 200000;
+	vector<uint64_t> keys = GenDistinctKeys(n, 1);
+
+	WriteAheadLog log;
+	log.SetMaxBatchSize(10000);
+	log.Open(path, 1000);
+	rep(i, 0, n - 1)
+	{
+		ReleaseAssert(log.Append(WriteAheadLog::x_opInsert, keys[i]) == uint64_t(1000 + i));
+		if (i % 30000 == 0)
+		{
+			log.WaitDurable(1000 + i);
+		}
+	}
+	log.Close();
+	printf("%llu batches, %llu bytes\n", static_cast<unsigned long long>(log.GetNumBatches()),
+	       static_cast<unsigned long long>(log.GetNumBytesWritten()));
+
+	// replay the whole log, then cut the file in the middle of its last batch, and replay again
+	//
+	struct stat st;
+	ReleaseAssert(stat(path.c_str(), &st) == 0 && uint64_t(st.st_size) == log.GetNumBytesWritten());
+	uint64_t lastBatchLsn = 0;
+	rep(round, 0, 1)
+	{
+		uint64_t firstLsn, endLsn;
+		int count = 0;
+		ReleaseAssert(WriteAheadLog::Replay(path, [&](uint64_t lsn, const uint64_t* k, const uint8_t* ops, uint32_t num) {
+			ReleaseAssert(lsn == uint64_t(1000 + count));
+			rep(j, 0, int(num) - 1)
+			{
+				ReleaseAssert(k[j] == keys[count + j] && ops[j] == WriteAheadLog::x_opInsert);
+			}
+			count += num;
+			lastBatchLsn = lsn;
+		}, true /*truncateTornTail*/, firstLsn, endLsn));
+		ReleaseAssert(firstLsn == 1000 && endLsn == uint64_t(1000 + count));
+		if (round == 0)
+		{
+			ReleaseAssert(count == n);
+			ReleaseAssert(truncate(path.c_str(), st.st_size - 5) == 0);
+		}
+		else
+		{
+			ReleaseAssert(count < n && count > 0);
+			ReleaseAssert(stat(path.c_str(), &st) == 0);
+			printf("torn tail cut, %d records left, file is %llu bytes\n", count, static_cast<unsigned long long>(st.st_size));
+		}
+	}
+	RemoveTestDirectory(dir);
+}
+
+// Repeatedly kill a process inserting keys into a durable set, and check that the recovered set holds
+// every key synced before the kill, and is a prefix of the insertion sequence
+//
+TEST(MlpSetDurable, CrashRecovery)
+{
+	string dir = TestDirectory("/tmp", "crash");
+	RemoveTestDirectory(dir);
+	const int n = 600000;
+	const int maxSetSize = n + 1000;
+	vector<uint64_t> keys = GenDistinctKeys(n, 2);
+	std::mt19937_64 rng(3);
+
+	int synced = 0;
+	rep(round, 0, 4)
+	{
+		int syncPipe[2];
+		ReleaseAssert(pipe(syncPipe) == 0);
+		pid_t pid = fork();
+		ReleaseAssert(pid != -1);
+		if (pid == 0)
+		{
+			close(syncPipe[0]);
+			DurableMlpSet ds;
+			ds.SetCheckpointInterval(70000);
+			ds.GetLog().SetMaxBatchSize(4096);
+			ds.Open(dir, maxSetSize);
+			int start = 0;
+			while (start < n && ds.Exist(keys[start])) start++;
+			rep(i, start, n - 1)
+			{
+				ReleaseAssert(ds.Insert(keys[i]));
+				if (i % 5000 == 4999)
+				{
+					ds.Sync();
+					int count = i + 1;
+					ReleaseAssert(write(syncPipe[1], &count, sizeof(count)) == sizeof(count));
+				}
+			}
+			// wait to be killed
+			//
+			while (true) pause();
+		}
+		close(syncPipe[1]);
+		int target = min(n, synced + 50000 + int(rng() % 60000));
+		int count = 0;
+		while (count < target)
+		{
+			ReleaseAssert(read(syncPipe[0], &count, sizeof(count)) == sizeof(count));
+		}
+		// let the child run a little more, so that it is killed in the middle of something
+		//
+		usleep(rng() % 20000);
+		ReleaseAssert(kill(pid, SIGKILL) == 0);
+		int status;
+		ReleaseAssert(waitpid(pid, &status, 0) == pid);
+		while (read(syncPipe[0], &count, sizeof(count)) == sizeof(count)) { }
+		close(syncPipe[0]);
+		synced = max(synced, count);
+
+		DurableMlpSet ds;
+		ds.Open(dir, maxSetSize);
+		int m = 0;
+		while (m < n && ds.Exist(keys[m])) m++;
+		printf("round %d: %d keys synced, %d recovered (%llu from checkpoint, %llu replayed)\n", round, synced, m,
+		       static_cast<unsigned long long>(ds.GetNumRecoveredCheckpointKeys()),
+		       static_cast<unsigned long long>(ds.GetNumReplayedRecords()));
+		ReleaseAssert(m >= synced);
+		ReleaseAssert(ds.GetNumRecoveredCheckpointKeys() + ds.GetNumReplayedRecords() == uint64_t(m));
+		rep(i, m, n - 1)
+		{
+			ReleaseAssert(!ds.Exist(keys[i]));
+		}
+		set<uint64_t> S(keys.begin(), keys.begin() + m);
+		rep(i, 0, 99999)
+		{
+			uint64_t key = (i % 2 == 0) ? keys[rng() % m] + rng() % 3 - 1 : rng() >> (rng() % 40);
+			auto it = S.lower_bound(key);
+			bool found;
+			uint64_t lb = ds.LowerBound(key, found);
+			ReleaseAssert(found == (it != S.end()));
+			ReleaseAssert(!found || lb == *it);
+		}
+		synced = m;
+	}
+
+	// a clean close and reopen recovers everything, and the obsolete files are removed
+	//
+	{
+		DurableMlpSet ds;
+		ds.Open(dir, maxSetSize);
+		int m = 0;
+		while (m < n && ds.Exist(keys[m])) m++;
+		rep(i, m, n - 1) ReleaseAssert(ds.Insert(keys[i]));
+		ds.Checkpoint();
+		ReleaseAssert(ds.GetNumCheckpoints() == 1);
+	}
+	{
+		DurableMlpSet ds;
+		ds.Open(dir, maxSetSize);
+		ReleaseAssert(ds.GetNumRecoveredCheckpointKeys() == uint64_t(n) && ds.GetNumReplayedRecords() == 0);
+		rep(i, 0, n - 1) ReleaseAssert(ds.Exist(keys[i]));
+	}
+	ReleaseAssert(MlpSetUInt64::LogDirectory::List(dir, DurableMlpSet::x_checkpointPrefix).size() == 1);
+	ReleaseAssert(MlpSetUInt64::LogDirectory::List(dir, DurableMlpSet::x_logPrefix).size() <= 2);
+	RemoveTestDirectory(dir);
+}
+
+// Insert the keys, calling Sync every syncEvery insertions (0 = only at the end), returns the throughput in Mops/s
+//
+double DurableInsertThroughput(const char* parent, const vector<uint64_t>& keys, WriteAheadLog::SyncMode mode, int syncEvery)
+{
+	string dir = TestDirectory(parent, "bench");
+	RemoveTestDirectory(dir);
+	double t;
+	uint64_t numBatches, numBytes;
+	{
+		DurableMlpSet ds;
+		ds.GetLog().SetSyncMode(mode);
+		ds.Open(dir, keys.size() + 1000);
+		{
+			AutoTimer timer(&t);
+			rep(i, 0, int(keys.size()) - 1)
+			{
+				ds.Insert(keys[i]);
+				if (syncEvery != 0 && i % syncEvery == syncEvery - 1)
+				{
+					ds.Sync();
+				}
+			}
+			ds.Sync();
+		}
+		numBatches = ds.GetLog().GetNumBatches();
+		numBytes = ds.GetLog().GetNumBytesWritten();
+	}
+	RemoveTestDirectory(dir);
+	double mops = double(keys.size()) / t / 1e6;
+	printf("    %s, %s, %s: %.2lf Mops/s, %llu batches, %.1lf MB logged\n", parent,
+	       mode == WriteAheadLog::x_syncData ? "fdatasync" : "write only",
+	       syncEvery == 0 ? "sync at end" : ("sync every " + std::to_string(syncEvery)).c_str(),
+	       mops, static_cast<unsigned long long>(numBatches), double(numBytes) / 1048576);
+	return mops;
+}
+
+// Recover a set of keys.size() keys, of which the first numCheckpointed are in a checkpoint and the rest in the log
+//
+void DurableRecoveryTime(const char* parent, const vector<uint64_t>& keys, uint64_t numCheckpointed)
+{
+	string dir = TestDirectory(parent, "recovery");
+	RemoveTestDirectory(dir);
+	{
+		DurableMlpSet ds;
+		ds.GetLog().SetSyncMode(WriteAheadLog::x_writeOnly);
+		ds.Open(dir, keys.size() + 1000);
+		rep(i, 0, int(keys.size()) - 1)
+		{
+			ds.Insert(keys[i]);
+			if (uint64_t(i) + 1 == numCheckpointed)
+			{
+				ds.Checkpoint();
+			}
+		}
+	}
+	// the files are read from the page cache, recovery after a reboot also pays for reading them from the disk
+	//
+	double t;
+	{
+		DurableMlpSet ds;
+		{
+			AutoTimer timer(&t);
+			ds.Open(dir, keys.size() + 1000);
+		}
+		ReleaseAssert(ds.GetNumRecoveredCheckpointKeys() + ds.GetNumReplayedRecords() == keys.size());
+		printf("    %s: recovered %llu keys from checkpoint + %llu log records in %.2lf s\n", parent,
+		       static_cast<unsigned long long>(ds.GetNumRecoveredCheckpointKeys()),
+		       static_cast<unsigned long long>(ds.GetNumReplayedRecords()), t);
+	}
+	RemoveTestDirectory(dir);
+}
+
+void DurableBenchmarkImpl(int n)
+{
+	printf("%d keys\n", n);
+	std::mt19937_64 rng(1);
+	vector<uint64_t> keys;
+	rep(i, 0, n - 1) keys.push_back(rng());
+
+	double t;
+	{
+		MlpSetUInt64::MlpSet ms;
+		ms.Init(n + 1000);
+		AutoTimer timer(&t);
+		rep(i, 0, n - 1) ms.Insert(keys[i]);
+	}
+	printf("Insert throughput:\n");
+	printf("    no logging: %.2lf Mops/s\n", double(n) / t / 1e6);
+	const char* parents[2] = { "/dev/shm", "/tmp" };
+	for (const char* parent : parents)
+	{
+		DurableInsertThroughput(parent, keys, WriteAheadLog::x_writeOnly, 0);
+		DurableInsertThroughput(parent, keys, WriteAheadLog::x_syncData, 0);
+		DurableInsertThroughput(parent, keys, WriteAheadLog::x_syncData, 1000);
+	}
+	printf("Recovery time:\n");
+	for (const char* parent : parents)
+	{
+		DurableRecoveryTime(parent, keys, n);
+		DurableRecoveryTime(parent, keys, n / 2);
+		DurableRecoveryTime(parent, keys, 0);
+	}
+}
+
+TEST(MlpSetDurable, Benchmark_4M)
+{
+	DurableBenchmarkImpl(4000000);
+}
+
+TEST(MlpSetDurable, Benchmark_80M)
+{
+	DurableBenchmarkImpl(80000000);
+}
+
+}	// annoymous namespace
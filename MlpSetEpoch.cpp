@@ -0,0 +1,204 @@
+#include "MlpSetEpoch.h"
+#include <thread>
+#include <sys/syscall.h>
+#include <linux/membarrier.h>
+
+namespace MlpSetUInt64
+{
+
+// Register the process for expedited membarrier, returns false if the kernel does not support it
+//
+static bool RegisterMembarrier()
+{
+	long cmds = syscall(__NR_membarrier, MEMBARRIER_CMD_QUERY, 0);
+	if (cmds < 0 || !(cmds & MEMBARRIER_CMD_PRIVATE_EXPEDITED) || !(cmds & MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED))
+	{
+		return false;
+	}
+	return syscall(__NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) == 0;
+}
+
+// The epoch starts at 1, since 0 is x_inactive
+//
+std::atomic<uint64_t> EpochReclaimer::m_globalEpoch(1);
+std::atomic<EpochReclaimer::ThreadState*> EpochReclaimer::m_threadStates(nullptr);
+bool EpochReclaimer::m_useMembarrier = RegisterMembarrier();
+__thread EpochReclaimer::ThreadState* EpochReclaimer::t_threadState = nullptr;
+
+// Releases the thread state of a thread when it exits
+//
+struct EpochThreadExitHook
+{
+	~EpochThreadExitHook()
+	{
+		EpochReclaimer::UnregisterThread();
+	}
+};
+
+static thread_local EpochThreadExitHook t_epochThreadExitHook;
+
+EpochReclaimer::ThreadState::ThreadState()
+	: m_epoch(x_inactive)
+	, m_nesting(0)
+	, m_inUse(true)
+	, m_next(nullptr)
+{ }
+
+EpochReclaimer::ThreadState* EpochReclaimer::RegisterThread()
+{
+	assert(t_threadState == nullptr);
+	// touch the exit hook so that it is constructed (and so destructed when the thread exits)
+	//
+	(void)&t_epochThreadExitHook;
+
+	// reuse the state of an exited thread if there is one
+	//
+	ThreadState* state = m_threadStates.load(std::memory_order_acquire);
+	while (state != nullptr)
+	{
+		bool expected = false;
+		if (!state->m_inUse.load(std::memory_order_relaxed) &&
+		    state->m_inUse.compare_exchange_strong(expected, true, std::memory_order_acquire))
+		{
+			break;
+		}
+		state = state->m_next;
+	}
+	if (state == nullptr)
+	{
+		// operator new does not honor the alignment of ThreadState in C++14
+		//
+		void* ptr = aligned_alloc(alignof(ThreadState), sizeof(ThreadState));
+		ReleaseAssert(ptr != nullptr);
+		state = new (ptr) ThreadState();
+		ThreadState* head = m_threadStates.load(std::memory_order_relaxed);
+		do
+		{
+			state->m_next = head;
+		}
+		while (!m_threadStates.compare_exchange_weak(head, state, std::memory_order_release, std::memory_order_relaxed));
+	}
+	assert(state->m_nesting == 0 && state->m_retired.empty());
+	t_threadState = state;
+	return state;
+}
+
+void EpochReclaimer::UnregisterThread()
+{
+	ThreadState* state = t_threadState;
+	if (state == nullptr)
+	{
+		return;
+	}
+	ReleaseAssert(state->m_nesting == 0);
+	Synchronize();
+	t_threadState = nullptr;
+	state->m_inUse.store(false, std::memory_order_release);
+}
+
+bool EpochReclaimer::TryAdvanceEpoch()
+{
+	uint64_t epoch = m_globalEpoch.load(std::memory_order_seq_cst);
+	// make the epochs published by the readers visible
+	//
+	if (m_useMembarrier)
+	{
+		int ret = syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0);
+		ReleaseAssert(ret == 0);
+	}
+	else
+	{
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+	}
+	ThreadState* state = m_threadStates.load(std::memory_order_acquire);
+	while (state != nullptr)
+	{
+		uint64_t readerEpoch = state->m_epoch.load(std::memory_order_acquire);
+		if (readerEpoch != x_inactive && readerEpoch != epoch)
+		{
+			return false;
+		}
+		state = state->m_next;
+	}
+	// another thread may have advanced the epoch concurrently, which is just as good
+	//
+	m_globalEpoch.compare_exchange_strong(epoch, epoch + 1, std::memory_order_seq_cst);
+	return true;
+}
+
+void EpochReclaimer::Retire(void* ptr, uint64_t size, FreeFn freeFn)
+{
+	ThreadState* state = t_threadState;
+	if (unlikely(state == nullptr))
+	{
+		state = RegisterThread();
+	}
+	// The unlinking store of ptr must be visible before we read the epoch,
+	// otherwise a reader could still find ptr after the epoch we tag it with has been advanced past
+	//
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	RetiredMemory r;
+	r.ptr = ptr;
+	r.size = size;
+	r.freeFn = freeFn;
+	r.epoch = m_globalEpoch.load(std::memory_order_seq_cst);
+	state->m_retired.push_back(r);
+	if (state->m_retired.size() % x_reclaimBatchSize == 0)
+	{
+		Reclaim();
+	}
+}
+
+void EpochReclaimer::Reclaim()
+{
+	ThreadState* state = t_threadState;
+	if (state == nullptr || state->m_retired.empty())
+	{
+		return;
+	}
+	TryAdvanceEpoch();
+	uint64_t epoch = m_globalEpoch.load(std::memory_order_seq_cst);
+	// a thread inside a read-side critical section holds back the epoch it published,
+	// so this also never frees memory retired by the calling thread while it is reading
+	//
+	size_t numKept = 0;
+	rep(i, 0, int(state->m_retired.size()) - 1)
+	{
+		RetiredMemory& r = state->m_retired[i];
+		if (r.epoch + 2 <= epoch)
+		{
+			r.freeFn(r.ptr, r.size);
+		}
+		else
+		{
+			state->m_retired[numKept++] = r;
+		}
+	}
+	state->m_retired.resize(numKept);
+}
+
+void EpochReclaimer::Synchronize()
+{
+	ThreadState* state = t_threadState;
+	if (state == nullptr)
+	{
+		return;
+	}
+	ReleaseAssert(state->m_nesting == 0);
+	while (!state->m_retired.empty())
+	{
+		Reclaim();
+		if (!state->m_retired.empty())
+		{
+			std::this_thread::yield();
+		}
+	}
+}
+
+uint32_t EpochReclaimer::GetNumPending()
+{
+	ThreadState* state = t_threadState;
+	return (state == nullptr) ? 0 : state->m_retired.size();
+}
+
+}	// namespace MlpSetUInt64
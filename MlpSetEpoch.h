@@ -0,0 +1,158 @@
+#pragma once
+
+#include "common.h"
+#include <atomic>
+
+namespace MlpSetUInt64
+{
+
+// Epoch-based reclamation of memory that concurrent readers may still be reading
+//
+// A reader brackets each operation with Enter/Exit (or a ReadGuard), which publishes the global epoch
+// in the reader's thread state. Memory that is unlinked by the writer is not freed but retired:
+// it is tagged with the global epoch and put on the retiring thread's list. The global epoch only advances
+// when every reader inside an operation has published the current epoch, so once the global epoch
+// is 2 past the tag, every reader that could have seen the memory has exited and the memory is freed.
+//
+// Readers only pay a thread-local store per operation. The store-load fence that makes the store visible
+// before the reader's first load is paid by the writer: it issues membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED)
+// before scanning the thread states, which serializes all running threads of the process.
+// If membarrier is not available, readers fall back to a full fence.
+//
+// The epoch domain is process-wide, so one guard covers reads of any number of sets.
+// Guards can be nested, only the outermost Enter and Exit touch the epoch.
+//
+// Only memory that is freed is protected. Memory that is reused in place (e.g. the hash table slots
+// recycled by MoveNode and RelocateBitMap) is not, readers racing with such writes need to validate what they read.
+//
+class EpochReclaimer
+{
+public:
+	// a function freeing retired memory, e.g. Allocator::Free
+	//
+	typedef void (*FreeFn)(void* ptr, uint64_t size);
+
+	// Enter and exit a read-side critical section
+	// Memory retired after Enter is not freed until the matching Exit
+	//
+	static void Enter()
+	{
+		ThreadState* state = t_threadState;
+		if (unlikely(state == nullptr))
+		{
+			state = RegisterThread();
+		}
+		if (state->m_nesting++ == 0)
+		{
+			state->m_epoch.store(m_globalEpoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+			if (unlikely(!m_useMembarrier))
+			{
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+			}
+			else
+			{
+				std::atomic_signal_fence(std::memory_order_seq_cst);
+			}
+		}
+	}
+
+	static void Exit()
+	{
+		ThreadState* state = t_threadState;
+		assert(state != nullptr && state->m_nesting > 0);
+		if (--state->m_nesting == 0)
+		{
+			state->m_epoch.store(x_inactive, std::memory_order_release);
+		}
+	}
+
+	class ReadGuard
+	{
+	public:
+		ReadGuard() { Enter(); }
+		~ReadGuard() { Exit(); }
+	};
+
+	// Retire ptr, freeFn(ptr, size) is called once no reader can be reading it
+	// ptr must be unreachable for readers that enter from now on
+	//
+	static void Retire(void* ptr, uint64_t size, FreeFn freeFn);
+
+	// Try to advance the global epoch, and free the memory retired by this thread that is safe to free
+	// Called by Retire every x_reclaimBatchSize retirements
+	//
+	static void Reclaim();
+
+	// Wait until all memory retired by this thread is freed
+	// Must not be called inside a read-side critical section
+	//
+	static void Synchronize();
+
+	// # of retired but not yet freed allocations of this thread
+	//
+	static uint32_t GetNumPending();
+
+	// Helpers for memory allocated by new and new[]
+	//
+	template<class T>
+	static void DeleteObject(void* ptr, uint64_t /*size*/)
+	{
+		delete reinterpret_cast<T*>(ptr);
+	}
+
+	template<class T>
+	static void DeleteArray(void* ptr, uint64_t /*size*/)
+	{
+		delete [] reinterpret_cast<T*>(ptr);
+	}
+
+	static const uint64_t x_inactive = 0;
+	static const uint32_t x_reclaimBatchSize = 64;
+
+private:
+	struct RetiredMemory
+	{
+		void* ptr;
+		uint64_t size;
+		FreeFn freeFn;
+		uint64_t epoch;
+	};
+
+	// Per-thread state, never freed: when a thread exits, its state is kept in the list for the next new thread
+	// Each state sits on its own cache lines, so that readers do not write to a line another thread reads in the fast path
+	//
+	struct alignas(128) ThreadState
+	{
+		ThreadState();
+
+		// the epoch published by the reader, or x_inactive if outside of read-side critical sections
+		//
+		std::atomic<uint64_t> m_epoch;
+		// nesting depth of read-side critical sections, only accessed by the owning thread
+		//
+		uint32_t m_nesting;
+		// whether a thread owns this state
+		//
+		std::atomic<bool> m_inUse;
+		// memory retired by the owning thread
+		//
+		vector<RetiredMemory> m_retired;
+		ThreadState* m_next;
+	};
+
+	static ThreadState* RegisterThread();
+	static void UnregisterThread();
+	static bool TryAdvanceEpoch();
+
+	friend struct EpochThreadExitHook;
+
+	static std::atomic<uint64_t> m_globalEpoch;
+	static std::atomic<ThreadState*> m_threadStates;
+	static bool m_useMembarrier;
+	// __thread rather than thread_local, so that the reader fast path is a plain TLS load
+	// (the thread exit hook is a separate thread_local, see MlpSetEpoch.cpp)
+	//
+	static __thread ThreadState* t_threadState;
+};
+
+}	// namespace MlpSetUInt64
@@ -0,0 +1,370 @@
+#include "common.h"
+#include "MlpSetUInt64.h"
+#include "gtest/gtest.h"
+#include <thread>
+#include <atomic>
+
+namespace {
+
+using MlpSetUInt64::EpochReclaimer;
+
+uint64_t GenRandomKey()
+{
+	uint64_t key = 0;
+	rep(k, 0, 7) key = key * 256 + rand() % 256;
+	return key;
+}
+
+int g_numFreed = 0;
+
+void CountingFree(void* ptr, uint64_t /*size*/)
+{
+	g_numFreed++;
+	delete [] reinterpret_cast<uint64_t*>(ptr);
+}
+
+TEST(MlpSetEpoch, SanityTest)
+{
+	EpochReclaimer::Synchronize();
+	g_numFreed = 0;
+
+	// memory retired outside of any read-side critical section is freed after two epochs
+	//
+	rep(i, 0, 9)
+	{
+		EpochReclaimer::Retire(new uint64_t[4], 32, CountingFree);
+	}
+	ReleaseAssert(EpochReclaimer::GetNumPending() == 10);
+	EpochReclaimer::Synchronize();
+	ReleaseAssert(EpochReclaimer::GetNumPending() == 0);
+	ReleaseAssert(g_numFreed == 10);
+
+	// memory retired inside a (nested) read-side critical section is not freed until it exits
+	//
+	{
+		EpochReclaimer::ReadGuard guard;
+		{
+			EpochReclaimer::ReadGuard nestedGuard;
+		}
+		rep(i, 0, int(EpochReclaimer::x_reclaimBatchSize) * 3 - 1)
+		{
+			EpochReclaimer::Retire(new uint64_t[4], 32, CountingFree);
+		}
+		EpochReclaimer::Reclaim();
+		EpochReclaimer::Reclaim();
+		EpochReclaimer::Reclaim();
+		ReleaseAssert(g_numFreed == 10);
+	}
+	EpochReclaimer::Synchronize();
+	ReleaseAssert(EpochReclaimer::GetNumPending() == 0);
+	ReleaseAssert(g_numFreed == 10 + int(EpochReclaimer::x_reclaimBatchSize) * 3);
+}
+
+// A block is published by the writer, and poisoned when it is freed,
+// so a reader reading a block after it is freed sees the poison (or a torn block)
+//
+const uint64_t x_poison = 0xdeaddeaddeaddeadULL;
+
+struct StressTestBlock
+{
+	uint64_t generation;
+	uint64_t payload[15];
+};
+
+std::atomic<StressTestBlock*> g_publishedBlock;
+std::atomic<int> g_numBlocksFreed;
+
+void PoisonBlock(void* ptr, uint64_t /*size*/)
+{
+	// the block is leaked rather than deleted, so that its memory is not reused by a later block
+	//
+	StressTestBlock* block = reinterpret_cast<StressTestBlock*>(ptr);
+	block->generation = x_poison;
+	rep(i, 0, 14)
+	{
+		block->payload[i] = x_poison;
+	}
+	g_numBlocksFreed++;
+}
+
+StressTestBlock* NewBlock(uint64_t generation)
+{
+	StressTestBlock* block = new StressTestBlock();
+	block->generation = generation;
+	rep(i, 0, 14)
+	{
+		block->payload[i] = generation * 15 + i;
+	}
+	return block;
+}
+
+TEST(MlpSetEpoch, StressTest)
+{
+	const int numReaders = 4;
+	const int numGenerations = 200000;
+
+	g_publishedBlock.store(NewBlock(0));
+	g_numBlocksFreed.store(0);
+	std::atomic<bool> done(false);
+	std::atomic<uint64_t> numReads(0);
+	std::atomic<uint64_t> numBadReads(0);
+
+	vector<std::thread> readers;
+	rep(t, 0, numReaders - 1)
+	{
+		readers.push_back(std::thread([&]() {
+			uint64_t reads = 0, badReads = 0;
+			uint64_t lastGeneration = 0;
+			while (!done.load(std::memory_order_relaxed))
+			{
+				EpochReclaimer::ReadGuard guard;
+				StressTestBlock* block = g_publishedBlock.load(std::memory_order_acquire);
+				uint64_t generation = block->generation;
+				bool ok = (generation != x_poison && generation >= lastGeneration);
+				rep(i, 0, 14)
+				{
+					ok &= (block->payload[i] == generation * 15 + i);
+				}
+				badReads += ok ? 0 : 1;
+				lastGeneration = generation;
+				reads++;
+			}
+			numReads += reads;
+			numBadReads += badReads;
+		}));
+	}
+
+	rep(i, 1, numGenerations)
+	{
+		StressTestBlock* old = g_publishedBlock.load(std::memory_order_relaxed);
+		g_publishedBlock.store(NewBlock(i), std::memory_order_release);
+		EpochReclaimer::Retire(old, sizeof(StressTestBlock), PoisonBlock);
+		if (i % 1000 == 0)
+		{
+			std::this_thread::yield();
+		}
+	}
+	done.store(true);
+	for (std::thread& t : readers)
+	{
+		t.join();
+	}
+	EpochReclaimer::Synchronize();
+	printf("%llu reads, %d blocks retired, %d freed\n",
+	       static_cast<unsigned long long>(numReads.load()), numGenerations, g_numBlocksFreed.load());
+	ReleaseAssert(numBadReads.load() == 0);
+	ReleaseAssert(g_numBlocksFreed.load() == numGenerations);
+	PoisonBlock(g_publishedBlock.load(), sizeof(StressTestBlock));
+}
+
+// MlpSet with epoch-based reclamation, through all paths that retire memory:
+// growth and promotion of the small-set array, rebuilds of the mirror and byte remapping rebuilds
+//
+void MlpSetEpochCorrectnessTestImpl(bool byteRemap)
+{
+	const int N = 300000;
+	const int Q = 500000;
+
+	MlpSetUInt64::MlpSet ms;
+	if (byteRemap)
+	{
+		ms.Init(N + 10);
+		vector<uint64_t> sample;
+		rep(i, 0, 999) sample.push_back(GenRandomKey() & 0x3f3f3f3f3f3f3f3fULL);
+		ms.EnableByteRemap(sample.data(), sample.size());
+	}
+	else
+	{
+		ms.InitCompact(N + 10);
+	}
+	ms.EnableEpochReclamation();
+	set<uint64_t> S;
+	rep(i, 0, N - 1)
+	{
+		uint64_t key = GenRandomKey() & 0x3f3f3f3f3f3f3f3fULL;
+		// in byte remapping mode, sometimes insert a key with a byte not in the alphabet, which triggers a rebuild
+		//
+		if (byteRemap && (i == 1000 || i == 100000))
+		{
+			key |= 0x80ULL << (8 * (rand() % 8));
+		}
+		bool expected = S.insert(key).second;
+		bool actual = ms.Insert(key);
+		ReleaseAssert(expected == actual);
+		if (i % 50000 == 49999)
+		{
+			ms.BuildUpperLevelMirror();
+		}
+	}
+	ms.BuildUpperLevelMirror();
+
+	rep(i, 0, Q - 1)
+	{
+		uint64_t key = (i % 2 == 0) ? (GenRandomKey() & 0x3f3f3f3f3f3f3f3fULL) : GenRandomKey();
+		auto it = S.lower_bound(key);
+		ReleaseAssert(ms.Exist(key) == (it != S.end() && *it == key));
+		bool found;
+		uint64_t lb = ms.LowerBound(key, found);
+		ReleaseAssert(found == (it != S.end()));
+		if (found)
+		{
+			ReleaseAssert(lb == *it);
+		}
+	}
+	EpochReclaimer::Synchronize();
+	ReleaseAssert(EpochReclaimer::GetNumPending() == 0);
+}
+
+TEST(MlpSetEpoch, MlpSetCorrectness)
+{
+	printf("Testing small-set mode..\n");
+	MlpSetEpochCorrectnessTestImpl(false /*byteRemap*/);
+	printf("Testing byte remapping mode..\n");
+	MlpSetEpochCorrectnessTestImpl(true /*byteRemap*/);
+}
+
+// Concurrent readers of a static MlpSet, while the writer keeps rebuilding the mirror of the first hash table level
+// (without epoch-based reclamation, the mirror would be rebuilt in place under the readers)
+//
+TEST(MlpSetEpoch, MlpSetConcurrentMirrorRebuild)
+{
+	const int N = 1000000;
+	const int numReaders = 3;
+	const int numRebuilds = 100;
+
+	MlpSetUInt64::MlpSet ms;
+	ms.Init(N + 10);
+	ms.EnableEpochReclamation();
+	vector<uint64_t> keys;
+	rep(i, 0, N - 1)
+	{
+		keys.push_back(GenRandomKey());
+		ms.Insert(keys.back());
+	}
+	sort(keys.begin(), keys.end());
+	ms.BuildUpperLevelMirror();
+
+	std::atomic<bool> done(false);
+	std::atomic<uint64_t> numReads(0);
+	std::atomic<uint64_t> numBadReads(0);
+	vector<std::thread> readers;
+	rep(t, 0, numReaders - 1)
+	{
+		readers.push_back(std::thread([&, t]() {
+			uint64_t reads = 0, badReads = 0;
+			uint64_t seed = t + 1;
+			while (!done.load(std::memory_order_relaxed))
+			{
+				seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+				uint64_t key = ((seed >> 32) & 1) ? keys[(seed >> 33) % N] : (seed ^ (seed >> 29));
+				auto it = lower_bound(keys.begin(), keys.end(), key);
+				bool found;
+				uint64_t lb = ms.LowerBound(key, found);
+				bool ok = (ms.Exist(key) == (it != keys.end() && *it == key));
+				ok &= (found == (it != keys.end())) && (!found || lb == *it);
+				badReads += ok ? 0 : 1;
+				reads++;
+			}
+			numReads += reads;
+			numBadReads += badReads;
+		}));
+	}
+	rep(i, 0, numRebuilds - 1)
+	{
+		ms.BuildUpperLevelMirror();
+		std::this_thread::yield();
+	}
+	done.store(true);
+	for (std::thread& t : readers)
+	{
+		t.join();
+	}
+	EpochReclaimer::Synchronize();
+	printf("%llu reads during %d rebuilds\n", static_cast<unsigned long long>(numReads.load()), numRebuilds);
+	ReleaseAssert(numBadReads.load() == 0);
+}
+
+// Overhead of the read-side critical section on the read throughput of MlpSet
+// (the loops are run alternately for a few rounds, and the best time of each is reported)
+//
+template<bool withGuard>
+uint64_t NO_INLINE EpochExistLoop(MlpSetUInt64::MlpSet& ms, const vector<uint64_t>& queries)
+{
+	uint64_t sum = 0;
+	rep(i, 0, int(queries.size()) - 1)
+	{
+		if (withGuard)
+		{
+			EpochReclaimer::ReadGuard guard;
+			sum += ms.Exist(queries[i]);
+		}
+		else
+		{
+			sum += ms.Exist(queries[i]);
+		}
+	}
+	return sum;
+}
+
+void EpochReadOverheadBenchmarkImpl(int n, int q)
+{
+	printf("==== %d keys, %d queries ====\n", n, q);
+	MlpSetUInt64::MlpSet ms;
+	ms.Init(n + 1000);
+	vector<uint64_t> keys;
+	rep(i, 0, n - 1)
+	{
+		keys.push_back(GenRandomKey());
+		ms.Insert(keys.back());
+	}
+	vector<uint64_t> queries;
+	rep(i, 0, q - 1)
+	{
+		queries.push_back((i % 2 == 0) ? keys[rand() % n] : GenRandomKey());
+	}
+
+	const int numRounds = 10;
+	double time[2] = { 1e100, 1e100 };
+	uint64_t sum[2];
+	rep(round, 0, numRounds - 1)
+	{
+		double t;
+		{
+			AutoTimer timer(&t);
+			sum[0] = EpochExistLoop<false>(ms, queries);
+		}
+		time[0] = min(time[0], t);
+		{
+			AutoTimer timer(&t);
+			sum[1] = EpochExistLoop<true>(ms, queries);
+		}
+		time[1] = min(time[1], t);
+		ReleaseAssert(sum[0] == sum[1]);
+	}
+	printf("Exist: %.2lf ns/query, with read guard %.2lf ns/query (%.2lf%% overhead)\n",
+	       time[0] * 1e9 / q, time[1] * 1e9 / q, (time[1] / time[0] - 1) * 100);
+}
+
+TEST(MlpSetEpoch, ReadOverhead)
+{
+	EpochReadOverheadBenchmarkImpl(10000, 10000000);
+	EpochReadOverheadBenchmarkImpl(16000000, 2000000);
+
+	// the writer side: each Retire tags the memory, and every x_reclaimBatchSize retirements the epoch is advanced
+	//
+	const int numRetires = 1000000;
+	g_numFreed = 0;
+	double retireTime;
+	{
+		AutoTimer timer(&retireTime);
+		rep(i, 0, numRetires - 1)
+		{
+			EpochReclaimer::Retire(new uint64_t[4], 32, CountingFree);
+		}
+		EpochReclaimer::Synchronize();
+	}
+	ReleaseAssert(g_numFreed == numRetires);
+	printf("Retire: %.2lf ns per retired allocation (including allocation and free)\n", retireTime * 1e9 / numRetires);
+}
+
+}	// annoymous namespace
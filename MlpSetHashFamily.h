@@ -0,0 +1,392 @@
+#pragma once
+
+#include "common.h"
+
+namespace MlpSetUInt64
+{
+
+// Hash families of the Cuckoo hash table (the HashFamily of the Config of BasicCuckooHashTable and BasicMlpSet, see MlpSetConfig.h)
+// A hash family provides 3 hash functions on the len-byte prefixes (1 <= len <= 8) of a key,
+// the hashes must only depend on the first len bytes of key and on len:
+//    static uint32_t HashFn1(uint64_t key, uint32_t len)
+//        the first Cuckoo position (masked by the hash table mask)
+//    static uint32_t HashFn2(uint64_t key, uint32_t len)
+//        the second Cuckoo position
+//    static uint32_t HashFn3(uint64_t key, uint32_t len)
+//        the tag stored in the node (only the low 18 bits are used)
+//    static void HashArray(uint64_t key, __m128i& out1, __m128i& out2, __m128i& out3, __m128i& out4, uint64_t& out5)
+//        the 18 hashes of the prefixes of length 3 to 8 at once, used by QueryLCP. High to low:
+//        out1: h1(8), h1(7), h1(6), h1(5)
+//        out2: h2(8), h2(7), h2(6), h2(5)
+//        out3: h3(8), h3(7), h3(6), h3(5)
+//        out4: h1(4), h1(3), h2(4), h2(3)
+//        out5: h3(4), h3(3)
+// HashFn1 and HashFn2 must be independent: keys that collide in both functions are a Cuckoo insertion failure waiting to happen.
+//
+
+// Vectorized XXHash utility
+// The hash function is a slightly modified XXH32, to fix a known deficiency
+// The 3 hash functions are XXHashFn1, XXHashFn2, XXHashFn3
+// XXHashArray computes 18 hashes from the prefixes of a key
+// using vectorization (detail in function comment)
+//
+namespace XXH
+{
+
+static const uint32_t XXH_SEED1 = 1192827283U;
+static const uint32_t XXH_SEED2 = 534897851U;
+
+static const uint32_t PRIME32_1 = 2654435761U;
+static const uint32_t PRIME32_2 = 2246822519U;
+static const uint32_t PRIME32_3 = 3266489917U;
+static const uint32_t PRIME32_4 = 668265263U;
+static const uint32_t PRIME32_5 = 374761393U;
+
+#define XXH_rotl32(x,r) ((x << r) | (x >> (32 - r)))
+
+inline uint32_t XXH32_avalanche(uint32_t h32)
+{
+    h32 ^= h32 >> 15;
+    h32 *= PRIME32_2;
+    h32 ^= h32 >> 13;
+    h32 *= PRIME32_3;
+    h32 ^= h32 >> 16;
+    return h32;
+}
+
+inline uint32_t XXH32_CoreLogic(uint64_t key, uint32_t len, uint32_t seed, uint32_t multiplier)
+{
+	key >>= (8-len)*8;
+	key <<= (8-len)*8;
+	uint32_t low = key;
+	uint32_t high = key >> 32;
+	uint32_t h32 = PRIME32_5 + seed + len;
+	h32 ^= high * multiplier;
+	h32 = XXH_rotl32(h32, 17) * PRIME32_4;
+	if (len > 4)
+	{
+		h32 ^= low * multiplier;
+		h32 = XXH_rotl32(h32, 17) * PRIME32_4;
+	}
+	return XXH32_avalanche(h32);
+}
+
+inline uint32_t XXHashFn1(uint64_t key, uint32_t len)
+{
+	return XXH32_CoreLogic(key, len, XXH_SEED1, PRIME32_1);
+}
+
+inline uint32_t XXHashFn2(uint64_t key, uint32_t len)
+{
+	return XXH32_CoreLogic(key, len, XXH_SEED2, PRIME32_3);
+}
+
+inline uint32_t XXHashFn3(uint64_t key, uint32_t len)
+{
+	return XXH32_CoreLogic(key, len, 0 /*seed*/, PRIME32_3);
+}
+
+static const __m128i PRIME32_1_ARRAY = _mm_set_epi32(PRIME32_1, PRIME32_1, PRIME32_1, PRIME32_1);
+static const __m128i PRIME32_2_ARRAY = _mm_set_epi32(PRIME32_2, PRIME32_2, PRIME32_2, PRIME32_2);
+static const __m128i PRIME32_3_ARRAY = _mm_set_epi32(PRIME32_3, PRIME32_3, PRIME32_3, PRIME32_3);
+static const __m128i PRIME32_4_ARRAY = _mm_set_epi32(PRIME32_4, PRIME32_4, PRIME32_4, PRIME32_4);
+
+static const __m128i XXH_OUT1_INIT = _mm_set_epi32(PRIME32_5 + XXH_SEED1 + 8U,
+                                                   PRIME32_5 + XXH_SEED1 + 7U,
+                                                   PRIME32_5 + XXH_SEED1 + 6U,
+                                                   PRIME32_5 + XXH_SEED1 + 5U);
+static const __m128i XXH_OUT2_INIT = _mm_set_epi32(PRIME32_5 + XXH_SEED2 + 8U,
+                                                   PRIME32_5 + XXH_SEED2 + 7U,
+                                                   PRIME32_5 + XXH_SEED2 + 6U,
+                                                   PRIME32_5 + XXH_SEED2 + 5U);
+static const __m128i XXH_OUT3_INIT = _mm_set_epi32(PRIME32_5 + 8U,
+                                                   PRIME32_5 + 7U,
+                                                   PRIME32_5 + 6U,
+                                                   PRIME32_5 + 5U);
+static const __m128i XXH_OUT4_INIT = _mm_set_epi32(PRIME32_5 + XXH_SEED1 + 4U,
+                                                   PRIME32_5 + XXH_SEED1 + 3U,
+                                                   PRIME32_5 + XXH_SEED2 + 4U,
+                                                   PRIME32_5 + XXH_SEED2 + 3U);
+static const __m128i XXH_LOW_MASK = _mm_set_epi32(0xffffffffU,
+                                                  0xffffff00U,
+                                                  0xffff0000U,
+                                                  0xff000000U);
+
+inline void XXHExecuteRotlAndMult(__m128i& data)
+{
+	__m128i tmp = _mm_srli_epi32(data, 15);
+	data = _mm_slli_epi32(data, 17);
+	data = _mm_or_si128(data, tmp);
+	data = _mm_mullo_epi32(data, PRIME32_4_ARRAY);
+}
+
+inline void XXHExecuteAvalanche(__m128i& data)
+{
+	__m128i tmp = _mm_srli_epi32(data, 15);
+	data = _mm_xor_si128(data, tmp);
+	data = _mm_mullo_epi32(data, PRIME32_2_ARRAY);
+
+	tmp = _mm_srli_epi32(data, 13);
+	data = _mm_xor_si128(data, tmp);
+	data = _mm_mullo_epi32(data, PRIME32_3_ARRAY);
+
+	tmp = _mm_srli_epi32(data, 16);
+	data = _mm_xor_si128(data, tmp);
+}
+
+// high to low:
+// out1: h1(8), h1(7), h1(6), h1(5)
+// out2: h2(8), h2(7), h2(6), h2(5)
+// out3: h3(8), h3(7), h3(6), h3(5)
+// out4: h1(4), h1(3), h2(4), h2(3)
+// out5: h3(4), h3(3)
+//
+inline void XXHashArray(uint64_t key, __m128i& out1, __m128i& out2, __m128i& out3, __m128i& out4, uint64_t& out5)
+{
+	uint32_t low = key;
+	uint32_t high = key >> 32;
+
+	uint32_t x1 = high * PRIME32_1;
+	uint32_t x2 = high * PRIME32_3;
+
+	out1 = _mm_set1_epi32(x1);
+	out1 = _mm_xor_si128(out1, XXH_OUT1_INIT);
+	XXHExecuteRotlAndMult(out1);
+
+	out2 = _mm_set1_epi32(x2);
+	out2 = _mm_xor_si128(out2, XXH_OUT2_INIT);
+	XXHExecuteRotlAndMult(out2);
+
+	out3 = _mm_set1_epi32(x2);
+	out3 = _mm_xor_si128(out3, XXH_OUT3_INIT);
+	XXHExecuteRotlAndMult(out3);
+
+	uint32_t high3byte = high & 0xffffff00U;
+	uint32_t high3byteP1 = high3byte * PRIME32_1;
+	uint32_t high3byteP3 = high3byte * PRIME32_3;
+
+	out4 = _mm_set_epi32(x1, high3byteP1, x2, high3byteP3);
+	out4 = _mm_xor_si128(out4, XXH_OUT4_INIT);
+	XXHExecuteRotlAndMult(out4);
+
+	__m128i v1 = _mm_set1_epi32(low);
+	v1 = _mm_and_si128(v1, XXH_LOW_MASK);
+	__m128i v2 = _mm_mullo_epi32(v1, PRIME32_1_ARRAY);
+	__m128i v3 = _mm_mullo_epi32(v1, PRIME32_3_ARRAY);
+
+	out1 = _mm_xor_si128(out1, v2);
+	XXHExecuteRotlAndMult(out1);
+
+	out2 = _mm_xor_si128(out2, v3);
+	XXHExecuteRotlAndMult(out2);
+
+	out3 = _mm_xor_si128(out3, v3);
+	XXHExecuteRotlAndMult(out3);
+
+	XXHExecuteAvalanche(out1);
+	XXHExecuteAvalanche(out2);
+	XXHExecuteAvalanche(out3);
+	XXHExecuteAvalanche(out4);
+
+	uint32_t h34 = (PRIME32_5 + 4U) ^ x2;
+	h34 = XXH_rotl32(h34, 17) * PRIME32_4;
+	h34 = XXH32_avalanche(h34);
+
+	uint32_t h33 = (PRIME32_5 + 3U) ^ high3byteP3;
+	h33 = XXH_rotl32(h33, 17) * PRIME32_4;
+	h33 = XXH32_avalanche(h33);
+
+	assert(_mm_extract_epi32(out1, 3) == XXHashFn1(key, 8));
+	assert(_mm_extract_epi32(out1, 2) == XXHashFn1(key, 7));
+	assert(_mm_extract_epi32(out1, 1) == XXHashFn1(key, 6));
+	assert(_mm_extract_epi32(out1, 0) == XXHashFn1(key, 5));
+	assert(_mm_extract_epi32(out2, 3) == XXHashFn2(key, 8));
+	assert(_mm_extract_epi32(out2, 2) == XXHashFn2(key, 7));
+	assert(_mm_extract_epi32(out2, 1) == XXHashFn2(key, 6));
+	assert(_mm_extract_epi32(out2, 0) == XXHashFn2(key, 5));
+	assert(_mm_extract_epi32(out3, 3) == XXHashFn3(key, 8));
+	assert(_mm_extract_epi32(out3, 2) == XXHashFn3(key, 7));
+	assert(_mm_extract_epi32(out3, 1) == XXHashFn3(key, 6));
+	assert(_mm_extract_epi32(out3, 0) == XXHashFn3(key, 5));
+	assert(_mm_extract_epi32(out4, 3) == XXHashFn1(key, 4));
+	assert(_mm_extract_epi32(out4, 2) == XXHashFn1(key, 3));
+	assert(_mm_extract_epi32(out4, 1) == XXHashFn2(key, 4));
+	assert(_mm_extract_epi32(out4, 0) == XXHashFn2(key, 3));
+	assert(h34 == XXHashFn3(key, 4));
+	assert(h33 == XXHashFn3(key, 3));
+
+	out5 = (uint64_t(h34) << 32) | h33;
+}
+
+}	// namespace XXH
+
+// The modified XXH32 family (the default)
+//
+struct XXHashFamily
+{
+	static uint32_t HashFn1(uint64_t key, uint32_t len) { return XXH::XXHashFn1(key, len); }
+	static uint32_t HashFn2(uint64_t key, uint32_t len) { return XXH::XXHashFn2(key, len); }
+	static uint32_t HashFn3(uint64_t key, uint32_t len) { return XXH::XXHashFn3(key, len); }
+
+	static void HashArray(uint64_t key, __m128i& out1, __m128i& out2, __m128i& out3, __m128i& out4, uint64_t& out5)
+	{
+		XXH::XXHashArray(key, out1, out2, out3, out4, out5);
+	}
+};
+
+// Hardware CRC32 (SSE4.2 crc32 instruction) family
+// CRC is linear over GF(2): for inputs of the same length, crc(seed1, x) ^ crc(seed2, x) is a constant,
+// so two CRCs of the same input with different seeds collide on exactly the same pairs of keys,
+// which is fatal for Cuckoo hashing. So the two Cuckoo positions are computed from different inputs:
+//    c1 = crc32(SEED1 + len, prefix), c2 = crc32(SEED2 + len, right-aligned prefix * K)
+// (the multiplication is not linear over GF(2)), and
+//    h1 = Mix(c1, M1), h2 = Mix(c2, M2), h3 = Mix(c1 ^ c2, M3)
+// where Mix(c, M) = c * M ^ (c * M) >> 16 is a bijection which spreads all bits of c into the low bits.
+// The tag must not be a function of c1 (or c2) alone: a 32-bit c1 collision (~16K pairs among 12M prefixes)
+// would then match both the position and the tag, which showed up as 1000x the expected tag false positive rate.
+// There is no vector crc32 instruction, so HashArray issues the 12 crc32 instructions back to back
+// (they are independent and pipelined: 3 cycles latency, 1 per cycle throughput), and vectorizes the mixing.
+//
+struct CRC32HashFamily
+{
+	static const uint32_t x_seed1 = 0x9e3779b9U;
+	static const uint32_t x_seed2 = 0x85ebca6bU;
+	static const uint64_t x_mult = 0xff51afd7ed558ccdULL;
+	static const uint32_t x_mix1 = 0xcc9e2d51U;
+	static const uint32_t x_mix2 = 0x1b873593U;
+	static const uint32_t x_mix3 = 0xe6546b65U;
+
+	static uint32_t Crc1(uint64_t key, uint32_t len)
+	{
+		uint64_t prefix = key >> (64 - 8 * len) << (64 - 8 * len);
+		return _mm_crc32_u64(x_seed1 + len, prefix);
+	}
+
+	static uint32_t Crc2(uint64_t key, uint32_t len)
+	{
+		uint64_t prefix = key >> (64 - 8 * len);
+		return _mm_crc32_u64(x_seed2 + len, prefix * x_mult);
+	}
+
+	static uint32_t Mix(uint32_t c, uint32_t m)
+	{
+		c *= m;
+		return c ^ (c >> 16);
+	}
+
+	static __m128i Mix(__m128i c, __m128i m)
+	{
+		c = _mm_mullo_epi32(c, m);
+		return _mm_xor_si128(c, _mm_srli_epi32(c, 16));
+	}
+
+	static uint32_t HashFn1(uint64_t key, uint32_t len) { return Mix(Crc1(key, len), x_mix1); }
+	static uint32_t HashFn2(uint64_t key, uint32_t len) { return Mix(Crc2(key, len), x_mix2); }
+	static uint32_t HashFn3(uint64_t key, uint32_t len) { return Mix(Crc1(key, len) ^ Crc2(key, len), x_mix3); }
+
+	static void HashArray(uint64_t key, __m128i& out1, __m128i& out2, __m128i& out3, __m128i& out4, uint64_t& out5)
+	{
+		// build the vectors from registers, a vector load of the 32-bit crcs from memory would fail store forwarding
+		//
+		__m128i c1High = _mm_setr_epi32(Crc1(key, 5), Crc1(key, 6), Crc1(key, 7), Crc1(key, 8));
+		__m128i c2High = _mm_setr_epi32(Crc2(key, 5), Crc2(key, 6), Crc2(key, 7), Crc2(key, 8));
+		uint32_t c13 = Crc1(key, 3);
+		uint32_t c14 = Crc1(key, 4);
+		uint32_t c23 = Crc2(key, 3);
+		uint32_t c24 = Crc2(key, 4);
+		out1 = Mix(c1High, _mm_set1_epi32(x_mix1));
+		out2 = Mix(c2High, _mm_set1_epi32(x_mix2));
+		out3 = Mix(_mm_xor_si128(c1High, c2High), _mm_set1_epi32(x_mix3));
+		out4 = Mix(_mm_setr_epi32(c23, c24, c13, c14), _mm_setr_epi32(x_mix2, x_mix2, x_mix1, x_mix1));
+		out5 = (uint64_t(Mix(c14 ^ c24, x_mix3)) << 32) | Mix(c13 ^ c23, x_mix3);
+
+		assert(uint32_t(_mm_extract_epi32(out1, 0)) == HashFn1(key, 5));
+		assert(uint32_t(_mm_extract_epi32(out2, 3)) == HashFn2(key, 8));
+		assert(uint32_t(_mm_extract_epi32(out3, 1)) == HashFn3(key, 6));
+		assert(uint32_t(_mm_extract_epi32(out4, 2)) == HashFn1(key, 3));
+		assert(uint32_t(_mm_extract_epi32(out4, 1)) == HashFn2(key, 4));
+	}
+};
+
+// Multiply-shift family: h = ((x * A) >> 32) + len * B (mod 2^32), with a different odd A for each function,
+// finalized by h ^ (h >> 16)
+// x is the right-aligned prefix folded by x ^ (x >> 32), so that the high bytes of an 8-byte prefix
+// also reach the low bits of the hash (multiplication only propagates bits upwards).
+// The final xor-shift is needed because the hash table mask and the tag take the LOW bits of h, which are the worst mixed
+// bits of the product; without it dense keys (few distinct byte values) give 25% tag false positives and Cuckoo insertion failures.
+// The len * B term separates the same x at different lengths (e.g. prefix 00 AB CD EF of len 4 and AB CD EF of len 3).
+// The vectorized version computes the high half of the 64-bit products with three 32x32 multiplications (_mm256_mul_epu32)
+// for the 4 prefixes of length 5 to 8, and two for the prefixes of length 3 and 4 (which fit in 32 bits).
+//
+struct MultiplyShiftHashFamily
+{
+	static const uint64_t x_mult1 = 0x9e3779b97f4a7c15ULL;
+	static const uint64_t x_mult2 = 0xc2b2ae3d27d4eb4fULL;
+	static const uint64_t x_mult3 = 0x165667b19e3779f9ULL;
+	static const uint32_t x_lenMult1 = 0x27d4eb2fU;
+	static const uint32_t x_lenMult2 = 0x85ebca77U;
+	static const uint32_t x_lenMult3 = 0x61c88647U;
+
+	static uint64_t Fold(uint64_t key, uint32_t len)
+	{
+		uint64_t x = key >> (64 - 8 * len);
+		return x ^ (x >> 32);
+	}
+
+	static uint32_t Finalize(uint32_t h) { return h ^ (h >> 16); }
+
+	static __m128i Finalize(__m128i h) { return _mm_xor_si128(h, _mm_srli_epi32(h, 16)); }
+
+	static uint32_t HashFn1(uint64_t key, uint32_t len) { return Finalize(uint32_t((Fold(key, len) * x_mult1) >> 32) + len * x_lenMult1); }
+	static uint32_t HashFn2(uint64_t key, uint32_t len) { return Finalize(uint32_t((Fold(key, len) * x_mult2) >> 32) + len * x_lenMult2); }
+	static uint32_t HashFn3(uint64_t key, uint32_t len) { return Finalize(uint32_t((Fold(key, len) * x_mult3) >> 32) + len * x_lenMult3); }
+
+	// high 32 bits of the 64-bit product of each lane, in the low 32 bits of the lane
+	//
+	static __m256i MulHigh32(__m256i x, __m256i mult)
+	{
+		__m256i lo = _mm256_srli_epi64(_mm256_mul_epu32(x, mult), 32);
+		__m256i mid1 = _mm256_mul_epu32(x, _mm256_srli_epi64(mult, 32));
+		__m256i mid2 = _mm256_mul_epu32(_mm256_srli_epi64(x, 32), mult);
+		return _mm256_add_epi32(_mm256_add_epi32(lo, mid1), mid2);
+	}
+
+	// the low 32 bits of each 64-bit lane
+	//
+	static __m128i PackLow32(__m256i x)
+	{
+		return _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(x, _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6)));
+	}
+
+	static void HashArray(uint64_t key, __m128i& out1, __m128i& out2, __m128i& out3, __m128i& out4, uint64_t& out5)
+	{
+		// prefixes of length 5 to 8, low to high
+		//
+		__m256i x = _mm256_srlv_epi64(_mm256_set1_epi64x(key), _mm256_setr_epi64x(24, 16, 8, 0));
+		x = _mm256_xor_si256(x, _mm256_srli_epi64(x, 32));
+		__m128i lenHigh = _mm_setr_epi32(5, 6, 7, 8);
+		out1 = Finalize(_mm_add_epi32(PackLow32(MulHigh32(x, _mm256_set1_epi64x(x_mult1))), _mm_mullo_epi32(lenHigh, _mm_set1_epi32(x_lenMult1))));
+		out2 = Finalize(_mm_add_epi32(PackLow32(MulHigh32(x, _mm256_set1_epi64x(x_mult2))), _mm_mullo_epi32(lenHigh, _mm_set1_epi32(x_lenMult2))));
+		out3 = Finalize(_mm_add_epi32(PackLow32(MulHigh32(x, _mm256_set1_epi64x(x_mult3))), _mm_mullo_epi32(lenHigh, _mm_set1_epi32(x_lenMult3))));
+
+		// prefixes of length 3 and 4 fit in 32 bits, so the fold is a no-op and the high half of x is 0
+		//
+		uint64_t x3 = key >> 40;
+		uint64_t x4 = key >> 32;
+		__m256i y = _mm256_setr_epi64x(x3, x4, x3, x4);
+		__m256i mult = _mm256_setr_epi64x(x_mult2, x_mult2, x_mult1, x_mult1);
+		__m256i low = _mm256_add_epi32(_mm256_srli_epi64(_mm256_mul_epu32(y, mult), 32),
+		                               _mm256_mul_epu32(y, _mm256_srli_epi64(mult, 32)));
+		out4 = Finalize(_mm_add_epi32(PackLow32(low), _mm_setr_epi32(3 * x_lenMult2, 4 * x_lenMult2, 3 * x_lenMult1, 4 * x_lenMult1)));
+		out5 = (uint64_t(HashFn3(key, 4)) << 32) | HashFn3(key, 3);
+
+		assert(uint32_t(_mm_extract_epi32(out1, 0)) == HashFn1(key, 5));
+		assert(uint32_t(_mm_extract_epi32(out1, 3)) == HashFn1(key, 8));
+		assert(uint32_t(_mm_extract_epi32(out2, 2)) == HashFn2(key, 7));
+		assert(uint32_t(_mm_extract_epi32(out3, 1)) == HashFn3(key, 6));
+		assert(uint32_t(_mm_extract_epi32(out4, 3)) == HashFn1(key, 4));
+		assert(uint32_t(_mm_extract_epi32(out4, 0)) == HashFn2(key, 3));
+	}
+};
+
+}	// namespace MlpSetUInt64
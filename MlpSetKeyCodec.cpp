@@ -0,0 +1,157 @@
+#include "MlpSetKeyCodec.h"
+
+namespace MlpSetUInt64
+{
+
+CommonPrefixKeyCodec::CommonPrefixKeyCodec()
+	: m_prefixLen(0)
+	, m_prefix(0)
+{ }
+
+void CommonPrefixKeyCodec::Learn(const uint64_t* keys, uint32_t n)
+{
+	m_prefixLen = 0;
+	m_prefix = 0;
+	if (n == 0)
+	{
+		return;
+	}
+	uint64_t diff = 0;
+	rep(i, 1, int(n) - 1)
+	{
+		diff |= keys[i] ^ keys[0];
+	}
+	// keep at least one bit so that all shifts are well-defined
+	//
+	m_prefixLen = (diff == 0) ? 63 : __builtin_clzll(diff);
+	if (m_prefixLen > 0)
+	{
+		m_prefix = keys[0] >> (64 - m_prefixLen) << (64 - m_prefixLen);
+	}
+}
+
+bool CommonPrefixKeyCodec::Encode(uint64_t key, uint64_t& code)
+{
+	if (m_prefixLen == 0)
+	{
+		code = key;
+		return true;
+	}
+	code = key << m_prefixLen;
+	return (key >> (64 - m_prefixLen)) == (m_prefix >> (64 - m_prefixLen));
+}
+
+bool CommonPrefixKeyCodec::EncodeLowerBound(uint64_t key, uint64_t& code)
+{
+	if (m_prefixLen == 0)
+	{
+		code = key;
+		return true;
+	}
+	uint64_t keyPrefix = key >> (64 - m_prefixLen);
+	uint64_t prefix = m_prefix >> (64 - m_prefixLen);
+	if (keyPrefix < prefix)
+	{
+		// all keys in domain are larger
+		//
+		code = 0;
+		return true;
+	}
+	if (keyPrefix > prefix)
+	{
+		return false;
+	}
+	code = key << m_prefixLen;
+	return true;
+}
+
+uint64_t CommonPrefixKeyCodec::Decode(uint64_t code)
+{
+	if (m_prefixLen == 0)
+	{
+		return code;
+	}
+	return m_prefix | (code >> m_prefixLen);
+}
+
+MixedRadixKeyCodec::MixedRadixKeyCodec()
+	: m_alphabet()
+	, m_shift(0)
+{ }
+
+void MixedRadixKeyCodec::Learn(const uint64_t* keys, uint32_t n)
+{
+	m_alphabet = ByteAlphabet();
+	rep(i, 0, int(n) - 1)
+	{
+		m_alphabet.AddKey(keys[i]);
+	}
+	if (n == 0)
+	{
+		// an empty domain is not useful, use the key 0 as the domain
+		//
+		m_alphabet.AddKey(0);
+	}
+	m_alphabet.Finalize();
+	// # of bits needed for the packed integer is ceil(log2(product of alphabet sizes))
+	//
+	unsigned __int128 product = 1;
+	rep(d, 0, 7)
+	{
+		product *= m_alphabet.size[d];
+	}
+	int bits = 0;
+	while ((unsigned __int128)1 << bits < product)
+	{
+		bits++;
+	}
+	m_shift = 64 - bits;
+}
+
+uint64_t MixedRadixKeyCodec::Pack(uint64_t ranks)
+{
+	uint64_t packed = 0;
+	rep(d, 0, 7)
+	{
+		packed = packed * m_alphabet.size[d] + ((ranks >> (56 - 8 * d)) & 255);
+	}
+	// shift by 64 is undefined, m_shift is 64 only if the domain is a single key
+	//
+	return (m_shift == 64) ? 0 : (packed << m_shift);
+}
+
+bool MixedRadixKeyCodec::Encode(uint64_t key, uint64_t& code)
+{
+	uint64_t ranks;
+	if (!m_alphabet.Encode(key, ranks))
+	{
+		return false;
+	}
+	code = Pack(ranks);
+	return true;
+}
+
+bool MixedRadixKeyCodec::EncodeLowerBound(uint64_t key, uint64_t& code)
+{
+	uint64_t ranks;
+	if (!m_alphabet.EncodeLowerBound(key, ranks))
+	{
+		return false;
+	}
+	code = Pack(ranks);
+	return true;
+}
+
+uint64_t MixedRadixKeyCodec::Decode(uint64_t code)
+{
+	uint64_t packed = (m_shift == 64) ? 0 : (code >> m_shift);
+	uint64_t ranks = 0;
+	repd(d, 7, 0)
+	{
+		ranks |= (packed % m_alphabet.size[d]) << (56 - 8 * d);
+		packed /= m_alphabet.size[d];
+	}
+	return m_alphabet.Decode(ranks);
+}
+
+}	// namespace MlpSetUInt64
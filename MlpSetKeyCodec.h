@@ -0,0 +1,187 @@
+#pragma once
+
+#include "common.h"
+#include "MlpSetUInt64.h"
+
+namespace MlpSetUInt64
+{
+
+// Order-preserving key codecs, applied to the keys before they reach MlpSet (and so before XXHashArray and QueryLCP)
+//
+// A codec maps the keys in its domain to codes, such that a < b iff Encode(a) < Encode(b).
+// The parameters of a codec are learned from a sample of keys (or from the whole bulk load).
+// Every codec implements:
+//    void Learn(const uint64_t* keys, uint32_t n)
+//        learn the parameters, the domain of the codec must contain all given keys
+//    bool Encode(uint64_t key, uint64_t& code)
+//        returns false if key is not in the domain
+//    bool EncodeLowerBound(uint64_t key, uint64_t& code)
+//        get the code of the smallest key in domain >= key, returns false if no such key exists
+//    uint64_t Decode(uint64_t code)
+//
+
+// The trivial codec
+//
+struct IdentityKeyCodec
+{
+	void Learn(const uint64_t* /*keys*/, uint32_t /*n*/) { }
+	bool Encode(uint64_t key, uint64_t& code) { code = key; return true; }
+	bool EncodeLowerBound(uint64_t key, uint64_t& code) { code = key; return true; }
+	uint64_t Decode(uint64_t code) { return code; }
+};
+
+// Elide the common prefix of all keys
+// The domain is all keys with the learned prefix, the code is the key shifted left by the prefix length,
+// so the varying bits of the key are moved to the top levels of the tree
+//
+struct CommonPrefixKeyCodec
+{
+	CommonPrefixKeyCodec();
+
+	void Learn(const uint64_t* keys, uint32_t n);
+	bool Encode(uint64_t key, uint64_t& code);
+	bool EncodeLowerBound(uint64_t key, uint64_t& code);
+	uint64_t Decode(uint64_t code);
+
+	// # of bits of the common prefix (0-63)
+	//
+	int m_prefixLen;
+	// the common prefix, in the high m_prefixLen bits
+	//
+	uint64_t m_prefix;
+};
+
+// Mixed-radix packing
+// Each byte position is remapped to its dense alphabet (see ByteAlphabet),
+// and the ranks are packed into a mixed-radix integer (radix of each position is its alphabet size).
+// The packed integer is then shifted to the top of the 64-bit code.
+// The domain is all keys whose bytes are all in the alphabets.
+// This elides all constant bytes and the unused values of each byte,
+// e.g. 6 bytes of 5 symbols and 2 bytes of 64 symbols are packed into 26 bits.
+//
+struct MixedRadixKeyCodec
+{
+	MixedRadixKeyCodec();
+
+	void Learn(const uint64_t* keys, uint32_t n);
+	bool Encode(uint64_t key, uint64_t& code);
+	bool EncodeLowerBound(uint64_t key, uint64_t& code);
+	uint64_t Decode(uint64_t code);
+
+	ByteAlphabet m_alphabet;
+	// code = packed ranks << m_shift
+	//
+	int m_shift;
+
+private:
+	uint64_t Pack(uint64_t ranks);
+};
+
+// MlpSet operating on codes of KeyCodec, results are returned in original key space
+// Inserting a key not in the domain of the codec rebuilds the set with a codec learned from all elements plus the key
+// (slow, O(n)). Exist and LowerBound accept any key.
+//
+template<class KeyCodec>
+class MlpSetWithKeyCodec
+{
+public:
+	MlpSetWithKeyCodec()
+		: m_set(nullptr)
+		, m_maxSetSize(0)
+	{ }
+
+	~MlpSetWithKeyCodec()
+	{
+		if (m_set != nullptr)
+		{
+			delete m_set;
+			m_set = nullptr;
+		}
+	}
+
+	// Initialize the set to hold at most maxSetSize elements, with the codec learned from sample
+	//
+	void Init(uint32_t maxSetSize, const uint64_t* sample, uint32_t sampleSize)
+	{
+		assert(m_set == nullptr);
+		m_maxSetSize = maxSetSize;
+		m_codec.Learn(sample, sampleSize);
+		m_set = new MlpSet();
+		ReleaseAssert(m_set != nullptr);
+		m_set->Init(maxSetSize);
+	}
+
+	bool Insert(uint64_t value)
+	{
+		uint64_t code;
+		if (unlikely(!m_codec.Encode(value, code)))
+		{
+			Rebuild(value);
+			bool ok = m_codec.Encode(value, code);
+			ReleaseAssert(ok);
+		}
+		return m_set->Insert(code);
+	}
+
+	bool Exist(uint64_t value)
+	{
+		uint64_t code;
+		if (!m_codec.Encode(value, code))
+		{
+			return false;
+		}
+		return m_set->Exist(code);
+	}
+
+	uint64_t LowerBound(uint64_t value, bool& found)
+	{
+		uint64_t code;
+		if (!m_codec.EncodeLowerBound(value, code))
+		{
+			found = false;
+			return 0xffffffffffffffffULL;
+		}
+		uint64_t result = m_set->LowerBound(code, found);
+		return found ? m_codec.Decode(result) : 0xffffffffffffffffULL;
+	}
+
+	KeyCodec* GetCodec() { return &m_codec; }
+	MlpSet* GetSet() { return m_set; }
+
+private:
+	void Rebuild(uint64_t value)
+	{
+		vector<uint64_t> elements;
+		uint64_t code = 0;
+		while (true)
+		{
+			bool found;
+			uint64_t x = m_set->LowerBound(code, found);
+			if (!found) break;
+			elements.push_back(m_codec.Decode(x));
+			if (x == 0xffffffffffffffffULL) break;
+			code = x + 1;
+		}
+		elements.push_back(value);
+		m_codec.Learn(elements.data(), elements.size());
+		elements.pop_back();
+
+		delete m_set;
+		m_set = new MlpSet();
+		ReleaseAssert(m_set != nullptr);
+		m_set->Init(max(m_maxSetSize, uint32_t(elements.size()) + 1));
+		rep(i, 0, int(elements.size()) - 1)
+		{
+			bool ok = m_codec.Encode(elements[i], code);
+			ReleaseAssert(ok);
+			bool inserted = m_set->Insert(code);
+			ReleaseAssert(inserted);
+		}
+	}
+
+	KeyCodec m_codec;
+	MlpSet* m_set;
+	uint32_t m_maxSetSize;
+};
+
+}	// namespace MlpSetUInt64
@@ -0,0 +1,184 @@
+#include "common.h"
+#include "MlpSetKeyCodec.h"
+#include "WorkloadInterface.h"
+#include "WorkloadC.h"
+#include "WorkloadD.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+// Keys with high-entropy low bytes (WorkloadC/D style), with a constant top byte
+//
+uint64_t GenLowBitVaryingKey()
+{
+	uint64_t key = 0x5a;
+	rep(k, 1, 5) key = key * 256 + rand() % 5 + 48;
+	rep(k, 6, 7) key = key * 256 + rand() % 64 + 32;
+	return key;
+}
+
+template<class KeyCodec>
+void KeyCodecCorrectnessTestImpl(const char* name)
+{
+	printf("Testing %s..\n", name);
+	const int N = 500000;
+	const int Q = 1000000;
+
+	vector<uint64_t> sample;
+	rep(i, 0, 9999) sample.push_back(GenLowBitVaryingKey());
+
+	MlpSetUInt64::MlpSetWithKeyCodec<KeyCodec> ms;
+	ms.Init(N + 10, sample.data(), sample.size());
+	set<uint64_t> S;
+	rep(i, 0, N - 1)
+	{
+		uint64_t key = GenLowBitVaryingKey();
+		// sometimes insert a key not in the domain of the codec, which triggers a rebuild
+		//
+		if (i == 1000 || i == 300000)
+		{
+			key ^= uint64_t(rand() % 255 + 1) << (8 * (rand() % 8));
+		}
+		bool expected = S.insert(key).second;
+		bool actual = ms.Insert(key);
+		ReleaseAssert(expected == actual);
+	}
+
+	rep(i, 0, Q - 1)
+	{
+		uint64_t key;
+		int kind = rand() % 3;
+		if (kind == 0)
+		{
+			key = GenLowBitVaryingKey();
+		}
+		else if (kind == 1)
+		{
+			key = 0;
+			rep(k, 0, 7) key = key * 256 + rand() % 256;
+		}
+		else
+		{
+			key = GenLowBitVaryingKey() + rand() % 5 - 2;
+		}
+		auto it = S.lower_bound(key);
+		ReleaseAssert(ms.Exist(key) == (it != S.end() && *it == key));
+		bool found;
+		uint64_t lb = ms.LowerBound(key, found);
+		ReleaseAssert(found == (it != S.end()));
+		if (found)
+		{
+			ReleaseAssert(lb == *it);
+		}
+	}
+}
+
+TEST(MlpSetKeyCodec, CorrectnessTest)
+{
+	KeyCodecCorrectnessTestImpl<MlpSetUInt64::IdentityKeyCodec>("identity codec");
+	KeyCodecCorrectnessTestImpl<MlpSetUInt64::CommonPrefixKeyCodec>("common prefix codec");
+	KeyCodecCorrectnessTestImpl<MlpSetUInt64::MixedRadixKeyCodec>("mixed radix codec");
+}
+
+TEST(MlpSetKeyCodec, CodecSanity)
+{
+	{
+		uint64_t keys[2] = { 0x1234567800000000ULL, 0x12345678ffffffffULL };
+		MlpSetUInt64::CommonPrefixKeyCodec codec;
+		codec.Learn(keys, 2);
+		ReleaseAssert(codec.m_prefixLen == 32);
+		uint64_t code;
+		ReleaseAssert(codec.Encode(0x12345678abcdef01ULL, code) && code == 0xabcdef0100000000ULL);
+		ReleaseAssert(codec.Decode(code) == 0x12345678abcdef01ULL);
+		ReleaseAssert(!codec.Encode(0x12345679abcdef01ULL, code));
+		ReleaseAssert(codec.EncodeLowerBound(0x1234567700000000ULL, code) && code == 0);
+		ReleaseAssert(!codec.EncodeLowerBound(0x1234567900000000ULL, code));
+	}
+	{
+		vector<uint64_t> keys;
+		rep(i, 0, 9999) keys.push_back(GenLowBitVaryingKey());
+		MlpSetUInt64::MixedRadixKeyCodec codec;
+		codec.Learn(keys.data(), keys.size());
+		// 5 bytes of 5 symbols and 2 bytes of 64 symbols
+		//
+		ReleaseAssert(codec.m_shift == 64 - 24);
+		sort(keys.begin(), keys.end());
+		uint64_t last = 0;
+		rep(i, 0, int(keys.size()) - 1)
+		{
+			uint64_t code;
+			ReleaseAssert(codec.Encode(keys[i], code));
+			ReleaseAssert(codec.Decode(code) == keys[i]);
+			ReleaseAssert(i == 0 || code >= last);
+			last = code;
+		}
+	}
+}
+
+// Benchmark the codecs on WorkloadC/D
+//
+template<class KeyCodec>
+void KeyCodecBenchmarkImpl(WorkloadUInt64& workload, const char* name)
+{
+	printf("==== %s ====\n", name);
+	MlpSetUInt64::MlpSetWithKeyCodec<KeyCodec> ms;
+	// learn from the whole bulk load
+	//
+	ms.Init(workload.numInitialValues + 1000, workload.initialValues, workload.numInitialValues);
+
+	printf("MlpSet populating initial values..\n");
+	{
+		AutoTimer timer;
+		rep(i, 0, workload.numInitialValues - 1)
+		{
+			ms.Insert(workload.initialValues[i]);
+		}
+	}
+
+	printf("MlpSet executing workload..\n");
+	{
+		AutoTimer timer;
+		rep(i, 0, workload.numOperations - 1)
+		{
+			if (workload.operations[i].type == WorkloadOperationType::EXIST)
+			{
+				workload.results[i] = ms.Exist(workload.operations[i].key);
+			}
+			else
+			{
+				ReleaseAssert(workload.operations[i].type == WorkloadOperationType::LOWER_BOUND);
+				bool found;
+				workload.results[i] = ms.LowerBound(workload.operations[i].key, found);
+			}
+		}
+	}
+	rep(i, 0, workload.numOperations - 1)
+	{
+		ReleaseAssert(workload.results[i] == workload.expectedResults[i]);
+	}
+}
+
+void KeyCodecBenchmarkAllCodecs(WorkloadUInt64& workload)
+{
+	KeyCodecBenchmarkImpl<MlpSetUInt64::IdentityKeyCodec>(workload, "identity codec");
+	KeyCodecBenchmarkImpl<MlpSetUInt64::CommonPrefixKeyCodec>(workload, "common prefix codec");
+	KeyCodecBenchmarkImpl<MlpSetUInt64::MixedRadixKeyCodec>(workload, "mixed radix codec");
+}
+
+TEST(MlpSetKeyCodec, WorkloadC_16M)
+{
+	printf("Generating workload WorkloadC 16M..\n");
+	WorkloadUInt64 workload = WorkloadC::GenWorkload16M();
+	Auto(workload.FreeMemory());
+	KeyCodecBenchmarkAllCodecs(workload);
+}
+
+TEST(MlpSetKeyCodec, WorkloadD_16M)
+{
+	printf("Generating workload WorkloadD 16M..\n");
+	WorkloadUInt64 workload = WorkloadD::GenWorkload16M();
+	Auto(workload.FreeMemory());
+	KeyCodecBenchmarkAllCodecs(workload);
+}
+
+}	// annoymous namespace
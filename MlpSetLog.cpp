@@ -0,0 +1,436 @@
+#include "MlpSetLog.h"
+#include <sys/uio.h>
+#include <dirent.h>
+
+namespace MlpSetUInt64
+{
+
+// Write all iovcnt buffers, resuming after partial writes
+//
+static void WriteFully(int fd, struct iovec* iov, int iovcnt)
+{
+	while (iovcnt > 0)
+	{
+		ssize_t ret = writev(fd, iov, iovcnt);
+		if (ret == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		ReleaseAssert(ret > 0);
+		size_t written = ret;
+		while (iovcnt > 0 && written >= iov->iov_len)
+		{
+			written -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0)
+		{
+			iov->iov_base = reinterpret_cast<uint8_t*>(iov->iov_base) + written;
+			iov->iov_len -= written;
+		}
+	}
+}
+
+// Read exactly size bytes, returns false on a short read (end of file)
+//
+static bool ReadFully(int fd, void* buf, size_t size)
+{
+	uint8_t* ptr = reinterpret_cast<uint8_t*>(buf);
+	while (size > 0)
+	{
+		ssize_t ret = read(fd, ptr, size);
+		if (ret == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		ReleaseAssert(ret >= 0);
+		if (ret == 0)
+		{
+			return false;
+		}
+		ptr += ret;
+		size -= ret;
+	}
+	return true;
+}
+
+WriteAheadLog::WriteAheadLog()
+	: m_fd(-1)
+	, m_syncMode(x_syncData)
+	, m_groupCommitIntervalUs(1000)
+	, m_maxBatchSize(65536)
+	, m_firstLsn(0)
+	, m_nextLsn(0)
+	, m_pendingFirstLsn(0)
+	, m_durableLsn(0)
+	, m_numWaiters(0)
+	, m_stop(false)
+	, m_numBatches(0)
+	, m_numBytesWritten(0)
+{ }
+
+WriteAheadLog::~WriteAheadLog()
+{
+	if (m_fd != -1)
+	{
+		Close();
+	}
+}
+
+void WriteAheadLog::Open(const string& path, uint64_t firstLsn)
+{
+	assert(m_fd == -1);
+	m_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	ReleaseAssert(m_fd != -1);
+	FileHeader header;
+	header.magic = x_fileMagic;
+	header.firstLsn = firstLsn;
+	struct iovec iov;
+	iov.iov_base = &header;
+	iov.iov_len = sizeof(header);
+	WriteFully(m_fd, &iov, 1);
+	ReleaseAssert(fdatasync(m_fd) == 0);
+
+	m_firstLsn = firstLsn;
+	m_nextLsn = firstLsn;
+	m_durableLsn = firstLsn;
+	m_pendingFirstLsn = firstLsn;
+	m_numWaiters = 0;
+	m_stop = false;
+	m_numBatches = 0;
+	m_numBytesWritten = sizeof(header);
+	m_pendingKeys.reserve(m_maxBatchSize);
+	m_pendingOps.reserve(m_maxBatchSize);
+	m_flusher = std::thread([this]() { FlusherThread(); });
+}
+
+void WriteAheadLog::Close()
+{
+	assert(m_fd != -1);
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_flusherCv.notify_one();
+	m_flusher.join();
+	assert(m_durableLsn == m_nextLsn);
+	// the file is synced even in x_writeOnly mode, so that a closed log is always durable
+	//
+	ReleaseAssert(fdatasync(m_fd) == 0);
+	close(m_fd);
+	m_fd = -1;
+}
+
+uint64_t WriteAheadLog::Append(Op op, uint64_t key)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if (m_pendingKeys.empty())
+	{
+		m_pendingSince = std::chrono::steady_clock::now();
+		m_pendingFirstLsn = m_nextLsn;
+		m_flusherCv.notify_one();
+	}
+	m_pendingKeys.push_back(key);
+	m_pendingOps.push_back(op);
+	if (m_pendingKeys.size() == m_maxBatchSize)
+	{
+		m_flusherCv.notify_one();
+	}
+	while (m_pendingKeys.size() >= size_t(m_maxBatchSize) * x_maxPendingBatches)
+	{
+		m_durableCv.wait(lock);
+	}
+	return m_nextLsn++;
+}
+
+void WriteAheadLog::WaitDurable(uint64_t lsn)
+{
+	assert(lsn < m_nextLsn);
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if (m_durableLsn > lsn)
+	{
+		return;
+	}
+	m_numWaiters++;
+	m_flusherCv.notify_one();
+	while (m_durableLsn <= lsn)
+	{
+		m_durableCv.wait(lock);
+	}
+	m_numWaiters--;
+}
+
+void WriteAheadLog::FlusherThread()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (true)
+	{
+		if (m_pendingKeys.empty())
+		{
+			if (m_stop)
+			{
+				break;
+			}
+			m_flusherCv.wait(lock);
+			continue;
+		}
+		if (!m_stop && m_numWaiters == 0 && m_pendingKeys.size() < m_maxBatchSize)
+		{
+			std::chrono::steady_clock::time_point deadline = m_pendingSince + std::chrono::microseconds(m_groupCommitIntervalUs);
+			if (std::chrono::steady_clock::now() < deadline)
+			{
+				m_flusherCv.wait_until(lock, deadline);
+				continue;
+			}
+		}
+		m_flushingKeys.swap(m_pendingKeys);
+		m_flushingOps.swap(m_pendingOps);
+		uint64_t firstLsn = m_pendingFirstLsn;
+		lock.unlock();
+
+		BatchHeader header;
+		header.firstLsn = firstLsn;
+		header.numRecords = m_flushingKeys.size();
+		header.checksum = BatchChecksum(header, m_flushingKeys.data(), m_flushingOps.data());
+		struct iovec iov[3];
+		iov[0].iov_base = &header;
+		iov[0].iov_len = sizeof(header);
+		iov[1].iov_base = m_flushingKeys.data();
+		iov[1].iov_len = m_flushingKeys.size() * sizeof(uint64_t);
+		iov[2].iov_base = m_flushingOps.data();
+		iov[2].iov_len = m_flushingOps.size();
+		WriteFully(m_fd, iov, 3);
+		if (m_syncMode == x_syncData)
+		{
+			ReleaseAssert(fdatasync(m_fd) == 0);
+		}
+		m_numBatches++;
+		m_numBytesWritten += sizeof(header) + m_flushingKeys.size() * (sizeof(uint64_t) + 1);
+		m_flushingKeys.clear();
+		m_flushingOps.clear();
+
+		lock.lock();
+		m_durableLsn = firstLsn + header.numRecords;
+		m_durableCv.notify_all();
+	}
+}
+
+uint32_t WriteAheadLog::BatchChecksum(const BatchHeader& header, const uint64_t* keys, const uint8_t* ops)
+{
+	uint64_t crc = _mm_crc32_u64(0xffffffffU, header.firstLsn);
+	crc = _mm_crc32_u64(crc, header.numRecords);
+	rep(i, 0, int(header.numRecords) - 1)
+	{
+		crc = _mm_crc32_u64(crc, keys[i]);
+	}
+	rep(i, 0, int(header.numRecords) - 1)
+	{
+		crc = _mm_crc32_u8(uint32_t(crc), ops[i]);
+	}
+	return uint32_t(crc);
+}
+
+bool WriteAheadLog::Replay(const string& path, const ReplayFn& func, bool truncateTornTail, uint64_t& firstLsn, uint64_t& endLsn)
+{
+	int fd = open(path.c_str(), (truncateTornTail ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+	if (fd == -1)
+	{
+		return false;
+	}
+	FileHeader fileHeader;
+	if (!ReadFully(fd, &fileHeader, sizeof(fileHeader)) || fileHeader.magic != x_fileMagic)
+	{
+		close(fd);
+		return false;
+	}
+	firstLsn = fileHeader.firstLsn;
+	endLsn = fileHeader.firstLsn;
+	uint64_t offset = sizeof(fileHeader);
+	vector<uint64_t> keys;
+	vector<uint8_t> ops;
+	while (true)
+	{
+		BatchHeader header;
+		if (!ReadFully(fd, &header, sizeof(header)))
+		{
+			break;
+		}
+		// a batch is never larger than the pending limit, anything else is garbage from a torn write
+		//
+		if (header.firstLsn != endLsn || header.numRecords == 0 || header.numRecords > (1U << 28))
+		{
+			break;
+		}
+		keys.resize(header.numRecords);
+		ops.resize(header.numRecords);
+		if (!ReadFully(fd, keys.data(), header.numRecords * sizeof(uint64_t)) ||
+		    !ReadFully(fd, ops.data(), header.numRecords) ||
+		    BatchChecksum(header, keys.data(), ops.data()) != header.checksum)
+		{
+			break;
+		}
+		func(header.firstLsn, keys.data(), ops.data(), header.numRecords);
+		endLsn += header.numRecords;
+		offset += sizeof(header) + header.numRecords * (sizeof(uint64_t) + 1);
+	}
+	if (truncateTornTail)
+	{
+		struct stat st;
+		ReleaseAssert(fstat(fd, &st) == 0);
+		if (uint64_t(st.st_size) != offset)
+		{
+			ReleaseAssert(ftruncate(fd, offset) == 0);
+			ReleaseAssert(fdatasync(fd) == 0);
+		}
+	}
+	close(fd);
+	return true;
+}
+
+CheckpointFile::CheckpointFile()
+	: m_fd(-1)
+	, m_lsn(0)
+	, m_numKeys(0)
+	, m_lastKey(0)
+	, m_checksum(0)
+	, m_bufferSize(0)
+	, m_buffer(nullptr)
+{ }
+
+CheckpointFile::~CheckpointFile()
+{
+	if (m_fd != -1)
+	{
+		close(m_fd);
+		unlink(m_tmpPath.c_str());
+	}
+	delete [] m_buffer;
+}
+
+void CheckpointFile::Create(const string& tmpPath, uint64_t lsn)
+{
+	assert(m_fd == -1);
+	m_fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	ReleaseAssert(m_fd != -1);
+	m_tmpPath = tmpPath;
+	m_lsn = lsn;
+	m_numKeys = 0;
+	m_checksum = 0xffffffffU;
+	m_bufferSize = 0;
+	if (m_buffer == nullptr)
+	{
+		m_buffer = new uint64_t[x_bufferSize];
+	}
+	// the header is written by Commit, an all-zero header is invalid
+	//
+	ReleaseAssert(lseek(m_fd, sizeof(Header), SEEK_SET) == off_t(sizeof(Header)));
+}
+
+uint32_t CheckpointFile::Checksum(uint32_t crc, const uint64_t* keys, uint64_t n)
+{
+	uint64_t c = crc;
+	for (uint64_t i = 0; i < n; i++)
+	{
+		c = _mm_crc32_u64(c, keys[i]);
+	}
+	return uint32_t(c);
+}
+
+void CheckpointFile::FlushBuffer()
+{
+	m_checksum = Checksum(m_checksum, m_buffer, m_bufferSize);
+	struct iovec iov;
+	iov.iov_base = m_buffer;
+	iov.iov_len = m_bufferSize * sizeof(uint64_t);
+	WriteFully(m_fd, &iov, 1);
+	m_bufferSize = 0;
+}
+
+void CheckpointFile::Commit(const string& path)
+{
+	assert(m_fd != -1);
+	FlushBuffer();
+	Header header;
+	header.magic = x_magic;
+	header.lsn = m_lsn;
+	header.numKeys = m_numKeys;
+	header.checksum = m_checksum;
+	ReleaseAssert(pwrite(m_fd, &header, sizeof(header), 0) == sizeof(header));
+	ReleaseAssert(fdatasync(m_fd) == 0);
+	close(m_fd);
+	m_fd = -1;
+	ReleaseAssert(rename(m_tmpPath.c_str(), path.c_str()) == 0);
+}
+
+bool CheckpointFile::Read(const string& path, uint64_t& lsn, vector<uint64_t>& keys)
+{
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+	{
+		return false;
+	}
+	Header header;
+	struct stat st;
+	bool ok = ReadFully(fd, &header, sizeof(header)) && header.magic == x_magic &&
+	          fstat(fd, &st) == 0 && uint64_t(st.st_size) == sizeof(Header) + header.numKeys * sizeof(uint64_t);
+	if (ok)
+	{
+		keys.resize(header.numKeys);
+		ok = ReadFully(fd, keys.data(), header.numKeys * sizeof(uint64_t)) &&
+		     Checksum(0xffffffffU, keys.data(), header.numKeys) == header.checksum;
+	}
+	close(fd);
+	if (!ok)
+	{
+		keys.clear();
+		return false;
+	}
+	lsn = header.lsn;
+	return true;
+}
+
+void LogDirectory::Create(const string& dir)
+{
+	int ret = mkdir(dir.c_str(), 0755);
+	ReleaseAssert(ret == 0 || errno == EEXIST);
+}
+
+string LogDirectory::FileName(const string& dir, const string& prefix, uint64_t lsn)
+{
+	// zero-padded, so that the files also sort by LSN in a directory listing
+	//
+	char buf[32];
+	sprintf(buf, "%020llu", static_cast<unsigned long long>(lsn));
+	return dir + "/" + prefix + buf;
+}
+
+vector<pair<uint64_t, string> > LogDirectory::List(const string& dir, const string& prefix)
+{
+	vector<pair<uint64_t, string> > files;
+	DIR* d = opendir(dir.c_str());
+	ReleaseAssert(d != nullptr);
+	struct dirent* entry;
+	while ((entry = readdir(d)) != nullptr)
+	{
+		string name = entry->d_name;
+		if (name.length() == prefix.length() + 20 && name.compare(0, prefix.length(), prefix) == 0 &&
+		    name.find_first_not_of("0123456789", prefix.length()) == string::npos)
+		{
+			files.push_back(make_pair(uint64_t(strtoull(name.c_str() + prefix.length(), nullptr, 10)), dir + "/" + name));
+		}
+	}
+	closedir(d);
+	sort(files.begin(), files.end());
+	return files;
+}
+
+void LogDirectory::Sync(const string& dir)
+{
+	int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	ReleaseAssert(fd != -1);
+	ReleaseAssert(fsync(fd) == 0);
+	close(fd);
+}
+
+}	// namespace MlpSetUInt64
@@ -0,0 +1,243 @@
+#pragma once
+
+#include "common.h"
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace MlpSetUInt64
+{
+
+// A redo log of the mutations of a set, written with group commit
+//
+// A single writer appends records to an in-memory batch, each record gets the next LSN (log sequence number).
+// A flusher thread writes out the whole pending batch with one writev and one fdatasync, so all records
+// appended while the previous batch was being synced share a single sync (group commit).
+// The flusher starts a batch as soon as someone waits for durability, the batch reaches the maximal batch size,
+// or the group commit interval has passed since the first record of the batch was appended.
+// The writer is throttled if x_maxPendingBatches batches worth of records are waiting for the flusher.
+//
+// File format: a FileHeader, then the batches, each a BatchHeader followed by the keys and then the ops of its records.
+// The checksum of a batch covers the header and the records, so a batch torn by a crash is detected on replay
+// (and everything from it onwards is ignored, it was never reported durable).
+//
+class WriteAheadLog
+{
+public:
+	enum Op : uint8_t
+	{
+		x_opInsert = 1
+	};
+
+	enum SyncMode
+	{
+		// fdatasync after each batch, a record is durable once it is reported durable
+		//
+		x_syncData,
+		// only write, a record survives a crash of the process but not of the machine
+		//
+		x_writeOnly
+	};
+
+	WriteAheadLog();
+	~WriteAheadLog();
+
+	// Must be called before Open
+	//
+	void SetSyncMode(SyncMode mode) { assert(m_fd == -1); m_syncMode = mode; }
+	void SetGroupCommitInterval(uint32_t us) { assert(m_fd == -1); m_groupCommitIntervalUs = us; }
+	void SetMaxBatchSize(uint32_t numRecords) { assert(m_fd == -1); m_maxBatchSize = numRecords; }
+
+	// Create a new log file, whose first record has LSN firstLsn, and start the flusher
+	// Fails (ReleaseAssert) if the file exists
+	//
+	void Open(const string& path, uint64_t firstLsn);
+
+	// Flush and sync all appended records, stop the flusher and close the file
+	//
+	void Close();
+
+	bool IsOpen() { return m_fd != -1; }
+
+	// Append a record, returns its LSN
+	//
+	uint64_t Append(Op op, uint64_t key);
+
+	// Wait until the record of LSN lsn (and all before it) is durable
+	//
+	void WaitDurable(uint64_t lsn);
+
+	// Wait until all appended records are durable
+	//
+	void Sync()
+	{
+		if (m_nextLsn > m_firstLsn)
+		{
+			WaitDurable(m_nextLsn - 1);
+		}
+	}
+
+	// The LSN the next appended record gets
+	//
+	uint64_t GetNextLsn() { return m_nextLsn; }
+
+	// The LSN of the first record of the log file
+	//
+	uint64_t GetFirstLsn() { return m_firstLsn; }
+
+	uint64_t GetNumBatches() { return m_numBatches; }
+	uint64_t GetNumBytesWritten() { return m_numBytesWritten; }
+
+	// Called with the first LSN, keys and ops of each batch
+	//
+	typedef std::function<void(uint64_t firstLsn, const uint64_t* keys, const uint8_t* ops, uint32_t n)> ReplayFn;
+
+	// Read the log file at path and call func on each intact batch in order
+	// Reading stops at the end of the file or at the first torn or corrupt batch, the file is truncated there
+	// if truncateTornTail is set. Returns false if the file does not exist or its header is invalid.
+	// firstLsn is set to the LSN of the first record in the file, and endLsn to the LSN after its last intact record.
+	//
+	static bool Replay(const string& path, const ReplayFn& func, bool truncateTornTail, uint64_t& firstLsn, uint64_t& endLsn);
+
+	static const uint32_t x_maxPendingBatches = 4;
+
+private:
+	struct FileHeader
+	{
+		uint64_t magic;
+		uint64_t firstLsn;
+	};
+
+	struct BatchHeader
+	{
+		uint64_t firstLsn;
+		uint32_t numRecords;
+		uint32_t checksum;
+	};
+
+	static const uint64_t x_fileMagic = 0x474f4c5445534c4dULL;
+
+	static uint32_t BatchChecksum(const BatchHeader& header, const uint64_t* keys, const uint8_t* ops);
+
+	void FlusherThread();
+
+	int m_fd;
+	SyncMode m_syncMode;
+	uint32_t m_groupCommitIntervalUs;
+	uint32_t m_maxBatchSize;
+	uint64_t m_firstLsn;
+
+	// Owned by the writer
+	//
+	uint64_t m_nextLsn;
+
+	// Protected by m_mutex: the batch being appended to, the time its first record was appended,
+	// the LSN of its first record, the LSN after the last durable record, and whether someone waits
+	//
+	std::mutex m_mutex;
+	std::condition_variable m_flusherCv;
+	std::condition_variable m_durableCv;
+	vector<uint64_t> m_pendingKeys;
+	vector<uint8_t> m_pendingOps;
+	std::chrono::steady_clock::time_point m_pendingSince;
+	uint64_t m_pendingFirstLsn;
+	uint64_t m_durableLsn;
+	uint32_t m_numWaiters;
+	bool m_stop;
+
+	// Owned by the flusher
+	//
+	vector<uint64_t> m_flushingKeys;
+	vector<uint8_t> m_flushingOps;
+	uint64_t m_numBatches;
+	uint64_t m_numBytesWritten;
+
+	std::thread m_flusher;
+};
+
+// A checkpoint: the sorted keys of a set, reflecting all log records before LSN lsn
+//
+// The keys are streamed to a temporary file, which is synced and atomically renamed to its final name by Commit,
+// so a checkpoint under its final name is always complete. The header (written last) holds a checksum of the keys.
+//
+class CheckpointFile
+{
+public:
+	CheckpointFile();
+	~CheckpointFile();
+
+	// Start writing a checkpoint of LSN lsn to tmpPath, fails (ReleaseAssert) if the file exists
+	//
+	void Create(const string& tmpPath, uint64_t lsn);
+
+	// Append a key, keys must be added in increasing order
+	//
+	void Add(uint64_t key)
+	{
+		assert(m_numKeys == 0 || key > m_lastKey);
+		m_buffer[m_bufferSize++] = key;
+		if (m_bufferSize == x_bufferSize)
+		{
+			FlushBuffer();
+		}
+#ifndef NDEBUG
+		m_lastKey = key;
+#endif
+		m_numKeys++;
+	}
+
+	// Complete the checkpoint, sync it and rename it to path
+	//
+	void Commit(const string& path);
+
+	// Read the checkpoint at path, returns false if it does not exist or is incomplete or corrupt
+	//
+	static bool Read(const string& path, uint64_t& lsn, vector<uint64_t>& keys);
+
+private:
+	struct Header
+	{
+		uint64_t magic;
+		uint64_t lsn;
+		uint64_t numKeys;
+		uint64_t checksum;
+	};
+
+	static const uint64_t x_magic = 0x54504b4354534c4dULL;
+	static const uint32_t x_bufferSize = 65536;
+
+	static uint32_t Checksum(uint32_t crc, const uint64_t* keys, uint64_t n);
+
+	void FlushBuffer();
+
+	int m_fd;
+	string m_tmpPath;
+	uint64_t m_lsn;
+	uint64_t m_numKeys;
+	uint64_t m_lastKey;
+	uint32_t m_checksum;
+	uint32_t m_bufferSize;
+	uint64_t* m_buffer;
+};
+
+// The files of a durable set in its directory are named <prefix><LSN>
+//
+struct LogDirectory
+{
+	// Create the directory if it does not exist
+	//
+	static void Create(const string& dir);
+
+	static string FileName(const string& dir, const string& prefix, uint64_t lsn);
+
+	// The files named <prefix><LSN> in the directory, sorted by LSN
+	//
+	static vector<pair<uint64_t, string> > List(const string& dir, const string& prefix);
+
+	// fsync the directory, making the creation, renaming and removal of its files durable
+	//
+	static void Sync(const string& dir);
+};
+
+}	// namespace MlpSetUInt64
@@ -0,0 +1,209 @@
+#include "MlpSetNuma.h"
+#include <fstream>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+namespace MlpSetUInt64
+{
+
+bool NumaTopology::m_initialized = false;
+bool NumaTopology::m_simulated = false;
+vector<vector<int> > NumaTopology::m_cpusOfNode;
+vector<int> NumaTopology::m_realNodeIds;
+__thread int NumaTopology::t_pinnedNode = -1;
+__thread int NumaAllocationScope::t_allocationNode = NumaTopology::x_interleave;
+
+// Parse a sysfs CPU list, e.g. "0-3,8-11"
+//
+static vector<int> ParseCpuList(const string& s)
+{
+	vector<int> cpus;
+	size_t pos = 0;
+	while (pos < s.length())
+	{
+		size_t end = s.find(',', pos);
+		if (end == string::npos) end = s.length();
+		string range = s.substr(pos, end - pos);
+		size_t dash = range.find('-');
+		if (!range.empty() && isdigit(range[0]))
+		{
+			int lo = atoi(range.c_str());
+			int hi = (dash == string::npos) ? lo : atoi(range.c_str() + dash + 1);
+			rep(cpu, lo, hi) cpus.push_back(cpu);
+		}
+		pos = end + 1;
+	}
+	return cpus;
+}
+
+static vector<int> GetAllCpus()
+{
+	int numCpus = max(1, int(sysconf(_SC_NPROCESSORS_ONLN)));
+	vector<int> cpus;
+	rep(i, 0, numCpus - 1) cpus.push_back(i);
+	return cpus;
+}
+
+void NumaTopology::DetectRealTopology()
+{
+	m_cpusOfNode.clear();
+	m_realNodeIds.clear();
+	std::ifstream online("/sys/devices/system/node/online");
+	string line;
+	if (online && std::getline(online, line))
+	{
+		for (int node : ParseCpuList(line))
+		{
+			std::ifstream cpulist("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+			string cpus;
+			if (cpulist && std::getline(cpulist, cpus) && !ParseCpuList(cpus).empty())
+			{
+				m_cpusOfNode.push_back(ParseCpuList(cpus));
+				m_realNodeIds.push_back(node);
+			}
+		}
+	}
+	if (m_cpusOfNode.empty())
+	{
+		m_cpusOfNode.push_back(GetAllCpus());
+		m_realNodeIds.push_back(0);
+	}
+	m_simulated = false;
+}
+
+void NumaTopology::InitIfNeeded()
+{
+	if (m_initialized)
+	{
+		return;
+	}
+	m_initialized = true;
+	DetectRealTopology();
+	const char* env = getenv("MLPSET_SIMULATE_NUMA_NODES");
+	if (env != nullptr && atoi(env) > 0)
+	{
+		Simulate(atoi(env));
+	}
+}
+
+void NumaTopology::Simulate(int numNodes)
+{
+	ReleaseAssert(numNodes >= 0);
+	m_initialized = true;
+	DetectRealTopology();
+	if (numNodes == 0)
+	{
+		return;
+	}
+	vector<int> cpus;
+	for (vector<int>& v : m_cpusOfNode)
+	{
+		cpus.insert(cpus.end(), v.begin(), v.end());
+	}
+	sort(cpus.begin(), cpus.end());
+	int numCpus = cpus.size();
+	m_cpusOfNode.assign(numNodes, vector<int>());
+	rep(i, 0, numNodes - 1)
+	{
+		if (numCpus >= numNodes)
+		{
+			rep(k, i * numCpus / numNodes, (i + 1) * numCpus / numNodes - 1)
+			{
+				m_cpusOfNode[i].push_back(cpus[k]);
+			}
+		}
+		else
+		{
+			m_cpusOfNode[i].push_back(cpus[i % numCpus]);
+		}
+	}
+	m_simulated = true;
+}
+
+int NumaTopology::GetNumNodes()
+{
+	InitIfNeeded();
+	return m_cpusOfNode.size();
+}
+
+bool NumaTopology::IsSimulated()
+{
+	InitIfNeeded();
+	return m_simulated;
+}
+
+const vector<int>& NumaTopology::GetCpusOfNode(int node)
+{
+	InitIfNeeded();
+	assert(0 <= node && node < int(m_cpusOfNode.size()));
+	return m_cpusOfNode[node];
+}
+
+int NumaTopology::GetCurrentNode()
+{
+	InitIfNeeded();
+	if (t_pinnedNode >= 0 && t_pinnedNode < int(m_cpusOfNode.size()))
+	{
+		return t_pinnedNode;
+	}
+	int cpu = sched_getcpu();
+	rep(node, 0, int(m_cpusOfNode.size()) - 1)
+	{
+		for (int c : m_cpusOfNode[node])
+		{
+			if (c == cpu) return node;
+		}
+	}
+	return 0;
+}
+
+void NumaTopology::PinCurrentThreadToNode(int node)
+{
+	InitIfNeeded();
+	ReleaseAssert(0 <= node && node < int(m_cpusOfNode.size()));
+	cpu_set_t cpuset;
+	CPU_ZERO(&cpuset);
+	for (int cpu : m_cpusOfNode[node])
+	{
+		CPU_SET(cpu, &cpuset);
+	}
+	int ret = sched_setaffinity(0 /*calling thread*/, sizeof(cpu_set_t), &cpuset);
+	ReleaseAssert(ret == 0);
+	t_pinnedNode = node;
+}
+
+bool NumaTopology::BindMemory(void* ptr, uint64_t size, int node)
+{
+	InitIfNeeded();
+	if (m_simulated || m_realNodeIds.size() <= 1)
+	{
+		return false;
+	}
+	const int x_maxNodes = 1024;
+	unsigned long nodeMask[x_maxNodes / 64];
+	memset(nodeMask, 0, sizeof(nodeMask));
+	int mode;
+	if (node == x_interleave)
+	{
+		mode = MPOL_INTERLEAVE;
+		for (int id : m_realNodeIds)
+		{
+			nodeMask[id / 64] |= 1UL << (id % 64);
+		}
+	}
+	else
+	{
+		// preferred rather than bind, so that the allocation falls back to another node
+		// (instead of failing) if the node runs out of memory or hugepages
+		//
+		ReleaseAssert(0 <= node && node < int(m_realNodeIds.size()));
+		mode = MPOL_PREFERRED;
+		int id = m_realNodeIds[node];
+		nodeMask[id / 64] |= 1UL << (id % 64);
+	}
+	long ret = syscall(__NR_mbind, ptr, size, mode, nodeMask, x_maxNodes, 0 /*flags*/);
+	return ret == 0;
+}
+
+}	// namespace MlpSetUInt64
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "common.h"
+
+namespace MlpSetUInt64
+{
+
+// The NUMA topology of the machine: the nodes, and the CPUs of each node
+//
+// The topology is read from /sys/devices/system/node at first use (a machine without it is a single node).
+// It can be replaced by a simulated topology, so that the NUMA code paths can be exercised on a single-node box:
+// the CPUs are split into the requested # of nodes (several nodes share a CPU if there are fewer CPUs than nodes),
+// and memory placement becomes a no-op. The environment variable MLPSET_SIMULATE_NUMA_NODES=<n>
+// switches to a simulated topology of n nodes at first use, and Simulate switches at runtime.
+//
+// Not thread-safe against concurrent Simulate, which is meant to be called before the threads are started.
+//
+class NumaTopology
+{
+public:
+	static int GetNumNodes();
+	static bool IsSimulated();
+
+	// Switch to a simulated topology of numNodes nodes, or back to the real topology if numNodes is 0
+	//
+	static void Simulate(int numNodes);
+
+	static const vector<int>& GetCpusOfNode(int node);
+
+	// The node of the calling thread: the node it was pinned to with PinCurrentThreadToNode,
+	// or the node of the CPU it is running on
+	//
+	static int GetCurrentNode();
+
+	// Restrict the calling thread to the CPUs of node
+	//
+	static void PinCurrentThreadToNode(int node);
+
+	// Set the memory policy of [ptr, ptr + size), which must not have been touched yet:
+	// prefer node if node >= 0, interleave the pages over all nodes if node is x_interleave.
+	// Returns false if nothing was done (single node, simulated topology, or the kernel refused, e.g. no permission),
+	// the placement is only a performance hint so this is not an error.
+	//
+	static bool BindMemory(void* ptr, uint64_t size, int node);
+
+	static const int x_interleave = -1;
+
+private:
+	static void InitIfNeeded();
+	static void DetectRealTopology();
+
+	static bool m_initialized;
+	static bool m_simulated;
+	static vector<vector<int> > m_cpusOfNode;
+	// the real node ids, the real topology may have holes in its node numbering
+	//
+	static vector<int> m_realNodeIds;
+	static __thread int t_pinnedNode;
+};
+
+// Sets the node the memory allocated by NumaAllocator on this thread is placed on, for the lifetime of the scope
+// Outside of any scope, the memory is interleaved over all nodes
+//
+class NumaAllocationScope
+{
+public:
+	NumaAllocationScope(int node)
+		: m_savedNode(t_allocationNode)
+	{
+		t_allocationNode = node;
+	}
+
+	~NumaAllocationScope()
+	{
+		t_allocationNode = m_savedNode;
+	}
+
+	static int GetNode() { return t_allocationNode; }
+
+private:
+	int m_savedNode;
+	static __thread int t_allocationNode;
+};
+
+}	// namespace MlpSetUInt64
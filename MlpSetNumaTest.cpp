@@ -0,0 +1,237 @@
+#include "common.h"
+#include "MlpSetReplicated.h"
+#include "gtest/gtest.h"
+#include <thread>
+#include <random>
+
+namespace {
+
+using MlpSetUInt64::NumaTopology;
+using MlpSetUInt64::ReplicatedMlpSet;
+
+// Switch to a simulated topology of numNodes nodes for the lifetime of the scope, unless the machine has that many nodes
+//
+struct SimulatedTopologyScope
+{
+	SimulatedTopologyScope(int numNodes)
+		: m_simulated(false)
+	{
+		if (NumaTopology::GetNumNodes() < numNodes || NumaTopology::IsSimulated())
+		{
+			NumaTopology::Simulate(numNodes);
+			m_simulated = true;
+		}
+	}
+
+	~SimulatedTopologyScope()
+	{
+		if (m_simulated)
+		{
+			NumaTopology::Simulate(0);
+		}
+	}
+
+	bool m_simulated;
+};
+
+TEST(MlpSetNuma, SimulatedTopology)
+{
+	int numRealNodes = NumaTopology::GetNumNodes();
+	printf("Machine has %d NUMA nodes\n", numRealNodes);
+	rep(numNodes, 1, 4)
+	{
+		NumaTopology::Simulate(numNodes);
+		ReleaseAssert(NumaTopology::IsSimulated());
+		ReleaseAssert(NumaTopology::GetNumNodes() == numNodes);
+		rep(node, 0, numNodes - 1)
+		{
+			ReleaseAssert(!NumaTopology::GetCpusOfNode(node).empty());
+		}
+		// memory placement is a no-op in a simulated topology
+		//
+		void* ptr = mmap(NULL, 1 << 21, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		ReleaseAssert(ptr != MAP_FAILED);
+		ReleaseAssert(!NumaTopology::BindMemory(ptr, 1 << 21, NumaTopology::x_interleave));
+		munmap(ptr, 1 << 21);
+
+		std::thread t([numNodes]() {
+			NumaTopology::PinCurrentThreadToNode(numNodes - 1);
+			ReleaseAssert(NumaTopology::GetCurrentNode() == numNodes - 1);
+		});
+		t.join();
+	}
+	NumaTopology::Simulate(0);
+	ReleaseAssert(!NumaTopology::IsSimulated());
+	ReleaseAssert(NumaTopology::GetNumNodes() == numRealNodes);
+}
+
+void ReplicatedCorrectnessTestImpl(int numNodes)
+{
+	printf("Testing %d nodes..\n", numNodes);
+	SimulatedTopologyScope topology(numNodes);
+	const int numBatches = 200;
+	const int batchSize = 1000;
+	const int numReaders = 4;
+	std::mt19937_64 rng(numNodes);
+
+	ReplicatedMlpSet rs;
+	rs.Init(numBatches * batchSize + 10);
+	ReleaseAssert(rs.GetNumReplicas() == NumaTopology::GetNumNodes());
+
+	vector<uint64_t> keys;
+	rep(i, 0, numBatches * batchSize - 1) keys.push_back(rng() >> (rng() % 40));
+	// # of batches whose InsertBatch has returned, the keys of these batches must be visible to all readers
+	//
+	std::atomic<int> numBatchesDone(0);
+	std::atomic<bool> stop(false);
+
+	vector<std::thread> readers;
+	vector<uint64_t> numRedirected(numReaders);
+	rep(t, 0, numReaders - 1)
+	{
+		readers.push_back(std::thread([&, t]() {
+			NumaTopology::PinCurrentThreadToNode(t % NumaTopology::GetNumNodes());
+			ReplicatedMlpSet::Reader* reader = rs.RegisterReader();
+			ReleaseAssert(reader->GetReplicaIndex() == t % rs.GetNumReplicas());
+			std::mt19937_64 threadRng(t + 100);
+			while (!stop.load())
+			{
+				int n = numBatchesDone.load();
+				if (n == 0) continue;
+				uint64_t key = keys[threadRng() % (n * batchSize)];
+				ReleaseAssert(reader->Exist(key));
+				bool found;
+				uint64_t lb = reader->LowerBound(key, found);
+				ReleaseAssert(found && lb == key);
+			}
+			numRedirected[t] = reader->GetNumRedirectedReads();
+		}));
+	}
+
+	set<uint64_t> S;
+	rep(b, 0, numBatches - 1)
+	{
+		uint32_t expected = 0;
+		rep(i, b * batchSize, (b + 1) * batchSize - 1)
+		{
+			expected += S.insert(keys[i]).second;
+		}
+		ReleaseAssert(rs.InsertBatch(keys.data() + b * batchSize, batchSize) == expected);
+		numBatchesDone.store(b + 1);
+	}
+	stop.store(true);
+	for (std::thread& t : readers)
+	{
+		t.join();
+	}
+	uint64_t totalRedirected = 0;
+	for (uint64_t x : numRedirected) totalRedirected += x;
+	printf("%llu reads redirected to another replica\n", static_cast<unsigned long long>(totalRedirected));
+
+	// all replicas hold the same set
+	//
+	rep(r, 0, rs.GetNumReplicas() - 1)
+	{
+		ReplicatedMlpSet::Replica* replica = rs.GetReplica(r);
+		rep(i, 0, 199999)
+		{
+			uint64_t key = (i % 2 == 0) ? keys[rng() % keys.size()] + rng() % 3 - 1 : rng();
+			auto it = S.lower_bound(key);
+			ReleaseAssert(replica->Exist(key) == (it != S.end() && *it == key));
+			bool found;
+			uint64_t lb = replica->LowerBound(key, found);
+			ReleaseAssert(found == (it != S.end()));
+			if (found)
+			{
+				ReleaseAssert(lb == *it);
+			}
+		}
+	}
+}
+
+TEST(MlpSetNuma, ReplicatedCorrectness)
+{
+	ReplicatedCorrectnessTestImpl(1);
+	ReplicatedCorrectnessTestImpl(2);
+	ReplicatedCorrectnessTestImpl(3);
+}
+
+template<class Set>
+uint64_t NO_INLINE NumaExistLoop(Set& s, const vector<uint64_t>& queries)
+{
+	uint64_t sum = 0;
+	for (uint64_t key : queries)
+	{
+		sum += s.Exist(key);
+	}
+	return sum;
+}
+
+// Run numThreads threads pinned to node, each querying its own Set (returned by getSet(thread index)),
+// and return the throughput in Mops/s
+//
+template<class GetSet>
+double RunPinnedReaders(int node, int numThreads, const vector<uint64_t>& queries, GetSet getSet)
+{
+	double t;
+	{
+		AutoTimer timer(&t);
+		vector<std::thread> threads;
+		rep(k, 0, numThreads - 1)
+		{
+			threads.push_back(std::thread([&, k]() {
+				NumaTopology::PinCurrentThreadToNode(node);
+				NumaExistLoop(*getSet(k), queries);
+			}));
+		}
+		for (std::thread& th : threads)
+		{
+			th.join();
+		}
+	}
+	return double(queries.size()) * numThreads / t / 1e6;
+}
+
+// For each node, readers pinned to the node query a set placed on the local node, on a remote node,
+// and interleaved over all nodes
+//
+TEST(MlpSetNuma, LocalRemoteThroughput)
+{
+	SimulatedTopologyScope topology(2);
+	int numNodes = NumaTopology::GetNumNodes();
+	printf("%d nodes%s\n", numNodes, NumaTopology::IsSimulated() ? " (simulated, so local and remote are the same memory)" : "");
+
+	const int n = 4000000;
+	const int q = 4000000;
+	std::mt19937_64 rng(1);
+	vector<uint64_t> keys;
+	rep(i, 0, n - 1) keys.push_back(rng());
+	vector<uint64_t> queries;
+	rep(i, 0, q - 1) queries.push_back((i % 2 == 0) ? keys[rng() % n] : rng());
+
+	ReplicatedMlpSet rs;
+	rs.Init(n + 1000);
+	rs.InsertBatch(keys.data(), n);
+
+	MlpSetUInt64::BasicMlpSet<MlpSetUInt64::NumaMlpSetConfig> interleaved;
+	interleaved.Init(n + 1000);
+	for (uint64_t key : keys) interleaved.Insert(key);
+
+	rep(node, 0, numNodes - 1)
+	{
+		int numThreads = min(4, int(NumaTopology::GetCpusOfNode(node).size()));
+		vector<ReplicatedMlpSet::Reader*> local, remote;
+		rep(k, 0, numThreads - 1)
+		{
+			local.push_back(rs.RegisterReader(node));
+			remote.push_back(rs.RegisterReader((node + 1) % numNodes));
+		}
+		double localThroughput = RunPinnedReaders(node, numThreads, queries, [&](int k) { return local[k]; });
+		double remoteThroughput = RunPinnedReaders(node, numThreads, queries, [&](int k) { return remote[k]; });
+		double interleavedThroughput = RunPinnedReaders(node, numThreads, queries, [&](int) { return &interleaved; });
+		printf("node %d, %d threads: local replica %.2lf Mops/s, remote replica %.2lf Mops/s, interleaved %.2lf Mops/s\n",
+		       node, numThreads, localThroughput, remoteThroughput, interleavedThroughput);
+	}
+}
+
+}	// annoymous namespace
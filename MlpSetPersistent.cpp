@@ -0,0 +1,506 @@
+#include "MlpSetPersistent.h"
+#include <linux/mman.h>
+
+namespace MlpSetUInt64
+{
+
+std::atomic<PersistentRegion*> PersistentRegion::s_regions[PersistentRegion::x_maxRegions];
+std::atomic<int> PersistentRegion::s_numRegions(0);
+
+bool PersistentRegion::IsFlushInstructionSupported(FlushInstruction instruction)
+{
+	__builtin_cpu_init();
+	switch (instruction)
+	{
+	case FLUSH_CLWB:
+		return __builtin_cpu_supports("clwb");
+	case FLUSH_CLFLUSHOPT:
+		return __builtin_cpu_supports("clflushopt");
+	case FLUSH_CLFLUSH:
+		return true;
+	}
+	return false;
+}
+
+static PersistentRegion::FlushInstruction ChooseFlushInstruction()
+{
+	if (PersistentRegion::IsFlushInstructionSupported(PersistentRegion::FLUSH_CLWB))
+	{
+		return PersistentRegion::FLUSH_CLWB;
+	}
+	if (PersistentRegion::IsFlushInstructionSupported(PersistentRegion::FLUSH_CLFLUSHOPT))
+	{
+		return PersistentRegion::FLUSH_CLFLUSHOPT;
+	}
+	return PersistentRegion::FLUSH_CLFLUSH;
+}
+
+static PersistentRegion::FlushInstruction g_flushInstruction = ChooseFlushInstruction();
+
+void PersistentRegion::SetFlushInstruction(FlushInstruction instruction)
+{
+	ReleaseAssert(IsFlushInstructionSupported(instruction));
+	g_flushInstruction = instruction;
+}
+
+PersistentRegion::FlushInstruction PersistentRegion::GetFlushInstruction()
+{
+	return g_flushInstruction;
+}
+
+// clwb keeps the line in the cache, clflushopt and clflush invalidate it (clflush is also ordered with other stores)
+//
+__attribute__((target("clwb")))
+static void FlushLinesClwb(uintptr_t begin, uintptr_t end)
+{
+	for (uintptr_t line = begin; line < end; line += 64)
+	{
+		_mm_clwb(reinterpret_cast<void*>(line));
+	}
+}
+
+__attribute__((target("clflushopt")))
+static void FlushLinesClflushopt(uintptr_t begin, uintptr_t end)
+{
+	for (uintptr_t line = begin; line < end; line += 64)
+	{
+		_mm_clflushopt(reinterpret_cast<void*>(line));
+	}
+}
+
+static void FlushLinesClflush(uintptr_t begin, uintptr_t end)
+{
+	for (uintptr_t line = begin; line < end; line += 64)
+	{
+		_mm_clflush(reinterpret_cast<void*>(line));
+	}
+}
+
+PersistentRegion::PersistentRegion()
+	: m_fd(-1)
+	, m_base(nullptr)
+	, m_size(0)
+	, m_header(nullptr)
+	, m_isDax(false)
+	, m_inTransaction(false)
+	, m_logUsed(0)
+	, m_numFences(0)
+	, m_numFlushedLines(0)
+	, m_numRecords(0)
+	, m_numLoggedBytes(0)
+	, m_numRecoveredRecords(0)
+	, m_durableImage(nullptr)
+	, m_crashImage(nullptr)
+	, m_crashRandomState(0)
+{ }
+
+PersistentRegion::~PersistentRegion()
+{
+	assert(!m_inTransaction);
+	DisableCrashSimulation();
+	if (m_base != nullptr)
+	{
+		UnregisterRegion();
+		int ret = munmap(m_base, m_size);
+		ReleaseAssert(ret == 0);
+		m_base = nullptr;
+	}
+	if (m_fd != -1)
+	{
+		close(m_fd);
+		m_fd = -1;
+	}
+}
+
+PersistentRegion* PersistentRegion::Open(const char* path, uint64_t contentSize, uint64_t arenaSize, bool& created)
+{
+	created = false;
+	int fd = open(path, O_RDWR | O_CLOEXEC);
+	string tmpPath;
+	if (fd == -1)
+	{
+		if (errno != ENOENT)
+		{
+			return nullptr;
+		}
+		// the region is formatted under a temporary name and renamed when complete,
+		// so a crash during the creation does not leave a file that is not a region at path
+		//
+		tmpPath = string(path) + ".tmp";
+		fd = open(tmpPath.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd == -1)
+		{
+			return nullptr;
+		}
+		uint64_t contentOffset = 4096;
+		uint64_t arenaOffset = (contentOffset + contentSize + 4095) / 4096 * 4096;
+		uint64_t logOffset = (arenaOffset + arenaSize + 4095) / 4096 * 4096;
+		if (ftruncate(fd, logOffset + x_logSize) != 0)
+		{
+			close(fd);
+			unlink(tmpPath.c_str());
+			return nullptr;
+		}
+		created = true;
+	}
+
+	PersistentRegion* region = new PersistentRegion();
+	region->m_fd = fd;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || uint64_t(st.st_size) < 4096)
+	{
+		delete region;
+		return nullptr;
+	}
+	region->m_size = st.st_size;
+	// MAP_SYNC is only accepted for a DAX file, on which it guarantees that the file system metadata of the mapping
+	// is durable whenever a page fault returns, so that flushing the stores from the cache is all it takes
+	//
+	void* ptr = mmap(NULL, region->m_size, PROT_READ | PROT_WRITE, MAP_SHARED_VALIDATE | MAP_SYNC, fd, 0 /*offset*/);
+	region->m_isDax = (ptr != MAP_FAILED);
+	if (ptr == MAP_FAILED)
+	{
+		ptr = mmap(NULL, region->m_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 /*offset*/);
+	}
+	if (ptr == MAP_FAILED)
+	{
+		delete region;
+		return nullptr;
+	}
+	region->m_base = reinterpret_cast<uint8_t*>(ptr);
+	region->m_header = reinterpret_cast<Header*>(ptr);
+	Header* header = region->m_header;
+
+	if (created)
+	{
+		header->fileSize = region->m_size;
+		header->contentOffset = 4096;
+		header->contentSize = contentSize;
+		header->arenaOffset = (header->contentOffset + contentSize + 4095) / 4096 * 4096;
+		header->arenaSize = arenaSize;
+		header->logOffset = (header->arenaOffset + arenaSize + 4095) / 4096 * 4096;
+		header->logSize = x_logSize;
+		header->arenaUsed = 0;
+		header->transactionSeq = 1;
+		header->magic = x_magic;
+		region->Persist(header, sizeof(Header));
+		if (!region->m_isDax)
+		{
+			ReleaseAssert(fsync(fd) == 0);
+		}
+		int ret = rename(tmpPath.c_str(), path);
+		ReleaseAssert(ret == 0);
+	}
+	else if (header->magic != x_magic || header->fileSize != region->m_size || header->contentOffset < 4096 ||
+	         header->contentOffset + header->contentSize > header->arenaOffset ||
+	         header->arenaOffset + header->arenaSize > header->logOffset ||
+	         header->logOffset + header->logSize > region->m_size || header->arenaUsed > header->arenaSize)
+	{
+		delete region;
+		return nullptr;
+	}
+	else
+	{
+		region->m_numRecoveredRecords = region->Rollback();
+	}
+	region->RegisterRegion();
+	return region;
+}
+
+void PersistentRegion::RegisterRegion()
+{
+	bool registered = false;
+	rep(i, 0, x_maxRegions - 1)
+	{
+		PersistentRegion* expected = nullptr;
+		if (s_regions[i].compare_exchange_strong(expected, this))
+		{
+			registered = true;
+			break;
+		}
+	}
+	ReleaseAssert(registered);
+	s_numRegions.fetch_add(1);
+}
+
+void PersistentRegion::UnregisterRegion()
+{
+	rep(i, 0, x_maxRegions - 1)
+	{
+		if (s_regions[i].load() == this)
+		{
+			s_regions[i].store(nullptr);
+			s_numRegions.fetch_sub(1);
+			break;
+		}
+	}
+}
+
+PersistentRegion* PersistentRegion::FindSlow(const void* ptr)
+{
+	uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+	rep(i, 0, x_maxRegions - 1)
+	{
+		PersistentRegion* region = s_regions[i].load(std::memory_order_acquire);
+		if (region != nullptr)
+		{
+			uintptr_t base = reinterpret_cast<uintptr_t>(region->m_base);
+			if (base + region->m_header->contentOffset <= addr && addr < base + region->m_header->logOffset)
+			{
+				return region;
+			}
+		}
+	}
+	return nullptr;
+}
+
+void PersistentRegion::Flush(const void* ptr, uint64_t size)
+{
+	uintptr_t begin = reinterpret_cast<uintptr_t>(ptr) & ~uintptr_t(63);
+	uintptr_t end = reinterpret_cast<uintptr_t>(ptr) + size;
+	switch (g_flushInstruction)
+	{
+	case FLUSH_CLWB:
+		FlushLinesClwb(begin, end);
+		break;
+	case FLUSH_CLFLUSHOPT:
+		FlushLinesClflushopt(begin, end);
+		break;
+	case FLUSH_CLFLUSH:
+		FlushLinesClflush(begin, end);
+		break;
+	}
+	m_numFlushedLines += (end - begin + 63) / 64;
+	if (unlikely(m_durableImage != nullptr))
+	{
+		for (uintptr_t line = begin; line < end; line += 64)
+		{
+			m_pendingLines.push_back(line - reinterpret_cast<uintptr_t>(m_base));
+		}
+	}
+}
+
+void PersistentRegion::Fence()
+{
+	m_numFences++;
+	if (unlikely(m_durableImage != nullptr))
+	{
+		SimulateCrash();
+	}
+	_mm_sfence();
+}
+
+uint32_t PersistentRegion::RecordChecksum(const LogRecord* record)
+{
+	uint64_t crc = _mm_crc32_u64(0xffffffffU, record->transactionSeq);
+	crc = _mm_crc32_u64(crc, record->offset);
+	crc = _mm_crc32_u64(crc, record->size);
+	const uint64_t* data = reinterpret_cast<const uint64_t*>(record + 1);
+	for (uint32_t i = 0; i < record->size / 8; i++)
+	{
+		crc = _mm_crc32_u64(crc, data[i]);
+	}
+	return uint32_t(crc);
+}
+
+void PersistentRegion::BeginTransaction()
+{
+	assert(!m_inTransaction && m_logUsed == 0 && m_dirtyRanges.empty());
+	m_inTransaction = true;
+}
+
+void PersistentRegion::RecordSlow(void* ptr, uint32_t size)
+{
+	assert(m_inTransaction);
+	assert(reinterpret_cast<uintptr_t>(ptr) % 8 == 0 && size % 8 == 0 && size > 0);
+	assert(FindSlow(ptr) == this || ptr == &m_header->arenaUsed);
+	// the same range is often recorded several times in a transaction (e.g. a node modified in several steps),
+	// only the first record is needed
+	//
+	uint8_t* p = reinterpret_cast<uint8_t*>(ptr);
+	int numRanges = int(m_dirtyRanges.size());
+	rep(i, max(0, numRanges - 32), numRanges - 1)
+	{
+		if (m_dirtyRanges[i].first == p && m_dirtyRanges[i].second == size)
+		{
+			return;
+		}
+	}
+	ReleaseAssert(m_logUsed + sizeof(LogRecord) + size <= m_header->logSize);
+	LogRecord* record = reinterpret_cast<LogRecord*>(m_base + m_header->logOffset + m_logUsed);
+	record->transactionSeq = m_header->transactionSeq;
+	record->offset = p - m_base;
+	record->size = size;
+	memcpy(record + 1, ptr, size);
+	record->checksum = RecordChecksum(record);
+	// the record must be durable before the range is modified
+	//
+	Persist(record, sizeof(LogRecord) + size);
+	m_logUsed += sizeof(LogRecord) + size;
+	m_dirtyRanges.push_back(std::make_pair(p, size));
+	m_numRecords++;
+	m_numLoggedBytes += sizeof(LogRecord) + size;
+}
+
+void PersistentRegion::CommitTransaction()
+{
+	assert(m_inTransaction);
+	m_inTransaction = false;
+	if (m_dirtyRanges.empty())
+	{
+		return;
+	}
+	for (auto& range : m_dirtyRanges)
+	{
+		Flush(range.first, range.second);
+	}
+	Fence();
+	// the records of the transaction become invalid once the new sequence # is durable, this is the commit point
+	//
+	m_header->transactionSeq++;
+	Persist(&m_header->transactionSeq, sizeof(uint64_t));
+	m_dirtyRanges.clear();
+	m_logUsed = 0;
+}
+
+uint64_t PersistentRegion::Rollback()
+{
+	vector<LogRecord*> records;
+	uint64_t offset = 0;
+	while (offset + sizeof(LogRecord) <= m_header->logSize)
+	{
+		LogRecord* record = reinterpret_cast<LogRecord*>(m_base + m_header->logOffset + offset);
+		if (record->transactionSeq != m_header->transactionSeq || record->size == 0 || record->size % 8 != 0 ||
+		    offset + sizeof(LogRecord) + record->size > m_header->logSize ||
+		    record->offset + record->size > m_header->logOffset ||
+		    RecordChecksum(record) != record->checksum)
+		{
+			break;
+		}
+		records.push_back(record);
+		offset += sizeof(LogRecord) + record->size;
+	}
+	if (records.empty())
+	{
+		return 0;
+	}
+	// the oldest record of a range holds its content before the transaction, so it is restored last
+	//
+	repd(i, int(records.size()) - 1, 0)
+	{
+		memcpy(m_base + records[i]->offset, records[i] + 1, records[i]->size);
+		Flush(m_base + records[i]->offset, records[i]->size);
+	}
+	Fence();
+	// the records must not be applied again, once new records of the same sequence # may have been written over part of them
+	//
+	m_header->transactionSeq++;
+	Persist(&m_header->transactionSeq, sizeof(uint64_t));
+	return records.size();
+}
+
+uint64_t* PersistentRegion::AllocateBitMap()
+{
+	uint64_t offset;
+	if (m_inTransaction)
+	{
+		Record(&m_header->arenaUsed, sizeof(uint64_t));
+		offset = m_header->arenaUsed;
+		m_header->arenaUsed += 32;
+	}
+	else
+	{
+		offset = __atomic_fetch_add(&m_header->arenaUsed, 32, __ATOMIC_RELAXED);
+	}
+	ReleaseAssert(offset + 32 <= m_header->arenaSize);
+	uint64_t* ptr = reinterpret_cast<uint64_t*>(m_base + m_header->arenaOffset + offset);
+	// the block may hold garbage of an allocation rolled back
+	//
+	memset(ptr, 0, 32);
+	if (m_inTransaction)
+	{
+		m_dirtyRanges.push_back(std::make_pair(reinterpret_cast<uint8_t*>(ptr), 32U));
+	}
+	return ptr;
+}
+
+void PersistentRegion::PersistContent()
+{
+	assert(!m_inTransaction);
+	Flush(GetContent(), m_header->contentSize);
+	Flush(m_base + m_header->arenaOffset, m_header->arenaUsed);
+	Persist(m_header, sizeof(Header));
+}
+
+void PersistentRegion::Wipe()
+{
+	assert(!m_inTransaction);
+	memset(GetContent(), 0, m_header->contentSize);
+	memset(m_base + m_header->arenaOffset, 0, m_header->arenaUsed);
+	PersistContent();
+	m_header->arenaUsed = 0;
+	Persist(&m_header->arenaUsed, sizeof(uint64_t));
+}
+
+void PersistentRegion::EnableCrashSimulation(uint64_t seed, const CrashImageFn& callback)
+{
+	assert(!m_inTransaction && m_durableImage == nullptr);
+	m_durableImage = new uint8_t[m_size];
+	m_crashImage = new uint8_t[m_size];
+	memcpy(m_durableImage, m_base, m_size);
+	m_crashImageFn = callback;
+	m_crashRandomState = seed | 1;
+}
+
+void PersistentRegion::DisableCrashSimulation()
+{
+	if (m_durableImage != nullptr)
+	{
+		delete [] m_durableImage;
+		delete [] m_crashImage;
+		m_durableImage = nullptr;
+		m_crashImage = nullptr;
+		m_pendingLines.clear();
+		m_crashImageFn = nullptr;
+	}
+}
+
+void PersistentRegion::SimulateCrash()
+{
+	// the durable copy, plus each 8-byte word stored to since then with probability 1/2
+	// (8-byte aligned stores are the unit of failure atomicity)
+	//
+	memcpy(m_crashImage, m_durableImage, m_size);
+	const uint64_t x_blockSize = 4096;
+	for (uint64_t block = 0; block < m_size; block += x_blockSize)
+	{
+		if (memcmp(m_base + block, m_durableImage + block, x_blockSize) == 0)
+		{
+			continue;
+		}
+		const uint64_t* live = reinterpret_cast<const uint64_t*>(m_base + block);
+		const uint64_t* durable = reinterpret_cast<const uint64_t*>(m_durableImage + block);
+		uint64_t* image = reinterpret_cast<uint64_t*>(m_crashImage + block);
+		rep(i, 0, int(x_blockSize / 8) - 1)
+		{
+			if (live[i] != durable[i])
+			{
+				m_crashRandomState ^= m_crashRandomState << 13;
+				m_crashRandomState ^= m_crashRandomState >> 7;
+				m_crashRandomState ^= m_crashRandomState << 17;
+				if (m_crashRandomState & 1)
+				{
+					image[i] = live[i];
+				}
+			}
+		}
+	}
+	m_crashImageFn(m_numFences, m_crashImage, m_size);
+	for (uint64_t line : m_pendingLines)
+	{
+		memcpy(m_durableImage + line, m_base + line, 64);
+	}
+	m_pendingLines.clear();
+}
+
+}	// namespace MlpSetUInt64
@@ -0,0 +1,235 @@
+#pragma once
+
+#include "common.h"
+#include <atomic>
+#include <functional>
+
+namespace MlpSetUInt64
+{
+
+// A file mapped read-write, whose content stays consistent across crashes, for sets stored in persistent memory
+//
+// The file is mapped with MAP_SYNC if it is on a DAX file system (persistent memory), so that the CPU stores reach
+// the media directly and are made durable by flushing their cache lines (clwb, clflushopt or clflush, whichever the CPU
+// supports) followed by a store fence. On other file systems (e.g. tmpfs) the mapping goes through the page cache,
+// so the content survives a crash of the process but not of the machine.
+//
+// The content is modified in failure-atomic transactions with an undo log:
+// before a range of the content is modified for the first time in a transaction, its old bytes are appended to the log
+// and made durable (Record), and only then the range is modified in place. Commit flushes the modified ranges,
+// then invalidates the log by bumping the transaction sequence # in the header. Opening the file rolls back the
+// records of an uncommitted transaction (newest first), so the content is always the one of the last committed
+// transaction, whatever the moment of the crash (a record torn by the crash fails its checksum, and the range it covers
+// has not been modified yet).
+//
+// File layout: the region header and a user header (see GetUserHeader) in the first 4096 bytes, then the content,
+// an arena of 32-byte blocks for the external bitmaps of the hash table nodes stored in the content
+// (see CuckooHashTableNode::AllocateExternalBitMap), and the undo log.
+//
+class PersistentRegion
+{
+public:
+	~PersistentRegion();
+
+	// Open the region in the file at path, creating it with zero-initialized content of contentSize bytes
+	// and an arena of arenaSize bytes if it does not exist (created is set in that case)
+	// An existing region keeps its own sizes, and its uncommitted transaction (if any) is rolled back.
+	// Returns nullptr if the file cannot be created or mapped, or is not a region.
+	//
+	static PersistentRegion* Open(const char* path, uint64_t contentSize, uint64_t arenaSize, bool& created);
+
+	// The region whose content or arena contains ptr, nullptr if none
+	//
+	static PersistentRegion* Find(const void* ptr)
+	{
+		if (likely(s_numRegions.load(std::memory_order_relaxed) == 0))
+		{
+			return nullptr;
+		}
+		return FindSlow(ptr);
+	}
+
+	void* GetContent() { return m_base + m_header->contentOffset; }
+	uint64_t GetContentSize() { return m_header->contentSize; }
+
+	// x_userHeaderSize bytes at the start of the file, zero when the region is created, for the owner's own metadata
+	// (which must be made durable with Persist)
+	//
+	void* GetUserHeader() { return m_base + x_userHeaderOffset; }
+	static const uint32_t x_userHeaderSize = 2048;
+
+	// Whether the file is mapped with MAP_SYNC, i.e. flushed stores are durable against power failures
+	//
+	bool IsDax() { return m_isDax; }
+
+	// Write back the cache lines of [ptr, ptr + size), they are durable after the next Fence
+	//
+	void Flush(const void* ptr, uint64_t size);
+	void Fence();
+	void Persist(const void* ptr, uint64_t size)
+	{
+		Flush(ptr, size);
+		Fence();
+	}
+
+	// Start a transaction, only one transaction is active at a time
+	//
+	void BeginTransaction();
+
+	// In a transaction, save the old content of [ptr, ptr + size) to the undo log before it is modified,
+	// ptr and size must be multiples of 8. No-op outside of a transaction.
+	//
+	void Record(void* ptr, uint32_t size)
+	{
+		if (m_inTransaction)
+		{
+			RecordSlow(ptr, size);
+		}
+	}
+
+	// Make the modifications of the transaction durable
+	//
+	void CommitTransaction();
+
+	bool InTransaction() { return m_inTransaction; }
+
+	// Allocate a zero-initialized 32-byte block from the arena
+	// In a transaction the block is flushed on commit, and the allocation is rolled back with the transaction.
+	// Outside of a transaction, allocations may be concurrent (see BasicMlpSet::BulkLoadSorted).
+	//
+	uint64_t* AllocateBitMap();
+
+	// Flush the content and the arena used so far, and fence, after it was modified outside of a transaction
+	//
+	void PersistContent();
+
+	// Forget all content: zero the content and the arena used so far, and make it durable
+	//
+	void Wipe();
+
+	// # of fences, of flushed cache lines, and of undo records written since the region was opened
+	//
+	uint64_t GetNumFences() { return m_numFences; }
+	uint64_t GetNumFlushedLines() { return m_numFlushedLines; }
+	uint64_t GetNumRecords() { return m_numRecords; }
+	uint64_t GetNumLoggedBytes() { return m_numLoggedBytes; }
+
+	// # of undo records rolled back when the region was opened
+	//
+	uint64_t GetNumRecoveredRecords() { return m_numRecoveredRecords; }
+
+	// The cache line write-back instruction used by Flush
+	//
+	enum FlushInstruction
+	{
+		FLUSH_CLWB,
+		FLUSH_CLFLUSHOPT,
+		FLUSH_CLFLUSH
+	};
+
+	static bool IsFlushInstructionSupported(FlushInstruction instruction);
+	// The best supported one is used by default
+	//
+	static void SetFlushInstruction(FlushInstruction instruction);
+	static FlushInstruction GetFlushInstruction();
+
+	// Crash simulation, for testing
+	// The region keeps a copy of what is durable (the file content at the time of the call, then the flushed cache lines
+	// as of each Fence), and on every Fence calls callback(fenceIndex, image, size) before the fence takes effect,
+	// with image being a possible file content if the machine crashed right then: the durable copy, plus a random subset
+	// of the 8-byte words stored to since they were made durable (e.g. evicted from the cache on their own).
+	//
+	typedef std::function<void(uint64_t fenceIndex, const uint8_t* image, uint64_t size)> CrashImageFn;
+	void EnableCrashSimulation(uint64_t seed, const CrashImageFn& callback);
+	void DisableCrashSimulation();
+
+	static const int x_maxRegions = 64;
+
+private:
+	PersistentRegion();
+
+	struct Header
+	{
+		uint64_t magic;
+		uint64_t fileSize;
+		uint64_t contentOffset;
+		uint64_t contentSize;
+		uint64_t arenaOffset;
+		uint64_t arenaSize;
+		uint64_t logOffset;
+		uint64_t logSize;
+		// bytes of the arena allocated so far, modified in transactions
+		//
+		uint64_t arenaUsed;
+		// sequence # of the current transaction, the undo records of other transactions are invalid
+		//
+		uint64_t transactionSeq;
+	};
+
+	// An undo record in the log, followed by the size old bytes at offset
+	//
+	struct LogRecord
+	{
+		uint64_t transactionSeq;
+		uint64_t offset;
+		uint32_t size;
+		// CRC32 of the fields above and the old bytes
+		//
+		uint32_t checksum;
+	};
+
+	static const uint64_t x_magic = 0x4e4f4947455250ULL;
+	static const uint32_t x_userHeaderOffset = 2048;
+	// a displacement chain of 1000 moves logs less than 1MB
+	//
+	static const uint64_t x_logSize = 4 * 1024 * 1024;
+
+	static PersistentRegion* FindSlow(const void* ptr);
+	static uint32_t RecordChecksum(const LogRecord* record);
+
+	void RecordSlow(void* ptr, uint32_t size);
+
+	// Call the crash image callback, then make the flushed cache lines durable in m_durableImage
+	//
+	void SimulateCrash();
+
+	// Roll back the undo records of the current transaction, returns the # of them
+	//
+	uint64_t Rollback();
+
+	void RegisterRegion();
+	void UnregisterRegion();
+
+	static std::atomic<PersistentRegion*> s_regions[x_maxRegions];
+	static std::atomic<int> s_numRegions;
+
+	int m_fd;
+	uint8_t* m_base;
+	uint64_t m_size;
+	Header* m_header;
+	bool m_isDax;
+
+	bool m_inTransaction;
+	// end of the undo records of the current transaction in the log
+	//
+	uint64_t m_logUsed;
+	// the ranges modified in the current transaction, flushed on commit
+	//
+	vector<pair<uint8_t*, uint32_t> > m_dirtyRanges;
+
+	uint64_t m_numFences;
+	uint64_t m_numFlushedLines;
+	uint64_t m_numRecords;
+	uint64_t m_numLoggedBytes;
+	uint64_t m_numRecoveredRecords;
+
+	// crash simulation state, m_durableImage is nullptr if not enabled
+	//
+	uint8_t* m_durableImage;
+	uint8_t* m_crashImage;
+	vector<uint64_t> m_pendingLines;
+	CrashImageFn m_crashImageFn;
+	uint64_t m_crashRandomState;
+};
+
+}	// namespace MlpSetUInt64
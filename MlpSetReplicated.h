@@ -0,0 +1,232 @@
+#pragma once
+
+#include "common.h"
+#include "MlpSetUInt64.h"
+#include "MlpSetSharded.h"
+#include "MlpSetNuma.h"
+#include <atomic>
+#include <mutex>
+
+namespace MlpSetUInt64
+{
+
+// A set replicated once per NUMA node, so that readers on every node query local memory
+//
+// Each replica is a full MlpSet whose memory is allocated inside a NumaAllocationScope of its node
+// (so with a NumaAllocator configuration, e.g. NumaMlpSetConfig, its flat bitmaps and hash table are placed on that node).
+// A reader registers a Reader bound to a node (by default the node it runs on), and queries the replica of that node.
+//
+// A single writer applies each batch of insertions to the replicas one after another. While a replica is being
+// written, its readers are redirected to the next replica (which is remote, but complete), so readers never wait
+// unless there is a single replica. The writer closes a replica with a Dekker-style handshake: it raises the writing
+// flag of the replica and waits until no reader is inside it, and a reader announces itself in its own slot
+// (on its own cache line) before checking the flag. So a read costs two uncontended stores and a load on local lines.
+//
+// A key inserted by a batch is visible to all readers once InsertBatch returns.
+// Memory allocated on the heap during insertions (e.g. external bitmaps) is first-touched by the writer thread,
+// only the memory chunk of each replica is placed on its node.
+//
+template<class Config>
+class BasicReplicatedMlpSet
+{
+public:
+	typedef BasicMlpSet<Config> Replica;
+
+	static const int x_maxReaders = 256;
+
+	// The handle of a reader, must only be used by one thread at a time
+	//
+	class Reader
+	{
+	public:
+		bool Exist(uint64_t value)
+		{
+			bool result;
+			Read([&](Replica& replica) { result = replica.Exist(value); });
+			return result;
+		}
+
+		uint64_t LowerBound(uint64_t value, bool& found)
+		{
+			uint64_t result;
+			Read([&](Replica& replica) { result = replica.LowerBound(value, found); });
+			return result;
+		}
+
+		// The replica the reader queries when it is not being written
+		//
+		int GetReplicaIndex() { return m_replica; }
+
+		// # of times a read found its replica being written, and moved on to the next replica
+		// (or waited, if there is a single replica)
+		//
+		uint64_t GetNumRedirectedReads() { return m_numRedirectedReads; }
+
+	private:
+		friend class BasicReplicatedMlpSet;
+
+		template<typename Func>
+		void Read(const Func& func)
+		{
+			int numReplicas = m_set->m_numReplicas;
+			int r = m_replica;
+			SpinWaiter waiter;
+			while (true)
+			{
+				ReplicaState& state = m_set->m_replicas[r];
+				state.readers[m_slot].active.store(true, std::memory_order_seq_cst);
+				if (likely(!state.writing.load(std::memory_order_seq_cst)))
+				{
+					func(state.set);
+					state.readers[m_slot].active.store(false, std::memory_order_release);
+					return;
+				}
+				state.readers[m_slot].active.store(false, std::memory_order_relaxed);
+				m_numRedirectedReads++;
+				r = (r + 1 == numReplicas) ? 0 : r + 1;
+				if (r == m_replica)
+				{
+					waiter.Wait();
+				}
+			}
+		}
+
+		BasicReplicatedMlpSet* m_set;
+		int m_replica;
+		int m_slot;
+		uint64_t m_numRedirectedReads;
+	};
+
+	BasicReplicatedMlpSet()
+		: m_numReplicas(0)
+		, m_replicas(nullptr)
+		, m_numReaders(0)
+	{ }
+
+	~BasicReplicatedMlpSet()
+	{
+		if (m_replicas != nullptr)
+		{
+			rep(i, 0, m_numReplicas - 1)
+			{
+				m_replicas[i].~ReplicaState();
+			}
+			free(m_replicas);
+			m_replicas = nullptr;
+		}
+		for (Reader* reader : m_readers)
+		{
+			delete reader;
+		}
+	}
+
+	// Initialize the set to hold at most maxSetSize elements, with one replica per NUMA node
+	// (numReplicas = 0), or numReplicas replicas assigned to the nodes round-robin
+	//
+	void Init(uint32_t maxSetSize, int numReplicas = 0)
+	{
+		assert(m_replicas == nullptr);
+		int numNodes = NumaTopology::GetNumNodes();
+		m_numReplicas = (numReplicas == 0) ? numNodes : numReplicas;
+		ReleaseAssert(m_numReplicas >= 1);
+		// operator new does not honor the alignment of ReplicaState in C++14
+		//
+		m_replicas = reinterpret_cast<ReplicaState*>(aligned_alloc(alignof(ReplicaState), sizeof(ReplicaState) * m_numReplicas));
+		ReleaseAssert(m_replicas != nullptr);
+		rep(i, 0, m_numReplicas - 1)
+		{
+			new (&m_replicas[i]) ReplicaState();
+			NumaAllocationScope scope(i % numNodes);
+			m_replicas[i].set.Init(maxSetSize);
+		}
+	}
+
+	// Register a reader querying the replica of node (the node of the calling thread if node is -1), thread-safe
+	//
+	Reader* RegisterReader(int node = -1)
+	{
+		if (node == -1)
+		{
+			node = NumaTopology::GetCurrentNode();
+		}
+		std::lock_guard<std::mutex> lock(m_registerMutex);
+		int slot = m_numReaders.load(std::memory_order_relaxed);
+		ReleaseAssert(slot < x_maxReaders);
+		Reader* reader = new Reader();
+		reader->m_set = this;
+		reader->m_replica = node % m_numReplicas;
+		reader->m_slot = slot;
+		reader->m_numRedirectedReads = 0;
+		m_readers.push_back(reader);
+		m_numReaders.store(slot + 1, std::memory_order_release);
+		return reader;
+	}
+
+	// Insert a batch of keys into all replicas, single writer
+	// Returns the # of keys that were not in the set
+	//
+	uint32_t InsertBatch(const uint64_t* keys, uint32_t n)
+	{
+		uint32_t numInserted = 0;
+		rep(r, 0, m_numReplicas - 1)
+		{
+			ReplicaState& state = m_replicas[r];
+			state.writing.store(true, std::memory_order_seq_cst);
+			int numReaders = m_numReaders.load(std::memory_order_acquire);
+			rep(i, 0, numReaders - 1)
+			{
+				SpinWaiter waiter;
+				while (state.readers[i].active.load(std::memory_order_seq_cst))
+				{
+					waiter.Wait();
+				}
+			}
+			uint32_t count = 0;
+			rep(i, 0, int(n) - 1)
+			{
+				count += state.set.Insert(keys[i]);
+			}
+			assert(r == 0 || count == numInserted);
+			numInserted = count;
+			state.writing.store(false, std::memory_order_release);
+		}
+		return numInserted;
+	}
+
+	bool Insert(uint64_t value)
+	{
+		return InsertBatch(&value, 1) == 1;
+	}
+
+	int GetNumReplicas() { return m_numReplicas; }
+
+	// Direct access to a replica, must not be used concurrently with InsertBatch
+	//
+	Replica* GetReplica(int i) { return &m_replicas[i].set; }
+
+private:
+	struct alignas(64) ReaderSlot
+	{
+		ReaderSlot() : active(false) { }
+		std::atomic<bool> active;
+	};
+
+	struct alignas(64) ReplicaState
+	{
+		ReplicaState() : writing(false) { }
+
+		std::atomic<bool> writing;
+		ReaderSlot readers[x_maxReaders];
+		Replica set;
+	};
+
+	int m_numReplicas;
+	ReplicaState* m_replicas;
+	std::mutex m_registerMutex;
+	vector<Reader*> m_readers;
+	std::atomic<int> m_numReaders;
+};
+
+typedef BasicReplicatedMlpSet<NumaMlpSetConfig> ReplicatedMlpSet;
+
+}	// namespace MlpSetUInt64
@@ -0,0 +1,321 @@
+#pragma once
+
+#include "common.h"
+#include "MlpSetUInt64.h"
+#include <atomic>
+#include <thread>
+
+namespace MlpSetUInt64
+{
+
+// Busy-waiting with backoff: pause, and yield the CPU every x_spinsBeforeYield spins,
+// so that a thread preempted by an oversubscribed scheduler is not starved by the threads waiting for it
+//
+class SpinWaiter
+{
+public:
+	SpinWaiter() : m_spins(0) { }
+
+	void Wait()
+	{
+		if (++m_spins < x_spinsBeforeYield)
+		{
+			_mm_pause();
+		}
+		else
+		{
+			std::this_thread::yield();
+			m_spins = 0;
+		}
+	}
+
+	static const int x_spinsBeforeYield = 100;
+
+private:
+	int m_spins;
+};
+
+// A test-and-test-and-set spinlock
+//
+class ShardSpinLock
+{
+public:
+	ShardSpinLock() : m_locked(false) { }
+
+	void Lock()
+	{
+		while (m_locked.exchange(true, std::memory_order_acquire))
+		{
+			SpinWaiter waiter;
+			while (m_locked.load(std::memory_order_relaxed))
+			{
+				waiter.Wait();
+			}
+		}
+	}
+
+	void Unlock()
+	{
+		m_locked.store(false, std::memory_order_release);
+	}
+
+	class Guard
+	{
+	public:
+		Guard(ShardSpinLock& lock) : m_lock(lock) { m_lock.Lock(); }
+		~Guard() { m_lock.Unlock(); }
+	private:
+		ShardSpinLock& m_lock;
+	};
+
+private:
+	std::atomic<bool> m_locked;
+};
+
+// A set range-partitioned into up to 64 independent MlpSet shards, for concurrent writers
+//
+// Each shard has its own hash table, flat bitmaps and external bitmaps, so writers to different shards
+// never share memory. The partition is order-preserving: every key of shard i is smaller than every key of shard i+1.
+// The shard of a key is found from the bits that follow the common prefix of a key sample:
+// the next x_shardTableBits bits index a table mapping them to a shard, and the table is built from
+// the quantiles of the sample, so each shard receives about the same share of the sample even if the keys are
+// skewed (e.g. WorkloadA keys all start with bytes in [32, 96), and would only use a quarter of the shards
+// if partitioned by the raw top bits). Keys outside of the sample prefix go to the first or last shard.
+//
+// A LowerBound that finds nothing in its shard falls through to the next non-empty shard,
+// found by a ctz on the shard occupancy bitmap, and returns its minimum, which each shard publishes in an atomic.
+// So LowerBound locks a single shard.
+//
+// Two modes of concurrency:
+//     Insert, Exist and LowerBound lock the shard of the key with a per-shard spinlock, any thread can call them.
+//     InsertUnlocked, ExistUnlocked and LowerBoundUnlocked take no lock. They are for the thread-per-shard mode,
+//     where the caller routes each operation with ShardOf to the thread owning the shard,
+//     so each shard is only ever accessed by its own thread (LowerBoundUnlocked only reads the published
+//     minimum and occupancy of the other shards, which is safe).
+// The two modes must not be mixed on the same shard concurrently.
+//
+template<class Config>
+class BasicShardedMlpSet
+{
+public:
+	typedef BasicMlpSet<Config> Shard;
+
+	BasicShardedMlpSet()
+		: m_numShards(0)
+		, m_prefixLen(0)
+		, m_prefix(0)
+		, m_occupancy(0)
+		, m_shards(nullptr)
+	{ }
+
+	~BasicShardedMlpSet()
+	{
+		if (m_shards != nullptr)
+		{
+			rep(i, 0, m_numShards - 1)
+			{
+				m_shards[i].~ShardState();
+			}
+			free(m_shards);
+			m_shards = nullptr;
+		}
+	}
+
+	// Initialize the set to hold at most maxSetSize elements in numShards shards (1 - 64),
+	// with the shard boundaries chosen from sample.
+	// Each shard is sized for x_shardSizeSlack times its share of the sample (so the keys inserted later
+	// must roughly follow the distribution of the sample), and starts in small-set mode (see InitCompact),
+	// so shards that stay empty cost almost no memory.
+	//
+	void Init(uint32_t maxSetSize, int numShards, const uint64_t* sample, uint32_t sampleSize)
+	{
+		assert(m_shards == nullptr);
+		ReleaseAssert(1 <= numShards && numShards <= x_maxNumShards);
+		ReleaseAssert(sampleSize > 0);
+		m_numShards = numShards;
+		// operator new does not honor the alignment of ShardState in C++14
+		//
+		m_shards = reinterpret_cast<ShardState*>(aligned_alloc(alignof(ShardState), sizeof(ShardState) * numShards));
+		ReleaseAssert(m_shards != nullptr);
+		rep(i, 0, numShards - 1)
+		{
+			new (&m_shards[i]) ShardState();
+		}
+
+		// the common prefix of the sample, capped so that the table bits fit in the key
+		//
+		uint64_t diff = 0;
+		rep(i, 1, int(sampleSize) - 1)
+		{
+			diff |= sample[i] ^ sample[0];
+		}
+		m_prefixLen = (diff == 0) ? 64 : __builtin_clzll(diff);
+		m_prefixLen = min(m_prefixLen, 64 - x_shardTableBits);
+		m_prefix = (m_prefixLen == 0) ? 0 : (sample[0] >> (64 - m_prefixLen));
+
+		// assign the table entries to shards by the quantiles of the sample
+		//
+		vector<uint32_t> count(x_shardTableSize, 0);
+		rep(i, 0, int(sampleSize) - 1)
+		{
+			count[TableIndex(sample[i])]++;
+		}
+		vector<uint64_t> shardCount(numShards, 0);
+		uint64_t numBefore = 0;
+		rep(i, 0, x_shardTableSize - 1)
+		{
+			int shard = min(uint64_t(numShards - 1), numBefore * numShards / sampleSize);
+			m_shardTable[i] = uint8_t(shard);
+			shardCount[shard] += count[i];
+			numBefore += count[i];
+		}
+
+		rep(i, 0, numShards - 1)
+		{
+			uint64_t shardSize = uint64_t(maxSetSize) * shardCount[i] / sampleSize;
+			shardSize = shardSize * x_shardSizeSlack + Shard::x_smallSetMaxSize + 1;
+			m_shards[i].set.InitCompact(uint32_t(min(shardSize, uint64_t(maxSetSize))));
+		}
+	}
+
+	// Returns the shard holding value
+	//
+	int ShardOf(uint64_t value)
+	{
+		uint64_t high = (m_prefixLen == 0) ? 0 : (value >> (64 - m_prefixLen));
+		if (unlikely(high != m_prefix))
+		{
+			return (high < m_prefix) ? 0 : m_numShards - 1;
+		}
+		return m_shardTable[TableIndex(value)];
+	}
+
+	bool Insert(uint64_t value)
+	{
+		int shard = ShardOf(value);
+		ShardSpinLock::Guard guard(m_shards[shard].lock);
+		return InsertIntoShard(shard, value);
+	}
+
+	bool Exist(uint64_t value)
+	{
+		int shard = ShardOf(value);
+		ShardSpinLock::Guard guard(m_shards[shard].lock);
+		return m_shards[shard].set.Exist(value);
+	}
+
+	uint64_t LowerBound(uint64_t value, bool& found)
+	{
+		int shard = ShardOf(value);
+		uint64_t result;
+		{
+			ShardSpinLock::Guard guard(m_shards[shard].lock);
+			result = m_shards[shard].set.LowerBound(value, found);
+		}
+		return found ? result : NextShardMinimum(shard, found);
+	}
+
+	bool InsertUnlocked(uint64_t value)
+	{
+		return InsertIntoShard(ShardOf(value), value);
+	}
+
+	bool ExistUnlocked(uint64_t value)
+	{
+		return m_shards[ShardOf(value)].set.Exist(value);
+	}
+
+	uint64_t LowerBoundUnlocked(uint64_t value, bool& found)
+	{
+		int shard = ShardOf(value);
+		uint64_t result = m_shards[shard].set.LowerBound(value, found);
+		return found ? result : NextShardMinimum(shard, found);
+	}
+
+	// The minimum of the first non-empty shard after shard, i.e. the lower bound of a key of shard
+	// that is larger than all keys in its shard (for callers querying the shard directly)
+	//
+	uint64_t NextShardMinimum(int shard, bool& found)
+	{
+		// (2 << 63) is 0, so the mask is empty for the last shard
+		//
+		uint64_t mask = m_occupancy.load(std::memory_order_acquire) & ~((uint64_t(2) << shard) - 1);
+		if (mask == 0)
+		{
+			found = false;
+			return 0xffffffffffffffffULL;
+		}
+		found = true;
+		return m_shards[__builtin_ctzll(mask)].minimum.load(std::memory_order_acquire);
+	}
+
+	int GetNumShards() { return m_numShards; }
+
+	// Direct access to a shard, the caller is responsible for the synchronization
+	// (insertions must go through Insert or InsertUnlocked, which maintain the shard minimum and occupancy)
+	//
+	Shard* GetShard(int shard) { return &m_shards[shard].set; }
+
+	// bit i is set if shard i is not empty
+	//
+	uint64_t GetOccupancy() { return m_occupancy.load(std::memory_order_acquire); }
+
+	static const int x_maxNumShards = 64;
+	static const int x_shardTableBits = 12;
+	static const int x_shardTableSize = 1 << x_shardTableBits;
+	static const uint64_t x_shardSizeSlack = 2;
+
+private:
+	int TableIndex(uint64_t value)
+	{
+		return int((value << m_prefixLen) >> (64 - x_shardTableBits));
+	}
+
+	bool InsertIntoShard(int shard, uint64_t value)
+	{
+		ShardState& s = m_shards[shard];
+		bool inserted = s.set.Insert(value);
+		// keys are never deleted, so the minimum only decreases, and only the writer of the shard updates it
+		//
+		if (inserted)
+		{
+			uint64_t bit = uint64_t(1) << shard;
+			bool occupied = (m_occupancy.load(std::memory_order_relaxed) & bit) != 0;
+			if (!occupied || value < s.minimum.load(std::memory_order_relaxed))
+			{
+				s.minimum.store(value, std::memory_order_release);
+				if (!occupied)
+				{
+					m_occupancy.fetch_or(bit, std::memory_order_release);
+				}
+			}
+		}
+		return inserted;
+	}
+
+	// Each shard on its own cache lines, so that writers to different shards do not false-share
+	//
+	struct alignas(64) ShardState
+	{
+		ShardState() : minimum(0xffffffffffffffffULL) { }
+
+		ShardSpinLock lock;
+		// the smallest key of the shard, valid once the occupancy bit of the shard is set
+		//
+		std::atomic<uint64_t> minimum;
+		Shard set;
+	};
+
+	int m_numShards;
+	// # of bits of the common prefix of the sample, and the prefix, in the low m_prefixLen bits
+	//
+	int m_prefixLen;
+	uint64_t m_prefix;
+	std::atomic<uint64_t> m_occupancy;
+	uint8_t m_shardTable[x_shardTableSize];
+	ShardState* m_shards;
+};
+
+typedef BasicShardedMlpSet<DefaultMlpSetConfig> ShardedMlpSet;
+
+}	// namespace MlpSetUInt64
@@ -0,0 +1,306 @@
+#include "common.h"
+#include "MlpSetSharded.h"
+#include "gtest/gtest.h"
+#include <thread>
+#include <random>
+
+namespace {
+
+using MlpSetUInt64::ShardedMlpSet;
+
+// Keys distributed as in WorkloadA: 2 bytes in [32, 96), then 6 bytes in [48, 53)
+//
+uint64_t GenWorkloadAKey(std::mt19937_64& rng)
+{
+	uint64_t key = 0;
+	rep(k, 0, 1) key = key * 256 + rng() % 64 + 32;
+	rep(k, 2, 7) key = key * 256 + rng() % 5 + 48;
+	return key;
+}
+
+uint64_t GenRandomKey(std::mt19937_64& rng)
+{
+	return rng();
+}
+
+void CheckAgainstStdSet(ShardedMlpSet& ss, set<uint64_t>& S, std::mt19937_64& rng, int q)
+{
+	rep(i, 0, q - 1)
+	{
+		uint64_t key;
+		int kind = rng() % 4;
+		if (kind == 0)
+		{
+			key = GenWorkloadAKey(rng);
+		}
+		else if (kind == 1)
+		{
+			key = GenRandomKey(rng);
+		}
+		else if (kind == 2)
+		{
+			key = GenWorkloadAKey(rng) + rng() % 5 - 2;
+		}
+		else
+		{
+			// a key in the gap before the minimum of a shard, whose lower bound is in the next non-empty shard
+			//
+			int shard = rng() % ss.GetNumShards();
+			bool found;
+			key = ss.GetShard(shard)->LowerBound(0, found);
+			if (found && key > 0) key--;
+		}
+		auto it = S.lower_bound(key);
+		ReleaseAssert(ss.Exist(key) == (it != S.end() && *it == key));
+		bool found;
+		uint64_t lb = ss.LowerBound(key, found);
+		ReleaseAssert(found == (it != S.end()));
+		if (found)
+		{
+			ReleaseAssert(lb == *it);
+		}
+	}
+}
+
+void ShardedCorrectnessTestImpl(int numShards)
+{
+	printf("Testing %d shards..\n", numShards);
+	const int N = 300000;
+	std::mt19937_64 rng(numShards);
+
+	vector<uint64_t> sample;
+	rep(i, 0, 9999) sample.push_back(GenWorkloadAKey(rng));
+
+	ShardedMlpSet ss;
+	ss.Init(N + 10, numShards, sample.data(), sample.size());
+	set<uint64_t> S;
+
+	// an empty set
+	//
+	CheckAgainstStdSet(ss, S, rng, 1000);
+
+	rep(i, 0, N - 1)
+	{
+		uint64_t key = GenWorkloadAKey(rng);
+		// sometimes insert a key outside of the prefix of the sample, which goes to the first or last shard
+		//
+		if (i % 1000 == 0)
+		{
+			key = (i % 2000 == 0) ? rng() % 1000 : (~uint64_t(0)) - rng() % 1000;
+		}
+		bool expected = S.insert(key).second;
+		bool actual = ss.Insert(key);
+		ReleaseAssert(expected == actual);
+	}
+	ReleaseAssert(ss.Insert(~uint64_t(0)) == S.insert(~uint64_t(0)).second);
+	CheckAgainstStdSet(ss, S, rng, 1000000);
+
+	// the shards must be balanced for the skewed WorkloadA keys
+	//
+	vector<int> shardSize(numShards, 0);
+	for (uint64_t key : S)
+	{
+		shardSize[ss.ShardOf(key)]++;
+	}
+	int maxShardSize = *max_element(shardSize.begin(), shardSize.end());
+	int minShardSize = *min_element(shardSize.begin(), shardSize.end());
+	printf("Shard size: min %d, max %d, average %d\n", minShardSize, maxShardSize, int(S.size()) / numShards);
+	ReleaseAssert(maxShardSize <= 2 * int(S.size()) / numShards);
+	if (numShards > 1)
+	{
+		ReleaseAssert(ss.GetOccupancy() == (numShards == 64 ? ~uint64_t(0) : (uint64_t(1) << numShards) - 1));
+	}
+}
+
+TEST(MlpSetSharded, CorrectnessTest)
+{
+	ShardedCorrectnessTestImpl(1);
+	ShardedCorrectnessTestImpl(7);
+	ShardedCorrectnessTestImpl(16);
+	ShardedCorrectnessTestImpl(64);
+}
+
+// Concurrent writers with the per-shard spinlocks, racing with readers
+//
+TEST(MlpSetSharded, ConcurrentCorrectness)
+{
+	const int numThreads = 8;
+	const int numKeysPerThread = 100000;
+	std::mt19937_64 rng(1);
+	vector<uint64_t> sample;
+	rep(i, 0, 9999) sample.push_back(GenWorkloadAKey(rng));
+
+	ShardedMlpSet ss;
+	ss.Init(numThreads * numKeysPerThread + 10, 16, sample.data(), sample.size());
+
+	vector<vector<uint64_t> > keys(numThreads);
+	set<uint64_t> S;
+	rep(t, 0, numThreads - 1)
+	{
+		while (int(keys[t].size()) < numKeysPerThread)
+		{
+			uint64_t key = GenWorkloadAKey(rng);
+			if (S.insert(key).second)
+			{
+				keys[t].push_back(key);
+			}
+		}
+	}
+
+	vector<std::thread> threads;
+	rep(t, 0, numThreads - 1)
+	{
+		threads.push_back(std::thread([&, t]() {
+			std::mt19937_64 threadRng(t + 100);
+			rep(i, 0, numKeysPerThread - 1)
+			{
+				ReleaseAssert(ss.Insert(keys[t][i]));
+				// our own keys are visible, and the lower bound of our key can only be our key
+				//
+				uint64_t key = keys[t][threadRng() % (i + 1)];
+				ReleaseAssert(ss.Exist(key));
+				bool found;
+				ReleaseAssert(ss.LowerBound(key, found) == key && found);
+			}
+		}));
+	}
+	for (std::thread& t : threads)
+	{
+		t.join();
+	}
+	CheckAgainstStdSet(ss, S, rng, 1000000);
+}
+
+// One op of the mixed workload
+//
+struct MixedOp
+{
+	int type;		// 0 = insert, 1 = exist, 2 = lower bound
+	uint64_t key;
+};
+
+// numOps ops: insertPercent% insertions of new keys, the rest split evenly between Exist and LowerBound
+//
+vector<MixedOp> GenMixedOps(std::mt19937_64& rng, int numOps, int insertPercent, const vector<uint64_t>& loadedKeys)
+{
+	vector<MixedOp> ops;
+	rep(i, 0, numOps - 1)
+	{
+		MixedOp op;
+		int r = rng() % 100;
+		if (r < insertPercent)
+		{
+			op.type = 0;
+			op.key = GenWorkloadAKey(rng);
+		}
+		else
+		{
+			op.type = (r % 2 == 0) ? 1 : 2;
+			op.key = (rng() % 2 == 0) ? loadedKeys[rng() % loadedKeys.size()] : GenWorkloadAKey(rng);
+		}
+		ops.push_back(op);
+	}
+	return ops;
+}
+
+template<bool locked>
+uint64_t NO_INLINE RunMixedOps(ShardedMlpSet& ss, const MixedOp* ops, int numOps)
+{
+	uint64_t sum = 0;
+	rep(i, 0, numOps - 1)
+	{
+		const MixedOp& op = ops[i];
+		if (op.type == 0)
+		{
+			sum += locked ? ss.Insert(op.key) : ss.InsertUnlocked(op.key);
+		}
+		else if (op.type == 1)
+		{
+			sum += locked ? ss.Exist(op.key) : ss.ExistUnlocked(op.key);
+		}
+		else
+		{
+			bool found;
+			sum += locked ? ss.LowerBound(op.key, found) : ss.LowerBoundUnlocked(op.key, found);
+		}
+	}
+	return sum;
+}
+
+void ShardedThroughputBenchmarkImpl(int numShards, int numLoaded, int numOps, int insertPercent)
+{
+	printf("==== %d shards, %d keys loaded, %d ops, %d%% inserts ====\n", numShards, numLoaded, numOps, insertPercent);
+	std::mt19937_64 rng(12345);
+	vector<uint64_t> loadedKeys;
+	rep(i, 0, numLoaded - 1) loadedKeys.push_back(GenWorkloadAKey(rng));
+	vector<MixedOp> ops = GenMixedOps(rng, numOps, insertPercent, loadedKeys);
+	uint32_t maxSetSize = numLoaded + numOps / 100 * insertPercent + 1000;
+
+	auto loadSet = [&](ShardedMlpSet& ss) {
+		ss.Init(maxSetSize, numShards, loadedKeys.data(), 10000);
+		for (uint64_t key : loadedKeys) ss.Insert(key);
+	};
+
+	// spinlock mode, the ops are split evenly among the threads
+	//
+	for (int numThreads = 1; numThreads <= 64; numThreads *= 2)
+	{
+		ShardedMlpSet ss;
+		loadSet(ss);
+		double t;
+		{
+			AutoTimer timer(&t);
+			vector<std::thread> threads;
+			rep(k, 0, numThreads - 1)
+			{
+				int begin = int(uint64_t(numOps) * k / numThreads);
+				int end = int(uint64_t(numOps) * (k + 1) / numThreads);
+				threads.push_back(std::thread([&, begin, end]() {
+					RunMixedOps<true>(ss, ops.data() + begin, end - begin);
+				}));
+			}
+			for (std::thread& th : threads)
+			{
+				th.join();
+			}
+		}
+		printf("spinlock mode, %d threads: %.2lf Mops/s\n", numThreads, numOps / t / 1e6);
+	}
+
+	// thread-per-shard mode, the ops are routed to the thread owning their shard
+	//
+	{
+		ShardedMlpSet ss;
+		loadSet(ss);
+		vector<vector<MixedOp> > routedOps(numShards);
+		for (const MixedOp& op : ops)
+		{
+			routedOps[ss.ShardOf(op.key)].push_back(op);
+		}
+		double t;
+		{
+			AutoTimer timer(&t);
+			vector<std::thread> threads;
+			rep(k, 0, numShards - 1)
+			{
+				threads.push_back(std::thread([&, k]() {
+					RunMixedOps<false>(ss, routedOps[k].data(), routedOps[k].size());
+				}));
+			}
+			for (std::thread& th : threads)
+			{
+				th.join();
+			}
+		}
+		printf("thread-per-shard mode, %d threads: %.2lf Mops/s (routing not included)\n", numShards, numOps / t / 1e6);
+	}
+}
+
+TEST(MlpSetSharded, MixedWorkloadThroughput)
+{
+	printf("%d hardware threads\n", int(std::thread::hardware_concurrency()));
+	ShardedThroughputBenchmarkImpl(16, 2000000, 4000000, 10);
+	ShardedThroughputBenchmarkImpl(64, 2000000, 4000000, 50);
+}
+
+}	// annoymous namespace
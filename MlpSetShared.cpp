@@ -0,0 +1,145 @@
+#include "MlpSetShared.h"
+#include <sys/vfs.h>
+#include <linux/magic.h>
+
+namespace MlpSetUInt64
+{
+
+// A POSIX shared memory object name is "/name" with no other slash, anything else is a file path
+//
+static bool IsShmName(const char* name)
+{
+	return name[0] == '/' && strchr(name + 1, '/') == nullptr;
+}
+
+// Set the size of the segment file, rounded up to its page size, returns false on failure
+//
+static bool SetSegmentSize(int fd, uint64_t size)
+{
+	struct statfs fs;
+	if (fstatfs(fd, &fs) != 0)
+	{
+		return false;
+	}
+	uint64_t pageSize = (fs.f_type == HUGETLBFS_MAGIC) ? uint64_t(fs.f_bsize) : uint64_t(sysconf(_SC_PAGESIZE));
+	size = (size + pageSize - 1) / pageSize * pageSize;
+	return ftruncate(fd, size) == 0;
+}
+
+SharedMemorySegment::SharedMemorySegment()
+	: m_fd(-1)
+	, m_base(nullptr)
+	, m_size(0)
+	, m_isHugeTLB(false)
+{ }
+
+SharedMemorySegment::~SharedMemorySegment()
+{
+	if (m_base != nullptr)
+	{
+		int ret = munmap(m_base, m_size);
+		ReleaseAssert(ret == 0);
+		m_base = nullptr;
+	}
+	if (m_fd != -1)
+	{
+		close(m_fd);
+		m_fd = -1;
+	}
+}
+
+bool SharedMemorySegment::Map(int fd, bool writable)
+{
+	struct statfs fs;
+	struct stat st;
+	if (fstatfs(fd, &fs) != 0 || fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		return false;
+	}
+	void* ptr = mmap(NULL, st.st_size, writable ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0 /*offset*/);
+	if (ptr == MAP_FAILED)
+	{
+		return false;
+	}
+	m_base = ptr;
+	m_size = st.st_size;
+	m_isHugeTLB = (fs.f_type == HUGETLBFS_MAGIC);
+	if (!m_isHugeTLB)
+	{
+		// failure is harmless (e.g. shmem THP disabled), we just get normal pages
+		//
+		madvise(m_base, m_size, MADV_HUGEPAGE);
+	}
+	return true;
+}
+
+SharedMemorySegment* SharedMemorySegment::Create(const char* name, uint64_t size)
+{
+	SharedMemorySegment* segment = new SharedMemorySegment();
+	if (name == nullptr)
+	{
+		// the hugetlbfs mapping fails if there are not enough free hugepages, fall back to normal pages in this case
+		// MFD_HUGE_SHIFT has the same value as MAP_HUGE_SHIFT
+		//
+		int fd = memfd_create("mlpset", MFD_CLOEXEC | MFD_HUGETLB | (__builtin_ctzll(HUGEPAGESIZE_BYTES) << MAP_HUGE_SHIFT));
+		if (fd != -1 && !(SetSegmentSize(fd, size) && segment->Map(fd, true /*writable*/)))
+		{
+			close(fd);
+			fd = -1;
+		}
+		if (fd == -1)
+		{
+			fd = memfd_create("mlpset", MFD_CLOEXEC);
+			ReleaseAssert(fd != -1);
+			ReleaseAssert(SetSegmentSize(fd, size) && segment->Map(fd, true /*writable*/));
+		}
+		segment->m_fd = fd;
+		segment->m_path = "/proc/" + std::to_string(getpid()) + "/fd/" + std::to_string(fd);
+	}
+	else
+	{
+		int fd = IsShmName(name) ? shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644) : open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+		ReleaseAssert(fd != -1);
+		ReleaseAssert(SetSegmentSize(fd, size) && segment->Map(fd, true /*writable*/));
+		close(fd);
+		segment->m_path = name;
+	}
+	return segment;
+}
+
+SharedMemorySegment* SharedMemorySegment::Attach(const char* path)
+{
+	int fd = IsShmName(path) ? shm_open(path, O_RDONLY, 0) : open(path, O_RDONLY);
+	if (fd == -1)
+	{
+		return nullptr;
+	}
+	SharedMemorySegment* segment = new SharedMemorySegment();
+	bool ok = segment->Map(fd, false /*writable*/);
+	close(fd);
+	if (!ok)
+	{
+		delete segment;
+		return nullptr;
+	}
+	segment->m_path = path;
+	return segment;
+}
+
+void SharedMemorySegment::Remove(const char* name)
+{
+	if (name == nullptr)
+	{
+		return;
+	}
+	if (IsShmName(name))
+	{
+		shm_unlink(name);
+	}
+	else
+	{
+		unlink(name);
+	}
+}
+
+}	// namespace MlpSetUInt64
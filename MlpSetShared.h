@@ -0,0 +1,66 @@
+#pragma once
+
+#include "common.h"
+
+namespace MlpSetUInt64
+{
+
+// A shared memory segment, created and mapped read-write by one process, and attached read-only by others
+//
+// The name passed to Create selects the kind of segment:
+//     nullptr: an anonymous memfd, on hugetlbfs pages of HUGEPAGESIZE_BYTES if the kernel can provide them
+//              (normal pages otherwise). Other processes attach it through GetPath(), i.e. /proc/<pid>/fd/<fd>
+//              of the creator, so it can only be attached while the creator holds the segment.
+//     "/name": a POSIX shared memory object (shm_open, normal pages of /dev/shm), which exists until Remove.
+//     any other path: a file, e.g. on a hugetlbfs mount such as /dev/hugepages/name, which exists until Remove.
+// Normal-page segments are advised to use transparent hugepages (effective if shmem THP is enabled).
+// The memory stays valid as long as some process maps it, even after Remove or after the creator exits.
+//
+class SharedMemorySegment
+{
+public:
+	~SharedMemorySegment();
+
+	// Create a zero-initialized segment of at least size bytes, mapped read-write
+	// Fails (ReleaseAssert) if the segment already exists
+	//
+	static SharedMemorySegment* Create(const char* name, uint64_t size);
+
+	// Attach an existing segment read-only, returns nullptr if it does not exist
+	//
+	static SharedMemorySegment* Attach(const char* path);
+
+	// Remove a named segment, no-op for nullptr
+	//
+	static void Remove(const char* name);
+
+	void* GetBase() { return m_base; }
+	uint64_t GetSize() { return m_size; }
+
+	// The path to pass to Attach
+	//
+	const string& GetPath() { return m_path; }
+
+	bool IsHugeTLB() { return m_isHugeTLB; }
+
+	// The fd of an anonymous memfd segment, -1 for the other kinds
+	//
+	int GetFd() { return m_fd; }
+
+private:
+	SharedMemorySegment();
+
+	// Map the fd (its size must be set), sets m_base, m_size and m_isHugeTLB, returns false on failure
+	//
+	bool Map(int fd, bool writable);
+
+	// -1 once the segment is mapped, except for an anonymous memfd, which must stay open to be attachable
+	//
+	int m_fd;
+	void* m_base;
+	uint64_t m_size;
+	string m_path;
+	bool m_isHugeTLB;
+};
+
+}	// namespace MlpSetUInt64
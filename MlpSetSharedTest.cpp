@@ -0,0 +1,292 @@
+#include "common.h"
+#include "MlpSetUInt64.h"
+#include "gtest/gtest.h"
+#include <fstream>
+#include <sstream>
+#include <random>
+#include <sys/wait.h>
+
+namespace {
+
+using MlpSetUInt64::MlpSet;
+using MlpSetUInt64::SharedMemorySegment;
+
+// Keys spread over all lengths of common prefixes, plus a dense range so that some nodes get external bitmaps
+//
+vector<uint64_t> GenSharedSetKeys(int n, uint64_t seed)
+{
+	std::mt19937_64 rng(seed);
+	vector<uint64_t> keys;
+	rep(i, 0, n - 1)
+	{
+		keys.push_back((i % 4 == 0) ? (0x123456000000ULL + rng() % (n * 4)) : (rng() >> (rng() % 40)));
+	}
+	return keys;
+}
+
+// Check the set against S, returns false on mismatch (so that a forked child can report it through its exit code)
+//
+bool CheckSharedSet(MlpSet& ms, const set<uint64_t>& S, const vector<uint64_t>& keys, uint64_t seed)
+{
+	std::mt19937_64 rng(seed);
+	rep(i, 0, 199999)
+	{
+		uint64_t key = (i % 2 == 0) ? keys[rng() % keys.size()] + rng() % 3 - 1 : rng() >> (rng() % 40);
+		auto it = S.lower_bound(key);
+		if (ms.Exist(key) != (it != S.end() && *it == key))
+		{
+			return false;
+		}
+		bool found;
+		uint64_t lb = ms.LowerBound(key, found);
+		if (found != (it != S.end()) || (found && lb != *it))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+TEST(MlpSetShared, PublishAttachCorrectness)
+{
+	const int n = 500000;
+	vector<uint64_t> keys = GenSharedSetKeys(n, 1);
+	set<uint64_t> S(keys.begin(), keys.end());
+
+	string shmName = "/mlpset-test-" + std::to_string(getpid());
+	string fileName = "/tmp/mlpset-test-" + std::to_string(getpid());
+	const char* names[3] = { nullptr, shmName.c_str(), fileName.c_str() };
+	rep(deamortized, 0, 1)
+	{
+		rep(k, 0, 2)
+		{
+			printf("Testing %s, %s insertion..\n", names[k] == nullptr ? "memfd" : names[k], deamortized ? "de-amortized" : "normal");
+			SharedMemorySegment* segment;
+			{
+				MlpSet ms;
+				ms.Init(n + 1000);
+				if (deamortized) ms.EnableDeamortizedInsert(4);
+				for (uint64_t key : keys) ms.Insert(key);
+				segment = ms.PublishShared(names[k]);
+				// the published copy does not depend on the memory of the source set
+				//
+			}
+			printf("%llu bytes, hugetlb = %d\n", static_cast<unsigned long long>(segment->GetSize()), int(segment->IsHugeTLB()));
+
+			{
+				MlpSet ms;
+				ReleaseAssert(ms.AttachShared(segment->GetPath().c_str()));
+				ReleaseAssert(ms.IsAttachedShared());
+				ReleaseAssert(CheckSharedSet(ms, S, keys, 2));
+				// the hot key cache is private to the process, and works on an attached set
+				//
+				ms.EnableHotKeyCache(1 << 16);
+				ReleaseAssert(CheckSharedSet(ms, S, keys, 3));
+			}
+
+			pid_t pid = fork();
+			ReleaseAssert(pid != -1);
+			if (pid == 0)
+			{
+				MlpSet ms;
+				bool ok = ms.AttachShared(segment->GetPath().c_str()) && CheckSharedSet(ms, S, keys, 4);
+				_exit(ok ? 0 : 1);
+			}
+			int status;
+			ReleaseAssert(waitpid(pid, &status, 0) == pid);
+			ReleaseAssert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+			delete segment;
+			SharedMemorySegment::Remove(names[k]);
+			if (names[k] != nullptr)
+			{
+				MlpSet ms;
+				ReleaseAssert(!ms.AttachShared(names[k]));
+			}
+		}
+	}
+}
+
+// Read "<field>: <value> kB" lines of a /proc file, returns the value in bytes, 0 if missing
+//
+uint64_t ReadProcField(const char* path, const string& field)
+{
+	std::ifstream in(path);
+	string line;
+	while (std::getline(in, line))
+	{
+		if (line.compare(0, field.length() + 1, field + ":") == 0)
+		{
+			std::istringstream ss(line.substr(field.length() + 1));
+			uint64_t value = 0;
+			string unit;
+			ss >> value >> unit;
+			return (unit == "kB") ? value * 1024 : value;
+		}
+	}
+	return 0;
+}
+
+// Memory in use system-wide, including hugepages (which MemAvailable does not account for)
+//
+uint64_t GetSystemUsedMemory()
+{
+	uint64_t hugepages = ReadProcField("/proc/meminfo", "HugePages_Total") - ReadProcField("/proc/meminfo", "HugePages_Free");
+	return ReadProcField("/proc/meminfo", "MemTotal") - ReadProcField("/proc/meminfo", "MemAvailable") +
+	       hugepages * ReadProcField("/proc/meminfo", "Hugepagesize");
+}
+
+uint64_t GetSystemFreeMemory()
+{
+	return ReadProcField("/proc/meminfo", "MemAvailable") +
+	       ReadProcField("/proc/meminfo", "HugePages_Free") * ReadProcField("/proc/meminfo", "Hugepagesize");
+}
+
+struct ChildReport
+{
+	double mops;
+	uint64_t rss;
+	uint64_t hugetlb;
+};
+
+uint64_t NO_INLINE SharedExistLoop(MlpSet& ms, const vector<uint64_t>& queries)
+{
+	uint64_t sum = 0;
+	for (uint64_t key : queries)
+	{
+		sum += ms.Exist(key);
+	}
+	return sum;
+}
+
+// Run numProcs processes, each querying either its own private copy built from keys, or the set published in path.
+// All processes get ready (set built or attached, and queried once so that its pages are mapped) before any timed query,
+// and the growth of the system-wide memory usage is measured at that point.
+//
+void RunQueryProcesses(const char* path, int numProcs, const vector<uint64_t>& keys, const vector<uint64_t>& queries)
+{
+	int readyPipe[2], startPipe[2], reportPipe[2];
+	ReleaseAssert(pipe(readyPipe) == 0 && pipe(startPipe) == 0 && pipe(reportPipe) == 0);
+	uint64_t memBefore = GetSystemUsedMemory();
+	vector<pid_t> children;
+	rep(i, 0, numProcs - 1)
+	{
+		pid_t pid = fork();
+		ReleaseAssert(pid != -1);
+		if (pid == 0)
+		{
+			close(startPipe[1]);
+			MlpSet ms;
+			if (path == nullptr)
+			{
+				ms.Init(keys.size() + 1000);
+				ms.BulkLoad(keys.data(), keys.size(), 1 /*numThreads*/);
+			}
+			else
+			{
+				ReleaseAssert(ms.AttachShared(path));
+			}
+			uint64_t expected = SharedExistLoop(ms, queries);
+			char c = 0;
+			ReleaseAssert(write(readyPipe[1], &c, 1) == 1);
+			// the parent closes the write end of the start pipe to start all processes at once
+			//
+			ReleaseAssert(read(startPipe[0], &c, 1) == 0);
+			double t;
+			{
+				AutoTimer timer(&t);
+				ReleaseAssert(SharedExistLoop(ms, queries) == expected);
+			}
+			ChildReport report;
+			report.mops = double(queries.size()) / t / 1e6;
+			report.rss = ReadProcField("/proc/self/status", "VmRSS");
+			report.hugetlb = ReadProcField("/proc/self/status", "HugetlbPages");
+			ReleaseAssert(write(reportPipe[1], &report, sizeof(report)) == sizeof(report));
+			_exit(0);
+		}
+		children.push_back(pid);
+	}
+	close(startPipe[0]);
+	rep(i, 0, numProcs - 1)
+	{
+		char c;
+		ReleaseAssert(read(readyPipe[0], &c, 1) == 1);
+	}
+	uint64_t memDelta = GetSystemUsedMemory() - memBefore;
+	close(startPipe[1]);
+
+	double minMops = 1e100, maxMops = 0, totalMops = 0;
+	uint64_t totalRss = 0, totalHugetlb = 0;
+	rep(i, 0, numProcs - 1)
+	{
+		ChildReport report;
+		ReleaseAssert(read(reportPipe[0], &report, sizeof(report)) == sizeof(report));
+		minMops = min(minMops, report.mops);
+		maxMops = max(maxMops, report.mops);
+		totalMops += report.mops;
+		totalRss += report.rss;
+		totalHugetlb += report.hugetlb;
+	}
+	for (pid_t pid : children)
+	{
+		int status;
+		ReleaseAssert(waitpid(pid, &status, 0) == pid);
+		ReleaseAssert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	}
+	close(readyPipe[0]); close(readyPipe[1]);
+	close(reportPipe[0]); close(reportPipe[1]);
+
+	printf("%s, %d processes:\n", path == nullptr ? "private copies" : "shared attached", numProcs);
+	printf("    system memory growth %.1lf MB (%.1lf MB per process)\n", double(memDelta) / 1048576, double(memDelta) / 1048576 / numProcs);
+	printf("    sum of VmRSS %.1lf MB, sum of HugetlbPages %.1lf MB (shared pages are counted once per process)\n",
+	       double(totalRss) / 1048576, double(totalHugetlb) / 1048576);
+	printf("    per-process throughput %.2lf - %.2lf Mops/s, total %.2lf Mops/s\n", minMops, maxMops, totalMops);
+}
+
+// Compare numProcs processes each building a private copy of the set, with numProcs processes attaching a single published copy
+// The processes run concurrently, so the per-process throughput only stays flat if there are at least numProcs cores.
+//
+void MultiProcessBenchmarkImpl(int n, int numProcs)
+{
+	printf("%d keys, %d processes, %d cores\n", n, numProcs, int(sysconf(_SC_NPROCESSORS_ONLN)));
+	std::mt19937_64 rng(1);
+	vector<uint64_t> keys;
+	rep(i, 0, n - 1) keys.push_back(rng());
+	vector<uint64_t> queries;
+	rep(i, 0, 3999999) queries.push_back((i % 2 == 0) ? keys[rng() % n] : rng());
+
+	SharedMemorySegment* segment;
+	{
+		MlpSet ms;
+		ms.Init(n + 1000);
+		ms.BulkLoad(keys.data(), n, 1 /*numThreads*/);
+		segment = ms.PublishShared(nullptr);
+	}
+	printf("Published set: %.1lf MB, hugetlb = %d\n", double(segment->GetSize()) / 1048576, int(segment->IsHugeTLB()));
+
+	RunQueryProcesses(segment->GetPath().c_str(), numProcs, keys, queries);
+	// a private copy needs about the size of the published segment (plus a copy of the keys while it is built)
+	//
+	if (segment->GetSize() * numProcs * 5 / 4 < GetSystemFreeMemory())
+	{
+		RunQueryProcesses(nullptr, numProcs, keys, queries);
+	}
+	else
+	{
+		printf("private copies, %d processes: skipped, %.1lf MB needed but only %.1lf MB free\n", numProcs,
+		       double(segment->GetSize() * numProcs) / 1048576, double(GetSystemFreeMemory()) / 1048576);
+	}
+	delete segment;
+}
+
+TEST(MlpSetShared, MultiProcess_4M)
+{
+	MultiProcessBenchmarkImpl(4000000, 4);
+}
+
+TEST(MlpSetShared, MultiProcess_80M)
+{
+	MultiProcessBenchmarkImpl(80000000, 24);
+}
+
+}	// annoymous namespace
@@ -0,0 +1,257 @@
+#include "MlpSetSnapshot.h"
+#include <mutex>
+
+namespace MlpSetUInt64
+{
+
+std::atomic<CowRegion*> CowRegion::s_regions[CowRegion::x_maxRegions];
+std::atomic<int> CowRegion::s_numRegions(0);
+
+static struct sigaction s_previousAction;
+static std::once_flag s_installFaultHandlerOnce;
+
+CowRegion::CowRegion()
+	: m_segment(nullptr)
+	, m_base(nullptr)
+	, m_size(0)
+	, m_pageSize(0)
+	, m_numPages(0)
+	, m_arenaBegin(0)
+	, m_arenaEnd(0)
+	, m_arenaUsed(0)
+	, m_lock(false)
+	, m_numSnapshots(0)
+	, m_writeProtected(false)
+	, m_numCopiedPages(0)
+	, m_numWriteFaults(0)
+	, m_refCount(1)
+{
+	memset(m_snapshots, 0, sizeof(m_snapshots));
+}
+
+void CowRegion::InstallFaultHandler()
+{
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_sigaction = OnFault;
+	action.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	int ret = sigaction(SIGSEGV, &action, &s_previousAction);
+	ReleaseAssert(ret == 0);
+}
+
+void CowRegion::OnFault(int /*sig*/, siginfo_t* info, void* /*context*/)
+{
+	CowRegion* region = FindSlow(info->si_addr);
+	if (region != nullptr && info->si_code == SEGV_ACCERR)
+	{
+		region->OnWriteFault(info->si_addr);
+		return;
+	}
+	// not a write to a write-protected region: restore the previous action, which handles the fault when it repeats
+	//
+	sigaction(SIGSEGV, &s_previousAction, nullptr);
+}
+
+CowRegion* CowRegion::Create(uint64_t size, uint64_t arenaSize)
+{
+	std::call_once(s_installFaultHandlerOnce, InstallFaultHandler);
+	CowRegion* region = new CowRegion();
+	region->m_arenaBegin = (size + 63) / 64 * 64;
+	region->m_arenaEnd = region->m_arenaBegin + arenaSize;
+	// On normal pages, we write-protect 2MB at a time rather than 4KB,
+	// mprotect splits the mapping at every protection change, and the # of mappings of a process is limited
+	//
+	const uint64_t x_normalPageGranularity = 2 * 1024 * 1024;
+	region->m_segment = SharedMemorySegment::Create(nullptr, (region->m_arenaEnd + x_normalPageGranularity - 1) / x_normalPageGranularity * x_normalPageGranularity);
+	region->m_base = reinterpret_cast<uint8_t*>(region->m_segment->GetBase());
+	region->m_size = region->m_segment->GetSize();
+	region->m_pageSize = region->m_segment->IsHugeTLB() ? HUGEPAGESIZE_BYTES : x_normalPageGranularity;
+	ReleaseAssert(region->m_size % region->m_pageSize == 0);
+	region->m_numPages = region->m_size / region->m_pageSize;
+
+	bool registered = false;
+	rep(i, 0, x_maxRegions - 1)
+	{
+		CowRegion* expected = nullptr;
+		if (s_regions[i].compare_exchange_strong(expected, region))
+		{
+			registered = true;
+			break;
+		}
+	}
+	ReleaseAssert(registered);
+	s_numRegions.fetch_add(1);
+	return region;
+}
+
+CowRegion* CowRegion::FindSlow(const void* ptr)
+{
+	uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+	rep(i, 0, x_maxRegions - 1)
+	{
+		CowRegion* region = s_regions[i].load(std::memory_order_acquire);
+		if (region != nullptr && reinterpret_cast<uintptr_t>(region->m_base) <= addr && addr < reinterpret_cast<uintptr_t>(region->m_base) + region->m_size)
+		{
+			return region;
+		}
+	}
+	return nullptr;
+}
+
+void CowRegion::Lock()
+{
+	while (m_lock.exchange(true, std::memory_order_acquire))
+	{
+		while (m_lock.load(std::memory_order_relaxed))
+		{
+			_mm_pause();
+		}
+	}
+}
+
+void CowRegion::Unlock()
+{
+	m_lock.store(false, std::memory_order_release);
+}
+
+void CowRegion::DecRef()
+{
+	if (m_refCount.fetch_sub(1) == 1)
+	{
+		delete this;
+	}
+}
+
+uint64_t* CowRegion::AllocateBitMap()
+{
+	// the arena is bump-allocated (external bitmaps are never freed),
+	// atomically because the threads of a parallel bulk load allocate concurrently
+	//
+	uint64_t offset = __atomic_fetch_add(&m_arenaUsed, 32, __ATOMIC_RELAXED);
+	ReleaseAssert(m_arenaBegin + offset + 32 <= m_arenaEnd);
+	return reinterpret_cast<uint64_t*>(m_base + m_arenaBegin + offset);
+}
+
+void CowRegion::OnWriteFault(const void* ptr)
+{
+	uint64_t page = (reinterpret_cast<uintptr_t>(ptr) - reinterpret_cast<uintptr_t>(m_base)) / m_pageSize;
+	// on normal pages, the kernel copies each 4KB page of the block on its own
+	//
+	uint64_t stride = m_segment->IsHugeTLB() ? m_pageSize : 4096;
+	Lock();
+	m_numWriteFaults++;
+	rep(i, 0, x_maxSnapshots - 1)
+	{
+		Snapshot& snapshot = m_snapshots[i];
+		if (snapshot.base != nullptr && (snapshot.copied[page / 64] & (uint64_t(1) << (page % 64))) == 0)
+		{
+			for (uint64_t offset = 0; offset < m_pageSize; offset += stride)
+			{
+				volatile uint8_t* p = snapshot.base + page * m_pageSize + offset;
+				*p = *p;
+			}
+			snapshot.copied[page / 64] |= uint64_t(1) << (page % 64);
+			m_numCopiedPages++;
+		}
+	}
+	int ret = mprotect(m_base + page * m_pageSize, m_pageSize, PROT_READ | PROT_WRITE);
+	ReleaseAssert(ret == 0);
+	Unlock();
+}
+
+void* CowRegion::TakeSnapshot()
+{
+	assert(m_segment != nullptr);
+	uint64_t* copied = new uint64_t[(m_numPages + 63) / 64]();
+	// the snapshot only takes memory for the pages copied into it, so no swap space is reserved for a full private copy
+	// (which the kernel may refuse for a large region)
+	//
+	void* ptr = mmap(NULL, m_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_NORESERVE, m_segment->GetFd(), 0 /*offset*/);
+	if (ptr == MAP_FAILED)
+	{
+		delete [] copied;
+		return nullptr;
+	}
+	Lock();
+	int slot = -1;
+	rep(i, 0, x_maxSnapshots - 1)
+	{
+		if (m_snapshots[i].base == nullptr)
+		{
+			slot = i;
+			break;
+		}
+	}
+	if (slot == -1)
+	{
+		Unlock();
+		munmap(ptr, m_size);
+		delete [] copied;
+		return nullptr;
+	}
+	m_snapshots[slot].base = reinterpret_cast<uint8_t*>(ptr);
+	m_snapshots[slot].copied = copied;
+	m_numSnapshots++;
+	// also protects again the pages written since an earlier snapshot
+	//
+	int ret = mprotect(m_base, m_size, PROT_READ);
+	ReleaseAssert(ret == 0);
+	m_writeProtected = true;
+	m_refCount.fetch_add(1);
+	Unlock();
+	return ptr;
+}
+
+void CowRegion::ReleaseSnapshot(void* snapshot)
+{
+	uint64_t* copied = nullptr;
+	Lock();
+	rep(i, 0, x_maxSnapshots - 1)
+	{
+		if (m_snapshots[i].base == snapshot)
+		{
+			copied = m_snapshots[i].copied;
+			m_snapshots[i].base = nullptr;
+			m_snapshots[i].copied = nullptr;
+			break;
+		}
+	}
+	ReleaseAssert(copied != nullptr);
+	m_numSnapshots--;
+	if (m_numSnapshots == 0 && m_segment != nullptr && m_writeProtected)
+	{
+		int ret = mprotect(m_base, m_size, PROT_READ | PROT_WRITE);
+		ReleaseAssert(ret == 0);
+		m_writeProtected = false;
+	}
+	Unlock();
+	munmap(snapshot, m_size);
+	delete [] copied;
+	DecRef();
+}
+
+void CowRegion::ReleaseLive()
+{
+	assert(m_segment != nullptr);
+	rep(i, 0, x_maxRegions - 1)
+	{
+		if (s_regions[i].load() == this)
+		{
+			s_regions[i].store(nullptr);
+			s_numRegions.fetch_sub(1);
+			break;
+		}
+	}
+	Lock();
+	SharedMemorySegment* segment = m_segment;
+	m_segment = nullptr;
+	m_writeProtected = false;
+	Unlock();
+	// the snapshots keep their pages, the memfd lives as long as it is mapped
+	//
+	delete segment;
+	DecRef();
+}
+
+}	// namespace MlpSetUInt64
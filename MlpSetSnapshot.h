@@ -0,0 +1,133 @@
+#pragma once
+
+#include "common.h"
+#include "MlpSetShared.h"
+#include <atomic>
+#include <signal.h>
+
+namespace MlpSetUInt64
+{
+
+// A memory region that can be snapshotted with page-level copy-on-write, without fork
+//
+// The region is an anonymous memfd (see SharedMemorySegment, on hugetlbfs pages if available), mapped shared by its owner.
+// A snapshot maps the same memfd privately (MAP_PRIVATE), so it shares every page with the live mapping until the kernel
+// copies the page on the first write to it through the snapshot mapping.
+// Taking a snapshot write-protects the live mapping. The first write to a page of the live mapping then raises SIGSEGV,
+// and the handler writes (the same bytes) to that page through every snapshot still sharing it, so the kernel gives each
+// of them a private copy of the unmodified page, before making the page writable again and letting the write proceed.
+// A reader of a snapshot sees either the shared page or its copy, which hold the same bytes at that time,
+// so the snapshot stays consistent while the owner keeps writing.
+//
+// So taking a snapshot costs an mmap and an mprotect, and the owner pays a fault and a page copy per snapshot
+// on the first write to each page after a snapshot. The page is HUGEPAGESIZE_BYTES on hugetlbfs and 2MB otherwise
+// (the protection is changed 2MB at a time, see Create), so with 1GB hugepages a snapshot copies 1GB at a time.
+//
+// The region ends with an arena of 32-byte blocks for the external bitmaps of the hash table nodes stored in the region
+// (see CuckooHashTableNode::AllocateExternalBitMap), so that the bitmaps are snapshotted along with the nodes,
+// and the offsets of the bitmaps from their nodes are the same in the snapshots.
+//
+class CowRegion
+{
+public:
+	// Create a zero-initialized region of size bytes, followed by an arena of arenaSize bytes
+	//
+	static CowRegion* Create(uint64_t size, uint64_t arenaSize);
+
+	// The region whose live mapping contains ptr, nullptr if none
+	//
+	static CowRegion* Find(const void* ptr)
+	{
+		if (likely(s_numRegions.load(std::memory_order_relaxed) == 0))
+		{
+			return nullptr;
+		}
+		return FindSlow(ptr);
+	}
+
+	void* GetBase() { return m_base; }
+	uint64_t GetPageSize() { return m_pageSize; }
+
+	// Allocate a zero-initialized 32-byte block from the arena, only called by the owner
+	//
+	uint64_t* AllocateBitMap();
+
+	// Take a snapshot, the owner must not write to the region during the call
+	// Returns the base of the snapshot mapping, which holds the content of the region at the time of the call
+	// (it is mapped writable for the copy-on-write, but must be treated as read-only),
+	// or nullptr if the snapshot cannot be mapped, or there are x_maxSnapshots snapshots already.
+	//
+	void* TakeSnapshot();
+
+	// Release a snapshot returned by TakeSnapshot, may be called by any thread
+	//
+	void ReleaseSnapshot(void* snapshot);
+
+	// Release the live mapping, only called by the owner
+	// The region is destroyed once the live mapping and all snapshots are released.
+	//
+	void ReleaseLive();
+
+	int GetNumSnapshots() { return m_numSnapshots; }
+
+	// # of page copies made for the snapshots, and the # of write faults taken by the owner
+	//
+	uint64_t GetNumCopiedPages() { return m_numCopiedPages; }
+	uint64_t GetNumWriteFaults() { return m_numWriteFaults; }
+
+	static const int x_maxSnapshots = 16;
+	static const int x_maxRegions = 64;
+
+private:
+	CowRegion();
+
+	struct Snapshot
+	{
+		uint8_t* base;
+		// bit i is set if page i has been copied into the snapshot
+		//
+		uint64_t* copied;
+	};
+
+	static CowRegion* FindSlow(const void* ptr);
+	static void InstallFaultHandler();
+	static void OnFault(int sig, siginfo_t* info, void* context);
+
+	void Lock();
+	void Unlock();
+	void DecRef();
+
+	// Make the page containing ptr writable, after copying it into the snapshots sharing it
+	//
+	void OnWriteFault(const void* ptr);
+
+	static std::atomic<CowRegion*> s_regions[x_maxRegions];
+	static std::atomic<int> s_numRegions;
+
+	SharedMemorySegment* m_segment;
+	uint8_t* m_base;
+	// size of the whole mapping (the region, the arena, and the rounding up to the page size)
+	//
+	uint64_t m_size;
+	uint64_t m_pageSize;
+	uint64_t m_numPages;
+	uint64_t m_arenaBegin;
+	uint64_t m_arenaEnd;
+	uint64_t m_arenaUsed;
+
+	// protects the snapshot list, taken by the fault handler
+	//
+	std::atomic<bool> m_lock;
+	Snapshot m_snapshots[x_maxSnapshots];
+	int m_numSnapshots;
+	// whether the live mapping is write-protected
+	//
+	bool m_writeProtected;
+	uint64_t m_numCopiedPages;
+	uint64_t m_numWriteFaults;
+	// one reference for the live mapping and one per snapshot
+	//
+	std::atomic<int> m_refCount;
+};
+
+}	// namespace MlpSetUInt64
@@ -0,0 +1,254 @@
+#include "common.h"
+#include "MlpSetUInt64.h"
+#include "gtest/gtest.h"
+#include <atomic>
+#include <random>
+#include <thread>
+#include <sys/wait.h>
+
+namespace {
+
+using MlpSetUInt64::MlpSet;
+using MlpSetUInt64::CowRegion;
+
+// Keys spread over all lengths of common prefixes, plus a dense range so that some nodes get external bitmaps
+//
+uint64_t GenSnapshotKey(std::mt19937_64& rng, int i)
+{
+	return (i % 4 == 0) ? (0x123456000000ULL + rng() % 4000000) : (rng() >> (rng() % 40));
+}
+
+// Check the set against S, using count random queries
+//
+void CheckSnapshotSet(MlpSet& ms, const set<uint64_t>& S, const vector<uint64_t>& keys, uint64_t seed, int count)
+{
+	std::mt19937_64 rng(seed);
+	rep(i, 0, count - 1)
+	{
+		uint64_t key = (i % 2 == 0) ? keys[rng() % keys.size()] + rng() % 3 - 1 : rng() >> (rng() % 40);
+		auto it = S.lower_bound(key);
+		ReleaseAssert(ms.Exist(key) == (it != S.end() && *it == key));
+		bool found;
+		uint64_t lb = ms.LowerBound(key, found);
+		ReleaseAssert(found == (it != S.end()));
+		ReleaseAssert(!found || lb == *it);
+	}
+}
+
+void SnapshotCorrectnessTestImpl(bool deamortized)
+{
+	printf("Testing %s insertion..\n", deamortized ? "de-amortized" : "normal");
+	const int n = 600000;
+	std::mt19937_64 rng(1);
+	vector<uint64_t> keys;
+	rep(i, 0, n - 1) keys.push_back(GenSnapshotKey(rng, i));
+
+	MlpSet* ms = new MlpSet();
+	ms->Init(n + 1000);
+	if (deamortized) ms->EnableDeamortizedInsert(4);
+	set<uint64_t> S;
+	// snapshots are enabled on a non-empty set, whose external bitmaps move into the region
+	//
+	rep(i, 0, n / 4 - 1)
+	{
+		ms->Insert(keys[i]);
+		S.insert(keys[i]);
+	}
+	ms->EnableSnapshots();
+	CheckSnapshotSet(*ms, S, keys, 2, 100000);
+
+	// take a snapshot after each quarter, while a reader checks the first snapshot concurrently with the insertions
+	//
+	vector<MlpSet*> snapshots;
+	vector<set<uint64_t> > expected;
+	// the reader holds references into both vectors
+	//
+	snapshots.reserve(3);
+	expected.reserve(3);
+	std::atomic<bool> stop(false);
+	std::thread reader;
+	rep(q, 1, 3)
+	{
+		snapshots.push_back(ms->Snapshot());
+		ReleaseAssert(snapshots.back() != nullptr && snapshots.back()->IsSnapshot());
+		expected.push_back(S);
+		if (q == 1)
+		{
+			reader = std::thread([&]() {
+				uint64_t seed = 100;
+				while (!stop.load())
+				{
+					CheckSnapshotSet(*snapshots[0], expected[0], keys, seed++, 1000);
+				}
+			});
+		}
+		rep(i, q * n / 4, (q + 1) * n / 4 - 1)
+		{
+			ms->Insert(keys[i]);
+			S.insert(keys[i]);
+		}
+	}
+	stop.store(true);
+	reader.join();
+	CowRegion* region = ms->GetCowRegion();
+	printf("%d snapshots, %llu write faults, %llu pages copied (%llu bytes each)\n", region->GetNumSnapshots(),
+	       static_cast<unsigned long long>(region->GetNumWriteFaults()), static_cast<unsigned long long>(region->GetNumCopiedPages()),
+	       static_cast<unsigned long long>(region->GetPageSize()));
+
+	CheckSnapshotSet(*ms, S, keys, 3, 200000);
+	rep(k, 0, 2)
+	{
+		CheckSnapshotSet(*snapshots[k], expected[k], keys, 4 + k, 200000);
+	}
+	// release a snapshot in the middle, and keep inserting
+	//
+	delete snapshots[1];
+	ReleaseAssert(region->GetNumSnapshots() == 2);
+	rep(i, 0, 99999)
+	{
+		uint64_t key = GenSnapshotKey(rng, i);
+		ms->Insert(key);
+		S.insert(key);
+	}
+	CheckSnapshotSet(*ms, S, keys, 7, 200000);
+	CheckSnapshotSet(*snapshots[2], expected[2], keys, 8, 200000);
+	// the snapshots outlive the set
+	//
+	delete ms;
+	CheckSnapshotSet(*snapshots[0], expected[0], keys, 9, 200000);
+	CheckSnapshotSet(*snapshots[2], expected[2], keys, 10, 200000);
+	delete snapshots[0];
+	delete snapshots[2];
+}
+
+TEST(MlpSetSnapshot, Correctness)
+{
+	SnapshotCorrectnessTestImpl(false);
+	SnapshotCorrectnessTestImpl(true);
+}
+
+// The threads of a parallel bulk load allocate external bitmaps from the arena concurrently
+//
+TEST(MlpSetSnapshot, BulkLoad)
+{
+	const int n = 1000000;
+	std::mt19937_64 rng(11);
+	vector<uint64_t> keys;
+	rep(i, 0, n - 1) keys.push_back(GenSnapshotKey(rng, i));
+	set<uint64_t> S(keys.begin(), keys.end());
+
+	MlpSet ms;
+	ms.Init(n + 1000);
+	ms.EnableSnapshots();
+	MlpSet* empty = ms.Snapshot();
+	ReleaseAssert(ms.BulkLoad(keys.data(), n, 4 /*numThreads*/) == S.size());
+	MlpSet* full = ms.Snapshot();
+	ms.Insert(1);
+	set<uint64_t> S1 = S;
+	S1.insert(1);
+	CheckSnapshotSet(ms, S1, keys, 12, 200000);
+	CheckSnapshotSet(*empty, set<uint64_t>(), keys, 13, 100000);
+	CheckSnapshotSet(*full, S, keys, 14, 200000);
+	delete empty;
+	delete full;
+}
+
+uint64_t NO_INLINE SnapshotScan(MlpSet& ms)
+{
+	uint64_t count = 0;
+	bool found;
+	uint64_t key = ms.LowerBound(0, found);
+	while (found)
+	{
+		count++;
+		if (key == std::numeric_limits<uint64_t>::max()) break;
+		key = ms.LowerBound(key + 1, found);
+	}
+	return count;
+}
+
+// Snapshot creation latency (compared with fork, which also copies the page tables),
+// and the throughput of a writer inserting while a snapshot is held
+//
+void SnapshotBenchmarkImpl(int n, int numInserts)
+{
+	printf("%d keys, %d insertions\n", n, numInserts);
+	std::mt19937_64 rng(1);
+	vector<uint64_t> keys;
+	rep(i, 0, n + 2 * numInserts - 1) keys.push_back(rng());
+
+	MlpSet ms;
+	ms.Init(n + 2 * numInserts + 1000);
+	ms.BulkLoad(keys.data(), n, 1 /*numThreads*/);
+	ms.EnableSnapshots();
+	CowRegion* region = ms.GetCowRegion();
+	printf("Region: %.1lf MB, %llu-byte pages\n", double(ms.GetMemoryFootprint()) / 1048576, static_cast<unsigned long long>(region->GetPageSize()));
+
+	const int numRounds = 10;
+	double t;
+	{
+		AutoTimer timer(&t);
+		rep(i, 0, numRounds - 1)
+		{
+			MlpSet* snapshot = ms.Snapshot();
+			ReleaseAssert(snapshot != nullptr);
+			delete snapshot;
+		}
+	}
+	printf("Snapshot creation + release: %.1lf us\n", t / numRounds * 1e6);
+	{
+		AutoTimer timer(&t);
+		rep(i, 0, numRounds - 1)
+		{
+			pid_t pid = fork();
+			ReleaseAssert(pid != -1);
+			if (pid == 0)
+			{
+				_exit(0);
+			}
+			int status;
+			waitpid(pid, &status, 0);
+		}
+	}
+	printf("fork + exit for reference: %.1lf us\n", t / numRounds * 1e6);
+
+	{
+		AutoTimer timer(&t);
+		rep(i, n, n + numInserts - 1) ms.Insert(keys[i]);
+	}
+	printf("Insert, no snapshot: %.2lf Mops/s\n", double(numInserts) / t / 1e6);
+
+	MlpSet* snapshot;
+	{
+		AutoTimer timer(&t);
+		snapshot = ms.Snapshot();
+	}
+	printf("Snapshot creation: %.1lf us\n", t * 1e6);
+	uint64_t faultsBefore = region->GetNumWriteFaults();
+	uint64_t copiedBefore = region->GetNumCopiedPages();
+	{
+		AutoTimer timer(&t);
+		rep(i, n + numInserts, n + 2 * numInserts - 1) ms.Insert(keys[i]);
+	}
+	printf("Insert, snapshot held: %.2lf Mops/s, %llu write faults, %.1lf MB copied\n", double(numInserts) / t / 1e6,
+	       static_cast<unsigned long long>(region->GetNumWriteFaults() - faultsBefore),
+	       double(region->GetNumCopiedPages() - copiedBefore) * region->GetPageSize() / 1048576);
+	{
+		AutoTimer timer(&t);
+		ReleaseAssert(SnapshotScan(*snapshot) == uint64_t(n + numInserts));
+	}
+	printf("Full scan of the snapshot: %.2lf s\n", t);
+	delete snapshot;
+}
+
+TEST(MlpSetSnapshot, Benchmark_4M)
+{
+	SnapshotBenchmarkImpl(4000000, 1000000);
+}
+
+TEST(MlpSetSnapshot, Benchmark_80M)
+{
+	SnapshotBenchmarkImpl(80000000, 10000000);
+}
+
+}	// annoymous namespace
@@ -1,211 +1,31 @@
 #include "MlpSetUInt64.h"
+#include <thread>
+#include <atomic>
 
 namespace MlpSetUInt64
 {
 
-// Vectorized XXHash utility
-// The hash function is a slightly modified XXH32, to fix a known deficiency 
-// The 3 hash functions are XXHashFn1, XXHashFn2, XXHashFn3
-// XXHashArray computes 18 hashes from the prefixes of a key 
-// using vectorization (detail in function comment)
-//
-namespace XXH
-{
-
-static const uint32_t XXH_SEED1 = 1192827283U;
-static const uint32_t XXH_SEED2 = 534897851U;
-
-static const uint32_t PRIME32_1 = 2654435761U;
-static const uint32_t PRIME32_2 = 2246822519U;
-static const uint32_t PRIME32_3 = 3266489917U;
-static const uint32_t PRIME32_4 = 668265263U;
-static const uint32_t PRIME32_5 = 374761393U;
-
-#define XXH_rotl32(x,r) ((x << r) | (x >> (32 - r)))
-
-uint32_t XXH32_avalanche(uint32_t h32)
+void CuckooHashTableNode::Init(int ilen, int dlen, uint64_t dkey, uint32_t hash18bit, int firstChild)
 {
-    h32 ^= h32 >> 15;
-    h32 *= PRIME32_2;
-    h32 ^= h32 >> 13;
-    h32 *= PRIME32_3;
-    h32 ^= h32 >> 16;
-    return h32;
+	assert(!IsOccupied());
+	assert(1 <= ilen && ilen <= 8 && 1 <= dlen && dlen <= 8 && -1 <= firstChild && firstChild <= 255);
+	hash = 0x80000000U | ((ilen - 1) << 27) | ((dlen - 1) << 24) | hash18bit;
+	minKey = dkey;
+	childMap = firstChild;
 }
 
-uint32_t XXH32_CoreLogic(uint64_t key, uint32_t len, uint32_t seed, uint32_t multiplier)
+bool CuckooHashTableNode::TryInitConcurrent(int ilen, int dlen, uint64_t dkey, uint32_t hash18bit, int firstChild)
 {
-	key >>= (8-len)*8;
-	key <<= (8-len)*8;
-	uint32_t low = key;
-	uint32_t high = key >> 32;
-	uint32_t h32 = PRIME32_5 + seed + len;
-	h32 ^= high * multiplier; 
-	h32 = XXH_rotl32(h32, 17) * PRIME32_4;
-	if (len > 4)
+	assert(1 <= ilen && ilen <= 8 && 1 <= dlen && dlen <= 8 && -1 <= firstChild && firstChild <= 255);
+	uint32_t expected = 0;
+	uint32_t desired = 0x80000000U | ((ilen - 1) << 27) | ((dlen - 1) << 24) | hash18bit;
+	if (!__atomic_compare_exchange_n(&hash, &expected, desired, false /*weak*/, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
 	{
-		h32 ^= low * multiplier; 
-		h32 = XXH_rotl32(h32, 17) * PRIME32_4;
+		return false;
 	}
-	return XXH32_avalanche(h32);
-}
-
-uint32_t XXHashFn1(uint64_t key, uint32_t len)
-{
-	return XXH32_CoreLogic(key, len, XXH_SEED1, PRIME32_1);
-}
-
-uint32_t XXHashFn2(uint64_t key, uint32_t len)
-{
-	return XXH32_CoreLogic(key, len, XXH_SEED2, PRIME32_3);
-}
-
-uint32_t XXHashFn3(uint64_t key, uint32_t len)
-{
-	return XXH32_CoreLogic(key, len, 0 /*seed*/, PRIME32_3);
-}
-
-static const __m128i PRIME32_1_ARRAY = _mm_set_epi32(PRIME32_1, PRIME32_1, PRIME32_1, PRIME32_1);
-static const __m128i PRIME32_2_ARRAY = _mm_set_epi32(PRIME32_2, PRIME32_2, PRIME32_2, PRIME32_2);
-static const __m128i PRIME32_3_ARRAY = _mm_set_epi32(PRIME32_3, PRIME32_3, PRIME32_3, PRIME32_3);
-static const __m128i PRIME32_4_ARRAY = _mm_set_epi32(PRIME32_4, PRIME32_4, PRIME32_4, PRIME32_4);
-
-static const __m128i XXH_OUT1_INIT = _mm_set_epi32(PRIME32_5 + XXH_SEED1 + 8U,
-                                                   PRIME32_5 + XXH_SEED1 + 7U,
-                                                   PRIME32_5 + XXH_SEED1 + 6U,
-                                                   PRIME32_5 + XXH_SEED1 + 5U);
-static const __m128i XXH_OUT2_INIT = _mm_set_epi32(PRIME32_5 + XXH_SEED2 + 8U,
-                                                   PRIME32_5 + XXH_SEED2 + 7U,
-                                                   PRIME32_5 + XXH_SEED2 + 6U,
-                                                   PRIME32_5 + XXH_SEED2 + 5U);
-static const __m128i XXH_OUT3_INIT = _mm_set_epi32(PRIME32_5 + 8U,
-                                                   PRIME32_5 + 7U,
-                                                   PRIME32_5 + 6U,
-                                                   PRIME32_5 + 5U);
-static const __m128i XXH_OUT4_INIT = _mm_set_epi32(PRIME32_5 + XXH_SEED1 + 4U,
-                                                   PRIME32_5 + XXH_SEED1 + 3U,
-                                                   PRIME32_5 + XXH_SEED2 + 4U,
-                                                   PRIME32_5 + XXH_SEED2 + 3U);
-static const __m128i XXH_LOW_MASK = _mm_set_epi32(0xffffffffU, 
-                                                  0xffffff00U, 
-                                                  0xffff0000U, 
-                                                  0xff000000U);
-
-void XXHExecuteRotlAndMult(__m128i& data)
-{
-	__m128i tmp = _mm_srli_epi32(data, 15);
-	data = _mm_slli_epi32(data, 17);
-	data = _mm_or_si128(data, tmp);
-	data = _mm_mullo_epi32(data, PRIME32_4_ARRAY);
-}
-
-void XXHExecuteAvalanche(__m128i& data)
-{
-	__m128i tmp = _mm_srli_epi32(data, 15);
-	data = _mm_xor_si128(data, tmp);
-	data = _mm_mullo_epi32(data, PRIME32_2_ARRAY);
-	
-	tmp = _mm_srli_epi32(data, 13);
-	data = _mm_xor_si128(data, tmp);
-	data = _mm_mullo_epi32(data, PRIME32_3_ARRAY);
-	
-	tmp = _mm_srli_epi32(data, 16);
-	data = _mm_xor_si128(data, tmp);
-}
-
-// high to low:
-// out1: h1(8), h1(7), h1(6), h1(5)
-// out2: h2(8), h2(7), h2(6), h2(5)
-// out3: h3(8), h3(7), h3(6), h3(5)
-// out4: h1(4), h1(3), h2(4), h2(3)
-// out5: h3(4), h3(3)
-//
-void XXHashArray(uint64_t key, __m128i& out1, __m128i& out2, __m128i& out3, __m128i& out4, uint64_t& out5)
-{
-	uint32_t low = key;
-	uint32_t high = key >> 32;
-	
-	uint32_t x1 = high * PRIME32_1;
-	uint32_t x2 = high * PRIME32_3;
-	
-	out1 = _mm_set1_epi32(x1);
-	out1 = _mm_xor_si128(out1, XXH_OUT1_INIT);
-	XXHExecuteRotlAndMult(out1);
-	
-	out2 = _mm_set1_epi32(x2);
-	out2 = _mm_xor_si128(out2, XXH_OUT2_INIT);
-	XXHExecuteRotlAndMult(out2);
-	
-	out3 = _mm_set1_epi32(x2);
-	out3 = _mm_xor_si128(out3, XXH_OUT3_INIT);
-	XXHExecuteRotlAndMult(out3);
-	
-	uint32_t high3byte = high & 0xffffff00U;
-	uint32_t high3byteP1 = high3byte * PRIME32_1;
-	uint32_t high3byteP3 = high3byte * PRIME32_3;
-	
-	out4 = _mm_set_epi32(x1, high3byteP1, x2, high3byteP3);
-	out4 = _mm_xor_si128(out4, XXH_OUT4_INIT);
-	XXHExecuteRotlAndMult(out4);
-	
-	__m128i v1 = _mm_set1_epi32(low);
-	v1 = _mm_and_si128(v1, XXH_LOW_MASK);
-	__m128i v2 = _mm_mullo_epi32(v1, PRIME32_1_ARRAY);
-	__m128i v3 = _mm_mullo_epi32(v1, PRIME32_3_ARRAY);
-	
-	out1 = _mm_xor_si128(out1, v2);
-	XXHExecuteRotlAndMult(out1);
-	
-	out2 = _mm_xor_si128(out2, v3);
-	XXHExecuteRotlAndMult(out2);
-	
-	out3 = _mm_xor_si128(out3, v3);
-	XXHExecuteRotlAndMult(out3);
-	
-	XXHExecuteAvalanche(out1);
-	XXHExecuteAvalanche(out2);
-	XXHExecuteAvalanche(out3);
-	XXHExecuteAvalanche(out4);
-	
-	uint32_t h34 = (PRIME32_5 + 4U) ^ x2;
-	h34 = XXH_rotl32(h34, 17) * PRIME32_4;
-	h34 = XXH32_avalanche(h34);
-	
-	uint32_t h33 = (PRIME32_5 + 3U) ^ high3byteP3;
-	h33 = XXH_rotl32(h33, 17) * PRIME32_4;
-	h33 = XXH32_avalanche(h33);
-	
-	assert(_mm_extract_epi32(out1, 3) == XXHashFn1(key, 8));
-	assert(_mm_extract_epi32(out1, 2) == XXHashFn1(key, 7));
-	assert(_mm_extract_epi32(out1, 1) == XXHashFn1(key, 6));
-	assert(_mm_extract_epi32(out1, 0) == XXHashFn1(key, 5));
-	assert(_mm_extract_epi32(out2, 3) == XXHashFn2(key, 8));
-	assert(_mm_extract_epi32(out2, 2) == XXHashFn2(key, 7));
-	assert(_mm_extract_epi32(out2, 1) == XXHashFn2(key, 6));
-	assert(_mm_extract_epi32(out2, 0) == XXHashFn2(key, 5));
-	assert(_mm_extract_epi32(out3, 3) == XXHashFn3(key, 8));
-	assert(_mm_extract_epi32(out3, 2) == XXHashFn3(key, 7));
-	assert(_mm_extract_epi32(out3, 1) == XXHashFn3(key, 6));
-	assert(_mm_extract_epi32(out3, 0) == XXHashFn3(key, 5));
-	assert(_mm_extract_epi32(out4, 3) == XXHashFn1(key, 4));
-	assert(_mm_extract_epi32(out4, 2) == XXHashFn1(key, 3));
-	assert(_mm_extract_epi32(out4, 1) == XXHashFn2(key, 4));
-	assert(_mm_extract_epi32(out4, 0) == XXHashFn2(key, 3));
-	assert(h34 == XXHashFn3(key, 4));
-	assert(h33 == XXHashFn3(key, 3));
-	
-	out5 = (uint64_t(h34) << 32) | h33;
-}
-
-}	// namespace XXH
-	
-void CuckooHashTableNode::Init(int ilen, int dlen, uint64_t dkey, uint32_t hash18bit, int firstChild)
-{
-	assert(!IsOccupied());
-	assert(1 <= ilen && ilen <= 8 && 1 <= dlen && dlen <= 8 && -1 <= firstChild && firstChild <= 255);
-	hash = 0x80000000U | ((ilen - 1) << 27) | ((dlen - 1) << 24) | hash18bit;
 	minKey = dkey;
 	childMap = firstChild;
+	return true;
 }
 	
 int CuckooHashTableNode::FindNeighboringEmptySlot()
@@ -241,14 +61,44 @@ int CuckooHashTableNode::FindNeighboringEmptySlot()
 	}
 	return 0;
 }
+
+int CuckooHashTableNode::ClaimNeighboringEmptySlot()
+{
+	// same preference order as FindNeighboringEmptySlot
+	//
+	int candidates[8];
+	int k = 0;
+	int lowbits = reinterpret_cast<uintptr_t>(this) & 63;
+	if (lowbits < 32)
+	{
+		candidates[k++] = 1;
+		candidates[k++] = -1;
+	}
+	rep(i, 1, 3)
+	{
+		candidates[k++] = i;
+		candidates[k++] = -i;
+	}
+	rep(i, 0, k - 1)
+	{
+		uint32_t expected = 0;
+		if (!this[candidates[i]].IsOccupied() && 
+		    __atomic_compare_exchange_n(&(this[candidates[i]].hash), &expected, 0xc0000000U, false /*weak*/, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		{
+			return candidates[i];
+		}
+	}
+	return 0;
+}
 	
 void CuckooHashTableNode::BitMapSet(int child)
 {
 	assert(IsNode() && !IsLeaf() && !IsUsingInternalChildMap());
 	assert(0 <= child && child <= 255);
+	assert(!IsInlineBitMap() || child < 64);
 	if (unlikely(IsExternalPointerBitMap()))
 	{
-		uint64_t* ptr = reinterpret_cast<uint64_t*>(childMap);
+		uint64_t* ptr = GetExternalBitMap();
 		ptr[child / 64] |= uint64_t(1) << (child % 64);
 	}
 	else
@@ -275,23 +125,34 @@ void CuckooHashTableNode::BitMapSet(int child)
 	
 uint64_t* CuckooHashTableNode::AllocateExternalBitMap()
 {
-	uint64_t* ptr = new uint64_t[4];
+	CowRegion* region = CowRegion::Find(this);
+	uint64_t* ptr = (region != nullptr) ? region->AllocateBitMap() : new uint64_t[4];
 	memset(ptr, 0, 32);
 	return ptr;
 }
 	
-void CuckooHashTableNode::ExtendToBitMap()
+void CuckooHashTableNode::ExtendToBitMap(bool inlineBitMap, bool concurrent)
 {
 	assert(IsNode() && !IsLeaf() && IsUsingInternalChildMap() && GetChildNum() == 8);
 	uint64_t children = childMap;
-	int offset = FindNeighboringEmptySlot() + 4;
+	int offset = inlineBitMap ? 4 : (concurrent ? ClaimNeighboringEmptySlot() : FindNeighboringEmptySlot()) + 4;
 	assert(1 <= offset && offset <= 7);
 	hash &= 0xff03ffffU;
 	hash |= (offset << 21);
-	if (offset == 4)
+	if (inlineBitMap)
+	{
+		hash |= (1 << 20);
+		childMap = 0;
+	}
+	else if (offset == 4)
+	{
+		SetExternalBitMap(AllocateExternalBitMap());
+	}
+	else if (concurrent)
 	{
-		uint64_t* ptr = AllocateExternalBitMap();
-		childMap = reinterpret_cast<uintptr_t>(ptr);
+		// the claimed slot was empty, so it is zero except for the hash set by the claim
+		//
+		childMap = 0;
 	}
 	else
 	{
@@ -309,173 +170,7 @@ void CuckooHashTableNode::ExtendToBitMap()
 	}
 }
 
-static int Bitmap256LowerBound(uint64_t* ptr, uint32_t child)
-{
-	assert(0 <= child && child <= 255);
-	int idx = child / 64;
-	uint64_t x = ptr[idx] >> (child % 64);
-	if (x) 
-	{ 
-		return __builtin_ctzll(x) + child; 
-	}
-	idx++;
-	while (idx < 4)
-	{
-		if (ptr[idx] != 0)
-		{
-			return __builtin_ctzll(ptr[idx]) + idx * 64;
-		}
-		idx++;
-	}
-	return -1;
-}
-
-int CuckooHashTableNode::LowerBoundChild(uint32_t child)
-{
-	assert(IsNode() && !IsLeaf());
-	assert(0 <= child && child <= 255);
-	if (IsUsingInternalChildMap())
-	{
-		if (child == 0) { return childMap & 255; }
-		int k = GetChildNum();
-		__m64 z = _mm_cvtsi64_m64(childMap);
-		__m64 cmpTarget = _mm_set1_pi8(child - 1);
-		__m64 res = _mm_max_pu8(cmpTarget, z);
-		res = _mm_cmpeq_pi8(cmpTarget, res);
-		int msk = _mm_movemask_pi8(res);
-		msk &= (1<<k)-1;
-		msk++;
-		int pos = __builtin_ffs(msk);
-		assert(1 <= pos && pos <= k + 1);
-		if (pos == k+1) 
-		{ 
-			return -1; 
-		}
-		return (childMap >> ((pos-1)*8)) & 255;
-	}
-	else if (unlikely(IsExternalPointerBitMap()))
-	{
-		uint64_t* ptr = reinterpret_cast<uint64_t*>(childMap);
-		return Bitmap256LowerBound(ptr, child);
-	}
-	else
-	{
-		int offset = (hash >> 21) & 7;
-		if (child < 64)
-		{
-			uint64_t x = childMap >> child;
-			if (x)
-			{	
-				return __builtin_ctzll(x) + child; 
-			}
-			uint64_t* ptr = reinterpret_cast<uint64_t*>(&(this[offset-4]));
-			x = ptr[0] & 0xffffffff3fffffffULL;
-			x |= uint64_t((hash >> 18) & 3) << 30;
-			if (x)
-			{
-				return __builtin_ctzll(x) + 64;
-			}
-			rep(k, 1, 2)
-			{
-				if (ptr[k])
-				{
-					return __builtin_ctzll(ptr[k]) + (k+1) * 64;
-				}
-			}
-			return -1;
-		}
-		else if (child < 128)
-		{
-			uint64_t* ptr = reinterpret_cast<uint64_t*>(&(this[offset-4]));
-			uint64_t x = ptr[0] & 0xffffffff3fffffffULL;
-			x |= uint64_t((hash >> 18) & 3) << 30;
-			x >>= (child - 64);
-			if (x)
-			{
-				return __builtin_ctzll(x) + child;
-			}
-			rep(k, 1, 2)
-			{
-				if (ptr[k])
-				{
-					return __builtin_ctzll(ptr[k]) + (k+1) * 64;
-				}
-			}
-			return -1;
-		}
-		else
-		{
-			uint64_t* ptr = reinterpret_cast<uint64_t*>(&(this[offset-4]));
-			int idx = child / 64 - 1;
-			uint64_t x = ptr[idx] >> (child % 64);
-			if (x)
-			{
-				return __builtin_ctzll(x) + child;
-			}
-			if (idx < 2)
-			{
-				if (ptr[2])
-				{
-					return __builtin_ctzll(ptr[2]) + 192;
-				}
-			}
-			return -1;
-		}
-	}	
-}
-	
-bool CuckooHashTableNode::ExistChild(int child)
-{
-	assert(IsNode() && !IsLeaf());
-	assert(0 <= child && child <= 255);
-	if (IsUsingInternalChildMap())
-	{
-		int k = GetChildNum();
-		__m64 z = _mm_cvtsi64_m64(childMap);
-		__m64 cmpTarget = _mm_set1_pi8(child);
-		__m64 res = _mm_cmpeq_pi8(cmpTarget, z);
-		int msk = _mm_movemask_pi8(res);
-		msk &= (1<<k)-1;
-		bool result = (msk != 0);
-		
-#ifndef NDEBUG
-		bool bruteForceResult = false;
-		uint64_t c = childMap;
-		rep(i,0,k-1)
-		{
-			int x = c & 255;
-			c >>= 8;
-			if (x == child) { bruteForceResult = true; break; }
-		}
-		assert(result == bruteForceResult);
-#endif
-		return result;
-	}
-	else if (unlikely(IsExternalPointerBitMap()))
-	{
-		uint64_t* ptr = reinterpret_cast<uint64_t*>(childMap);
-		return (ptr[child / 64] & (uint64_t(1) << (child % 64))) != 0;
-	}
-	else
-	{
-		if (child < 64)
-		{
-			return (childMap & (uint64_t(1) << child)) != 0;
-		}
-		else if (unlikely(child == 94 || child == 95))
-		{
-			return (hash & (1 << (child - 76))) != 0;
-		}
-		else
-		{
-			int offset = ((hash >> 21) & 7) - 4;
-			uint64_t* ptr = reinterpret_cast<uint64_t*>(&(this[offset]));
-			return (ptr[child / 64 - 1] & (uint64_t(1) << (child % 64))) != 0;
-		}
-	}
-}
-
-void CuckooHashTableNode::AddChild(int child)
+void CuckooHashTableNode::AddChild(int child, bool smallAlphabet)
 {
 	assert(IsNode() && !IsLeaf());
 	assert(0 <= child && child <= 255);
@@ -511,7 +206,7 @@ void CuckooHashTableNode::AddChild(int child)
 #endif
 			return;
 		}
-		ExtendToBitMap();
+		ExtendToBitMap(smallAlphabet);
 	}
 	BitMapSet(child);
 }
@@ -541,7 +236,7 @@ vector<int> CuckooHashTableNode::GetAllChildren()
 	}
 	else if (unlikely(IsExternalPointerBitMap()))
 	{
-		uint64_t* ptr = reinterpret_cast<uint64_t*>(childMap);
+		uint64_t* ptr = GetExternalBitMap();
 		rep(i,0,255)
 		{
 			if (ptr[i/64] & (uint64_t(1) << (i%64)))
@@ -550,6 +245,16 @@ vector<int> CuckooHashTableNode::GetAllChildren()
 			}
 		}
 	}
+	else if (IsInlineBitMap())
+	{
+		rep(i,0,63)
+		{
+			if (childMap & (uint64_t(1) << i))
+			{
+				ret.push_back(i);
+			}
+		}
+	}
 	else
 	{
 		rep(i,0,63)
@@ -588,7 +293,7 @@ vector<int> CuckooHashTableNode::GetAllChildren()
 	
 uint64_t* CuckooHashTableNode::CopyToExternalBitMap()
 {
-	assert(IsNode() && !IsLeaf() && !IsUsingInternalChildMap() && !IsExternalPointerBitMap());
+	assert(IsNode() && !IsLeaf() && !IsUsingInternalChildMap() && !IsExternalPointerBitMap() && !IsInlineBitMap());
 	uint64_t* ptr = AllocateExternalBitMap();
 	int offset = (hash >> 21) & 7;
 	ptr[0] = childMap;
@@ -601,8 +306,12 @@ uint64_t* CuckooHashTableNode::CopyToExternalBitMap()
 void CuckooHashTableNode::MoveNode(CuckooHashTableNode* target)
 {
 	*target = *this;
-	if (IsUsingInternalChildMap() || IsExternalPointerBitMap())
+	if (IsUsingInternalChildMap() || IsExternalPointerBitMap() || IsInlineBitMap())
 	{
+		if (!IsUsingInternalChildMap() && IsExternalPointerBitMap())
+		{
+			target->SetExternalBitMap(GetExternalBitMap());
+		}
 		memset(this, 0, sizeof(CuckooHashTableNode));
 		return;
 	}
@@ -616,14 +325,13 @@ void CuckooHashTableNode::MoveNode(CuckooHashTableNode* target)
 	}
 	else
 	{
-		uint64_t* ptr = CopyToExternalBitMap();
-		target->childMap = reinterpret_cast<uint64_t>(ptr);
+		target->SetExternalBitMap(CopyToExternalBitMap());
 	}
 	memset(this, 0, sizeof(CuckooHashTableNode));
 	memset(&(this[offset-4]), 0, sizeof(CuckooHashTableNode));
 #ifndef NDEBUG
 	assert(target->IsNode());
-	if (!target->IsUsingInternalChildMap() && !target->IsExternalPointerBitMap())
+	if (!target->IsUsingInternalChildMap() && !target->IsExternalPointerBitMap() && !target->IsInlineBitMap())
 	{
 		int o = (target->hash >> 21) & 7;
 		assert(target[o-4].IsOccupied() && !target[o-4].IsNode());
@@ -633,7 +341,7 @@ void CuckooHashTableNode::MoveNode(CuckooHashTableNode* target)
 	
 void CuckooHashTableNode::RelocateBitMap()
 {
-	assert(IsNode() && !IsLeaf() && !IsUsingInternalChildMap() && !IsExternalPointerBitMap());
+	assert(IsNode() && !IsLeaf() && !IsUsingInternalChildMap() && !IsExternalPointerBitMap() && !IsInlineBitMap());
 	uint64_t children = childMap;
 	int offset = FindNeighboringEmptySlot() + 4;
 	assert(1 <= offset && offset <= 7);
@@ -641,8 +349,7 @@ void CuckooHashTableNode::RelocateBitMap()
 	assert(offset != oldOffset);
 	if (offset == 4)
 	{
-		uint64_t* ptr = CopyToExternalBitMap();
-		childMap = reinterpret_cast<uint64_t>(ptr);
+		SetExternalBitMap(CopyToExternalBitMap());
 	}
 	else
 	{
@@ -654,13 +361,6 @@ void CuckooHashTableNode::RelocateBitMap()
 	assert(offset == 4 || (this[offset-4].IsOccupied() && !this[offset-4].IsNode()));
 }	
 
-static const __m128i HASH18_MASK = _mm_set_epi32(0x3ffffU, 0x3ffffU, 0x3ffffU, 0x3ffffU);
-static const __m128i HASH_EXPECT_MASK1 = _mm_set_epi32(0x80000000U | (7U << 27), 
-                                                       0x80000000U | (6U << 27), 
-                                                       0x80000000U | (5U << 27), 
-                                                       0x80000000U | (4U << 27));
-static const __m128i HASH_EXPECT_MASK2 = _mm_set_epi32(0xf803ffffU, 0xf803ffffU, 0xf803ffffU, 0xf803ffffU);
-
 static inline uint64_t RoundUpToNearestMultipleOf(uint64_t x, uint64_t y)
 {
 	if (x % y == 0) return x;
@@ -680,61 +380,225 @@ static inline void MultiplyBy3(const __m128i& input, __m128i& output)
 	output = _mm_add_epi32(input, output);
 }
 
-#ifdef ENABLE_STATS
-CuckooHashTable::Stats::Stats()
+CuckooHashTableBase::Stats::Stats()
 	: m_slowpathCount(0)
 	, m_movedNodesCount(0)
 	, m_relocatedBitmapsCount(0)
+	, m_stashedNodesCount(0)
+	, m_stashHighWatermark(0)
+	, m_stashFullFallbackCount(0)
 {
 	memset(m_lcpResultHistogram, 0, sizeof m_lcpResultHistogram); 
 }
 
-void CuckooHashTable::Stats::ClearStats()
+void CuckooHashTableBase::Stats::ClearStats()
 {
 	m_slowpathCount = 0;
 	m_movedNodesCount = 0;
 	m_relocatedBitmapsCount = 0;
+	m_stashedNodesCount = 0;
+	m_stashHighWatermark = 0;
+	m_stashFullFallbackCount = 0;
 	memset(m_lcpResultHistogram, 0, sizeof m_lcpResultHistogram); 
 }
 
-void CuckooHashTable::Stats::ReportStats()
+void CuckooHashTableBase::Stats::ReportStats()
 {
 	printf("Cuckoo HashTable stats:\n");
 	printf("\tQueryLCP slow-path count = %u\n", m_slowpathCount);
 	printf("\tInsertion moved nodes count = %u\n", m_movedNodesCount);
 	printf("\tInsertion relocated bitmaps count = %u\n", m_relocatedBitmapsCount);
+	printf("\tInsertion stashed nodes count = %u (high watermark = %u, stash full fallback = %u)\n", 
+	       m_stashedNodesCount, m_stashHighWatermark, m_stashFullFallbackCount);
 	printf("\tQueryLCP result histogram (result node IndexLen, not actual LCP):\n");
 	rep(i, 2, 8)
 	{
 		printf("\t\tLCP = %d: %u\n", i, m_lcpResultHistogram[i]);
 	}
 }
-#endif
 
-CuckooHashTable::CuckooHashTable() 
+template<class Config>
+BasicCuckooHashTable<Config>::BasicCuckooHashTable() 
 	: ht(nullptr)
 	, htMask(0)
-#ifdef ENABLE_STATS
+	, m_lowestIndexLen(3)
+	, m_probeStrategy(PROBE_ALL_LENGTHS)
+	, m_upperLevelMirror(nullptr)
 	, stats()
-#endif
+	, m_stashBegin(0)
+	, m_stashCount(0)
+	, m_stashPending(nullptr)
 #ifndef NDEBUG
 	, m_hasCalledInit(false)
 #endif
 { }
+
+template<class Config>
+BasicCuckooHashTable<Config>::~BasicCuckooHashTable()
+{
+	if (m_stashPending != nullptr)
+	{
+		delete [] m_stashPending;
+		m_stashPending = nullptr;
+	}
+}
 	
-void CuckooHashTable::Init(CuckooHashTableNode* _ht, uint64_t _mask)
+template<class Config>
+void BasicCuckooHashTable<Config>::Init(CuckooHashTableNode* _ht, uint64_t _mask, int lowestIndexLen)
 {
 	assert(!m_hasCalledInit);
 #ifndef NDEBUG
 	m_hasCalledInit = true;
 #endif
+	assert(lowestIndexLen == 3 || lowestIndexLen == 4);
+	assert(Config::x_numFlatLevels == 0 || lowestIndexLen == Config::x_numFlatLevels);
 	ht = _ht;
 	htMask = _mask;
+	m_lowestIndexLen = lowestIndexLen;
 	assert(reinterpret_cast<uintptr_t>(_ht) % 128 == 0);
 	assert(RoundUpToNearestPowerOf2(_mask + 1) == _mask + 1);
+	// the gather kernels index the table with 32-bit 3*position (see ProbeTagsAVX2), 
+	// this covers the stash at the end of the table as well
+	//
+	assert((uint64_t(_mask) + 1 + 6 + x_stashRegionSlots) * 3 <= 0xffffffffULL);
+}
+
+bool CuckooHashTableBase::IsProbeKernelSupported(ProbeKernel kernel)
+{
+	__builtin_cpu_init();
+	switch (kernel)
+	{
+	case PROBE_KERNEL_SCALAR:
+		return true;
+	case PROBE_KERNEL_AVX2:
+		return __builtin_cpu_supports("avx2");
+	case PROBE_KERNEL_AVX512:
+		return __builtin_cpu_supports("avx512f");
+	}
+	return false;
+}
+
+// the vector kernels are slower than the scalar loop on all of our workloads (see ProbeKernel_16M), so they are opt-in
+//
+CuckooHashTableBase::ProbeKernel g_probeKernel = CuckooHashTableBase::PROBE_KERNEL_SCALAR;
+
+void CuckooHashTableBase::SetProbeKernel(ProbeKernel kernel)
+{
+	ReleaseAssert(IsProbeKernelSupported(kernel));
+	g_probeKernel = kernel;
+}
+
+CuckooHashTableBase::ProbeKernel CuckooHashTableBase::GetProbeKernel()
+{
+	return g_probeKernel;
+}
+
+template<class Config>
+void BasicCuckooHashTable<Config>::InitStash(uint32_t stashRegionBegin)
+{
+	assert(m_hasCalledInit);
+	assert(m_stashBegin == 0 && m_stashCount == 0);
+	// the first 3 slots are guard zone for the neighboring bitmaps of the first stash slots
+	// they must not overlap with the neighboring bitmap zone of the last hash table slots
+	//
+	assert(stashRegionBegin >= htMask + 1 + 3);
+	m_stashBegin = stashRegionBegin + 3;
+	m_stashPending = new uint32_t[x_stashSize];
+	ReleaseAssert(m_stashPending != nullptr);
+	rep(i, -3, x_stashSize + 2)
+	{
+		assert(!ht[m_stashBegin + i].IsOccupied());
+	}
+}
+
+template<class Config>
+uint32_t BasicCuckooHashTable<Config>::AllocateStashSlot()
+{
+	assert(m_stashBegin != 0);
+	if (m_stashCount == x_stashSize)
+	{
+		return -1;
+	}
+	// a stash slot may be occupied by a neighboring bitmap of another stashed node,
+	// but since there are x_stashSize slots in total, a free slot must exist
+	//
+	rep(i, 0, x_stashSize - 1)
+	{
+		if (!ht[m_stashBegin + i].IsOccupied())
+		{
+			m_stashPending[m_stashCount] = m_stashBegin + i;
+			m_stashCount++;
+			if (Config::x_enableStats)
+			{
+				stats.m_stashedNodesCount++;
+				stats.m_stashHighWatermark = max(stats.m_stashHighWatermark, uint32_t(m_stashCount));
+			}
+			return m_stashBegin + i;
+		}
+	}
+	assert(false);
+	return -1;
 }
 
-uint32_t CuckooHashTable::ReservePositionForInsert(int ilen, uint64_t dkey, uint32_t hash18bit, bool& exist, bool& failed)
+template<class Config>
+void BasicCuckooHashTable<Config>::ExecutePendingDisplacements(int maxSteps)
+{
+	while (maxSteps > 0 && m_stashCount > 0)
+	{
+		maxSteps--;
+		uint32_t pos = m_stashPending[m_stashCount - 1];
+		assert(ht[pos].IsNode());
+		
+		int ilen = ht[pos].GetIndexKeyLen();
+		uint64_t ikey = ht[pos].GetIndexKey();
+		uint32_t h1, h2;
+		h1 = HashFamily::HashFn1(ikey, ilen) & htMask;
+		h2 = HashFamily::HashFn2(ikey, ilen) & htMask;
+		
+		if (!ht[h1].IsOccupied() || !ht[h2].IsOccupied())
+		{
+			uint32_t target = ht[h1].IsOccupied() ? h2 : h1;
+			m_stashCount--;
+			if (Config::x_enableStats)
+			{
+				stats.m_movedNodesCount++;
+			}
+			ht[pos].MoveNode(&ht[target]);
+			OnNodeMoved(target);
+			continue;
+		}
+		
+		uint32_t victimPosition = rand()%2 ? h1 : h2;
+		if (unlikely(!ht[victimPosition].IsNode()))
+		{
+			// the victim is a bitmap, relocate it so that the slot frees up
+			// the stashed node will be moved into the slot in the next step
+			//
+			RelocateBitMapInSlot(victimPosition);
+			continue;
+		}
+		
+		// Swap the victim node with the stashed node: 
+		// the victim goes to the stash, and becomes the next node to move
+		//
+		m_stashCount--;
+		uint32_t stashPos = AllocateStashSlot();
+		assert(stashPos != (uint32_t)-1);
+		if (Config::x_enableStats)
+		{
+			stats.m_movedNodesCount += 2;
+		}
+		ht[victimPosition].MoveNode(&ht[stashPos]);
+		ht[pos].MoveNode(&ht[victimPosition]);
+		// fix up minvOffset only after both moves, so that all ancestors can be found by Lookup
+		//
+		OnNodeMoved(stashPos);
+		OnNodeMoved(victimPosition);
+	}
+}
+
+template<class Config>
+uint32_t BasicCuckooHashTable<Config>::ReservePositionForInsert(int ilen, uint64_t dkey, uint32_t hash18bit, bool& exist, bool& failed)
 {
 	assert(m_hasCalledInit);
 	
@@ -746,8 +610,8 @@ uint32_t CuckooHashTable::ReservePositionForInsert(int ilen, uint64_t dkey, uint
 	uint64_t shiftedKey = dkey >> shiftLen;
 	
 	uint32_t h1, h2;
-	h1 = XXH::XXHashFn1(dkey, ilen) & htMask;
-	h2 = XXH::XXHashFn2(dkey, ilen) & htMask;
+	h1 = HashFamily::HashFn1(dkey, ilen) & htMask;
+	h2 = HashFamily::HashFn2(dkey, ilen) & htMask;
 	if (ht[h1].IsEqual(expectedHash, shiftLen, shiftedKey))
 	{
 		exist = true;
@@ -758,6 +622,15 @@ uint32_t CuckooHashTable::ReservePositionForInsert(int ilen, uint64_t dkey, uint
 		exist = true;
 		return h2;
 	}
+	if (unlikely(m_stashCount > 0))
+	{
+		uint32_t pos = LookupInStash(ilen, dkey);
+		if (pos != (uint32_t)-1)
+		{
+			exist = true;
+			return pos;
+		}
+	}
 	if (!ht[h1].IsOccupied())
 	{
 		return h1;
@@ -766,21 +639,45 @@ uint32_t CuckooHashTable::ReservePositionForInsert(int ilen, uint64_t dkey, uint
 	{
 		return h2;
 	}
+	if (m_stashBegin != 0)
+	{
+		// de-amortized insertion mode, park the node in stash
+		//
+		uint32_t pos = AllocateStashSlot();
+		if (likely(pos != (uint32_t)-1))
+		{
+			return pos;
+		}
+		if (Config::x_enableStats)
+		{
+			stats.m_stashFullFallbackCount++;
+		}
+	}
 	uint32_t victimPosition = rand()%2 ? h1 : h2;
 	HashTableCuckooDisplacement(victimPosition, 1, failed);
 	if (failed)
 	{
-		return -1;
+		// The displacement chain ran into a cycle (no node has been moved in this case), 
+		// try the chain starting from the other position, which succeeds unless both sides contain a cycle
+		//
+		failed = false;
+		victimPosition = (victimPosition == h1) ? h2 : h1;
+		HashTableCuckooDisplacement(victimPosition, 1, failed);
+		if (failed)
+		{
+			return -1;
+		}
 	}
 	assert(!ht[victimPosition].IsOccupied());
 	return victimPosition;
 }
 
-uint32_t CuckooHashTable::Insert(int ilen, int dlen, uint64_t dkey, int firstChild, bool& exist, bool& failed)
+template<class Config>
+uint32_t BasicCuckooHashTable<Config>::Insert(int ilen, int dlen, uint64_t dkey, int firstChild, bool& exist, bool& failed)
 {
 	assert(m_hasCalledInit);
 	
-	uint32_t hash18bit = XXH::XXHashFn3(dkey, ilen);
+	uint32_t hash18bit = HashFamily::HashFn3(dkey, ilen);
 	hash18bit = hash18bit & ((1<<18) - 1);
 	
 	uint32_t pos = ReservePositionForInsert(ilen, dkey, hash18bit, exist, failed);
@@ -791,365 +688,1460 @@ uint32_t CuckooHashTable::Insert(int ilen, int dlen, uint64_t dkey, int firstChi
 	return pos;
 }
 
-uint32_t CuckooHashTable::Lookup(int ilen, uint64_t ikey, bool& found)
+// Vectorized tag compare kernels of QueryLCP
+// For each len in [lowestLen, 7], compare the tag (hash & 0xf803ffff) of the nodes at allPositions1[len] and allPositions2[len]
+// against expectedHash[len], and find the largest len with a match (preferring allPositions1).
+// Returns that len (lowestLen - 1 if none), with the same side effects as the scalar loop in QueryLCP: 
+// allPositions1[len] is set to the matching position, and allPositions1[i] is set to 0 for all i > len.
+// Lanes below lowestLen are masked out, since allPositions2 and expectedHash are not populated there.
+//
+// The gather index is the 32-bit 3*position with scale 8 (one node is 24 bytes). 
+// The index is sign-extended by the hardware, so we flip its sign bit and move the base pointer 2^31 * 8 bytes forward,
+// which lets the kernels address tables up to 2^32 / 3 slots.
+//
+static const uint64_t x_gatherBaseBias = uint64_t(1) << 34;
+
+__attribute__((target("avx2")))
+int ProbeTagsAVX2(CuckooHashTableNode* ht, 
+                  uint32_t* allPositions1, 
+                  uint32_t* allPositions2, 
+                  uint32_t* expectedHash, 
+                  int lowestLen)
 {
-	assert(m_hasCalledInit);
+	const int* base = reinterpret_cast<const int*>(reinterpret_cast<uintptr_t>(ht) + x_gatherBaseBias);
+	__m256i laneIndex = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	__m256i laneMask = _mm256_cmpgt_epi32(laneIndex, _mm256_set1_epi32(lowestLen - 1));
+	__m256i signBit = _mm256_set1_epi32(0x80000000U);
+	__m256i tagMask = _mm256_set1_epi32(0xf803ffffU);
 	
-	found = false;
-	uint32_t hash18bit = XXH::XXHashFn3(ikey, ilen);
-	hash18bit = hash18bit & ((1<<18) - 1);
-	uint32_t expectedHash = hash18bit | ((ilen-1) << 27) | 0x80000000U;
-	int shiftLen = 64 - 8 * ilen;
-	uint64_t shiftedKey = ikey >> shiftLen;
+	__m256i pos1 = _mm256_loadu_si256(reinterpret_cast<__m256i*>(allPositions1));
+	__m256i pos2 = _mm256_loadu_si256(reinterpret_cast<__m256i*>(allPositions2));
+	__m256i idx1 = _mm256_xor_si256(_mm256_add_epi32(pos1, _mm256_add_epi32(pos1, pos1)), signBit);
+	__m256i idx2 = _mm256_xor_si256(_mm256_add_epi32(pos2, _mm256_add_epi32(pos2, pos2)), signBit);
+	__m256i tag1 = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), base, idx1, laneMask, 8);
+	__m256i tag2 = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), base, idx2, laneMask, 8);
+	__m256i expected = _mm256_loadu_si256(reinterpret_cast<__m256i*>(expectedHash));
+	__m256i eq1 = _mm256_and_si256(_mm256_cmpeq_epi32(_mm256_and_si256(tag1, tagMask), expected), laneMask);
+	__m256i eq2 = _mm256_and_si256(_mm256_cmpeq_epi32(_mm256_and_si256(tag2, tagMask), expected), laneMask);
+	uint32_t match1 = _mm256_movemask_ps(_mm256_castsi256_ps(eq1));
+	uint32_t match2 = _mm256_movemask_ps(_mm256_castsi256_ps(eq2));
+	uint32_t match = match1 | match2;
 	
-	uint32_t h1, h2;
-	h1 = XXH::XXHashFn1(ikey, ilen) & htMask;
-	h2 = XXH::XXHashFn2(ikey, ilen) & htMask;
-	MEM_PREFETCH(ht[h1]);
-	MEM_PREFETCH(ht[h2]);
-	if (ht[h1].IsEqual(expectedHash, shiftLen, shiftedKey))
-	{
-		found = true;
-		return h1;
-	}
-	if (ht[h2].IsEqual(expectedHash, shiftLen, shiftedKey))
-	{
-		found = true;
-		return h2;
-	}
-	return -1;
+	int len = (match == 0) ? (lowestLen - 1) : (31 - __builtin_clz(match));
+	// use allPositions2 at len if only it matches, and clear all lanes above len
+	//
+	__m256i useSecond = _mm256_and_si256(_mm256_andnot_si256(eq1, eq2), _mm256_cmpeq_epi32(laneIndex, _mm256_set1_epi32(len)));
+	__m256i result = _mm256_blendv_epi8(pos1, pos2, useSecond);
+	result = _mm256_andnot_si256(_mm256_cmpgt_epi32(laneIndex, _mm256_set1_epi32(len)), result);
+	// keep the lanes below lowestLen untouched
+	//
+	result = _mm256_blendv_epi8(pos1, result, laneMask);
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(allPositions1), result);
+	return len;
 }
 
-CuckooHashTable::LookupMustExistPromise CuckooHashTable::GetLookupMustExistPromise(int ilen, uint64_t ikey)
+__attribute__((target("avx512f")))
+int ProbeTagsAVX512(CuckooHashTableNode* ht, 
+                    uint32_t* allPositions1, 
+                    uint32_t* allPositions2, 
+                    uint32_t* expectedHash, 
+                    int lowestLen)
 {
-	assert(m_hasCalledInit);
-	
-	uint32_t hash18bit = XXH::XXHashFn3(ikey, ilen);
-	hash18bit = hash18bit & ((1<<18) - 1);
-	uint32_t expectedHash = hash18bit | ((ilen-1) << 27) | 0x80000000U;
-	int shiftLen = 64 - 8 * ilen;
-	uint64_t shiftedKey = ikey >> shiftLen;
-	
-	uint32_t h1, h2;
-	h1 = XXH::XXHashFn1(ikey, ilen) & htMask;
-	h2 = XXH::XXHashFn2(ikey, ilen) & htMask;
+	const int* base = reinterpret_cast<const int*>(reinterpret_cast<uintptr_t>(ht) + x_gatherBaseBias);
+	// lanes 0-7 are allPositions1, lanes 8-15 are allPositions2
+	//
+	__mmask16 laneMask = (0xff >> lowestLen << lowestLen) * 0x101;
+	__m256i pos1 = _mm256_loadu_si256(reinterpret_cast<__m256i*>(allPositions1));
+	__m256i pos2 = _mm256_loadu_si256(reinterpret_cast<__m256i*>(allPositions2));
+	__m512i pos = _mm512_inserti64x4(_mm512_castsi256_si512(pos1), pos2, 1);
+	__m512i idx = _mm512_xor_si512(_mm512_add_epi32(pos, _mm512_add_epi32(pos, pos)), _mm512_set1_epi32(0x80000000U));
+	__m512i tag = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), laneMask, idx, base, 8);
+	__m512i expected = _mm512_broadcast_i64x4(_mm256_loadu_si256(reinterpret_cast<__m256i*>(expectedHash)));
+	uint32_t match = _mm512_mask_cmpeq_epi32_mask(laneMask, _mm512_and_si512(tag, _mm512_set1_epi32(0xf803ffffU)), expected);
+	uint32_t match1 = match & 0xff;
+	uint32_t match2 = match >> 8;
 	
-	return LookupMustExistPromise(true /*valid*/,
-	                              shiftLen,
-	                              ht + h1,
-	                              ht + h2,
-	                              expectedHash,
-	                              shiftedKey);
+	int len = ((match1 | match2) == 0) ? (lowestLen - 1) : (31 - __builtin_clz(match1 | match2));
+	// use allPositions2 at len if only it matches, and clear all lanes in [lowestLen, 7] above len
+	//
+	__mmask8 useSecond = match2 & ~match1 & (1U << len);
+	__m256i result = _mm512_castsi512_si256(_mm512_mask_blend_epi32(useSecond, pos, _mm512_shuffle_i64x2(pos, pos, 0xee)));
+	__mmask8 clearMask = (0xff << (len + 1)) & (0xff >> lowestLen << lowestLen);
+	result = _mm512_castsi512_si256(_mm512_maskz_mov_epi32(__mmask16(~clearMask & 0xff), _mm512_castsi256_si512(result)));
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(allPositions1), result);
+	return len;
 }
 
-int ALWAYS_INLINE CuckooHashTable::QueryLCP(uint64_t key, 
-                                            uint32_t& idxLen, 
-                                            uint32_t* allPositions1, 
-                                            uint32_t* allPositions2, 
-                                            uint32_t* expectedHash)
+template<class Config>
+void BasicCuckooHashTable<Config>::HashTableCuckooDisplacement(uint32_t victimPosition, int rounds, bool& failed)
 {
-	assert(m_hasCalledInit);
-	
-	__m128i h1, h2, h3, h4;
-	uint64_t h5;
-	XXH::XXHashArray(key, h1, h2, h3, h4, h5);
-	
-	__m128i hashModMask = _mm_set1_epi32(htMask);
-	h1 = _mm_and_si128(h1, hashModMask);
-	h2 = _mm_and_si128(h2, hashModMask);
-	h4 = _mm_and_si128(h4, hashModMask);
-	
-	_mm_storeu_si128(reinterpret_cast<__m128i*>(allPositions1 + 4), h1);
-	_mm_storeu_si128(reinterpret_cast<__m128i*>(allPositions2 + 4), h2);
-	_mm_storeu_si128(reinterpret_cast<__m128i*>(allPositions1), h4);
-	*reinterpret_cast<uint64_t*>(allPositions2 + 2) = *reinterpret_cast<uint64_t*>(allPositions1);
-	
-	MEM_PREFETCH(ht[allPositions1[2]]);
-	MEM_PREFETCH(ht[allPositions1[3]]);
-	MEM_PREFETCH(ht[allPositions1[4]]);
-	MEM_PREFETCH(ht[allPositions1[5]]);
-	MEM_PREFETCH(ht[allPositions1[6]]);
-	MEM_PREFETCH(ht[allPositions2[2]]);
-	MEM_PREFETCH(ht[allPositions2[3]]);
-	MEM_PREFETCH(ht[allPositions2[4]]);
-	MEM_PREFETCH(ht[allPositions2[5]]);
-	MEM_PREFETCH(ht[allPositions2[6]]);
-	
-	__m128i expect1 = _mm_and_si128(h3, HASH18_MASK);
-	expect1 = _mm_or_si128(expect1, HASH_EXPECT_MASK1);
-	_mm_storeu_si128(reinterpret_cast<__m128i*>(expectedHash + 4), expect1);
-	h5 &= 0x3ffff0003ffffULL;
-	h5 |= 0x8000000080000000ULL | (3ULL << 59) | (2ULL << 27);
-	*reinterpret_cast<uint64_t*>(expectedHash + 2) = h5;
-	
-	int len = 7;
+	if (rounds > 1000)
+	{
+		failed = true;
+		return;
+	}
 
-	for (; len >= 2; len --)
+	assert(ht[victimPosition].IsOccupied());
+	if (likely(ht[victimPosition].IsNode()))
 	{
-		if ((ht[allPositions1[len]].hash & 0xf803ffffU) == expectedHash[len]) 
+		int ilen = ht[victimPosition].GetIndexKeyLen();
+		uint64_t ikey = ht[victimPosition].GetIndexKey();
+		
+		uint32_t h1, h2;
+		h1 = HashFamily::HashFn1(ikey, ilen) & htMask;
+		h2 = HashFamily::HashFn2(ikey, ilen) & htMask;
+		
+		if (h1 == victimPosition)
 		{
-			break;
+			swap(h1, h2);
 		}
-		if ((ht[allPositions2[len]].hash & 0xf803ffffU) == expectedHash[len])
+		assert(h2 == victimPosition);
+		if (ht[h1].IsOccupied())
 		{
-			allPositions1[len] = allPositions2[len];
-			break;
+			HashTableCuckooDisplacement(h1, rounds+1, failed);
+			if (failed) return;
 		}
-		else
+		assert(!ht[h1].IsOccupied());
+		if (Config::x_enableStats)
 		{
-			allPositions1[len] = 0;
+			stats.m_movedNodesCount++;
 		}
+		ht[victimPosition].MoveNode(&ht[h1]);
+		OnNodeMoved(h1);
 	}
-	if (len < 2)
+	else
 	{
-#ifdef ENABLE_STATS
-		stats.m_lcpResultHistogram[2]++;
-#endif
-		return 2;
+		RelocateBitMapInSlot(victimPosition);
 	}
+	assert(!ht[victimPosition].IsOccupied());
+}
 
-#ifndef NDEBUG
+template<class Config>
+void BasicCuckooHashTable<Config>::OnNodeMoved(uint32_t newPosition)
+{
+	assert(ht[newPosition].IsNode());
+	if (ht[newPosition].IsLeaf())
 	{
-		uint32_t hash18bit = XXH::XXHashFn3(key, len + 1);
-		hash18bit = hash18bit & ((1<<18) - 1);
-		uint32_t expectedx = hash18bit | (len << 27) | 0x80000000U;
-		assert((ht[allPositions1[len]].hash & 0xf803ffffU) == expectedx);
+		ht[newPosition].minvOffset = newPosition;
+		UpdateMinvOffsetOnPath(newPosition);
 	}
-#endif
+}
 
-	int shiftLen = 64 - 8 * (len + 1);
-	if (unlikely((ht[allPositions1[len]].minKey >> shiftLen) != (key >> shiftLen))) goto _slowpath;
+template<class Config>
+void BasicCuckooHashTable<Config>::UpdateMinvOffsetOnPath(uint32_t leafPos)
+{
+	assert(ht[leafPos].IsNode() && ht[leafPos].IsLeaf());
+	uint64_t key = ht[leafPos].minKey;
+	// not every prefix of key is a node (path compression), so missing prefixes are skipped
+	//
+	for (int len = ht[leafPos].GetIndexKeyLen() - 1; len >= LowestIndexLen(); len--)
+	{
+		bool found;
+		uint32_t pos = Lookup(len, key, found);
+		if (found)
+		{
+			if (ht[pos].minKey != key)
+			{
+				break;
+			}
+			ht[pos].minvOffset = leafPos;
+		}
+	}
+}
 
-	idxLen = len + 1;
-#ifdef ENABLE_STATS
-	stats.m_lcpResultHistogram[idxLen]++;
-#endif
+template<class Config>
+void BasicCuckooHashTable<Config>::RelocateBitMapInSlot(uint32_t position)
+{
+	assert(ht[position].IsOccupied() && !ht[position].IsNode());
+	CuckooHashTableNode* owner = nullptr;
+	rep(i, -3, 3)
 	{
-		uint64_t xorValue = key ^ ht[allPositions1[len]].minKey;
-		if (!xorValue) return 8;
-			
-		int z = __builtin_clzll(xorValue);
-		return z / 8;
+		CuckooHashTableNode* target = &ht[position + i];
+		if (target->IsOccupiedAndNode() && !target->IsUsingInternalChildMap() && 
+		    !target->IsExternalPointerBitMap() && !target->IsInlineBitMap())
+		{
+			int offset = ((target->hash >> 21) & 7) - 4;
+			if (offset + i == 0)
+			{
+				owner = target;
+				break;
+			}
+		}
 	}
-	
-	// slow path handling hash conflict
-	//
-_slowpath:
+	assert(owner != nullptr);
+	if (Config::x_enableStats)
 	{
-#ifdef ENABLE_STATS
-		stats.m_slowpathCount++;
-#endif
-
-		if (ht[allPositions1[7]].IsEqualNoHash(key, 8)) { idxLen = 8; goto _slowpath_end; }
-		if (ht[allPositions2[7]].IsEqualNoHash(key, 8)) { allPositions1[7] = allPositions2[7]; idxLen = 8; goto _slowpath_end; }
-		if (ht[allPositions1[6]].IsEqualNoHash(key, 7)) { idxLen = 7; goto _slowpath_end; }
-		if (ht[allPositions2[6]].IsEqualNoHash(key, 7)) { allPositions1[6] = allPositions2[6]; idxLen = 7; goto _slowpath_end; }
-		if (ht[allPositions1[5]].IsEqualNoHash(key, 6)) { idxLen = 6; goto _slowpath_end; }
-		if (ht[allPositions2[5]].IsEqualNoHash(key, 6)) { allPositions1[5] = allPositions2[5]; idxLen = 6; goto _slowpath_end; }
-		if (ht[allPositions1[4]].IsEqualNoHash(key, 5)) { idxLen = 5; goto _slowpath_end; }
-		if (ht[allPositions2[4]].IsEqualNoHash(key, 5)) { allPositions1[4] = allPositions2[4]; idxLen = 5; goto _slowpath_end; }
-		if (ht[allPositions1[3]].IsEqualNoHash(key, 4)) { idxLen = 4; goto _slowpath_end; }
-		if (ht[allPositions2[3]].IsEqualNoHash(key, 4)) { allPositions1[3] = allPositions2[3]; idxLen = 4; goto _slowpath_end; }
-		if (ht[allPositions1[2]].IsEqualNoHash(key, 3)) { idxLen = 3; goto _slowpath_end; }
-		if (ht[allPositions2[2]].IsEqualNoHash(key, 3)) { allPositions1[2] = allPositions2[2]; idxLen = 3; goto _slowpath_end; }
-#ifdef ENABLE_STATS
-		stats.m_lcpResultHistogram[2]++;
-#endif
-		return 2;
-
-_slowpath_end:
-#ifdef ENABLE_STATS
-		stats.m_lcpResultHistogram[idxLen]++;
-#endif
-		uint64_t xorValue = key ^ ht[allPositions1[idxLen-1]].minKey;
-		if (!xorValue) return 8;
-			
-		int z = __builtin_clzll(xorValue);
-		return z / 8;
+		stats.m_relocatedBitmapsCount++;
 	}
+	owner->RelocateBitMap();
+	assert(!ht[position].IsOccupied());
 }
 
-void CuckooHashTable::HashTableCuckooDisplacement(uint32_t victimPosition, int rounds, bool& failed)
+ByteAlphabet::ByteAlphabet()
 {
-	if (rounds > 1000)
+	memset(present, 0, sizeof(present));
+	memset(size, 0, sizeof(size));
+}
+
+void ByteAlphabet::AddKey(uint64_t key)
+{
+	rep(d, 0, 7)
 	{
-		failed = true;
-		return;
+		int b = (key >> (56 - 8 * d)) & 255;
+		present[d][b / 64] |= uint64_t(1) << (b % 64);
 	}
+}
 
-	assert(ht[victimPosition].IsOccupied());
-	if (likely(ht[victimPosition].IsNode()))
+void ByteAlphabet::Finalize()
+{
+	rep(d, 0, 7)
 	{
-		int ilen = ht[victimPosition].GetIndexKeyLen();
-		uint64_t ikey = ht[victimPosition].GetIndexKey();
-		
-		uint32_t h1, h2;
-		h1 = XXH::XXHashFn1(ikey, ilen) & htMask;
-		h2 = XXH::XXHashFn2(ikey, ilen) & htMask;
-		
-		if (h1 == victimPosition)
+		int k = 0;
+		rep(i, 0, 3)
 		{
-			swap(h1, h2);
+			k += __builtin_popcountll(present[d][i]);
 		}
-		assert(h2 == victimPosition);
-		if (ht[h1].IsOccupied())
+		size[d] = k;
+		// assign codes in increasing order, and the ceiling code for bytes not in alphabet
+		//
+		int code = 0;
+		rep(b, 0, 255)
 		{
-			HashTableCuckooDisplacement(h1, rounds+1, failed);
-			if (failed) return;
+			if (present[d][b / 64] & (uint64_t(1) << (b % 64)))
+			{
+				encode[d][b] = code;
+				decode[d][code] = b;
+				code++;
+			}
+			else
+			{
+				encode[d][b] = code | 0x200;
+			}
 		}
-		assert(!ht[h1].IsOccupied());
-#ifdef ENABLE_STATS
-		stats.m_movedNodesCount++;
-#endif
-		ht[victimPosition].MoveNode(&ht[h1]);
+		assert(code == k);
 	}
-	else
+}
+
+bool ByteAlphabet::Encode(uint64_t key, uint64_t& code)
+{
+	code = 0;
+	uint32_t notExist = 0;
+	rep(d, 0, 7)
+	{
+		uint32_t x = encode[d][(key >> (56 - 8 * d)) & 255];
+		notExist |= x;
+		code = (code << 8) | (x & 255);
+	}
+	return (notExist & 0x200) == 0;
+}
+
+bool ByteAlphabet::EncodeLowerBound(uint64_t key, uint64_t& code)
+{
+	code = 0;
+	rep(d, 0, 7)
 	{
-		CuckooHashTableNode* owner = nullptr;
-		rep(i, -3, 3)
+		uint32_t x = encode[d][(key >> (56 - 8 * d)) & 255];
+		if (likely((x & 0x200) == 0))
+		{
+			code = (code << 8) | x;
+			continue;
+		}
+		x &= 0x1ff;
+		if (x < size[d])
+		{
+			// the smallest symbol larger than the byte, followed by the smallest symbols (code 0)
+			//
+			code = ((code << 8) | x) << (56 - 8 * d);
+			return true;
+		}
+		// no symbol larger than the byte at this depth, we need the next prefix of length d
+		// increment the code prefix in mixed radix
+		//
+		repd(e, d - 1, 0)
 		{
-			CuckooHashTableNode* target = &ht[victimPosition + i];
-			if (target->IsOccupiedAndNode() && !target->IsUsingInternalChildMap() && !target->IsExternalPointerBitMap())
+			uint32_t c = code & 255;
+			code >>= 8;
+			if (c + 1 < size[e])
 			{
-				int offset = ((target->hash >> 21) & 7) - 4;
-				if (offset + i == 0)
-				{
-					owner = target;
-					break;
-				}
+				code = ((code << 8) | (c + 1)) << (64 - 8 * e - 8);
+				return true;
 			}
 		}
-		assert(owner != nullptr);
-#ifdef ENABLE_STATS
-		stats.m_relocatedBitmapsCount++;
-#endif
-		owner->RelocateBitMap();
+		return false;
 	}
-	assert(!ht[victimPosition].IsOccupied());
+	return true;
 }
 
-MlpSet::MlpSet() 
-	: m_memoryPtr(nullptr)
-	, m_allocatedSize(-1)
-	, m_hashTable()
-#ifndef NDEBUG
-	, m_hasCalledInit(false)
-#endif
+uint64_t ByteAlphabet::Decode(uint64_t code)
+{
+	uint64_t key = 0;
+	rep(d, 0, 7)
+	{
+		key = (key << 8) | decode[d][(code >> (56 - 8 * d)) & 255];
+	}
+	return key;
+}
+
+// A cheap 64-bit mixer for hashing full keys
+//
+static inline uint64_t MixKey64(uint64_t key)
+{
+	uint64_t h = key * 0x9e3779b97f4a7c15ULL;
+	h ^= h >> 29;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 32;
+	return h;
+}
+
+LeafFilter::LeafFilter()
+	: m_buckets(nullptr)
+	, m_bucketMask(0)
+	, m_allocatedSize(0)
 { }
-	
-MlpSet::~MlpSet()
+
+LeafFilter::~LeafFilter()
 {
-	if (m_memoryPtr != nullptr && m_memoryPtr != MAP_FAILED)
+	if (m_buckets != nullptr)
 	{
-		int ret = SAFE_HUGETLB_MUNMAP(m_memoryPtr, m_allocatedSize);
+		int ret = SAFE_HUGETLB_MUNMAP(m_buckets, m_allocatedSize);
 		assert(ret == 0);
-		m_memoryPtr = nullptr;
+		m_buckets = nullptr;
 	}
 }
-	
-#ifdef ENABLE_STATS
-MlpSet::Stats::Stats()
+
+void LeafFilter::Init(uint32_t maxSetSize)
 {
-	memset(m_lowerBoundParentPathStepsHistogram, 0, sizeof m_lowerBoundParentPathStepsHistogram);
+	assert(m_buckets == nullptr);
+	// 16 keys per bucket on average when the set is full, 
+	// so the chance of a 32-entry bucket overflowing is negligible
+	//
+	uint64_t numBuckets = RoundUpToNearestPowerOf2(max(maxSetSize / 16, 1U));
+	m_bucketMask = numBuckets - 1;
+	m_allocatedSize = numBuckets * 64;
+	void* ptr = mmap(NULL, 
+	                 m_allocatedSize, 
+	                 PROT_READ | PROT_WRITE, 
+	                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, 
+	                 -1 /*fd*/, 
+	                 0 /*offset*/);
+	ReleaseAssert(ptr != MAP_FAILED);
+	m_buckets = reinterpret_cast<uint16_t*>(ptr);
+	Clear();
 }
-		
-void MlpSet::Stats::ClearStats()
+
+void LeafFilter::Clear()
 {
-	memset(m_lowerBoundParentPathStepsHistogram, 0, sizeof m_lowerBoundParentPathStepsHistogram);
+	memset(m_buckets, 0, m_allocatedSize);
 }
-		
-void MlpSet::Stats::ReportStats()	
+
+uint16_t* LeafFilter::GetBucket(uint64_t key, uint16_t& fingerprint)
 {
-	printf("MlpSet stats:\n");
-	bool containsUsefulInfo = false;
-	rep(i, 0, 7) 
+	// the low bits select the bucket and the high bits are the fingerprint
+	//
+	uint64_t h = MixKey64(key);
+	fingerprint = (h >> 48) & 8191;
+	if (fingerprint == 0) fingerprint = 1;
+	return m_buckets + (h & m_bucketMask) * 32;
+}
+
+void LeafFilter::Add(uint64_t key, int ilen)
+{
+	assert(1 <= ilen && ilen <= 8);
+	uint16_t fingerprint;
+	uint16_t* bucket = GetBucket(key, fingerprint);
+	// entries are filled in order, so the first empty entry is right after the last used one
+	//
+	__m256i zero = _mm256_setzero_si256();
+	uint32_t empty1 = _mm256_movemask_epi8(_mm256_cmpeq_epi16(_mm256_load_si256(reinterpret_cast<__m256i*>(bucket)), zero));
+	uint32_t empty2 = _mm256_movemask_epi8(_mm256_cmpeq_epi16(_mm256_load_si256(reinterpret_cast<__m256i*>(bucket + 16)), zero));
+	uint64_t empty = empty1 | (uint64_t(empty2) << 32);
+	if (unlikely(empty == 0))
 	{
-		if (m_lowerBoundParentPathStepsHistogram[i]) 
+		// bucket is full, drop the entry, queries on this bucket will fall back to QueryLCP
+		//
+		return;
+	}
+	bucket[__builtin_ctzll(empty) / 2] = (fingerprint << 3) | (ilen - 1);
+}
+
+void LeafFilter::UpdateIndexLen(uint64_t key, int oldIlen, int newIlen)
+{
+	uint16_t fingerprint;
+	uint16_t* bucket = GetBucket(key, fingerprint);
+	uint16_t oldEntry = (fingerprint << 3) | (oldIlen - 1);
+	int numMatches = 0;
+	int matchIndex = -1;
+	rep(i, 0, 31)
+	{
+		if (bucket[i] == oldEntry)
 		{
-			containsUsefulInfo = true;
+			numMatches++;
+			matchIndex = i;
 		}
 	}
-	if (containsUsefulInfo)
+	if (numMatches == 1)
+	{
+		bucket[matchIndex] = (fingerprint << 3) | (newIlen - 1);
+	}
+	else
+	{
+		// the entry might belong to another key with the same fingerprint, keep it
+		//
+		Add(key, newIlen);
+	}
+}
+
+uint32_t LeafFilter::Query(uint64_t key)
+{
+	uint16_t fingerprint;
+	uint16_t* bucket = GetBucket(key, fingerprint);
+	__m256i mask = _mm256_set1_epi16(short(0xfff8));
+	__m256i expected = _mm256_set1_epi16(short(fingerprint << 3));
+	__m256i v1 = _mm256_load_si256(reinterpret_cast<__m256i*>(bucket));
+	__m256i v2 = _mm256_load_si256(reinterpret_cast<__m256i*>(bucket + 16));
+	uint32_t match1 = _mm256_movemask_epi8(_mm256_cmpeq_epi16(_mm256_and_si256(v1, mask), expected));
+	uint32_t match2 = _mm256_movemask_epi8(_mm256_cmpeq_epi16(_mm256_and_si256(v2, mask), expected));
+	// 2 bits per matched entry
+	//
+	uint64_t matches = match1 | (uint64_t(match2) << 32);
+	uint32_t result = 0;
+	while (matches)
+	{
+		int i = __builtin_ctzll(matches) / 2;
+		result |= 1U << (bucket[i] & 7);
+		matches &= ~(3ULL << (i * 2));
+	}
+	if (unlikely(bucket[31] != 0))
+	{
+		// bucket is full, entries might have been dropped
+		//
+		result |= x_unknown;
+	}
+	return result;
+}
+
+HotKeyCache::HotKeyCache()
+	: m_tags(nullptr)
+	, m_entries(nullptr)
+	, m_setMask(0)
+	, m_generation(0)
+	, m_replaceCounter(0)
+	, m_numLookups(0)
+	, m_numHits(0)
+{ }
+
+HotKeyCache::~HotKeyCache()
+{
+	if (m_tags != nullptr)
+	{
+		delete [] m_tags;
+		m_tags = nullptr;
+	}
+	if (m_entries != nullptr)
+	{
+		delete [] m_entries;
+		m_entries = nullptr;
+	}
+}
+
+void HotKeyCache::Init(uint32_t sizeBytes)
+{
+	assert(m_tags == nullptr);
+	const uint32_t setSize = 8 * (sizeof(uint16_t) + sizeof(Entry));
+	uint32_t numSets = 1;
+	while (uint64_t(numSets) * 2 * setSize <= sizeBytes) numSets *= 2;
+	m_tags = new uint16_t[numSets * 8];
+	ReleaseAssert(m_tags != nullptr);
+	memset(m_tags, 0, sizeof(uint16_t) * numSets * 8);
+	m_entries = new Entry[numSets * 8];
+	ReleaseAssert(m_entries != nullptr);
+	m_setMask = numSets - 1;
+}
+
+int HotKeyCache::Find(uint64_t key, uint32_t& setIndex, uint16_t& tag)
+{
+	uint64_t h = MixKey64(key);
+	setIndex = h & m_setMask;
+	tag = (h >> 48) | 1;
+	uint32_t matches = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_loadu_si128(reinterpret_cast<__m128i*>(m_tags + setIndex * 8)), 
+	                                                     _mm_set1_epi16(short(tag))));
+	// 2 bits per matched way
+	//
+	while (matches)
+	{
+		int way = __builtin_ctz(matches) / 2;
+		if (m_entries[setIndex * 8 + way].key == key)
+		{
+			return setIndex * 8 + way;
+		}
+		matches &= ~(3U << (way * 2));
+	}
+	return -1;
+}
+
+HotKeyCache::Entry* HotKeyCache::FindOrAllocate(uint64_t key)
+{
+	uint32_t setIndex;
+	uint16_t tag;
+	int idx = Find(key, setIndex, tag);
+	if (idx == -1)
+	{
+		uint32_t empty = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_loadu_si128(reinterpret_cast<__m128i*>(m_tags + setIndex * 8)), 
+		                                                   _mm_setzero_si128()));
+		int way = empty ? __builtin_ctz(empty) / 2 : (m_replaceCounter++ & 7);
+		idx = setIndex * 8 + way;
+		m_tags[idx] = tag;
+		m_entries[idx].key = key;
+	}
+	return &m_entries[idx];
+}
+
+bool HotKeyCache::LookupExist(uint64_t key, bool& exist)
+{
+	m_numLookups++;
+	uint32_t setIndex;
+	uint16_t tag;
+	int idx = Find(key, setIndex, tag);
+	if (idx == -1)
+	{
+		return false;
+	}
+	Entry& e = m_entries[idx];
+	switch (e.kind)
+	{
+		case EXIST_TRUE: exist = true; break;
+		case EXIST_FALSE: exist = false; break;
+		case LOWER_BOUND_FOUND:
+		{
+			// the key is in the set if the lower bound is itself, and this never goes stale
+			//
+			if (e.answer == key) 
+			{
+				exist = true;
+				break;
+			}
+			if (e.generation != m_generation) return false;
+			exist = false;
+			break;
+		}
+		default:
+		{
+			if (e.generation != m_generation) return false;
+			exist = false;
+			break;
+		}
+	}
+	m_numHits++;
+	return true;
+}
+
+bool HotKeyCache::LookupLowerBound(uint64_t key, uint64_t& result, bool& found)
+{
+	m_numLookups++;
+	uint32_t setIndex;
+	uint16_t tag;
+	int idx = Find(key, setIndex, tag);
+	if (idx == -1)
+	{
+		return false;
+	}
+	Entry& e = m_entries[idx];
+	if (e.kind == EXIST_TRUE)
+	{
+		result = key;
+		found = true;
+	}
+	else if (e.kind == EXIST_FALSE || e.generation != m_generation)
+	{
+		return false;
+	}
+	else
+	{
+		found = (e.kind == LOWER_BOUND_FOUND);
+		result = e.answer;
+	}
+	m_numHits++;
+	return true;
+}
+
+void HotKeyCache::StoreExist(uint64_t key, bool exist)
+{
+	Entry* e = FindOrAllocate(key);
+	e->kind = exist ? EXIST_TRUE : EXIST_FALSE;
+}
+
+void HotKeyCache::StoreLowerBound(uint64_t key, uint64_t result, bool found)
+{
+	Entry* e = FindOrAllocate(key);
+	e->kind = found ? LOWER_BOUND_FOUND : LOWER_BOUND_NOT_FOUND;
+	e->answer = result;
+	e->generation = m_generation;
+}
+
+void HotKeyCache::OnInsert(uint64_t key)
+{
+	m_generation++;
+	uint32_t setIndex;
+	uint16_t tag;
+	int idx = Find(key, setIndex, tag);
+	if (idx != -1)
+	{
+		m_entries[idx].kind = EXIST_TRUE;
+	}
+}
+
+UpperLevelMirror::UpperLevelMirror()
+	: m_bitmap(nullptr)
+	, m_shift(0)
+	, m_blockRank(nullptr)
+	, m_entries(nullptr)
+	, m_numEntries(0)
+	, m_memoryPtr(nullptr)
+	, m_allocatedSize(0)
+{ }
+
+UpperLevelMirror::~UpperLevelMirror()
+{
+	if (m_memoryPtr != nullptr)
+	{
+		int ret = SAFE_HUGETLB_MUNMAP(m_memoryPtr, m_allocatedSize);
+		assert(ret == 0);
+		m_memoryPtr = nullptr;
+	}
+}
+
+template<class HashTable>
+void UpperLevelMirror::Build(const uint64_t* bitmap, int prefixLen, HashTable* hashTable)
+{
+	assert(prefixLen == 3 || prefixLen == 4);
+	uint64_t numWords = (uint64_t(1) << (8 * prefixLen)) / 64;
+	uint64_t numBlocks = numWords / 8;
+	uint64_t numEntries = 0;
+	rep(i, 0, int(numWords) - 1)
+	{
+		numEntries += __builtin_popcountll(bitmap[i]);
+	}
+	
+	uint64_t rankSize = RoundUpToNearestMultipleOf(numBlocks * sizeof(uint32_t), 64);
+	uint64_t sz = rankSize + numEntries * sizeof(Entry);
+	if (sz > m_allocatedSize)
+	{
+		if (m_memoryPtr != nullptr)
+		{
+			int ret = SAFE_HUGETLB_MUNMAP(m_memoryPtr, m_allocatedSize);
+			assert(ret == 0);
+		}
+		m_memoryPtr = mmap(NULL, 
+		                   sz, 
+		                   PROT_READ | PROT_WRITE, 
+		                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, 
+		                   -1 /*fd*/, 
+		                   0 /*offset*/);
+		ReleaseAssert(m_memoryPtr != MAP_FAILED);
+		m_allocatedSize = sz;
+	}
+	m_bitmap = bitmap;
+	m_shift = 64 - 8 * prefixLen;
+	m_blockRank = reinterpret_cast<uint32_t*>(m_memoryPtr);
+	m_entries = reinterpret_cast<Entry*>(reinterpret_cast<uintptr_t>(m_memoryPtr) + rankSize);
+	m_numEntries = numEntries;
+	
+	uint32_t rank = 0;
+	rep(i, 0, int(numWords) - 1)
+	{
+		if (i % 8 == 0)
+		{
+			m_blockRank[i / 8] = rank;
+		}
+		uint64_t word = bitmap[i];
+		while (word)
+		{
+			uint64_t idx = uint64_t(i) * 64 + __builtin_ctzll(word);
+			word &= word - 1;
+			bool found;
+			uint32_t pos = hashTable->Lookup(prefixLen, idx << m_shift, found);
+			assert(found);
+			m_entries[rank].minKey = hashTable->ht[pos].minKey;
+			m_entries[rank].position = pos;
+			rank++;
+		}
+	}
+	assert(rank == numEntries);
+}
+
+template<class Config>
+BasicMlpSet<Config>::BasicMlpSet() 
+	: m_memoryPtr(nullptr)
+	, m_allocatedSize(-1)
+	, m_sharedSegment(nullptr)
+	, m_cowRegion(nullptr)
+	, m_snapshotRegion(nullptr)
+	, m_treeDepth3(nullptr)
+	, m_numFlatLevels((Config::x_numFlatLevels != 0) ? Config::x_numFlatLevels : 3)
+	, m_hashTable()
+	, m_deamortizedStepsPerInsert(0)
+	, m_byteAlphabet(nullptr)
+	, m_inlineBitMapDepthMask(0)
+	, m_leafFilter(nullptr)
+	, m_hotKeyCache(nullptr)
+	, m_upperLevelMirror(nullptr)
+	, m_epochReclamation(false)
+	, m_hasProbeStrategyOverride(false)
+	, m_probeStrategyOverride(CuckooHashTableBase::PROBE_ALL_LENGTHS)
+	, m_isSmallSet(false)
+	, m_smallSetSize(0)
+	, m_smallSetCapacity(0)
+	, m_maxSetSize(0)
+	, m_smallSetKeys(nullptr)
+#ifndef NDEBUG
+	, m_hasCalledInit(false)
+#endif
+{ }
+	
+template<class Config>
+BasicMlpSet<Config>::~BasicMlpSet()
+{
+	if (m_sharedSegment != nullptr)
+	{
+		delete m_sharedSegment;
+		m_sharedSegment = nullptr;
+		m_memoryPtr = nullptr;
+	}
+	if (m_cowRegion != nullptr)
+	{
+		m_cowRegion->ReleaseLive();
+		m_cowRegion = nullptr;
+		m_memoryPtr = nullptr;
+	}
+	if (m_snapshotRegion != nullptr)
+	{
+		m_snapshotRegion->ReleaseSnapshot(m_memoryPtr);
+		m_snapshotRegion = nullptr;
+		m_memoryPtr = nullptr;
+	}
+	if (m_memoryPtr != nullptr)
+	{
+		Allocator::Free(m_memoryPtr, m_allocatedSize);
+		m_memoryPtr = nullptr;
+	}
+	if (m_smallSetKeys != nullptr)
+	{
+		delete [] m_smallSetKeys;
+		m_smallSetKeys = nullptr;
+	}
+	if (m_byteAlphabet != nullptr)
+	{
+		delete m_byteAlphabet;
+		m_byteAlphabet = nullptr;
+	}
+	if (m_leafFilter != nullptr)
+	{
+		delete m_leafFilter;
+		m_leafFilter = nullptr;
+	}
+	if (m_hotKeyCache != nullptr)
+	{
+		delete m_hotKeyCache;
+		m_hotKeyCache = nullptr;
+	}
+	if (m_upperLevelMirror != nullptr)
+	{
+		delete m_upperLevelMirror;
+		m_upperLevelMirror = nullptr;
+	}
+}
+	
+template<class Config>
+BasicMlpSet<Config>::Stats::Stats()
+{
+	memset(m_lowerBoundParentPathStepsHistogram, 0, sizeof m_lowerBoundParentPathStepsHistogram);
+	memset(m_lowerBoundRoundTripsHistogram, 0, sizeof m_lowerBoundRoundTripsHistogram);
+	m_bulkLoadNodeCount = 0;
+	m_bulkLoadSerialNodeCount = 0;
+}
+		
+template<class Config>
+void BasicMlpSet<Config>::Stats::ClearStats()
+{
+	memset(m_lowerBoundParentPathStepsHistogram, 0, sizeof m_lowerBoundParentPathStepsHistogram);
+	memset(m_lowerBoundRoundTripsHistogram, 0, sizeof m_lowerBoundRoundTripsHistogram);
+	m_bulkLoadNodeCount = 0;
+	m_bulkLoadSerialNodeCount = 0;
+}
+		
+template<class Config>
+void BasicMlpSet<Config>::Stats::ReportStats()	
+{
+	printf("MlpSet stats:\n");
+	bool containsUsefulInfo = false;
+	rep(i, 0, 7) 
+	{
+		if (m_lowerBoundParentPathStepsHistogram[i]) 
+		{
+			containsUsefulInfo = true;
+		}
+	}
+	if (containsUsefulInfo)
+	{
+		printf("\tLower_bound queries parent-path walk length histogram:\n");
+		rep(i, 0, 7)
+		{
+			printf("\tlen = %d: %u\n", i, m_lowerBoundParentPathStepsHistogram[i]);
+		}
+		printf("\tLower_bound queries memory round trips histogram:\n");
+		rep(i, 0, 7)
+		{
+			printf("\tround trips = %d: %u\n", i, m_lowerBoundRoundTripsHistogram[i]);
+		}
+	}
+	if (m_bulkLoadNodeCount > 0)
+	{
+		printf("\tBulk load: %llu nodes, %llu inserted in the serial phase\n", 
+		       static_cast<unsigned long long>(m_bulkLoadNodeCount), static_cast<unsigned long long>(m_bulkLoadSerialNodeCount));
+	}
+}
+
+template<class Config>
+void BasicMlpSet<Config>::ClearStats()
+{
+	if (!Config::x_enableStats)
+	{
+		return;
+	}
+	stats.ClearStats();
+	m_hashTable.stats.ClearStats();
+}
+		
+template<class Config>
+void BasicMlpSet<Config>::ReportStats()
+{
+	if (!Config::x_enableStats)
+	{
+		printf("MlpSet stats: not enabled in this configuration\n");
+		return;
+	}
+	stats.ReportStats();
+	m_hashTable.stats.ReportStats();
+}
+
+template<class Config>
+void BasicMlpSet<Config>::Init(uint32_t maxSetSize, int numFlatLevels)
+{
+	assert(!m_hasCalledInit);
+#ifndef NDEBUG
+	m_hasCalledInit = true;
+#endif
+	ReleaseAssert(numFlatLevels == 3 || numFlatLevels == 4);
+	ReleaseAssert(Config::x_numFlatLevels == 0 || numFlatLevels == Config::x_numFlatLevels);
+	m_numFlatLevels = numFlatLevels;
+	m_maxSetSize = maxSetSize;
+	AllocateFullLayout(maxSetSize);
+}
+
+template<class Config>
+int BasicMlpSet<Config>::ChooseNumFlatLevels(const uint64_t* sample, uint32_t sampleSize, uint32_t maxSetSize)
+{
+	// The depth-3 bitmap costs 512MB, don't bother unless it is at most ~32 bytes per element
+	//
+	if (maxSetSize < (1U << 24) || sampleSize == 0)
+	{
+		return 3;
+	}
+	// With 4 flat levels, every index-len-3 node in the hash table is replaced by a 32-byte block in the depth-3 bitmap, 
+	// and all leaves with index len 3 are pushed down to index len 4.
+	// This is a win if most 3-byte prefixes branch at the 4th byte (so they are internal nodes with full key len 3), 
+	// which we estimate by the ratio between # of distinct 4-byte prefixes and # of distinct 3-byte prefixes in the sample.
+	// For uniformly random keys the ratio is ~1, the depth-3 bitmap would only make everything bigger.
+	//
+	vector<uint32_t> prefixes(sampleSize);
+	rep(i, 0, int(sampleSize) - 1)
+	{
+		prefixes[i] = sample[i] >> 32;
+	}
+	sort(prefixes.begin(), prefixes.end());
+	uint32_t distinct4 = 0, distinct3 = 0;
+	rep(i, 0, int(sampleSize) - 1)
+	{
+		if (i == 0 || prefixes[i] != prefixes[i-1]) distinct4++;
+		if (i == 0 || (prefixes[i] >> 8) != (prefixes[i-1] >> 8)) distinct3++;
+	}
+	return (distinct4 >= distinct3 * 3) ? 4 : 3;
+}
+
+template<class Config>
+void BasicMlpSet<Config>::InitCompact(uint32_t maxSetSize)
+{
+	assert(!m_hasCalledInit);
+#ifndef NDEBUG
+	m_hasCalledInit = true;
+#endif
+	ReleaseAssert(maxSetSize <= (1 << 28));
+	m_isSmallSet = true;
+	m_maxSetSize = maxSetSize;
+	m_smallSetSize = 0;
+	m_smallSetCapacity = 8;
+	m_smallSetKeys = new uint64_t[m_smallSetCapacity];
+	ReleaseAssert(m_smallSetKeys != nullptr);
+	memset(m_smallSetKeys, 0xff, sizeof(uint64_t) * m_smallSetCapacity);
+}
+
+template<class Config>
+uint64_t BasicMlpSet<Config>::GetMemoryFootprint()
+{
+	if (m_isSmallSet)
+	{
+		return sizeof(*this) + sizeof(uint64_t) * m_smallSetCapacity;
+	}
+	else
+	{
+		return sizeof(*this) + m_allocatedSize;
+	}
+}
+
+template<class Config>
+void BasicMlpSet<Config>::AllocateFullLayout(uint32_t maxSetSize)
+{
+	// The gather kernels of QueryLCP use 32-bit indexes (see ProbeTagsAVX2), which allows us to only index as far as 32GB memory
+	// This is currently limiting how many elements we can hold in the container
+	// If we use _mm256_i64gather_epi32 instead, we will support a max size of 2^30 
+	// (the current 32-bit hash functiion becomes the limiting factor in this case)
+	// In theory, we can support up to 2^37 elements (which should be sufficient for any in-memory workload), 
+	// by making use of the currently unused 14 higher bits of HashFn3 to get two 39-bit hash value for Cuckoo
+	// But for now let's just target 1<<28 input size
+	// TODO: investigate what is the perf effect of changing _mm256_i32gather_epi32 to _mm256_i64gather_epi32
+	//
+	ReleaseAssert(maxSetSize <= (1 << 28));
+	maxSetSize = max(maxSetSize, 4096U);
+	
+	// compute how much memory to allocate
+	// First, the top 3 levels of the tree
+	//
+	uint64_t sz = 32 + 8192 + 2 * 1024 * 1024;
+	// and the depth-3 bitmap if we have 4 flat levels
+	//
+	if (NumFlatLevels() == 4)
+	{
+		sz += 512ULL * 1024 * 1024;
+	}
+	// Then, we need 6 HashTableNode's gap for internal bitmap
+	//
+	sz += sizeof(CuckooHashTableNode) * 6;
+	// Pad sz to 128 bytes so the real hash table starts at 128-byte boundary
+	//
+	sz = RoundUpToNearestMultipleOf(sz, 128);
+	uint64_t hashTableOffset = sz;
+	// Real hash table size
+	//
+	uint64_t htSize = RoundUpToNearestPowerOf2(maxSetSize) * 4;
+	// We need 6 slots gap in the end for internal bitmap as well
+	//
+	sz += (htSize + 6) * sizeof(CuckooHashTableNode);
+	// Then the stash for de-amortized insertion mode (a few KB, so we always reserve it)
+	//
+	sz += CuckooHashTableBase::x_stashRegionSlots * sizeof(CuckooHashTableNode);
+	
+	m_memoryPtr = Allocator::Allocate(sz);
+	m_allocatedSize = sz;
+	InitLayoutPointers(hashTableOffset, htSize);
+	
+	memset(m_memoryPtr, 0, m_allocatedSize);
+}
+
+template<class Config>
+void BasicMlpSet<Config>::InitLayoutPointers(uint64_t hashTableOffset, uint64_t htSize)
+{
+	uintptr_t ptr = reinterpret_cast<uintptr_t>(m_memoryPtr);
+	m_root = reinterpret_cast<uint64_t*>(ptr);
+	m_treeDepth1 = reinterpret_cast<uint64_t*>(ptr + 32);
+	m_treeDepth2 = reinterpret_cast<uint64_t*>(ptr + 32 + 8192);
+	if (NumFlatLevels() == 4)
+	{
+		m_treeDepth3 = reinterpret_cast<uint64_t*>(ptr + 32 + 8192 + 2 * 1024 * 1024);
+	}
+	m_hashTable.Init(reinterpret_cast<CuckooHashTableNode*>(ptr + hashTableOffset), htSize - 1, NumFlatLevels() /*lowestIndexLen*/);
+	m_hashTable.SetProbeStrategy(m_hasProbeStrategyOverride ? 
+	                             m_probeStrategyOverride : 
+	                             ChooseProbeStrategy(htSize * sizeof(CuckooHashTableNode)));
+}
+
+template<class Config>
+uint64_t BasicMlpSet<Config>::SharedSetHashFingerprint()
+{
+	uint64_t key = 0x0123456789abcdefULL;
+	return uint64_t(HashFamily::HashFn1(key, 8)) | (uint64_t(HashFamily::HashFn2(key, 7)) << 32);
+}
+
+template<class Config>
+SharedMemorySegment* BasicMlpSet<Config>::PublishShared(const char* name)
+{
+	assert(m_hasCalledInit && m_sharedSegment == nullptr);
+	ReleaseAssert(!m_isSmallSet && m_byteAlphabet == nullptr);
+	// the stash is not searched by the attached sets
+	//
+	m_hashTable.ExecutePendingDisplacements(1 << 30);
+	assert(m_hashTable.GetStashedNodesCount() == 0);
+	
+	CuckooHashTableNode* ht = m_hashTable.ht;
+	uint32_t numSlots = m_hashTable.htMask + 1 + 6 + CuckooHashTableBase::x_stashRegionSlots;
+	uint64_t numExternalBitMaps = 0;
+	rep(pos, 0, int(numSlots) - 1)
+	{
+		if (ht[pos].IsOccupiedAndNode() && !ht[pos].IsLeaf() && 
+		    !ht[pos].IsUsingInternalChildMap() && ht[pos].IsExternalPointerBitMap())
+		{
+			numExternalBitMaps++;
+		}
+	}
+	
+	// the chunk is placed at a page boundary, so that the hash table keeps its cache line alignment
+	//
+	uint64_t chunkOffset = 4096;
+	uint64_t externalBitMapsOffset = (chunkOffset + m_allocatedSize + 63) / 64 * 64;
+	SharedMemorySegment* segment = SharedMemorySegment::Create(name, externalBitMapsOffset + numExternalBitMaps * 32);
+	uintptr_t base = reinterpret_cast<uintptr_t>(segment->GetBase());
+	memcpy(reinterpret_cast<void*>(base + chunkOffset), m_memoryPtr, m_allocatedSize);
+	
+	// re-point the external bitmaps of the copied nodes to the packed copies
+	//
+	uint64_t hashTableOffset = reinterpret_cast<uintptr_t>(ht) - reinterpret_cast<uintptr_t>(m_memoryPtr);
+	CuckooHashTableNode* sharedHt = reinterpret_cast<CuckooHashTableNode*>(base + chunkOffset + hashTableOffset);
+	uint64_t* bitmaps = reinterpret_cast<uint64_t*>(base + externalBitMapsOffset);
+	rep(pos, 0, int(numSlots) - 1)
+	{
+		if (ht[pos].IsOccupiedAndNode() && !ht[pos].IsLeaf() && 
+		    !ht[pos].IsUsingInternalChildMap() && ht[pos].IsExternalPointerBitMap())
+		{
+			memcpy(bitmaps, ht[pos].GetExternalBitMap(), 32);
+			sharedHt[pos].SetExternalBitMap(bitmaps);
+			bitmaps += 4;
+		}
+	}
+	
+	SharedSetHeader* header = reinterpret_cast<SharedSetHeader*>(base);
+	header->hashFingerprint = SharedSetHashFingerprint();
+	header->numFlatLevels = NumFlatLevels();
+	header->maxSetSize = m_maxSetSize;
+	header->chunkOffset = chunkOffset;
+	header->chunkSize = m_allocatedSize;
+	header->hashTableOffset = hashTableOffset;
+	header->htSize = m_hashTable.htMask + 1;
+	header->externalBitMapsOffset = externalBitMapsOffset;
+	header->numExternalBitMaps = numExternalBitMaps;
+	// the magic is written last, a segment without it is incomplete
+	//
+	__atomic_store_n(&header->magic, x_sharedSetMagic, __ATOMIC_RELEASE);
+	return segment;
+}
+
+template<class Config>
+bool BasicMlpSet<Config>::AttachShared(const char* path)
+{
+	assert(!m_hasCalledInit);
+	SharedMemorySegment* segment = SharedMemorySegment::Attach(path);
+	if (segment == nullptr)
+	{
+		return false;
+	}
+	SharedSetHeader* header = reinterpret_cast<SharedSetHeader*>(segment->GetBase());
+	if (segment->GetSize() < sizeof(SharedSetHeader) || 
+	    __atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != x_sharedSetMagic || 
+	    header->hashFingerprint != SharedSetHashFingerprint() || 
+	    (Config::x_numFlatLevels != 0 && int(header->numFlatLevels) != Config::x_numFlatLevels) || 
+	    header->externalBitMapsOffset + header->numExternalBitMaps * 32 > segment->GetSize())
+	{
+		delete segment;
+		return false;
+	}
+#ifndef NDEBUG
+	m_hasCalledInit = true;
+#endif
+	m_sharedSegment = segment;
+	m_numFlatLevels = header->numFlatLevels;
+	m_maxSetSize = header->maxSetSize;
+	m_memoryPtr = reinterpret_cast<uint8_t*>(segment->GetBase()) + header->chunkOffset;
+	m_allocatedSize = header->chunkSize;
+	InitLayoutPointers(header->hashTableOffset, header->htSize);
+	return true;
+}
+
+template<class Config>
+void BasicMlpSet<Config>::EnableSnapshots()
+{
+	assert(m_hasCalledInit && m_sharedSegment == nullptr && m_cowRegion == nullptr && m_snapshotRegion == nullptr);
+	ReleaseAssert(m_byteAlphabet == nullptr);
+	if (m_isSmallSet)
+	{
+		PromoteSmallSet();
+	}
+	// A node with an external bitmap has more than 8 children, so there are at most 2 * (# of slots) / 9 of them,
+	// the arena is sized for 1/4 of the slots (it is only backed by memory as far as it is used, except on hugetlbfs)
+	//
+	uint64_t numSlots = m_hashTable.htMask + 1 + 6 + CuckooHashTableBase::x_stashRegionSlots;
+	CowRegion* region = CowRegion::Create(m_allocatedSize, (m_hashTable.htMask + 1) / 4 * 32);
+	uint8_t* base = reinterpret_cast<uint8_t*>(region->GetBase());
+	memcpy(base, m_memoryPtr, m_allocatedSize);
+	
+	// move the external bitmaps into the arena
+	//
+	uint64_t hashTableOffset = reinterpret_cast<uintptr_t>(m_hashTable.ht) - reinterpret_cast<uintptr_t>(m_memoryPtr);
+	CuckooHashTableNode* ht = m_hashTable.ht;
+	CuckooHashTableNode* newHt = reinterpret_cast<CuckooHashTableNode*>(base + hashTableOffset);
+	rep(pos, 0, int(numSlots) - 1)
+	{
+		if (ht[pos].IsOccupiedAndNode() && !ht[pos].IsLeaf() && 
+		    !ht[pos].IsUsingInternalChildMap() && ht[pos].IsExternalPointerBitMap())
+		{
+			uint64_t* bitmap = region->AllocateBitMap();
+			memcpy(bitmap, ht[pos].GetExternalBitMap(), 32);
+			FreeOrRetire(ht[pos].GetExternalBitMap(), 32, EpochReclaimer::DeleteArray<uint64_t>);
+			newHt[pos].SetExternalBitMap(bitmap);
+		}
+	}
+	
+	FreeOrRetire(m_memoryPtr, m_allocatedSize, Allocator::Free);
+	uintptr_t delta = reinterpret_cast<uintptr_t>(base) - reinterpret_cast<uintptr_t>(m_memoryPtr);
+	m_memoryPtr = base;
+	m_root = reinterpret_cast<uint64_t*>(reinterpret_cast<uintptr_t>(m_root) + delta);
+	m_treeDepth1 = reinterpret_cast<uint64_t*>(reinterpret_cast<uintptr_t>(m_treeDepth1) + delta);
+	m_treeDepth2 = reinterpret_cast<uint64_t*>(reinterpret_cast<uintptr_t>(m_treeDepth2) + delta);
+	if (m_treeDepth3 != nullptr)
+	{
+		m_treeDepth3 = reinterpret_cast<uint64_t*>(reinterpret_cast<uintptr_t>(m_treeDepth3) + delta);
+	}
+	m_hashTable.ht = newHt;
+	m_cowRegion = region;
+}
+
+template<class Config>
+BasicMlpSet<Config>* BasicMlpSet<Config>::Snapshot()
+{
+	assert(m_hasCalledInit && m_snapshotRegion == nullptr);
+	ReleaseAssert(m_cowRegion != nullptr);
+	// the stash is not searched by the snapshot, it is emptied first (it holds a few nodes at most)
+	//
+	m_hashTable.ExecutePendingDisplacements(1 << 30);
+	assert(m_hashTable.GetStashedNodesCount() == 0);
+	void* base = m_cowRegion->TakeSnapshot();
+	if (base == nullptr)
+	{
+		return nullptr;
+	}
+	BasicMlpSet* snapshot = new BasicMlpSet();
+#ifndef NDEBUG
+	snapshot->m_hasCalledInit = true;
+#endif
+	snapshot->m_snapshotRegion = m_cowRegion;
+	snapshot->m_numFlatLevels = m_numFlatLevels;
+	snapshot->m_maxSetSize = m_maxSetSize;
+	snapshot->m_hasProbeStrategyOverride = m_hasProbeStrategyOverride;
+	snapshot->m_probeStrategyOverride = m_probeStrategyOverride;
+	snapshot->m_memoryPtr = base;
+	snapshot->m_allocatedSize = m_allocatedSize;
+	snapshot->InitLayoutPointers(reinterpret_cast<uintptr_t>(m_hashTable.ht) - reinterpret_cast<uintptr_t>(m_memoryPtr), m_hashTable.htMask + 1);
+	return snapshot;
+}
+
+template<class Config>
+void BasicMlpSet<Config>::EnableDeamortizedInsert(int stepsPerInsert)
+{
+	assert(m_hasCalledInit && m_deamortizedStepsPerInsert == 0);
+	assert(stepsPerInsert > 0);
+	m_deamortizedStepsPerInsert = stepsPerInsert;
+	// In small-set mode, the stash is initialized when the set is promoted
+	//
+	if (!m_isSmallSet)
+	{
+		m_hashTable.InitStash(m_hashTable.htMask + 1 + 6 /*stashRegionBegin*/);
+	}
+}
+
+template<class Config>
+void BasicMlpSet<Config>::EnableExistFilter()
+{
+	assert(m_hasCalledInit && m_leafFilter == nullptr);
+	m_leafFilter = new LeafFilter();
+	ReleaseAssert(m_leafFilter != nullptr);
+	m_leafFilter->Init(m_maxSetSize);
+}
+
+template<class Config>
+void BasicMlpSet<Config>::EnableHotKeyCache(uint32_t sizeBytes)
+{
+	assert(m_hasCalledInit && m_hotKeyCache == nullptr);
+	m_hotKeyCache = new HotKeyCache();
+	ReleaseAssert(m_hotKeyCache != nullptr);
+	m_hotKeyCache->Init(sizeBytes);
+}
+
+template<class Config>
+void BasicMlpSet<Config>::EnableEpochReclamation()
+{
+	assert(m_hasCalledInit);
+	m_epochReclamation = true;
+}
+
+template<class Config>
+void BasicMlpSet<Config>::FreeOrRetire(void* ptr, uint64_t size, EpochReclaimer::FreeFn freeFn)
+{
+	if (m_epochReclamation)
+	{
+		EpochReclaimer::Retire(ptr, size, freeFn);
+	}
+	else
+	{
+		freeFn(ptr, size);
+	}
+}
+
+template<class Config>
+void BasicMlpSet<Config>::SetProbeStrategy(CuckooHashTableBase::ProbeStrategy strategy)
+{
+	assert(m_hasCalledInit);
+	m_hasProbeStrategyOverride = true;
+	m_probeStrategyOverride = strategy;
+	// In small-set mode, the strategy is applied when the set is promoted
+	//
+	if (!m_isSmallSet)
+	{
+		m_hashTable.SetProbeStrategy(strategy);
+	}
+}
+
+template<class Config>
+CuckooHashTableBase::ProbeStrategy BasicMlpSet<Config>::ChooseProbeStrategy(uint64_t hashTableBytes)
+{
+	// Top-down probing costs one dependent round trip per node on the path, 
+	// so it only wins on deep trees (e.g. dense keys) if every round trip is a cheap L2 hit.
+	// Once the hash table spills into LLC, the LLC latency of the dependent round trips already loses
+	// to the parallel probes of all-lengths probing.
+	//
+	long l2Size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+	if (l2Size <= 0)
+	{
+		return CuckooHashTableBase::PROBE_ALL_LENGTHS;
+	}
+	return (hashTableBytes <= uint64_t(l2Size)) ? CuckooHashTableBase::PROBE_TOP_DOWN : CuckooHashTableBase::PROBE_ALL_LENGTHS;
+}
+
+template<class Config>
+void BasicMlpSet<Config>::BuildUpperLevelMirror()
+{
+	assert(m_hasCalledInit);
+	if (m_isSmallSet)
+	{
+		return;
+	}
+	// queries must not use the mirror while it is being built
+	//
+	m_hashTable.SetUpperLevelMirror(nullptr);
+	if (m_upperLevelMirror != nullptr && m_epochReclamation)
+	{
+		// concurrent readers may still be reading the old mirror, build a new one
+		//
+		FreeOrRetire(m_upperLevelMirror, sizeof(UpperLevelMirror), EpochReclaimer::DeleteObject<UpperLevelMirror>);
+		m_upperLevelMirror = nullptr;
+	}
+	if (m_upperLevelMirror == nullptr)
+	{
+		m_upperLevelMirror = new UpperLevelMirror();
+		ReleaseAssert(m_upperLevelMirror != nullptr);
+	}
+	m_upperLevelMirror->Build((NumFlatLevels() == 3) ? m_treeDepth2 : m_treeDepth3, 
+	                          NumFlatLevels() /*prefixLen*/, 
+	                          &m_hashTable);
+	m_hashTable.SetUpperLevelMirror(m_upperLevelMirror);
+}
+
+template<class Config>
+bool BasicMlpSet<Config>::SmallSetInsert(uint64_t value)
+{
+	assert(m_isSmallSet);
+	uint32_t idx = SmallSetLowerBoundIndex(value);
+	if (idx < m_smallSetSize && m_smallSetKeys[idx] == value)
+	{
+		return false;
+	}
+	if (m_smallSetSize + 8 + 1 > m_smallSetCapacity)
+	{
+		uint32_t newCapacity = m_smallSetCapacity * 2;
+		uint64_t* newKeys = new uint64_t[newCapacity];
+		ReleaseAssert(newKeys != nullptr);
+		memcpy(newKeys, m_smallSetKeys, sizeof(uint64_t) * m_smallSetSize);
+		memset(newKeys + m_smallSetSize, 0xff, sizeof(uint64_t) * (newCapacity - m_smallSetSize));
+		uint64_t* oldKeys = m_smallSetKeys;
+		m_smallSetKeys = newKeys;
+		FreeOrRetire(oldKeys, sizeof(uint64_t) * m_smallSetCapacity, EpochReclaimer::DeleteArray<uint64_t>);
+		m_smallSetCapacity = newCapacity;
+	}
+	memmove(m_smallSetKeys + idx + 1, m_smallSetKeys + idx, sizeof(uint64_t) * (m_smallSetSize - idx));
+	m_smallSetKeys[idx] = value;
+	m_smallSetSize++;
+	return true;
+}
+
+template<class Config>
+void BasicMlpSet<Config>::PromoteSmallSet()
+{
+	assert(m_isSmallSet);
+	m_isSmallSet = false;
+	AllocateFullLayout(max(m_maxSetSize, m_smallSetSize + 1));
+	if (m_deamortizedStepsPerInsert > 0)
+	{
+		m_hashTable.InitStash(m_hashTable.htMask + 1 + 6 /*stashRegionBegin*/);
+	}
+	rep(i, 0, int(m_smallSetSize) - 1)
 	{
-		printf("\tLower_bound queries parent-path walk length histogram:\n");
-		rep(i, 0, 7)
-		{
-			printf("\tlen = %d: %u\n", i, m_lowerBoundParentPathStepsHistogram[i]);
-		}
+		bool inserted = InsertInternal(m_smallSetKeys[i]);
+		ReleaseAssert(inserted);
 	}
+	FreeOrRetire(m_smallSetKeys, sizeof(uint64_t) * m_smallSetCapacity, EpochReclaimer::DeleteArray<uint64_t>);
+	m_smallSetKeys = nullptr;
+	m_smallSetSize = 0;
+	m_smallSetCapacity = 0;
 }
 
-void MlpSet::ClearStats()
+template<class Config>
+void BasicMlpSet<Config>::EnableByteRemap(const uint64_t* sample, uint32_t sampleSize)
 {
-	stats.ClearStats();
-	m_hashTable.stats.ClearStats();
+	assert(m_hasCalledInit && m_byteAlphabet == nullptr);
+	ReleaseAssert(m_cowRegion == nullptr);
+	assert(m_isSmallSet ? (m_smallSetSize == 0) : ((m_root[0] | m_root[1] | m_root[2] | m_root[3]) == 0));
+	m_byteAlphabet = new ByteAlphabet();
+	ReleaseAssert(m_byteAlphabet != nullptr);
+	rep(i, 0, int(sampleSize) - 1)
+	{
+		m_byteAlphabet->AddKey(sample[i]);
+	}
+	m_byteAlphabet->Finalize();
+	UpdateInlineBitMapDepthMask();
 }
-		
-void MlpSet::ReportStats()
+
+template<class Config>
+void BasicMlpSet<Config>::UpdateInlineBitMapDepthMask()
 {
-	stats.ReportStats();
-	m_hashTable.stats.ReportStats();
+	m_inlineBitMapDepthMask = 0;
+	rep(d, 0, 7)
+	{
+		if (m_byteAlphabet->size[d] <= 64)
+		{
+			m_inlineBitMapDepthMask |= 1U << d;
+		}
+	}
 }
-#endif
 
-void MlpSet::Init(uint32_t maxSetSize)
+template<class Config>
+void BasicMlpSet<Config>::RebuildWithExtendedByteAlphabet(uint64_t value)
 {
-	assert(!m_hasCalledInit);
-#ifndef NDEBUG
-	m_hasCalledInit = true;
-#endif
-	// We are using _mm_i32gather_epi32 currently, which allows us to only index as far as 32GB memory
-	// This is currently limiting how many elements we can hold in the container
-	// If we use _mm256_i64gather_epi32 instead, we will support a max size of 2^30 
-	// (the current 32-bit hash functiion becomes the limiting factor in this case)
-	// In theory, we can support up to 2^37 elements (which should be sufficient for any in-memory workload), 
-	// by making use of the currently unused 14 higher bits of HashFn3 to get two 39-bit hash value for Cuckoo
-	// But for now let's just target 1<<28 input size
-	// TODO: investigate what is the perf effect of changing _mm_i32gather_epi32 to _mm256_i64gather_epi32
+	assert(m_byteAlphabet != nullptr);
+	// Collect all elements in the original key space
 	//
-	ReleaseAssert(maxSetSize <= (1 << 28));
-	maxSetSize = max(maxSetSize, 4096U);
+	vector<uint64_t> elements;
+	{
+		uint64_t code = 0;
+		while (true)
+		{
+			bool found;
+			Promise p = LowerBoundInternal(code, found);
+			if (!found) break;
+			uint64_t x = p.Resolve();
+			elements.push_back(m_byteAlphabet->Decode(x));
+			if (x == 0xffffffffffffffffULL) break;
+			code = x + 1;
+		}
+	}
 	
-	// compute how much memory to allocate
-	// First, the top 3 levels of the tree
-	//
-	uint64_t sz = 32 + 8192 + 2 * 1024 * 1024;
-	// Then, we need 6 HashTableNode's gap for internal bitmap
-	//
-	sz += sizeof(CuckooHashTableNode) * 6;
-	// Pad sz to 128 bytes so the real hash table starts at 128-byte boundary
-	//
-	sz = RoundUpToNearestMultipleOf(sz, 128);
-	uint64_t hashTableOffset = sz;
-	// Real hash table size
-	//
-	uint64_t htSize = RoundUpToNearestPowerOf2(maxSetSize) * 4;
-	// We need 6 slots gap in the end for internal bitmap as well
+	// Reset to an empty set
 	//
-	sz += (htSize + 6) * sizeof(CuckooHashTableNode);
+	if (m_isSmallSet)
+	{
+		m_smallSetSize = 0;
+		memset(m_smallSetKeys, 0xff, sizeof(uint64_t) * m_smallSetCapacity);
+	}
+	else
+	{
+		FreeOrRetire(m_memoryPtr, m_allocatedSize, Allocator::Free);
+		m_memoryPtr = nullptr;
+		m_hashTable.~HashTable();
+		new (&m_hashTable) HashTable();
+		AllocateFullLayout(max(m_maxSetSize, uint32_t(elements.size()) + 1));
+		if (m_deamortizedStepsPerInsert > 0)
+		{
+			m_hashTable.InitStash(m_hashTable.htMask + 1 + 6 /*stashRegionBegin*/);
+		}
+	}
 	
-	m_memoryPtr = mmap(NULL, 
-	                   sz, 
-	                   PROT_READ | PROT_WRITE, 
-	                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, 
-	                   -1 /*fd*/, 
-	                   0 /*offset*/);
-	ReleaseAssert(m_memoryPtr != MAP_FAILED);
-	m_allocatedSize = sz;
-		
-	uintptr_t ptr = reinterpret_cast<uintptr_t>(m_memoryPtr);
-	m_root = reinterpret_cast<uint64_t*>(ptr);
-	m_treeDepth1 = reinterpret_cast<uint64_t*>(ptr + 32);
-	m_treeDepth2 = reinterpret_cast<uint64_t*>(ptr + 32 + 8192);
-	m_hashTable.Init(reinterpret_cast<CuckooHashTableNode*>(ptr + hashTableOffset), htSize - 1);
+	if (m_leafFilter != nullptr)
+	{
+		m_leafFilter->Clear();
+	}
 	
-	memset(m_memoryPtr, 0, m_allocatedSize);
+	// Extend the alphabets, and re-insert all elements
+	//
+	m_byteAlphabet->AddKey(value);
+	m_byteAlphabet->Finalize();
+	UpdateInlineBitMapDepthMask();
+	rep(i, 0, int(elements.size()) - 1)
+	{
+		uint64_t code;
+		bool ok = m_byteAlphabet->Encode(elements[i], code);
+		ReleaseAssert(ok);
+		bool inserted = InsertInternal(code);
+		ReleaseAssert(inserted);
+	}
 }
 
-bool MlpSet::Insert(uint64_t value)
+template<class Config>
+bool BasicMlpSet<Config>::Insert(uint64_t value)
 {
-	assert(m_hasCalledInit);
+	uint64_t code = value;
+	if (unlikely(m_byteAlphabet != nullptr))
+	{
+		if (unlikely(!m_byteAlphabet->Encode(value, code)))
+		{
+			RebuildWithExtendedByteAlphabet(value);
+			bool ok = m_byteAlphabet->Encode(value, code);
+			ReleaseAssert(ok);
+		}
+	}
+	bool inserted = InsertInternal(code);
+	if (unlikely(m_hotKeyCache != nullptr) && inserted)
+	{
+		m_hotKeyCache->OnInsert(value);
+	}
+	if (unlikely(m_hashTable.GetUpperLevelMirror() != nullptr) && inserted)
+	{
+		// the mirror is a snapshot, stop using it until it is rebuilt
+		//
+		m_hashTable.SetUpperLevelMirror(nullptr);
+	}
+	return inserted;
+}
+
+template<class Config>
+bool BasicMlpSet<Config>::InsertInternal(uint64_t value)
+{
+	assert(m_hasCalledInit && m_sharedSegment == nullptr && m_snapshotRegion == nullptr);
+	if (unlikely(m_isSmallSet))
+	{
+		if (m_smallSetSize < x_smallSetMaxSize)
+		{
+			return SmallSetInsert(value);
+		}
+		uint32_t idx = SmallSetLowerBoundIndex(value);
+		if (idx < m_smallSetSize && m_smallSetKeys[idx] == value)
+		{
+			return false;
+		}
+		PromoteSmallSet();
+	}
+	
 	int lcpLen;
+	// # of flat levels minus 1, the LCP returned by QueryLCP if the LCP is not in hash table
+	//
+	int flatLcpLen = NumFlatLevels() - 1;
+	// whether value becomes the minimum of some existing node (so minvOffset of those nodes needs update)
+	//
+	bool minKeyUpdated = false;
 	// Handle LCP < 2 case first
 	// This is supposed to be a L1 hit (working set 8KB)
 	//
@@ -1157,16 +2149,20 @@ bool MlpSet::Insert(uint64_t value)
 		uint64_t h16bits = value >> 48;
 		if (unlikely((m_treeDepth1[h16bits / 64] & (uint64_t(1) << (h16bits % 64))) == 0))
 		{
-			lcpLen = 2;
+			lcpLen = flatLcpLen;
 			m_root[(h16bits >> 8) / 64] |= uint64_t(1) << ((h16bits >> 8) % 64);
 			m_treeDepth1[h16bits / 64] |= uint64_t(1) << (h16bits % 64);
 			goto _end;
 		}
 	}
 	
-	// Issue the prefetch in case LCP turns out to be 2
+	// Issue the prefetch in case LCP turns out to be in the flat levels
 	//
 	MEM_PREFETCH(m_treeDepth2[(value >> 40) / 64]);
+	if (NumFlatLevels() == 4)
+	{
+		MEM_PREFETCH(m_treeDepth3[(value >> 32) / 64]);
+	}
 	
 	// Since we know the LCP is >= 2, QueryLCP is applicable
 	// 
@@ -1185,10 +2181,9 @@ bool MlpSet::Insert(uint64_t value)
 		{
 			return false;
 		}
-		if (lcpLen > 2)
+		if (lcpLen > flatLcpLen)
 		{
 			uint32_t pos = allPositions1[ilen - 1];
-			bool minKeyUpdated = false;
 			assert(ilen <= lcpLen && lcpLen <= m_hashTable.ht[pos].GetFullKeyLen());
 			// Split as needed
 			// Determine whether the path-compression string completely matched
@@ -1197,7 +2192,8 @@ bool MlpSet::Insert(uint64_t value)
 			{
 				// path-compression string matched, no need to split
 				//
-				m_hashTable.ht[pos].AddChild((value >> (56 - lcpLen * 8)) % 256);
+				m_hashTable.ht[pos].AddChild((value >> (56 - lcpLen * 8)) % 256, 
+				                             (m_inlineBitMapDepthMask >> lcpLen) & 1 /*smallAlphabet*/);
 				if (value < m_hashTable.ht[pos].minKey)
 				{
 					minKeyUpdated = true;
@@ -1222,20 +2218,37 @@ bool MlpSet::Insert(uint64_t value)
 
 				// Add new node
 				//
+				uint32_t x;
 				{
 					bool exist, failed;
-					uint32_t newHash18bit = XXH::XXHashFn3(minKey, lcpLen + 1);
+					uint32_t newHash18bit = HashFamily::HashFn3(minKey, lcpLen + 1);
 					newHash18bit = newHash18bit & ((1<<18) - 1);
-					uint32_t x = m_hashTable.ReservePositionForInsert(lcpLen + 1 /*indexLen*/, 
-						                                              minKey /*key*/,
-						                                              newHash18bit /*hash18bit*/, 
-						                                              exist /*out*/, 
-						                                              failed /*out*/);
+					x = m_hashTable.ReservePositionForInsert(lcpLen + 1 /*indexLen*/, 
+					                                         minKey /*key*/,
+					                                         newHash18bit /*hash18bit*/, 
+					                                         exist /*out*/, 
+					                                         failed /*out*/);
 					assert(!exist && !failed);
 					assert(!m_hashTable.ht[x].IsOccupied());
+					// The Cuckoo displacement above may have moved the node we are splitting
+					//
+					if (unlikely(!m_hashTable.ht[pos].IsEqualNoHash(minKey, ilen)))
+					{
+						bool found;
+						pos = m_hashTable.Lookup(ilen, minKey, found);
+						assert(found);
+					}
 					m_hashTable.ht[pos].MoveNode(&(m_hashTable.ht[x]));
 					m_hashTable.ht[x].AlterIndexKeyLen(lcpLen + 1);
 					m_hashTable.ht[x].AlterHash18bit(newHash18bit);
+					if (m_hashTable.ht[x].IsLeaf())
+					{
+						m_hashTable.ht[x].minvOffset = x;
+						if (m_leafFilter != nullptr)
+						{
+							m_leafFilter->UpdateIndexLen(minKey, ilen, lcpLen + 1);
+						}
+					}
 				}
 				
 				// Re-construct ht[pos] (it has been cleared in MoveNode)
@@ -1253,7 +2266,17 @@ bool MlpSet::Insert(uint64_t value)
 						                     z /*minKey*/,
 						                     oldHash18bit /*hash18bit*/,
 						                     (minKey >> (56 - 8 * lcpLen)) % 256 /*firstChild*/);
-					m_hashTable.ht[pos].AddChild((value >> (56 - 8 * lcpLen)) % 256);
+					m_hashTable.ht[pos].AddChild((value >> (56 - 8 * lcpLen)) % 256, 
+					                             (m_inlineBitMapDepthMask >> lcpLen) & 1 /*smallAlphabet*/);
+					// if value is the new minimum, this is fixed up after the leaf is inserted
+					//
+					m_hashTable.ht[pos].minvOffset = m_hashTable.ht[x].minvOffset;
+					// if the split node was a leaf, it has been moved, so redirect its ancestors
+					//
+					if (m_hashTable.ht[x].IsLeaf() && !minKeyUpdated)
+					{
+						m_hashTable.UpdateMinvOffsetOnPath(x);
+					}
 				}  
 
 #ifndef NDEBUG
@@ -1298,7 +2321,7 @@ bool MlpSet::Insert(uint64_t value)
 			//
 			if (minKeyUpdated)
 			{
-				for (ilen--; ilen > 2; ilen--)
+				for (ilen--; int(ilen) > flatLcpLen; ilen--)
 				{
 					uint32_t pos = allPositions1[ilen - 1];
 					if (m_hashTable.ht[pos].IsEqualNoHash(value, ilen))
@@ -1339,239 +2362,465 @@ _end:
 	//
 	{
 		bool exist, failed;
-		m_hashTable.Insert(lcpLen + 1 /*indexLen*/,
-		                   8 /*fullKeyLen*/,
-		                   value /*minKey*/, 
-		                   -1 /*firstChild*/,
-		                   exist /*out*/, 
-		                   failed /*out*/);
+		uint32_t pos = m_hashTable.Insert(lcpLen + 1 /*indexLen*/,
+		                                  8 /*fullKeyLen*/,
+		                                  value /*minKey*/, 
+		                                  -1 /*firstChild*/,
+		                                  exist /*out*/, 
+		                                  failed /*out*/);
 		assert(!exist && !failed);
+		m_hashTable.ht[pos].minvOffset = pos;
+		if (m_leafFilter != nullptr)
+		{
+			m_leafFilter->Add(value, lcpLen + 1);
+		}
+		if (minKeyUpdated)
+		{
+			m_hashTable.UpdateMinvOffsetOnPath(pos);
+		}
+	}
+	
+	// Finally, if the LCP is in the flat levels, we need to set the corresponding bit in the deepest flat level,
+	// (and the m_treeDepth2 bit with 4 flat levels, which may or may not be already set)
+	//
+	if (lcpLen == flatLcpLen)
+	{
+		if (NumFlatLevels() == 3)
+		{
+			assert((m_treeDepth2[(value >> 40) / 64] & (uint64_t(1) << ((value >> 40) % 64))) == 0);
+			m_treeDepth2[(value >> 40) / 64] |= uint64_t(1) << ((value >> 40) % 64);
+		}
+		else
+		{
+			assert((m_treeDepth3[(value >> 32) / 64] & (uint64_t(1) << ((value >> 32) % 64))) == 0);
+			m_treeDepth2[(value >> 40) / 64] |= uint64_t(1) << ((value >> 40) % 64);
+			m_treeDepth3[(value >> 32) / 64] |= uint64_t(1) << ((value >> 32) % 64);
+		}
 	}
 	
-	// Finally, if lcp == 2, we need to set the corresponding m_treeDepth2 bit
+	// In de-amortized insertion mode, execute a bounded number of pending displacements
+	// This must happen after all the work above, since displacements invalidate the positions we got from QueryLCP
 	//
-	if (lcpLen == 2)
+	if (m_deamortizedStepsPerInsert > 0)
 	{
-		assert((m_treeDepth2[(value >> 40) / 64] & (uint64_t(1) << ((value >> 40) % 64))) == 0);
-		m_treeDepth2[(value >> 40) / 64] |= uint64_t(1) << ((value >> 40) % 64);
-	}	
+		m_hashTable.ExecutePendingDisplacements(m_deamortizedStepsPerInsert);
+	}
 	return true;
 }
 
-bool MlpSet::Exist(uint64_t value)
+// Run func(threadIndex) on numThreads threads, the calling thread being thread 0
+//
+template<typename Func>
+static void RunOnThreads(int numThreads, const Func& func)
 {
-	assert(m_hasCalledInit);
-	uint32_t ilen;
-	uint64_t _allPositions1[4], _allPositions2[4], _expectedHash[4];
-	uint32_t* allPositions1 = reinterpret_cast<uint32_t*>(_allPositions1);
-	uint32_t* allPositions2 = reinterpret_cast<uint32_t*>(_allPositions2);
-	uint32_t* expectedHash = reinterpret_cast<uint32_t*>(_expectedHash);
-	int lcpLen = m_hashTable.QueryLCP(value, 
-		                              ilen /*out*/, 
-		                              allPositions1 /*out*/, 
-		                              allPositions2 /*out*/, 
-		                              expectedHash /*out*/);
-	return (lcpLen == 8);
+	vector<std::thread> threads;
+	rep(t, 1, numThreads - 1)
+	{
+		threads.push_back(std::thread([&func, t]() { func(t); }));
+	}
+	func(0);
+	for (std::thread& th : threads)
+	{
+		th.join();
+	}
 }
 
-MlpSet::Promise MlpSet::LowerBoundInternal(uint64_t value, bool& found)
+// The smallest child in a 256-bit bitmap of children, -1 if there is none (a leaf)
+//
+static int FirstChildInBitMap(const uint64_t* children)
 {
-	assert(m_hasCalledInit);
-	found = true;
-	
-	// Issue the prefetch in case LCP turns out to be 2
+	rep(k, 0, 3)
+	{
+		if (children[k] != 0)
+		{
+			return k * 64 + __builtin_ctzll(children[k]);
+		}
+	}
+	return -1;
+}
+
+template<class Config>
+uint32_t BasicMlpSet<Config>::BulkLoad(const uint64_t* keys, uint32_t n, int numThreads)
+{
+	ReleaseAssert(numThreads >= 1);
+	// Partition the keys by their 2-byte prefix with a parallel counting sort:
+	// each thread counts the keys of its slice of the input, and scatters them to its own range of each partition
 	//
-	MEM_PREFETCH(m_treeDepth2[(value >> 48) * 4]);
-	
-#ifdef ENABLE_STATS
-	int numParentPathSteps = 0;
-	Auto(
-		assert(numParentPathSteps < 8);
-		stats.m_lowerBoundParentPathStepsHistogram[numParentPathSteps]++;
-	);
-#endif
+	vector<vector<uint32_t> > offsets(numThreads, vector<uint32_t>(65536, 0));
+	RunOnThreads(numThreads, [&](int t) {
+		uint32_t* cnt = offsets[t].data();
+		rep(i, int(uint64_t(n) * t / numThreads), int(uint64_t(n) * (t + 1) / numThreads) - 1)
+		{
+			cnt[keys[i] >> 48]++;
+		}
+	});
+	vector<uint32_t> partitionBegin(65537);
+	uint32_t sum = 0;
+	rep(b, 0, 65535)
+	{
+		partitionBegin[b] = sum;
+		rep(t, 0, numThreads - 1)
+		{
+			uint32_t cnt = offsets[t][b];
+			offsets[t][b] = sum;
+			sum += cnt;
+		}
+	}
+	partitionBegin[65536] = sum;
+	assert(sum == n);
+	vector<uint64_t> sorted(n);
+	RunOnThreads(numThreads, [&](int t) {
+		uint32_t* offset = offsets[t].data();
+		rep(i, int(uint64_t(n) * t / numThreads), int(uint64_t(n) * (t + 1) / numThreads) - 1)
+		{
+			sorted[offset[keys[i] >> 48]++] = keys[i];
+		}
+	});
+	// Sort the partitions, handed out to the threads in batches
+	//
+	std::atomic<uint32_t> nextPartition(0);
+	RunOnThreads(numThreads, [&](int) {
+		while (true)
+		{
+			uint32_t b = nextPartition.fetch_add(64);
+			if (b >= 65536) break;
+			rep(k, b, b + 63)
+			{
+				std::sort(sorted.begin() + partitionBegin[k], sorted.begin() + partitionBegin[k + 1]);
+			}
+		}
+	});
+	return BulkLoadSorted(sorted.data(), n, numThreads);
+}
 
-	uint32_t ilen;
-	uint32_t allPositions[2][8];
-	uint64_t _expectedHash[4];
-	uint32_t* expectedHash = reinterpret_cast<uint32_t*>(_expectedHash);
-	int lcpLen = m_hashTable.QueryLCP(value, 
-		                              ilen /*out*/, 
-		                              allPositions[0] /*out*/, 
-		                              allPositions[1] /*out*/, 
-		                              expectedHash /*out*/);
-	if (lcpLen == 8)
+template<class Config>
+uint32_t BasicMlpSet<Config>::BulkLoadSorted(const uint64_t* keys, uint32_t n, int numThreads)
+{
+	assert(m_hasCalledInit && m_sharedSegment == nullptr);
+	ReleaseAssert(numThreads >= 1);
+#ifndef NDEBUG
+	rep(i, 1, int(n) - 1)
 	{
-		return Promise(&m_hashTable.ht[allPositions[0][ilen - 1]]);
+		assert(keys[i - 1] <= keys[i]);
+	}
+#endif
+	if (m_byteAlphabet != nullptr || (m_isSmallSet && n <= x_smallSetMaxSize))
+	{
+		uint32_t numInserted = 0;
+		rep(i, 0, int(n) - 1)
+		{
+			numInserted += Insert(keys[i]);
+		}
+		return numInserted;
 	}
-	if (lcpLen == 2)
+	if (m_isSmallSet)
 	{
-		goto _flat_mapping;
+		assert(m_smallSetSize == 0);
+		PromoteSmallSet();
 	}
+	assert((m_root[0] | m_root[1] | m_root[2] | m_root[3]) == 0);
 	
-	// lcp in hash table
+	// The partitions, and the top two flat levels (a few KB, so we set them upfront)
 	//
+	vector<uint32_t> partitionBegin(65537);
+	rep(b, 0, 65535)
+	{
+		partitionBegin[b] = std::lower_bound(keys, keys + n, uint64_t(b) << 48) - keys;
+	}
+	partitionBegin[65536] = n;
+	rep(b, 0, 65535)
 	{
-		uint32_t pos = allPositions[0][ilen - 1];
-		int dlen = m_hashTable.ht[pos].GetFullKeyLen();
-		if (dlen == lcpLen)
+		if (partitionBegin[b] < partitionBegin[b + 1])
 		{
-			// path compression string matches, lower bound on child
-			//
-			uint32_t child = (value >> (56 - dlen * 8)) & 255;
-			int lbChild = m_hashTable.ht[pos].LowerBoundChild(child);
-			if (lbChild == -1) 
+			m_root[(b >> 8) / 64] |= uint64_t(1) << ((b >> 8) % 64);
+			m_treeDepth1[b / 64] |= uint64_t(1) << (b % 64);
+		}
+	}
+	// Group the partitions into chunks of about n / numThreads / 16 keys, handed out to the threads dynamically
+	//
+	vector<int> chunkBegin;
+	{
+		uint32_t chunkSize = max(uint64_t(1), uint64_t(n) / numThreads / 16);
+		uint32_t last = 0;
+		rep(b, 0, 65535)
+		{
+			if (b == 0 || partitionBegin[b] - last >= chunkSize)
 			{
-				goto _parent;
+				chunkBegin.push_back(b);
+				last = partitionBegin[b];
 			}
-			assert(lbChild != child);
-			// return the minimum value in lbChild subtree
-			//
-			uint64_t keyToFind = value & (~(255ULL << (56 - dlen * 8)));
-			keyToFind |= uint64_t(lbChild) << (56 - dlen * 8);
-			return m_hashTable.GetLookupMustExistPromise(dlen + 1, keyToFind);
 		}
-		else
+		chunkBegin.push_back(65536);
+	}
+	
+	// Parallel phase
+	//
+	int flatLcpLen = NumFlatLevels() - 1;
+	vector<BulkLoadThreadState> states(numThreads);
+	std::atomic<uint32_t> nextChunk(0);
+	RunOnThreads(numThreads, [&](int t) {
+		BulkLoadThreadState& state = states[t];
+		while (true)
 		{
-			// path compression string does not match
-			// either the given value is smaller than the whole subtree, or larger than the whole subtree
-			//
-			if (value < m_hashTable.ht[pos].minKey)
+			uint32_t c = nextChunk.fetch_add(1);
+			if (c + 1 >= chunkBegin.size()) break;
+			rep(b, chunkBegin[c], chunkBegin[c + 1] - 1)
 			{
-				// smaller than whole subtree, result is just subtreeMin
+				// the words of the deeper flat levels covered by partition b are not shared with other partitions
 				//
-				return Promise(&m_hashTable.ht[pos]);
+				uint32_t i = partitionBegin[b];
+				while (i < partitionBegin[b + 1])
+				{
+					uint64_t value = keys[i];
+					uint64_t mask = (uint64_t(1) << (64 - 8 * NumFlatLevels())) - 1;
+					uint32_t j = std::upper_bound(keys + i, keys + partitionBegin[b + 1], value | mask) - keys;
+					m_treeDepth2[(value >> 40) / 64] |= uint64_t(1) << ((value >> 40) % 64);
+					if (NumFlatLevels() == 4)
+					{
+						m_treeDepth3[(value >> 32) / 64] |= uint64_t(1) << ((value >> 32) % 64);
+					}
+					BulkLoadSubtree(keys, i, j, flatLcpLen + 1 /*ilen*/, state);
+					i = j;
+				}
 			}
-			else
-			{	
-				// larger than subtreeMax, need to visit parent path
-				//
-				goto _parent;
+		}
+		BulkLoadPlaceStaged(state);
+	});
+	
+	// Serial phase, insert the nodes set aside with Cuckoo displacement
+	// A leaf moved by a displacement updates the minvOffset of its ancestors already in the hash table (OnNodeMoved)
+	//
+	uint32_t numInserted = 0;
+	for (BulkLoadThreadState& state : states)
+	{
+		numInserted += state.numLeaves;
+		for (BulkLoadNode& node : state.pending)
+		{
+			bool isLeaf = (node.dlen == 8);
+			bool exist, failed;
+			uint32_t pos = m_hashTable.Insert(node.ilen, node.dlen, node.minKey, FirstChildInBitMap(node.children), 
+			                                  exist /*out*/, failed /*out*/);
+			ReleaseAssert(!exist && !failed);
+			BulkLoadFillNode(pos, isLeaf ? nullptr : node.children, node.minLeafIlen, false /*concurrent*/);
+			// In de-amortized insertion mode, drain the stash right away: there is no per-insert latency to bound here, 
+			// and unlike a new node of Insert, a node set aside may have a neighboring bitmap taking another stash slot
+			//
+			if (m_deamortizedStepsPerInsert > 0)
+			{
+				m_hashTable.ExecutePendingDisplacements(1 << 30);
 			}
 		}
+		if (Config::x_enableStats)
+		{
+			stats.m_bulkLoadNodeCount += state.numNodes;
+			stats.m_bulkLoadSerialNodeCount += state.pending.size();
+		}
+		vector<BulkLoadNode>().swap(state.pending);
 	}
 	
-_parent:
-	// The specified value is larger than the maximum in the subtree
-	// We need to return the smallest value larger than subtreeMax by visiting the parent path
-	// 
+	// Resolve the minvOffset placeholders, the hash table is read-only in this phase
+	// The lookups are issued in batches, with the Cuckoo positions prefetched first
+	//
 	{
-		ilen--;
-		for (; ilen > 2; ilen--)
-		{
-#ifdef ENABLE_STATS
-			numParentPathSteps++;
-#endif
-			rep(k, 0, 1)
+		CuckooHashTableNode* ht = m_hashTable.ht;
+		uint32_t numSlots = m_hashTable.htMask + 1 + 6 + CuckooHashTableBase::x_stashRegionSlots;
+		RunOnThreads(numThreads, [&](int t) {
+			uint32_t batch[x_bulkLoadBatchSize];
+			int batchSize = 0;
+			auto resolveBatch = [&]() {
+				rep(k, 0, batchSize - 1)
+				{
+					CuckooHashTableNode& node = ht[batch[k]];
+					bool found;
+					uint32_t leafPos = m_hashTable.Lookup(node.minvOffset & 15, node.minKey, found);
+					assert(found && ht[leafPos].IsLeaf() && ht[leafPos].minKey == node.minKey);
+					node.minvOffset = leafPos;
+				}
+				batchSize = 0;
+			};
+			rep(pos, int(uint64_t(numSlots) * t / numThreads), int(uint64_t(numSlots) * (t + 1) / numThreads) - 1)
 			{
-				uint32_t pos = allPositions[k][ilen - 1];
-				if (m_hashTable.ht[pos].IsEqualNoHash(value, ilen))
+				if (ht[pos].IsOccupiedAndNode() && (ht[pos].minvOffset & x_bulkLoadMinvPlaceholder))
 				{
-					assert(m_hashTable.ht[pos].GetIndexKeyLen() == ilen);
-					int dlen = m_hashTable.ht[pos].GetFullKeyLen();
-					assert((m_hashTable.ht[pos].minKey >> (64 - dlen * 8)) == (value >> (64 - dlen * 8)));
-					uint32_t child = (value >> (56 - dlen * 8)) & 255;
-					if (child < 255)
+					int leafIlen = ht[pos].minvOffset & 15;
+					MEM_PREFETCH(ht[HashFamily::HashFn1(ht[pos].minKey, leafIlen) & m_hashTable.htMask]);
+					MEM_PREFETCH(ht[HashFamily::HashFn2(ht[pos].minKey, leafIlen) & m_hashTable.htMask]);
+					batch[batchSize++] = pos;
+					if (batchSize == x_bulkLoadBatchSize)
 					{
-						int lbChild = m_hashTable.ht[pos].LowerBoundChild(child + 1);
-						if (lbChild != -1) 
-						{
-							assert(lbChild != child);
-							// return the minimum value in lbChild subtree
-							//
-							uint64_t keyToFind = value & (~(255ULL << (56 - dlen * 8)));
-							keyToFind |= uint64_t(lbChild) << (56 - dlen * 8);
-							return m_hashTable.GetLookupMustExistPromise(dlen + 1, keyToFind);
-						}
+						resolveBatch();
 					}
-					break;
+				}
+			}
+			resolveBatch();
+		});
+		if (m_leafFilter != nullptr)
+		{
+			rep(pos, 0, int(numSlots) - 1)
+			{
+				if (ht[pos].IsOccupiedAndNode() && ht[pos].IsLeaf())
+				{
+					m_leafFilter->Add(ht[pos].minKey, ht[pos].GetIndexKeyLen());
 				}
 			}
 		}
 	}
 	
-_flat_mapping:
-	// We have reached lv2 of the tree, which are stored in the flat bitarray instead of the hash table
-	//
-#ifdef ENABLE_STATS
-	numParentPathSteps++;
-#endif
-	uint64_t high24bits = value >> 40;
-	if ((high24bits & 255) < 255)
+	if (m_hotKeyCache != nullptr)
 	{
-		int lv2LbChild = Bitmap256LowerBound(m_treeDepth2 + (high24bits >> 8) * 4, (high24bits & 255) + 1);
-		if (lv2LbChild != -1)
+		rep(i, 0, int(n) - 1)
 		{
-			uint64_t keyToFind = ((high24bits >> 8) << 48) | (uint64_t(lv2LbChild) << 40);
-			return m_hashTable.GetLookupMustExistPromise(3, keyToFind);
+			m_hotKeyCache->OnInsert(keys[i]);
 		}
 	}
-	// check lv1 of tree
-	//
-#ifdef ENABLE_STATS
-	numParentPathSteps++;
-#endif
-	if (((high24bits >> 8) & 255) < 255)
+	if (m_hashTable.GetUpperLevelMirror() != nullptr)
 	{
-		int lv1LbChild = Bitmap256LowerBound(m_treeDepth1 + (high24bits >> 16) * 4, ((high24bits >> 8) & 255) + 1);
-		if (lv1LbChild != -1)
-		{
-			uint64_t high16bits = ((high24bits >> 16) << 8) | lv1LbChild;
-			int lv2FirstChild = Bitmap256LowerBound(m_treeDepth2 + high16bits * 4, 0 /*child*/);
-			assert(lv2FirstChild != -1);
-			uint64_t keyToFind = (high16bits << 48) | (uint64_t(lv2FirstChild) << 40);
-			return m_hashTable.GetLookupMustExistPromise(3, keyToFind);
-		}
+		m_hashTable.SetUpperLevelMirror(nullptr);
 	}
-	// finally check root
-	//
-#ifdef ENABLE_STATS
-	numParentPathSteps++;
-#endif
-	if ((high24bits >> 16) < 255)
+	return numInserted;
+}
+
+template<class Config>
+int BasicMlpSet<Config>::BulkLoadSubtree(const uint64_t* keys, uint32_t lo, uint32_t hi, int ilen, BulkLoadThreadState& state)
+{
+	assert(lo < hi && ilen <= 8);
+	uint64_t minKey = keys[lo];
+	BulkLoadNode node;
+	node.minKey = minKey;
+	node.ilen = ilen;
+	memset(node.children, 0, sizeof(node.children));
+	if (minKey == keys[hi - 1])
+	{
+		// a leaf (the keys are all duplicates)
+		//
+		node.dlen = 8;
+		node.minLeafIlen = ilen;
+		state.numLeaves++;
+	}
+	else
 	{
-		int lv0LbChild = Bitmap256LowerBound(m_root, (high24bits >> 16) + 1);
-		if (lv0LbChild != -1)
+		// the path-compressed node, branching at the first byte where the smallest and the largest key differ
+		//
+		node.dlen = __builtin_clzll(minKey ^ keys[hi - 1]) / 8;
+		assert(ilen <= node.dlen && node.dlen < 8);
+		int shiftLen = 56 - 8 * node.dlen;
+		uint32_t i = lo;
+		while (i < hi)
 		{
-			int lv1FirstChild = Bitmap256LowerBound(m_treeDepth1 + lv0LbChild * 4, 0 /*child*/);
-			assert(lv1FirstChild != -1);
-			uint64_t high16bits = (lv0LbChild << 8) | lv1FirstChild;
-			int lv2FirstChild = Bitmap256LowerBound(m_treeDepth2 + high16bits * 4, 0 /*child*/);
-			assert(lv2FirstChild != -1);
-			uint64_t keyToFind = (high16bits << 48) | (uint64_t(lv2FirstChild) << 40);
-			return m_hashTable.GetLookupMustExistPromise(3, keyToFind);
+			uint64_t value = keys[i];
+			uint32_t j = std::upper_bound(keys + i, keys + hi, value | ((uint64_t(1) << shiftLen) - 1)) - keys;
+			int leafIlen = BulkLoadSubtree(keys, i, j, node.dlen + 1, state);
+			if (i == lo)
+			{
+				node.minLeafIlen = leafIlen;
+			}
+			int child = (value >> shiftLen) % 256;
+			node.children[child / 64] |= uint64_t(1) << (child % 64);
+			i = j;
 		}
 	}
-	// not found
-	//
-	found = false;
-	return Promise();
+	state.numNodes++;
+	state.staged.push_back(node);
+	if (state.staged.size() == x_bulkLoadBatchSize)
+	{
+		BulkLoadPlaceStaged(state);
+	}
+	return node.minLeafIlen;
 }
 
-MlpSet::Promise MlpSet::LowerBound(uint64_t value)
+template<class Config>
+void BasicMlpSet<Config>::BulkLoadPlaceStaged(BulkLoadThreadState& state)
 {
-	bool found;
-	Promise p = LowerBoundInternal(value, found);
-	if (found) 
+	CuckooHashTableNode* ht = m_hashTable.ht;
+	uint32_t htMask = m_hashTable.htMask;
+	for (BulkLoadNode& node : state.staged)
+	{
+		node.pos = HashFamily::HashFn1(node.minKey, node.ilen) & htMask;
+		MEM_PREFETCH(ht[node.pos]);
+	}
+	// try the first positions, and keep the nodes that failed at the front of staged to try their second positions
+	//
+	int numRetries = 0;
+	rep(round, 0, 1)
 	{
-		p.Prefetch();
+		int n = (round == 0) ? int(state.staged.size()) : numRetries;
+		numRetries = 0;
+		rep(i, 0, n - 1)
+		{
+			BulkLoadNode& node = state.staged[i];
+			bool isLeaf = (node.dlen == 8);
+			uint32_t hash18bit = HashFamily::HashFn3(node.minKey, node.ilen) & ((1 << 18) - 1);
+			if (ht[node.pos].TryInitConcurrent(node.ilen, node.dlen, node.minKey, hash18bit, FirstChildInBitMap(node.children)))
+			{
+				BulkLoadFillNode(node.pos, isLeaf ? nullptr : node.children, node.minLeafIlen, true /*concurrent*/);
+			}
+			else if (round == 0)
+			{
+				node.pos = HashFamily::HashFn2(node.minKey, node.ilen) & htMask;
+				MEM_PREFETCH(ht[node.pos]);
+				state.staged[numRetries++] = node;
+			}
+			else
+			{
+				state.pending.push_back(node);
+			}
+		}
 	}
-	return p;
+	state.staged.clear();
 }
 
-uint64_t MlpSet::LowerBound(uint64_t value, bool& found)
+template<class Config>
+void BasicMlpSet<Config>::BulkLoadFillNode(uint32_t pos, const uint64_t* children, int minLeafIlen, bool concurrent)
 {
-	Promise p = LowerBoundInternal(value, found);
-	if (found) 
+	CuckooHashTableNode& node = m_hashTable.ht[pos];
+	if (children == nullptr)
 	{
-		p.Prefetch();
-		return p.Resolve();
+		assert(node.IsLeaf());
+		node.minvOffset = pos;
+		return;
 	}
-	else
+	assert(!node.IsLeaf());
+	node.minvOffset = x_bulkLoadMinvPlaceholder | minLeafIlen;
+	// the first child was set by Init
+	//
+	bool first = true;
+	rep(k, 0, 3)
 	{
-		return 0xffffffffffffffffULL;
+		uint64_t bits = children[k];
+		while (bits != 0)
+		{
+			int child = k * 64 + __builtin_ctzll(bits);
+			bits &= bits - 1;
+			if (first)
+			{
+				first = false;
+				continue;
+			}
+			if (node.IsUsingInternalChildMap() && node.GetChildNum() == 8)
+			{
+				node.ExtendToBitMap(false /*inlineBitMap*/, concurrent);
+			}
+			node.AddChild(child, false /*smallAlphabet*/);
+		}
 	}
 }
 
+// The configurations are compiled in explicitly, see MlpSetConfig.h
+//
+template class BasicCuckooHashTable<DefaultMlpSetConfig>;
+template class BasicCuckooHashTable<StatsMlpSetConfig>;
+template class BasicCuckooHashTable<FourFlatLevelsMlpSetConfig>;
+template class BasicCuckooHashTable<TransparentHugePageMlpSetConfig>;
+template class BasicCuckooHashTable<NumaMlpSetConfig>;
+template class BasicCuckooHashTable<MlpSetConfig<CRC32HashFamily> >;
+template class BasicCuckooHashTable<MlpSetConfig<MultiplyShiftHashFamily> >;
+template class BasicMlpSet<DefaultMlpSetConfig>;
+template class BasicMlpSet<StatsMlpSetConfig>;
+template class BasicMlpSet<FourFlatLevelsMlpSetConfig>;
+template class BasicMlpSet<TransparentHugePageMlpSetConfig>;
+template class BasicMlpSet<NumaMlpSetConfig>;
+template class BasicMlpSet<MlpSetConfig<CRC32HashFamily> >;
+template class BasicMlpSet<MlpSetConfig<MultiplyShiftHashFamily> >;
+
 }	// namespace MlpSetUInt64
 
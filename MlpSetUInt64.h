@@ -1,6 +1,10 @@
 #pragma once
 
 #include "common.h"
+#include "MlpSetConfig.h"
+#include "MlpSetEpoch.h"
+#include "MlpSetShared.h"
+#include "MlpSetSnapshot.h"
 
 
 namespace MlpSetUInt64
@@ -16,12 +20,14 @@ struct CuckooHashTableNode
 	// 2 bit: occupy flag, 00 = not used, 10 = used as node, 11 = used as bitmap
 	// 3 bit: length of the indexing part of the key (1-8), indexLen in above diagram
 	// 3 bit: length of the full key containing path-compressed bytes (1-8), fullKeyLen in above diagram
-	// 3 bit: 000 = using internal map, 100 = pointer external map, otherwise offset of the external bitmap 
-	// 3 bit: # of childs if using internal map, 0 + bitmap's highest 2 bits if using external bitmap
+	// 3 bit: 000 = using internal map, 100 = pointer external map or inline bitmap, otherwise offset of the external bitmap 
+	// 3 bit: # of childs if using internal map, 0 + bitmap's highest 2 bits if using external bitmap, 
+	//        100 if using inline bitmap (100 + 100 above)
 	// 18 bit: hash 
 	//
 	uint32_t hash;	
-	// points to min node in this subtree
+	// points to min node in this subtree (the hash table position of the leaf holding minKey)
+	// a leaf points to itself. This is kept valid when leaves are moved by Cuckoo displacement and splits
 	//
 	uint32_t minvOffset;
 	// the min node's full key
@@ -33,6 +39,7 @@ struct CuckooHashTableNode
 	// the child map
 	// when using internal map, each byte stores a child
 	// when using external bitmap, each bit represent whether the corresponding child exists
+	// when using inline bitmap, all children are < 64, and each bit represent whether the corresponding child exists
 	// when using pointer external bitmap, this is the pointer to the 32-byte bitmap
 	// when it is a leaf, this is the opaque data pointer
 	// 
@@ -142,7 +149,13 @@ struct CuckooHashTableNode
 	bool IsExternalPointerBitMap()
 	{
 		assert(IsNode() && !IsUsingInternalChildMap());
-		return ((hash >> 21) & 7) == 4;
+		return ((hash >> 20) & 15) == 8;
+	}
+	
+	bool IsInlineBitMap()
+	{
+		assert(IsNode() && !IsUsingInternalChildMap());
+		return ((hash >> 20) & 15) == 9;
 	}
 	
 	int GetChildNum()
@@ -161,17 +174,44 @@ struct CuckooHashTableNode
 	
 	void Init(int ilen, int dlen, uint64_t dkey, uint32_t hash18bit, int firstChild);
 	
+	// Same as Init, but claims the slot with a CAS on hash, so that several threads can initialize nodes 
+	// in the same hash table concurrently (see BasicMlpSet::BulkLoadSorted)
+	// Returns false (and does nothing) if the slot is occupied
+	//
+	bool TryInitConcurrent(int ilen, int dlen, uint64_t dkey, uint32_t hash18bit, int firstChild);
+	
 	int FindNeighboringEmptySlot();
 	
+	// Same as FindNeighboringEmptySlot, but also claims the slot as a bitmap slot with a CAS
+	//
+	int ClaimNeighboringEmptySlot();
+	
 	void BitMapSet(int child);
 	
 	// TODO: free external bitmap memory when hash table is destroyed
+	// The bitmap is allocated from the arena of the CowRegion if the node is in one (see BasicMlpSet::EnableSnapshots)
 	//
 	uint64_t* AllocateExternalBitMap();
 	
+	// The bitmap of a node using a pointer external bitmap
+	// childMap holds the offset of the bitmap from the node itself rather than an absolute pointer, 
+	// so that a hash table copied together with its external bitmaps stays valid (see BasicMlpSet::PublishShared)
+	//
+	uint64_t* GetExternalBitMap()
+	{
+		return reinterpret_cast<uint64_t*>(reinterpret_cast<uintptr_t>(this) + childMap);
+	}
+	
+	void SetExternalBitMap(uint64_t* ptr)
+	{
+		childMap = reinterpret_cast<uintptr_t>(ptr) - reinterpret_cast<uintptr_t>(this);
+	}
+	
 	// Switch from internal child list to internal/external bitmap
+	// or to inline bitmap if inlineBitMap is true (all children must be < 64)
+	// concurrent: the neighboring slot is claimed by ClaimNeighboringEmptySlot (see TryInitConcurrent)
 	//
-	void ExtendToBitMap();
+	void ExtendToBitMap(bool inlineBitMap, bool concurrent = false);
 	
 	// Find minimum child >= given child
 	// returns -1 if larger child does not exist
@@ -183,8 +223,10 @@ struct CuckooHashTableNode
 	bool ExistChild(int child);
 	
 	// Add a new child, must not exist
+	// smallAlphabet: the caller guarantees all children of this node are < 64, 
+	// so the node switches to inline bitmap instead of internal/external bitmap when internal list is full
 	//
-	void AddChild(int child);
+	void AddChild(int child, bool smallAlphabet = false);
 
 	// for debug only, get list of all children in sorted order
 	//
@@ -205,24 +247,28 @@ struct CuckooHashTableNode
 
 static_assert(sizeof(CuckooHashTableNode) == 24, "size of node should be 24");
 
-// This class does not own the main hash table's memory
-// TODO: it should manage the external bitmap memory, but not implemented yet
+class UpperLevelMirror;
+
+// The part of the Cuckoo hash table that does not depend on the hash family
 //
-class CuckooHashTable
+class CuckooHashTableBase
 {
 public:
-#ifdef ENABLE_STATS
+	// statistics, only collected if enabled by the configuration (see MlpSetConfig.h)
+	//
 	struct Stats
 	{
 		uint32_t m_slowpathCount;
 		uint32_t m_movedNodesCount;
 		uint32_t m_relocatedBitmapsCount;
+		uint32_t m_stashedNodesCount;
+		uint32_t m_stashHighWatermark;
+		uint32_t m_stashFullFallbackCount;
 		uint32_t m_lcpResultHistogram[9];
 		Stats();
 		void ClearStats();
 		void ReportStats();
 	};
-#endif
 
 	class LookupMustExistPromise
 	{
@@ -245,18 +291,29 @@ public:
 			, shiftedKey(shiftedKey)
 		{ }
 		
+		// A promise that is already resolved to the given value
+		//
+		static LookupMustExistPromise FromValue(uint64_t value)
+		{
+			return LookupMustExistPromise(true /*valid*/, 0 /*shiftLen*/, nullptr, nullptr, 0 /*expectedHash*/, value);
+		}
+		
 		bool IsValid() { return valid; }
 		
 		uint64_t Resolve()
 		{
 			assert(IsValid());
-			if (h2 == nullptr || h1->IsEqual(expectedHash, shiftLen, shiftedKey))
+			if (h2 == nullptr)
+			{
+				return (h1 == nullptr) ? shiftedKey : h1->minKey;
+			}
+			if (h1->IsEqual(expectedHash, shiftLen, shiftedKey))
 			{
 				return h1->minKey;
 			}
 			else
 			{
-				assert(h1->IsEqual(expectedHash, shiftLen, shiftedKey));
+				assert(h2->IsEqual(expectedHash, shiftLen, shiftedKey));
 				return h2->minKey;
 			}
 		}
@@ -280,9 +337,96 @@ public:
 		uint64_t shiftedKey;
 	};
 	
-	CuckooHashTable();
+	// How QueryLCP finds the deepest node on the path of the key
+	//
+	enum ProbeStrategy
+	{
+		// Hash all prefixes and probe all their Cuckoo positions in parallel
+		// Best when the hash table is much larger than the cache, so every probe is a DRAM miss
+		//
+		PROBE_ALL_LENGTHS,
+		// Walk down the tree from the first hash table level, one Lookup per node on the path
+		// Best when the hash table is cache-resident, since it only touches the nodes on the path
+		//
+		PROBE_TOP_DOWN
+	};
+	
+	// How QueryLCP (in PROBE_ALL_LENGTHS mode) compares the hash tags of the candidate positions against the expected hashes
+	//
+	enum ProbeKernel
+	{
+		// one length at a time, from the longest
+		//
+		PROBE_KERNEL_SCALAR,
+		// gather the tags of each candidate array with one AVX2 gather, compare all lengths at once
+		//
+		PROBE_KERNEL_AVX2,
+		// gather the tags of both candidate arrays with one AVX-512 gather
+		//
+		PROBE_KERNEL_AVX512
+	};
 	
-	void Init(CuckooHashTableNode* _ht, uint64_t _mask);
+	// Returns whether the CPU we are running on supports kernel
+	//
+	static bool IsProbeKernelSupported(ProbeKernel kernel);
+	
+	// The kernel is process-wide, and defaults to PROBE_KERNEL_SCALAR
+	// The vector kernels must wait for all probed cache lines, while the scalar loop can stop at the first (longest) match,
+	// so they are only faster if most probes hit the cache. SetProbeKernel fails if the CPU does not support the kernel.
+	//
+	static void SetProbeKernel(ProbeKernel kernel);
+	static ProbeKernel GetProbeKernel();
+	
+	// Max # of nodes that can be parked in the stash in de-amortized insertion mode
+	//
+	static const int x_stashSize = 64;
+	// Total # of slots needed by the stash, including the 3-slot guard zone on each side
+	// (stash nodes may keep their bitmap in a neighboring stash slot, just like normal nodes)
+	//
+	static const int x_stashRegionSlots = x_stashSize + 6;
+};
+
+// The Cuckoo hash table, with the hash functions and statistics given by Config (see MlpSetConfig.h)
+// This class does not own the main hash table's memory
+// TODO: it should manage the external bitmap memory, but not implemented yet
+//
+template<class Config>
+class BasicCuckooHashTable : public CuckooHashTableBase
+{
+public:
+	typedef typename Config::HashFamily HashFamily;
+	
+	BasicCuckooHashTable();
+	~BasicCuckooHashTable();
+	
+	// Nodes with index len < lowestIndexLen are not stored in the hash table 
+	// (the owner keeps those levels of the tree in flat bitmaps)
+	// If the configuration fixes the # of flat levels, lowestIndexLen must agree with it
+	//
+	void Init(CuckooHashTableNode* _ht, uint64_t _mask, int lowestIndexLen = 3);
+	
+	// Nodes with index len smaller than this are not stored in hash table (3 or 4), 
+	// a compile-time constant if the configuration fixes the # of flat levels
+	//
+	int LowestIndexLen() const { return (Config::x_numFlatLevels != 0) ? Config::x_numFlatLevels : m_lowestIndexLen; }
+	
+	// Enable de-amortized insertion mode
+	// The caller must have reserved x_stashRegionSlots zero-initialized slots starting at ht[stashRegionBegin]
+	// In this mode, when both Cuckoo positions of a new node are occupied, 
+	// the node is parked in the stash instead of executing the whole displacement chain.
+	// The displacements are later executed in bounded steps by ExecutePendingDisplacements().
+	// Lookups (QueryLCP, Lookup, GetLookupMustExistPromise) check the stash as well when it is not empty. 
+	//
+	void InitStash(uint32_t stashRegionBegin);
+	
+	// Execute at most maxSteps Cuckoo displacement steps to move stashed nodes back into the hash table
+	// Each step moves at most 2 nodes (or relocates 1 bitmap)
+	//
+	void ExecutePendingDisplacements(int maxSteps);
+	
+	// # of nodes currently parked in the stash
+	//
+	int GetStashedNodesCount() { return m_stashCount; }
 	
 	// Execute Cuckoo displacements to make up a slot for the specified key
 	//
@@ -300,15 +444,21 @@ public:
 
 	// Single point lookup on a key that is supposed to exist
 	//
-	CuckooHashTable::LookupMustExistPromise GetLookupMustExistPromise(int ilen, uint64_t ikey);
+	LookupMustExistPromise GetLookupMustExistPromise(int ilen, uint64_t ikey);
+	
+	// Point the minvOffset of all ancestors of the leaf at leafPos whose minimum is this leaf to leafPos
+	// The ancestors whose minimum is the leaf form a chain starting from its parent, 
+	// so the walk stops at the first ancestor with a different minKey
+	//
+	void UpdateMinvOffsetOnPath(uint32_t leafPos);
 	
 	// Fast LCP query using vectorized hash computation and memory level parallelism
-	// Since we only store nodes of depth >= 3 in hash table, 
-	// this function will return 2 if the LCP is < 3 (even if the real LCP is < 2).
-	// In case this function returns > 2,
+	// Since we only store nodes of depth >= L = m_lowestIndexLen in hash table, 
+	// this function will return L-1 if the LCP is < L (even if the real LCP is < L-1).
+	// In case this function returns > L-1,
 	//   idxLen will be the index len of the lcp node in hash table (so allPositions1[idxLen - 1] will be the lcp node)
 	//   for i >= idxLen - 1, allPositions1[i] will be the node for prefix i+1 (0 if not exist)
-	//   for 2 <= i < idxLen - 1, allPositions1[i] and allPositions2[i] will be the possible 2 places where the node show up,
+	//   for L-1 <= i < idxLen - 1, allPositions1[i] and allPositions2[i] will be the possible 2 places where the node show up,
 	//   and expectedHash[i] will be its expected hash value.
 	// allPositions1, allPositions2, expectedHash must be buffers at least 32 bytes long. 
 	//
@@ -318,53 +468,523 @@ public:
                  uint32_t* allPositions2, 
                  uint32_t* expectedHash);
 	
+	void SetProbeStrategy(ProbeStrategy strategy) { m_probeStrategy = strategy; }
+	ProbeStrategy GetProbeStrategy() { return m_probeStrategy; }
+	
+	// Resolve the first hash table level (index len m_lowestIndexLen) from mirror in QueryLCP, nullptr to disable
+	// The mirror must be rebuilt (or disabled) after any modification to the hash table
+	//
+	void SetUpperLevelMirror(UpperLevelMirror* mirror) { m_upperLevelMirror = mirror; }
+	UpperLevelMirror* GetUpperLevelMirror() { return m_upperLevelMirror; }
+	
 	// hash table array pointer
 	//
 	CuckooHashTableNode* ht;
 	// hash table mask (always a power of 2 minus 1)
 	//
 	uint32_t htMask;
-#ifdef ENABLE_STATS
-	// statistic info
+	// nodes with index len smaller than this are not stored in hash table (3 or 4), read it with LowestIndexLen()
+	//
+	int m_lowestIndexLen;
+	// strategy used by QueryLCP
+	//
+	ProbeStrategy m_probeStrategy;
+	// mirror of the first hash table level, nullptr if not in use
+	//
+	UpperLevelMirror* m_upperLevelMirror;
+	// statistic info, only updated if Config::x_enableStats
 	//
 	Stats stats;
-#endif
 
 private:
 	void HashTableCuckooDisplacement(uint32_t victimPosition, int rounds, bool& failed);
 	
+	// QueryLCP in PROBE_TOP_DOWN mode, same contract as QueryLCP,
+	// except that all candidate positions are exact (allPositions2 is a copy of allPositions1)
+	// and expectedHash is not populated
+	//
+	int QueryLCPTopDown(uint64_t key, 
+	                    uint32_t& idxLen, 
+	                    uint32_t* allPositions1, 
+	                    uint32_t* allPositions2);
+	
+	// Must be called after a node is moved to newPosition, to keep minvOffset valid if the node is a leaf
+	//
+	void OnNodeMoved(uint32_t newPosition);
+	
+	// Free up a slot occupied by a bitmap by relocating the bitmap of its owner node
+	//
+	void RelocateBitMapInSlot(uint32_t position);
+	
+	// Returns the index of a free stash slot, or -1 if the stash is full
+	//
+	uint32_t AllocateStashSlot();
+	
+	// Find node (ilen, ikey) in stash, returns -1 if not found
+	//
+	uint32_t LookupInStash(int ilen, uint64_t ikey);
+	
+	// Redirect QueryLCP candidate positions to the stash for prefixes of key that are parked in stash
+	//
+	void ApplyStashToCandidates(uint64_t key, uint32_t* allPositions1, uint32_t* allPositions2);
+	
+	// index of the first usable stash slot, 0 if stash is not enabled
+	//
+	uint32_t m_stashBegin;
+	// # of nodes in stash
+	//
+	int m_stashCount;
+	// stack of stash slots that are waiting to be moved back into the hash table (x_stashSize entries)
+	// allocated only when stash is enabled, to keep the object small
+	//
+	uint32_t* m_stashPending;
+	
 #ifndef NDEBUG
 	bool m_hasCalledInit;
 #endif
 };
 
-class MlpSet
+typedef BasicCuckooHashTable<DefaultMlpSetConfig> CuckooHashTable;
+
+// Order-preserving per-depth byte remapping
+// For each byte position (depth), the set of byte values that appear at that position (the alphabet) 
+// is mapped to dense codes 0, 1, .., k-1 in increasing order.
+// A key is representable if all its bytes are in the alphabets of their depths, 
+// and the comparison order of representable keys is the same as the order of their codes
+//
+struct ByteAlphabet
+{
+	ByteAlphabet();
+	
+	// Add all bytes of key to the alphabets, Finalize() must be called afterwards
+	//
+	void AddKey(uint64_t key);
+	
+	// Build the encode/decode tables
+	//
+	void Finalize();
+	
+	// Returns false if key is not representable
+	//
+	bool Encode(uint64_t key, uint64_t& code);
+	
+	// Get the code of the smallest representable key >= key
+	// returns false if no such key exists
+	//
+	bool EncodeLowerBound(uint64_t key, uint64_t& code);
+	
+	uint64_t Decode(uint64_t code);
+	
+	// for each depth and byte b, bit 9 is set if b is not in alphabet, 
+	// low 9 bits is the code of the smallest symbol >= b (alphabet size if not exist)
+	//
+	uint16_t encode[8][256];
+	uint8_t decode[8][256];
+	// alphabet size of each depth
+	//
+	uint16_t size[8];
+	// bitmap of the alphabet of each depth
+	//
+	uint64_t present[8][4];
+};
+
+// Fingerprint filter on the full keys (leaves) of an MlpSet, used by the Exist fast path
+// The filter is an array of 64-byte buckets of 32 16-bit entries, and a key only maps to one bucket, 
+// so a negative answer costs a single cache line.
+// Each entry is (13-bit non-zero fingerprint << 3) | (index len of the leaf - 1),
+// so on a fingerprint match, only the two Cuckoo positions of the leaf need to be probed (instead of QueryLCP).
+// Entries are never removed. When a split moves a leaf to a larger index len, 
+// its entry is updated in place if that is unambiguous, otherwise a new entry is added and the stale one stays
+// (a stale entry only costs an extra probe). When a bucket is full, further entries are dropped, 
+// and all queries on that bucket fall back to QueryLCP.
+//
+class LeafFilter
+{
+public:
+	// Returned by Query if the bucket is full so the filter cannot tell
+	//
+	static const uint32_t x_unknown = 1 << 8;
+	
+	LeafFilter();
+	~LeafFilter();
+	
+	// Allocate the filter for at most maxSetSize keys (about 4 bytes per key)
+	//
+	void Init(uint32_t maxSetSize);
+	
+	// Remove all entries
+	//
+	void Clear();
+	
+	void Add(uint64_t key, int ilen);
+	
+	// The leaf of key is moved from oldIlen to newIlen
+	//
+	void UpdateIndexLen(uint64_t key, int oldIlen, int newIlen);
+	
+	// Returns 0 if key does not exist, x_unknown if the filter cannot tell, 
+	// otherwise bit i-1 is set if the leaf of key may exist at index len i
+	//
+	uint32_t Query(uint64_t key);
+	
+	uint64_t GetMemoryFootprint() { return m_allocatedSize; }
+	
+private:
+	uint16_t* GetBucket(uint64_t key, uint16_t& fingerprint);
+	
+	// 32 entries per bucket
+	//
+	uint16_t* m_buckets;
+	uint32_t m_bucketMask;
+	uint64_t m_allocatedSize;
+};
+
+// Small set-associative cache of recent Exist and LowerBound answers, meant to stay resident in L2
+// Each set has 8 ways whose 16-bit tags are compared with one SSE instruction, 
+// and the full key is compared afterwards, so the answers are always exact.
+// Coherence with Insert: 
+//   an Exist answer can only go stale if the queried key itself is inserted, so only that entry is invalidated;
+//   a LowerBound(q) answer goes stale if any key in [q, answer) is inserted, and those entries cannot be located,
+//   so LowerBound answers are tagged with an insertion generation, and every Insert invalidates all of them.
+// So the cache is most effective on read-mostly workloads.
+//
+class HotKeyCache
+{
+public:
+	HotKeyCache();
+	~HotKeyCache();
+	
+	// Allocate about sizeBytes of memory (rounded down to a power of 2 # of sets)
+	//
+	void Init(uint32_t sizeBytes);
+	
+	// Returns false on cache miss
+	//
+	bool LookupExist(uint64_t key, bool& exist);
+	bool LookupLowerBound(uint64_t key, uint64_t& result, bool& found);
+	
+	void StoreExist(uint64_t key, bool exist);
+	void StoreLowerBound(uint64_t key, uint64_t result, bool found);
+	
+	// Must be called whenever key is inserted into the set
+	//
+	void OnInsert(uint64_t key);
+	
+	uint64_t GetNumLookups() { return m_numLookups; }
+	uint64_t GetNumHits() { return m_numHits; }
+	
+private:
+	enum EntryKind : uint32_t
+	{
+		EXIST_TRUE,
+		EXIST_FALSE,
+		LOWER_BOUND_FOUND,
+		LOWER_BOUND_NOT_FOUND
+	};
+	
+	struct Entry
+	{
+		uint64_t key;
+		uint64_t answer;
+		// the value of m_generation when a LowerBound answer is stored
+		//
+		uint32_t generation;
+		EntryKind kind;
+	};
+	
+	// Returns the index of the entry holding key, or -1
+	// setIndex and tag are set to the set and tag of key
+	//
+	int Find(uint64_t key, uint32_t& setIndex, uint16_t& tag);
+	Entry* FindOrAllocate(uint64_t key);
+	
+	// 8 tags per set, 0 if the way is empty
+	// the tags are kept apart from the entries, so that a cache miss only touches the (small, hot) tag array
+	//
+	uint16_t* m_tags;
+	// 8 entries per set
+	//
+	Entry* m_entries;
+	uint32_t m_setMask;
+	// incremented on every Insert, LowerBound answers with an older generation are stale
+	//
+	uint32_t m_generation;
+	// for choosing the victim way
+	//
+	uint32_t m_replaceCounter;
+	uint64_t m_numLookups;
+	uint64_t m_numHits;
+};
+
+// Dense mirror of the first hash table level (the nodes with index len 3, or 4 with 4 flat levels)
+// These nodes are on the path of almost every query, but they are scattered across the hash table, 
+// so they compete for cache and TLB with the cold leaves, and each probe also touches the other (cold) Cuckoo position.
+// The nodes correspond one-to-one to the set bits of the deepest flat bitmap (m_treeDepth2, or m_treeDepth3), 
+// so the mirror keeps a copy of each node at the rank of its bit, contiguously in hugepage memory.
+// The rank is the count in a directory of 512-bit blocks plus the popcounts of one cache line of the bitmap.
+// The mirror is a snapshot, so it is only used until the next modification of the set.
+//
+class UpperLevelMirror
 {
 public:
-#ifdef ENABLE_STATS
+	struct Entry
+	{
+		uint64_t minKey;
+		// position of the node in hash table
+		//
+		uint32_t position;
+		uint32_t padding;
+	};
+	
+	UpperLevelMirror();
+	~UpperLevelMirror();
+	
+	// Build the mirror of the nodes with index len prefixLen in hashTable (a BasicCuckooHashTable)
+	// bitmap is the flat bitmap of all prefixes of length prefixLen, which must not be changed while the mirror is in use
+	//
+	template<class HashTable>
+	void Build(const uint64_t* bitmap, int prefixLen, HashTable* hashTable);
+	
+	// Returns the entry of the node whose index key is the prefix of key, nullptr if the node does not exist
+	//
+	Entry* Find(uint64_t key)
+	{
+		uint64_t idx = key >> m_shift;
+		const uint64_t* word = m_bitmap + idx / 64;
+		if (((*word) & (uint64_t(1) << (idx % 64))) == 0)
+		{
+			return nullptr;
+		}
+		uint32_t rank = m_blockRank[idx / 512] + __builtin_popcountll((*word) & ((uint64_t(1) << (idx % 64)) - 1));
+		for (const uint64_t* w = m_bitmap + idx / 512 * 8; w < word; w++)
+		{
+			rank += __builtin_popcountll(*w);
+		}
+		return m_entries + rank;
+	}
+	
+	uint32_t GetNumEntries() { return m_numEntries; }
+	uint64_t GetMemoryFootprint() { return m_allocatedSize; }
+	
+private:
+	const uint64_t* m_bitmap;
+	// the bitmap index of a key is key >> m_shift
+	//
+	int m_shift;
+	// # of set bits before each 512-bit block of the bitmap
+	//
+	uint32_t* m_blockRank;
+	Entry* m_entries;
+	uint32_t m_numEntries;
+	// both arrays live in one hugepage allocation, reused by later builds if large enough
+	//
+	void* m_memoryPtr;
+	uint64_t m_allocatedSize;
+};
+
+// The set, configured at compile time by Config (see MlpSetConfig.h)
+//
+template<class Config>
+class BasicMlpSet
+{
+public:
+	// statistics, only collected if Config::x_enableStats
+	//
 	struct Stats
 	{
 		uint32_t m_lowerBoundParentPathStepsHistogram[8];
+		// # of dependent memory round trips (out of L2) of a lower_bound query, including resolving the promise
+		//
+		uint32_t m_lowerBoundRoundTripsHistogram[8];
+		// # of nodes built by BulkLoadSorted, and # of them inserted in the serial phase
+		//
+		uint64_t m_bulkLoadNodeCount;
+		uint64_t m_bulkLoadSerialNodeCount;
 		Stats();
 		void ClearStats();
 		void ReportStats();
 	};
 	Stats stats;
-#endif
 
-	typedef CuckooHashTable::LookupMustExistPromise Promise;
+	typedef typename Config::HashFamily HashFamily;
+	typedef typename Config::Allocator Allocator;
+	typedef BasicCuckooHashTable<Config> HashTable;
+	typedef CuckooHashTableBase::LookupMustExistPromise Promise;
 	
-	MlpSet();
-	~MlpSet();
+	BasicMlpSet();
+	~BasicMlpSet();
 	
 	// Initialize the set to hold at most maxSetSize elements
+	// numFlatLevels is the # of top levels of the tree stored in flat bitmaps instead of the hash table, 3 or 4.
+	// With 4 flat levels, a 256^4 bits (512MB) depth-3 bitmap is allocated, 
+	// which removes all the index-len-3 nodes from the hash table. 
+	// This only pays off if the keys are dense in their 4-byte prefixes (see ChooseNumFlatLevels).
+	// If the configuration fixes the # of flat levels, numFlatLevels must agree with it.
 	//
-	void Init(uint32_t maxSetSize);
+	void Init(uint32_t maxSetSize, int numFlatLevels = (Config::x_numFlatLevels != 0) ? Config::x_numFlatLevels : 3);
+	
+	// Choose the # of flat levels for a set of expected size maxSetSize, from a sample of its keys
+	// Returns 4 if the set is large enough to amortize the depth-3 bitmap, 
+	// and the 3-byte prefixes of the sample branch at the 4th byte on average (dense keys), 3 otherwise.
+	//
+	static int ChooseNumFlatLevels(const uint64_t* sample, uint32_t sampleSize, uint32_t maxSetSize);
+	
+	int GetNumFlatLevels() { return NumFlatLevels(); }
+	
+	// Initialize the set to hold at most maxSetSize elements, starting in small-set mode
+	// In small-set mode the elements are stored in a sorted array in normal heap memory, 
+	// so an empty or tiny set only costs a few hundred bytes, instead of the 2MB+ of flat bitmaps 
+	// and the hash table in hugepage memory needed by the full layout.
+	// The set promotes itself to the full layout once it holds more than x_smallSetMaxSize elements.
+	//
+	void InitCompact(uint32_t maxSetSize);
+	
+	// Max # of elements held in small-set mode
+	//
+	static const uint32_t x_smallSetMaxSize = 256;
+	
+	// Returns whether the set is still using the small-set representation
+	//
+	bool IsSmallSet() { return m_isSmallSet; }
+	
+	// Returns # of bytes of memory allocated by this set (external bitmaps not included)
+	//
+	uint64_t GetMemoryFootprint();
+	
+	// Switch to de-amortized insertion mode (must be called after Init, before any insertion)
+	// Instead of executing a possibly long Cuckoo displacement chain inside a single Insert, 
+	// nodes that cannot be placed immediately are parked in a small stash, 
+	// and each Insert executes at most stepsPerInsert displacement steps, 
+	// so that the worst-case memory accesses of an Insert is bounded.
+	// Falls back to the synchronous displacement only when the stash overflows.
+	//
+	void EnableDeamortizedInsert(int stepsPerInsert);
+	
+	// Switch to byte remapping mode with alphabets learned from sample (must be called after Init, before any insertion)
+	// All elements are stored remapped by ByteAlphabet, so that each depth of the tree has a dense alphabet. 
+	// Nodes at depths with at most 64 symbols keep their children in an inline 64-bit bitmap 
+	// when the internal list is full, instead of a neighboring slot or an external bitmap. 
+	// Inserting a key with bytes not in the alphabets rebuilds the set with extended alphabets (slow, O(n)).
+	// Exist and LowerBound accept any key.
+	// In this mode, the LowerBound promise is resolved eagerly (since the result needs to be decoded).
+	//
+	void EnableByteRemap(const uint64_t* sample, uint32_t sampleSize);
+	
+	// Enable the Exist fast path (must be called after Init, before any insertion)
+	// A fingerprint filter of all elements (see LeafFilter) answers most negative Exist queries from one cache line, 
+	// and on positive answers Exist only probes the Cuckoo positions of the leaf instead of running QueryLCP.
+	// Costs about 4 bytes per element and one extra cache line access per Insert.
+	//
+	void EnableExistFilter();
+	
+	// Enable a front cache of recent Exist and LowerBound answers of about sizeBytes (see HotKeyCache)
+	// Pays off for skewed query distributions, where a small # of hot keys receive most of the queries.
+	// The LowerBound promise API only reads the cache and does not populate it.
+	//
+	void EnableHotKeyCache(uint32_t sizeBytes = 256 * 1024);
+	
+	HotKeyCache* GetHotKeyCache() { return m_hotKeyCache; }
+	
+	// Enable epoch-based reclamation for concurrent readers (see EpochReclaimer, must be called before the readers start)
+	// Exist and LowerBound run inside a read-side critical section, and the memory the set frees while in use
+	// (the small-set array when it grows or is promoted, the memory chunk when the set is rebuilt in byte remapping mode, 
+	// and the mirror of the first hash table level when it is rebuilt) is retired instead, 
+	// so that a concurrent reader never reads freed memory.
+	// The promise returned by LowerBound(value) reads the set when it is resolved, 
+	// so a concurrent reader using it must hold an EpochReclaimer::ReadGuard until then.
+	//
+	void EnableEpochReclamation();
+	
+	// Override the probe strategy of QueryLCP (can be called at any time)
+	// By default, the strategy is chosen by ChooseProbeStrategy when the hash table is allocated
+	//
+	void SetProbeStrategy(CuckooHashTableBase::ProbeStrategy strategy);
+	
+	CuckooHashTableBase::ProbeStrategy GetProbeStrategy() { return m_hashTable.GetProbeStrategy(); }
+	
+	// Build (or rebuild) the dense mirror of the first hash table level (see UpperLevelMirror)
+	// The mirror is used by queries until the next successful Insert, so this should be called 
+	// after a batch of insertions is done, e.g. after the bulk load of a read-mostly set.
+	// Costs 16 bytes per first-level node, plus a rank directory of 1/128 of the size of the deepest flat bitmap.
+	// No-op in small-set mode.
+	//
+	void BuildUpperLevelMirror();
+	
+	// Returns the mirror currently in use by queries, nullptr if none
+	//
+	UpperLevelMirror* GetUpperLevelMirror() { return m_hashTable.GetUpperLevelMirror(); }
+	
+	// Choose the probe strategy for a hash table of the given size, 
+	// top-down if the hash table fits in the L2 cache, all-lengths otherwise
+	//
+	static CuckooHashTableBase::ProbeStrategy ChooseProbeStrategy(uint64_t hashTableBytes);
 	
 	// Insert an element, returns true if the insertion took place, false if the element already exists
 	//
 	bool Insert(uint64_t value);
 	
+	// Bulk load an empty set with numThreads threads, keys may be in any order and contain duplicates
+	// The keys are first partitioned by their 2-byte prefix and sorted in parallel, then loaded by BulkLoadSorted.
+	// Returns the # of distinct keys inserted.
+	//
+	uint32_t BulkLoad(const uint64_t* keys, uint32_t n, int numThreads);
+	
+	// Bulk load an empty set with numThreads threads, keys must be sorted, and may contain duplicates
+	// The keys are partitioned by their 2-byte prefix (the bit index into m_treeDepth1), and the subtrees of 
+	// the partitions are disjoint, so each thread builds the subtrees of a range of partitions on its own: 
+	// it sets their deeper flat bitmap bits (which are in disjoint words), and computes their nodes bottom-up
+	// and places them into the shared hash table directly, claiming one of the two Cuckoo positions with a CAS.
+	// A node whose both positions are taken is set aside, and all such nodes are inserted serially afterwards
+	// (with Cuckoo displacement). Finally the minvOffset of internal nodes is resolved in parallel, 
+	// since the leaves may have moved during the serial phase.
+	// Not thread-safe against other operations on the set. Falls back to Insert in byte remapping mode.
+	// Returns the # of distinct keys inserted.
+	//
+	uint32_t BulkLoadSorted(const uint64_t* keys, uint32_t n, int numThreads);
+	
+	// Copy the set into a new shared memory segment (see SharedMemorySegment::Create for the choice of name), 
+	// so that other processes can attach it read-only with AttachShared instead of building their own copy
+	// The copy is position-independent: the memory chunk (flat bitmaps and hash table) followed by the external 
+	// bitmaps, which the nodes refer to by offsets relative to themselves. 
+	// The set must be in the full layout and not in byte remapping mode, pending displacements are executed first.
+	// The exist filter, the hot key cache and the upper level mirror are not copied.
+	// Returns the segment, the caller deletes it once published (or when the set is to be dropped, for a memfd).
+	//
+	SharedMemorySegment* PublishShared(const char* name);
+	
+	// Initialize the set as a read-only view of a set published with PublishShared, instead of Init
+	// path is SharedMemorySegment::GetPath() of the published segment. Only queries are allowed on the set 
+	// (the hot key cache and the upper level mirror may be enabled, they are private to the process).
+	// Returns false if the segment does not exist, or was published by a set of a different configuration.
+	//
+	bool AttachShared(const char* path);
+	
+	// Whether the set is attached to a shared memory segment
+	//
+	bool IsAttachedShared() { return m_sharedSegment != nullptr; }
+	
+	// Move the memory chunk and the external bitmaps of the set into a CowRegion, so that Snapshot can be used
+	// A small set is promoted to the full layout first. Not supported in byte remapping mode.
+	// Must not run concurrently with queries.
+	//
+	void EnableSnapshots();
+	
+	// Returns a read-only view of the set as of the call, which shares the unchanged pages with the set (see CowRegion)
+	// Must be called by the writer between insertions, the writer then keeps inserting without waiting for the snapshot.
+	// The snapshot is a set which only allows queries, it may be queried and deleted by any thread, 
+	// also after the source set is destroyed. The exist filter, the hot key cache and the upper level mirror are not copied.
+	// Returns nullptr if the kernel cannot reserve the memory for the snapshot.
+	//
+	BasicMlpSet* Snapshot();
+	
+	// Whether the set is a view returned by Snapshot
+	//
+	bool IsSnapshot() { return m_snapshotRegion != nullptr; }
+	
+	// The region holding the set if snapshots are enabled, nullptr otherwise
+	//
+	CowRegion* GetCowRegion() { return m_cowRegion; }
+	
 	// Returns whether the specified value exists in the set
 	//
 	bool Exist(uint64_t value);
@@ -378,28 +998,152 @@ public:
 	// Promise.IsValid() denotes if lower_bound doesn't exist
 	// The promise can be resolved via Promise.Resolve() to get the lower_bound
 	//
-	MlpSet::Promise LowerBound(uint64_t value);
+	Promise LowerBound(uint64_t value);
 	
 	// For debug purposes only
 	//
 	uint64_t* GetRootPtr() { return m_root; }
 	uint64_t* GetLv1Ptr() { return m_treeDepth1; }
 	uint64_t* GetLv2Ptr() { return m_treeDepth2; }
-	CuckooHashTable* GetHtPtr() { return &m_hashTable; }
+	uint64_t* GetLv3Ptr() { return m_treeDepth3; }
+	HashTable* GetHtPtr() { return &m_hashTable; }
 	
-#ifdef ENABLE_STATS
+	// If Config::x_enableStats is false, ClearStats is a no-op and ReportStats only says so
+	//
 	void ClearStats();
 	void ReportStats();
-#endif
 
 private:
-	MlpSet::Promise LowerBoundInternal(uint64_t value, bool& found);
+	// # of flat levels, a compile-time constant if the configuration fixes it
+	//
+	int NumFlatLevels() const { return (Config::x_numFlatLevels != 0) ? Config::x_numFlatLevels : m_numFlatLevels; }
+	
+	Promise LowerBoundInternal(uint64_t value, bool& found);
+	
+	// Exist and LowerBound without the front cache
+	//
+	bool ExistNoCache(uint64_t value);
+	uint64_t LowerBoundNoCache(uint64_t value, bool& found);
+	
+	// Insert, on remapped value in byte remapping mode
+	//
+	bool InsertInternal(uint64_t value);
+	
+	// Rebuild the set in byte remapping mode, with the alphabets extended to contain value
+	//
+	void RebuildWithExtendedByteAlphabet(uint64_t value);
+	void UpdateInlineBitMapDepthMask();
+	
+	// allocate the flat bitmaps and the hash table
+	//
+	void AllocateFullLayout(uint32_t maxSetSize);
+	
+	// set the pointers to the flat bitmaps and the hash table in the memory chunk m_memoryPtr
+	//
+	void InitLayoutPointers(uint64_t hashTableOffset, uint64_t htSize);
+	
+	// The start of a shared memory segment written by PublishShared
+	//
+	struct SharedSetHeader
+	{
+		uint64_t magic;
+		// hash values of a fixed key, so that a set of another hash family refuses to attach
+		//
+		uint64_t hashFingerprint;
+		uint32_t numFlatLevels;
+		uint32_t maxSetSize;
+		// offset of the memory chunk in the segment, and the offset of the hash table in the chunk
+		//
+		uint64_t chunkOffset;
+		uint64_t chunkSize;
+		uint64_t hashTableOffset;
+		uint64_t htSize;
+		// offset of the packed external bitmaps in the segment
+		//
+		uint64_t externalBitMapsOffset;
+		uint64_t numExternalBitMaps;
+	};
+	
+	static const uint64_t x_sharedSetMagic = 0x5445534d50534c4dULL;
+	static uint64_t SharedSetHashFingerprint();
+	
+	// A node built by BulkLoadSorted
+	//
+	struct BulkLoadNode
+	{
+		uint64_t minKey;
+		// bitmap of children, all zero for a leaf
+		//
+		uint64_t children[4];
+		int ilen;
+		int dlen;
+		// the index len of the leaf of minKey
+		//
+		int minLeafIlen;
+		// the Cuckoo position being tried
+		//
+		uint32_t pos;
+	};
+	
+	// The state of a thread of BulkLoadSorted
+	//
+	struct BulkLoadThreadState
+	{
+		BulkLoadThreadState() : numLeaves(0), numNodes(0) { }
+		
+		// nodes built but not placed yet, they are placed in batches of x_bulkLoadBatchSize, 
+		// so that their Cuckoo positions are prefetched together
+		//
+		vector<BulkLoadNode> staged;
+		// nodes whose both Cuckoo positions were taken, inserted in the serial phase
+		//
+		vector<BulkLoadNode> pending;
+		uint32_t numLeaves;
+		uint64_t numNodes;
+	};
+	
+	static const int x_bulkLoadBatchSize = 32;
+	
+	// Build the subtree of the sorted keys in [lo, hi), which share their first ilen bytes, for BulkLoadSorted
+	// Returns the index len of the leaf of keys[lo]
+	//
+	int BulkLoadSubtree(const uint64_t* keys, uint32_t lo, uint32_t hi, int ilen, BulkLoadThreadState& state);
+	
+	// Place the staged nodes at one of their Cuckoo positions, or move them to the pending list if both are taken
+	//
+	void BulkLoadPlaceStaged(BulkLoadThreadState& state);
+	
+	// Fill in the children and minvOffset of a node of BulkLoadSorted, just initialized at pos
+	// An internal node gets a placeholder minvOffset (x_bulkLoadMinvPlaceholder | minLeafIlen), resolved at the end
+	//
+	void BulkLoadFillNode(uint32_t pos, const uint64_t* children, int minLeafIlen, bool concurrent);
+	
+	static const uint32_t x_bulkLoadMinvPlaceholder = 0x80000000U;
+	
+	// Free memory readers may be reading, retire it instead if epoch-based reclamation is enabled
+	//
+	void FreeOrRetire(void* ptr, uint64_t size, EpochReclaimer::FreeFn freeFn);
+	
+	// small-set mode operations
+	//
+	uint32_t SmallSetLowerBoundIndex(uint64_t value);
+	bool SmallSetInsert(uint64_t value);
+	void PromoteSmallSet();
 	
 	// we mmap memory all at once, hold the pointer to the memory chunk
 	// TODO: this needs to changed after we support hash table resizing 
 	//
 	void* m_memoryPtr;
 	uint64_t m_allocatedSize;
+	// the segment holding the memory chunk if the set is attached with AttachShared, nullptr otherwise
+	//
+	SharedMemorySegment* m_sharedSegment;
+	// the region holding the memory chunk if snapshots are enabled, nullptr otherwise
+	//
+	CowRegion* m_cowRegion;
+	// the region whose snapshot mapping holds the memory chunk if the set is a snapshot, nullptr otherwise
+	//
+	CowRegion* m_snapshotRegion;
 	
 	// flat bitmap mapping parts of the tree
 	// root and depth 1 should be in L1 or L2 cache
@@ -412,14 +1156,65 @@ private:
 	// lv2 of the tree, 256^3 bits (2MB), not supposed to be in cache
 	//
 	uint64_t* m_treeDepth2;
-	// hash mapping parts of the tree, starting at lv3
+	// lv3 of the tree, 256^4 bits (512MB), only allocated with 4 flat levels, nullptr otherwise
+	//
+	uint64_t* m_treeDepth3;
+	// # of flat levels (3 or 4), read it with NumFlatLevels()
 	//
-	CuckooHashTable m_hashTable;
+	int m_numFlatLevels;
+	// hash mapping parts of the tree, starting at lv3 (or lv4 with 4 flat levels)
+	//
+	HashTable m_hashTable;
+	// # of pending Cuckoo displacement steps executed per Insert, 0 if not in de-amortized insertion mode
+	//
+	int m_deamortizedStepsPerInsert;
+	
+	// byte remapping dictionary, nullptr if not in byte remapping mode
+	//
+	ByteAlphabet* m_byteAlphabet;
+	// bit d is set if depth d has an alphabet of at most 64 symbols in byte remapping mode
+	//
+	uint32_t m_inlineBitMapDepthMask;
+	
+	// filter for the Exist fast path, nullptr if not enabled
+	//
+	LeafFilter* m_leafFilter;
+	// front cache, nullptr if not enabled
+	//
+	HotKeyCache* m_hotKeyCache;
+	
+	// the mirror of the first hash table level, nullptr if never built
+	// it is in use only if it is also installed in m_hashTable
+	//
+	UpperLevelMirror* m_upperLevelMirror;
+	
+	// whether epoch-based reclamation is enabled
+	//
+	bool m_epochReclamation;
+	
+	// whether SetProbeStrategy has been called, and the strategy it set
+	//
+	bool m_hasProbeStrategyOverride;
+	CuckooHashTableBase::ProbeStrategy m_probeStrategyOverride;
+	
+	// small-set mode: sorted array of elements, 
+	// the slots in [m_smallSetSize, m_smallSetCapacity) are padded with UINT64_MAX, 
+	// and we always have m_smallSetSize + 8 <= m_smallSetCapacity, so that we can always load 8 elements
+	//
+	bool m_isSmallSet;
+	uint32_t m_smallSetSize;
+	uint32_t m_smallSetCapacity;
+	uint32_t m_maxSetSize;
+	uint64_t* m_smallSetKeys;
 	
 #ifndef NDEBUG
 	bool m_hasCalledInit;
 #endif
 };
 
+typedef BasicMlpSet<DefaultMlpSetConfig> MlpSet;
+
 }	// namespace MlpSetUInt64
  
+
+#include "MlpSetUInt64Query.h"
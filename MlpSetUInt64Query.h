@@ -0,0 +1,969 @@
+#pragma once
+
+// The query path of MlpSet and its Cuckoo hash table (Exist, LowerBound, QueryLCP and the lookups they use).
+// It is defined in this header rather than in MlpSetUInt64.cpp so that the compiler can inline it into the caller's loop,
+// which saves the call and lets the caller's code be scheduled together with the hashing and the probes.
+// GCC judges ExistNoCache, LowerBoundNoCache, LowerBoundInternal and QueryLCP too large to inline by itself, 
+// so they are ALWAYS_INLINE (the rare cases, e.g. the stash and the hot key cache, still call out-of-line).
+// Included at the end of MlpSetUInt64.h, do not include it directly.
+//
+
+namespace MlpSetUInt64
+{
+
+static const __m128i HASH18_MASK = _mm_set_epi32(0x3ffffU, 0x3ffffU, 0x3ffffU, 0x3ffffU);
+static const __m128i HASH_EXPECT_MASK1 = _mm_set_epi32(0x80000000U | (7U << 27), 
+                                                       0x80000000U | (6U << 27), 
+                                                       0x80000000U | (5U << 27), 
+                                                       0x80000000U | (4U << 27));
+static const __m128i HASH_EXPECT_MASK2 = _mm_set_epi32(0xf803ffffU, 0xf803ffffU, 0xf803ffffU, 0xf803ffffU);
+
+inline int Bitmap256LowerBound(uint64_t* ptr, uint32_t child)
+{
+	assert(0 <= child && child <= 255);
+	int idx = child / 64;
+	uint64_t x = ptr[idx] >> (child % 64);
+	if (x) 
+	{ 
+		return __builtin_ctzll(x) + child; 
+	}
+	idx++;
+	while (idx < 4)
+	{
+		if (ptr[idx] != 0)
+		{
+			return __builtin_ctzll(ptr[idx]) + idx * 64;
+		}
+		idx++;
+	}
+	return -1;
+}
+
+inline int CuckooHashTableNode::LowerBoundChild(uint32_t child)
+{
+	assert(IsNode() && !IsLeaf());
+	assert(0 <= child && child <= 255);
+	if (IsUsingInternalChildMap())
+	{
+		if (child == 0) { return childMap & 255; }
+		int k = GetChildNum();
+		__m64 z = _mm_cvtsi64_m64(childMap);
+		__m64 cmpTarget = _mm_set1_pi8(child - 1);
+		__m64 res = _mm_max_pu8(cmpTarget, z);
+		res = _mm_cmpeq_pi8(cmpTarget, res);
+		int msk = _mm_movemask_pi8(res);
+		msk &= (1<<k)-1;
+		msk++;
+		int pos = __builtin_ffs(msk);
+		assert(1 <= pos && pos <= k + 1);
+		if (pos == k+1) 
+		{ 
+			return -1; 
+		}
+		return (childMap >> ((pos-1)*8)) & 255;
+	}
+	else if (unlikely(IsExternalPointerBitMap()))
+	{
+		uint64_t* ptr = GetExternalBitMap();
+		return Bitmap256LowerBound(ptr, child);
+	}
+	else if (IsInlineBitMap())
+	{
+		if (child >= 64)
+		{
+			return -1;
+		}
+		uint64_t x = childMap >> child;
+		return x ? __builtin_ctzll(x) + child : -1;
+	}
+	else
+	{
+		int offset = (hash >> 21) & 7;
+		if (child < 64)
+		{
+			uint64_t x = childMap >> child;
+			if (x)
+			{	
+				return __builtin_ctzll(x) + child; 
+			}
+			uint64_t* ptr = reinterpret_cast<uint64_t*>(&(this[offset-4]));
+			x = ptr[0] & 0xffffffff3fffffffULL;
+			x |= uint64_t((hash >> 18) & 3) << 30;
+			if (x)
+			{
+				return __builtin_ctzll(x) + 64;
+			}
+			rep(k, 1, 2)
+			{
+				if (ptr[k])
+				{
+					return __builtin_ctzll(ptr[k]) + (k+1) * 64;
+				}
+			}
+			return -1;
+		}
+		else if (child < 128)
+		{
+			uint64_t* ptr = reinterpret_cast<uint64_t*>(&(this[offset-4]));
+			uint64_t x = ptr[0] & 0xffffffff3fffffffULL;
+			x |= uint64_t((hash >> 18) & 3) << 30;
+			x >>= (child - 64);
+			if (x)
+			{
+				return __builtin_ctzll(x) + child;
+			}
+			rep(k, 1, 2)
+			{
+				if (ptr[k])
+				{
+					return __builtin_ctzll(ptr[k]) + (k+1) * 64;
+				}
+			}
+			return -1;
+		}
+		else
+		{
+			uint64_t* ptr = reinterpret_cast<uint64_t*>(&(this[offset-4]));
+			int idx = child / 64 - 1;
+			uint64_t x = ptr[idx] >> (child % 64);
+			if (x)
+			{
+				return __builtin_ctzll(x) + child;
+			}
+			if (idx < 2)
+			{
+				if (ptr[2])
+				{
+					return __builtin_ctzll(ptr[2]) + 192;
+				}
+			}
+			return -1;
+		}
+	}	
+}
+
+inline bool CuckooHashTableNode::ExistChild(int child)
+{
+	assert(IsNode() && !IsLeaf());
+	assert(0 <= child && child <= 255);
+	if (IsUsingInternalChildMap())
+	{
+		int k = GetChildNum();
+		__m64 z = _mm_cvtsi64_m64(childMap);
+		__m64 cmpTarget = _mm_set1_pi8(child);
+		__m64 res = _mm_cmpeq_pi8(cmpTarget, z);
+		int msk = _mm_movemask_pi8(res);
+		msk &= (1<<k)-1;
+		bool result = (msk != 0);
+		
+#ifndef NDEBUG
+		bool bruteForceResult = false;
+		uint64_t c = childMap;
+		rep(i,0,k-1)
+		{
+			int x = c & 255;
+			c >>= 8;
+			if (x == child) { bruteForceResult = true; break; }
+		}
+		assert(result == bruteForceResult);
+#endif
+		return result;
+	}
+	else if (unlikely(IsExternalPointerBitMap()))
+	{
+		uint64_t* ptr = GetExternalBitMap();
+		return (ptr[child / 64] & (uint64_t(1) << (child % 64))) != 0;
+	}
+	else if (IsInlineBitMap())
+	{
+		return child < 64 && (childMap & (uint64_t(1) << child)) != 0;
+	}
+	else
+	{
+		if (child < 64)
+		{
+			return (childMap & (uint64_t(1) << child)) != 0;
+		}
+		else if (unlikely(child == 94 || child == 95))
+		{
+			return (hash & (1 << (child - 76))) != 0;
+		}
+		else
+		{
+			int offset = ((hash >> 21) & 7) - 4;
+			uint64_t* ptr = reinterpret_cast<uint64_t*>(&(this[offset]));
+			return (ptr[child / 64 - 1] & (uint64_t(1) << (child % 64))) != 0;
+		}
+	}
+}
+
+template<class Config>
+uint32_t BasicCuckooHashTable<Config>::LookupInStash(int ilen, uint64_t ikey)
+{
+	rep(i, 0, m_stashCount - 1)
+	{
+		uint32_t pos = m_stashPending[i];
+		if (ht[pos].IsEqualNoHash(ikey, ilen))
+		{
+			return pos;
+		}
+	}
+	return -1;
+}
+
+template<class Config>
+void BasicCuckooHashTable<Config>::ApplyStashToCandidates(uint64_t key, uint32_t* allPositions1, uint32_t* allPositions2)
+{
+	rep(i, 0, m_stashCount - 1)
+	{
+		uint32_t pos = m_stashPending[i];
+		// the reserved slot might not have been initialized yet
+		//
+		if (ht[pos].IsOccupiedAndNode())
+		{
+			int ilen = ht[pos].GetIndexKeyLen();
+			if (ilen >= 3 && ht[pos].IsEqualNoHash(key, ilen))
+			{
+				allPositions1[ilen - 1] = pos;
+				allPositions2[ilen - 1] = pos;
+			}
+		}
+	}
+}
+
+template<class Config>
+uint32_t BasicCuckooHashTable<Config>::Lookup(int ilen, uint64_t ikey, bool& found)
+{
+	assert(m_hasCalledInit);
+	
+	found = false;
+	uint32_t hash18bit = HashFamily::HashFn3(ikey, ilen);
+	hash18bit = hash18bit & ((1<<18) - 1);
+	uint32_t expectedHash = hash18bit | ((ilen-1) << 27) | 0x80000000U;
+	int shiftLen = 64 - 8 * ilen;
+	uint64_t shiftedKey = ikey >> shiftLen;
+	
+	uint32_t h1, h2;
+	h1 = HashFamily::HashFn1(ikey, ilen) & htMask;
+	h2 = HashFamily::HashFn2(ikey, ilen) & htMask;
+	MEM_PREFETCH(ht[h1]);
+	MEM_PREFETCH(ht[h2]);
+	if (ht[h1].IsEqual(expectedHash, shiftLen, shiftedKey))
+	{
+		found = true;
+		return h1;
+	}
+	if (ht[h2].IsEqual(expectedHash, shiftLen, shiftedKey))
+	{
+		found = true;
+		return h2;
+	}
+	if (unlikely(m_stashCount > 0))
+	{
+		uint32_t pos = LookupInStash(ilen, ikey);
+		if (pos != (uint32_t)-1)
+		{
+			found = true;
+			return pos;
+		}
+	}
+	return -1;
+}
+
+template<class Config>
+CuckooHashTableBase::LookupMustExistPromise BasicCuckooHashTable<Config>::GetLookupMustExistPromise(int ilen, uint64_t ikey)
+{
+	assert(m_hasCalledInit);
+	
+	uint32_t hash18bit = HashFamily::HashFn3(ikey, ilen);
+	hash18bit = hash18bit & ((1<<18) - 1);
+	uint32_t expectedHash = hash18bit | ((ilen-1) << 27) | 0x80000000U;
+	int shiftLen = 64 - 8 * ilen;
+	uint64_t shiftedKey = ikey >> shiftLen;
+	
+	if (unlikely(m_stashCount > 0))
+	{
+		uint32_t pos = LookupInStash(ilen, ikey);
+		if (pos != (uint32_t)-1)
+		{
+			return LookupMustExistPromise(ht + pos);
+		}
+	}
+	
+	uint32_t h1, h2;
+	h1 = HashFamily::HashFn1(ikey, ilen) & htMask;
+	h2 = HashFamily::HashFn2(ikey, ilen) & htMask;
+	
+	return LookupMustExistPromise(true /*valid*/,
+	                              shiftLen,
+	                              ht + h1,
+	                              ht + h2,
+	                              expectedHash,
+	                              shiftedKey);
+}
+
+// Vectorized tag compare kernels of QueryLCP and the kernel selected by SetProbeKernel, defined in MlpSetUInt64.cpp
+// (the kernels are opt-in and never inlined, since they need a target attribute)
+//
+extern CuckooHashTableBase::ProbeKernel g_probeKernel;
+
+__attribute__((target("avx2")))
+int ProbeTagsAVX2(CuckooHashTableNode* ht, 
+                  uint32_t* allPositions1, 
+                  uint32_t* allPositions2, 
+                  uint32_t* expectedHash, 
+                  int lowestLen);
+
+__attribute__((target("avx512f")))
+int ProbeTagsAVX512(CuckooHashTableNode* ht, 
+                    uint32_t* allPositions1, 
+                    uint32_t* allPositions2, 
+                    uint32_t* expectedHash, 
+                    int lowestLen);
+
+template<class Config>
+inline int ALWAYS_INLINE BasicCuckooHashTable<Config>::QueryLCP(uint64_t key, 
+                                                                uint32_t& idxLen, 
+                                                                uint32_t* allPositions1, 
+                                                                uint32_t* allPositions2, 
+                                                                uint32_t* expectedHash)
+{
+	assert(m_hasCalledInit);
+	
+	if (m_probeStrategy == PROBE_TOP_DOWN)
+	{
+		return QueryLCPTopDown(key, idxLen, allPositions1, allPositions2);
+	}
+	
+	__m128i h1, h2, h3, h4;
+	uint64_t h5;
+	HashFamily::HashArray(key, h1, h2, h3, h4, h5);
+	
+	__m128i hashModMask = _mm_set1_epi32(htMask);
+	h1 = _mm_and_si128(h1, hashModMask);
+	h2 = _mm_and_si128(h2, hashModMask);
+	h4 = _mm_and_si128(h4, hashModMask);
+	
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(allPositions1 + 4), h1);
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(allPositions2 + 4), h2);
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(allPositions1), h4);
+	*reinterpret_cast<uint64_t*>(allPositions2 + 2) = *reinterpret_cast<uint64_t*>(allPositions1);
+	
+	if (unlikely(m_stashCount > 0))
+	{
+		ApplyStashToCandidates(key, allPositions1, allPositions2);
+	}
+	
+	// No need to probe index len 3 if it is kept in flat bitmap
+	//
+	int lowestLen = LowestIndexLen() - 1;
+	MEM_PREFETCH(ht[allPositions1[4]]);
+	MEM_PREFETCH(ht[allPositions1[5]]);
+	MEM_PREFETCH(ht[allPositions1[6]]);
+	MEM_PREFETCH(ht[allPositions2[4]]);
+	MEM_PREFETCH(ht[allPositions2[5]]);
+	MEM_PREFETCH(ht[allPositions2[6]]);
+	if (m_upperLevelMirror != nullptr)
+	{
+		// The mirror gives the exact position of the first-level node, so only that position is probed.
+		// This is done after the deeper probes are issued, since the rank computation is a dependent load.
+		// If the node does not exist, slot 0 is probed and rejected by the hash compare (or the slow path)
+		//
+		UpperLevelMirror::Entry* entry = m_upperLevelMirror->Find(key);
+		allPositions1[lowestLen] = (entry != nullptr) ? entry->position : 0;
+		allPositions2[lowestLen] = allPositions1[lowestLen];
+	}
+	if (lowestLen == 2)
+	{
+		MEM_PREFETCH(ht[allPositions1[2]]);
+		MEM_PREFETCH(ht[allPositions2[2]]);
+	}
+	MEM_PREFETCH(ht[allPositions1[3]]);
+	MEM_PREFETCH(ht[allPositions2[3]]);
+	
+	__m128i expect1 = _mm_and_si128(h3, HASH18_MASK);
+	expect1 = _mm_or_si128(expect1, HASH_EXPECT_MASK1);
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(expectedHash + 4), expect1);
+	h5 &= 0x3ffff0003ffffULL;
+	h5 |= 0x8000000080000000ULL | (3ULL << 59) | (2ULL << 27);
+	*reinterpret_cast<uint64_t*>(expectedHash + 2) = h5;
+	
+	int len = 7;
+
+	if (g_probeKernel == PROBE_KERNEL_AVX512)
+	{
+		len = ProbeTagsAVX512(ht, allPositions1, allPositions2, expectedHash, lowestLen);
+	}
+	else if (g_probeKernel == PROBE_KERNEL_AVX2)
+	{
+		len = ProbeTagsAVX2(ht, allPositions1, allPositions2, expectedHash, lowestLen);
+	}
+	else
+	{
+		for (; len >= lowestLen; len --)
+		{
+			if ((ht[allPositions1[len]].hash & 0xf803ffffU) == expectedHash[len]) 
+			{
+				break;
+			}
+			if ((ht[allPositions2[len]].hash & 0xf803ffffU) == expectedHash[len])
+			{
+				allPositions1[len] = allPositions2[len];
+				break;
+			}
+			else
+			{
+				allPositions1[len] = 0;
+			}
+		}
+	}
+	if (len < lowestLen)
+	{
+		if (Config::x_enableStats)
+		{
+			stats.m_lcpResultHistogram[lowestLen]++;
+		}
+		return lowestLen;
+	}
+
+#ifndef NDEBUG
+	{
+		uint32_t hash18bit = HashFamily::HashFn3(key, len + 1);
+		hash18bit = hash18bit & ((1<<18) - 1);
+		uint32_t expectedx = hash18bit | (len << 27) | 0x80000000U;
+		assert((ht[allPositions1[len]].hash & 0xf803ffffU) == expectedx);
+	}
+#endif
+
+	int shiftLen = 64 - 8 * (len + 1);
+	if (unlikely((ht[allPositions1[len]].minKey >> shiftLen) != (key >> shiftLen))) goto _slowpath;
+
+	idxLen = len + 1;
+	if (Config::x_enableStats)
+	{
+		stats.m_lcpResultHistogram[idxLen]++;
+	}
+	{
+		uint64_t xorValue = key ^ ht[allPositions1[len]].minKey;
+		if (!xorValue) return 8;
+			
+		int z = __builtin_clzll(xorValue);
+		return z / 8;
+	}
+	
+	// slow path handling hash conflict
+	//
+_slowpath:
+	{
+		if (Config::x_enableStats)
+		{
+			stats.m_slowpathCount++;
+		}
+
+		if (ht[allPositions1[7]].IsEqualNoHash(key, 8)) { idxLen = 8; goto _slowpath_end; }
+		if (ht[allPositions2[7]].IsEqualNoHash(key, 8)) { allPositions1[7] = allPositions2[7]; idxLen = 8; goto _slowpath_end; }
+		if (ht[allPositions1[6]].IsEqualNoHash(key, 7)) { idxLen = 7; goto _slowpath_end; }
+		if (ht[allPositions2[6]].IsEqualNoHash(key, 7)) { allPositions1[6] = allPositions2[6]; idxLen = 7; goto _slowpath_end; }
+		if (ht[allPositions1[5]].IsEqualNoHash(key, 6)) { idxLen = 6; goto _slowpath_end; }
+		if (ht[allPositions2[5]].IsEqualNoHash(key, 6)) { allPositions1[5] = allPositions2[5]; idxLen = 6; goto _slowpath_end; }
+		if (ht[allPositions1[4]].IsEqualNoHash(key, 5)) { idxLen = 5; goto _slowpath_end; }
+		if (ht[allPositions2[4]].IsEqualNoHash(key, 5)) { allPositions1[4] = allPositions2[4]; idxLen = 5; goto _slowpath_end; }
+		if (ht[allPositions1[3]].IsEqualNoHash(key, 4)) { idxLen = 4; goto _slowpath_end; }
+		if (ht[allPositions2[3]].IsEqualNoHash(key, 4)) { allPositions1[3] = allPositions2[3]; idxLen = 4; goto _slowpath_end; }
+		if (lowestLen == 2)
+		{
+			if (ht[allPositions1[2]].IsEqualNoHash(key, 3)) { idxLen = 3; goto _slowpath_end; }
+			if (ht[allPositions2[2]].IsEqualNoHash(key, 3)) { allPositions1[2] = allPositions2[2]; idxLen = 3; goto _slowpath_end; }
+		}
+		if (Config::x_enableStats)
+		{
+			stats.m_lcpResultHistogram[lowestLen]++;
+		}
+		return lowestLen;
+
+_slowpath_end:
+		if (Config::x_enableStats)
+		{
+			stats.m_lcpResultHistogram[idxLen]++;
+		}
+		uint64_t xorValue = key ^ ht[allPositions1[idxLen-1]].minKey;
+		if (!xorValue) return 8;
+			
+		int z = __builtin_clzll(xorValue);
+		return z / 8;
+	}
+}
+
+template<class Config>
+int BasicCuckooHashTable<Config>::QueryLCPTopDown(uint64_t key, 
+                                                  uint32_t& idxLen, 
+                                                  uint32_t* allPositions1, 
+                                                  uint32_t* allPositions2)
+{
+	memset(allPositions1, 0, sizeof(uint32_t) * 8);
+	
+	// The first node on the path in hash table (if any) always has index len LowestIndexLen(),
+	// and the index len of every other node is the full key len of its parent plus 1.
+	// The walk stops at the first node whose path-compression string does not match, 
+	// or whose child on the path does not exist (so there is no deeper node on the path)
+	//
+	int lcpLen = LowestIndexLen() - 1;
+	int ilen = LowestIndexLen();
+	while (true)
+	{
+		bool found;
+		uint32_t pos;
+		if (ilen == LowestIndexLen() && m_upperLevelMirror != nullptr)
+		{
+			UpperLevelMirror::Entry* entry = m_upperLevelMirror->Find(key);
+			found = (entry != nullptr);
+			pos = found ? entry->position : 0;
+		}
+		else
+		{
+			pos = Lookup(ilen, key, found);
+		}
+		if (!found)
+		{
+			break;
+		}
+		allPositions1[ilen - 1] = pos;
+		idxLen = ilen;
+		uint64_t xorValue = key ^ ht[pos].minKey;
+		lcpLen = xorValue ? __builtin_clzll(xorValue) / 8 : 8;
+		int dlen = ht[pos].GetFullKeyLen();
+		if (lcpLen < dlen || dlen == 8)
+		{
+			break;
+		}
+		if (!ht[pos].ExistChild((key >> (56 - 8 * dlen)) & 255))
+		{
+			break;
+		}
+		ilen = dlen + 1;
+	}
+	memcpy(allPositions2, allPositions1, sizeof(uint32_t) * 8);
+	if (Config::x_enableStats)
+	{
+		stats.m_lcpResultHistogram[(lcpLen < LowestIndexLen()) ? lcpLen : idxLen]++;
+	}
+	return lcpLen;
+}
+
+template<class Config>
+uint32_t BasicMlpSet<Config>::SmallSetLowerBoundIndex(uint64_t value)
+{
+	assert(m_isSmallSet);
+	// Branchless binary search narrows down the range to at most 8 elements
+	// invariant: the lower bound index is in [base, base + len]
+	//
+	const uint64_t* base = m_smallSetKeys;
+	uint32_t len = m_smallSetSize;
+	while (len > 8)
+	{
+		uint32_t half = len / 2;
+		bool goRight = base[half - 1] < value;
+		base += goRight ? half : 0;
+		len = goRight ? len - half : half;
+	}
+	// Count elements < value in the 8 elements starting at base using SIMD
+	// Elements at base + len or later are all >= value (either real elements or UINT64_MAX padding),
+	// so the count is exactly the offset of the lower bound from base.
+	// AVX2 only has signed 64-bit comparison, so flip the sign bits to do an unsigned comparison
+	//
+	const __m256i signBit = _mm256_set1_epi64x(0x8000000000000000ULL);
+	__m256i target = _mm256_xor_si256(_mm256_set1_epi64x(value), signBit);
+	__m256i v1 = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(base)), signBit);
+	__m256i v2 = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(base + 4)), signBit);
+	int msk1 = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(target, v1)));
+	int msk2 = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(target, v2)));
+	uint32_t result = (base - m_smallSetKeys) + __builtin_popcount(msk1) + __builtin_popcount(msk2);
+#ifndef NDEBUG
+	uint32_t expected = std::lower_bound(m_smallSetKeys, m_smallSetKeys + m_smallSetSize, value) - m_smallSetKeys;
+	assert(result == expected);
+#endif
+	return result;
+}
+
+template<class Config>
+bool BasicMlpSet<Config>::Exist(uint64_t value)
+{
+	bool epochReclamation = m_epochReclamation;
+	if (unlikely(epochReclamation))
+	{
+		EpochReclaimer::Enter();
+	}
+	bool exist;
+	if (unlikely(m_hotKeyCache != nullptr))
+	{
+		if (!m_hotKeyCache->LookupExist(value, exist))
+		{
+			exist = ExistNoCache(value);
+			m_hotKeyCache->StoreExist(value, exist);
+		}
+	}
+	else
+	{
+		exist = ExistNoCache(value);
+	}
+	if (unlikely(epochReclamation))
+	{
+		EpochReclaimer::Exit();
+	}
+	return exist;
+}
+
+template<class Config>
+inline bool ALWAYS_INLINE BasicMlpSet<Config>::ExistNoCache(uint64_t value)
+{
+	assert(m_hasCalledInit);
+	if (unlikely(m_byteAlphabet != nullptr))
+	{
+		uint64_t code;
+		if (!m_byteAlphabet->Encode(value, code))
+		{
+			return false;
+		}
+		value = code;
+	}
+	if (unlikely(m_isSmallSet))
+	{
+		uint32_t idx = SmallSetLowerBoundIndex(value);
+		return idx < m_smallSetSize && m_smallSetKeys[idx] == value;
+	}
+	if (m_leafFilter != nullptr)
+	{
+		uint32_t candidates = m_leafFilter->Query(value);
+		if (candidates == 0)
+		{
+			return false;
+		}
+		// probe only the Cuckoo positions of the leaf, for each possible index len of the leaf
+		//
+		uint32_t ilenMask = candidates & 255;
+		while (ilenMask)
+		{
+			int ilen = __builtin_ctz(ilenMask) + 1;
+			ilenMask &= ilenMask - 1;
+			bool found;
+			uint32_t pos = m_hashTable.Lookup(ilen, value, found);
+			if (found && m_hashTable.ht[pos].IsLeaf() && m_hashTable.ht[pos].minKey == value)
+			{
+				return true;
+			}
+		}
+		if (!(candidates & LeafFilter::x_unknown))
+		{
+			return false;
+		}
+	}
+	uint32_t ilen;
+	uint64_t _allPositions1[4], _allPositions2[4], _expectedHash[4];
+	uint32_t* allPositions1 = reinterpret_cast<uint32_t*>(_allPositions1);
+	uint32_t* allPositions2 = reinterpret_cast<uint32_t*>(_allPositions2);
+	uint32_t* expectedHash = reinterpret_cast<uint32_t*>(_expectedHash);
+	int lcpLen = m_hashTable.QueryLCP(value, 
+		                              ilen /*out*/, 
+		                              allPositions1 /*out*/, 
+		                              allPositions2 /*out*/, 
+		                              expectedHash /*out*/);
+	return (lcpLen == 8);
+}
+
+template<class Config>
+inline typename BasicMlpSet<Config>::Promise ALWAYS_INLINE BasicMlpSet<Config>::LowerBoundInternal(uint64_t value, bool& found)
+{
+	assert(m_hasCalledInit);
+	found = true;
+	
+	if (unlikely(m_isSmallSet))
+	{
+		uint32_t idx = SmallSetLowerBoundIndex(value);
+		if (idx < m_smallSetSize)
+		{
+			return Promise::FromValue(m_smallSetKeys[idx]);
+		}
+		found = false;
+		return Promise();
+	}
+	
+	// Issue the prefetch in case LCP turns out to be in the flat levels
+	//
+	int flatLcpLen = NumFlatLevels() - 1;
+	if (flatLcpLen == 2)
+	{
+		MEM_PREFETCH(m_treeDepth2[(value >> 48) * 4]);
+	}
+	else
+	{
+		MEM_PREFETCH(m_treeDepth3[(value >> 40) * 4]);
+	}
+	
+	int numParentPathSteps = 0;
+	// the QueryLCP round trip
+	//
+	int numRoundTrips = 1;
+	Auto(
+		if (Config::x_enableStats)
+		{
+			assert(numParentPathSteps < 8);
+			stats.m_lowerBoundParentPathStepsHistogram[numParentPathSteps]++;
+			stats.m_lowerBoundRoundTripsHistogram[min(numRoundTrips, 7)]++;
+		}
+	);
+
+	uint32_t ilen;
+	uint32_t allPositions[2][8];
+	uint64_t _expectedHash[4];
+	uint32_t* expectedHash = reinterpret_cast<uint32_t*>(_expectedHash);
+	int lcpLen = m_hashTable.QueryLCP(value, 
+		                              ilen /*out*/, 
+		                              allPositions[0] /*out*/, 
+		                              allPositions[1] /*out*/, 
+		                              expectedHash /*out*/);
+	if (lcpLen == 8)
+	{
+		return Promise(&m_hashTable.ht[allPositions[0][ilen - 1]]);
+	}
+	if (lcpLen == flatLcpLen)
+	{
+		goto _flat_mapping;
+	}
+	
+	// lcp in hash table
+	//
+	{
+		uint32_t pos = allPositions[0][ilen - 1];
+		int dlen = m_hashTable.ht[pos].GetFullKeyLen();
+		if (dlen == lcpLen)
+		{
+			// path compression string matches, lower bound on child
+			//
+			uint32_t child = (value >> (56 - dlen * 8)) & 255;
+			int lbChild = m_hashTable.ht[pos].LowerBoundChild(child);
+			if (lbChild == -1) 
+			{
+				goto _parent;
+			}
+			assert(lbChild != child);
+			// if lbChild is the first child, the minimum value in its subtree is the minimum value of this node,
+			// which we already have, so no hash table lookup is needed
+			//
+			if (lbChild == int((m_hashTable.ht[pos].minKey >> (56 - dlen * 8)) & 255))
+			{
+				return Promise(&m_hashTable.ht[pos]);
+			}
+			// return the minimum value in lbChild subtree
+			//
+			uint64_t keyToFind = value & (~(255ULL << (56 - dlen * 8)));
+			keyToFind |= uint64_t(lbChild) << (56 - dlen * 8);
+			if (Config::x_enableStats)
+			{
+				numRoundTrips++;
+			}
+			return m_hashTable.GetLookupMustExistPromise(dlen + 1, keyToFind);
+		}
+		else
+		{
+			// path compression string does not match
+			// either the given value is smaller than the whole subtree, or larger than the whole subtree
+			//
+			if (value < m_hashTable.ht[pos].minKey)
+			{
+				// smaller than whole subtree, result is just subtreeMin
+				//
+				return Promise(&m_hashTable.ht[pos]);
+			}
+			else
+			{	
+				// larger than subtreeMax, need to visit parent path
+				//
+				goto _parent;
+			}
+		}
+	}
+	
+_parent:
+	// The specified value is larger than the maximum in the subtree
+	// We need to return the smallest value larger than subtreeMax by visiting the parent path
+	// 
+	{
+		ilen--;
+		for (; int(ilen) > flatLcpLen; ilen--)
+		{
+			if (Config::x_enableStats)
+			{
+				numParentPathSteps++;
+			}
+			rep(k, 0, 1)
+			{
+				uint32_t pos = allPositions[k][ilen - 1];
+				if (m_hashTable.ht[pos].IsEqualNoHash(value, ilen))
+				{
+					assert(m_hashTable.ht[pos].GetIndexKeyLen() == ilen);
+					int dlen = m_hashTable.ht[pos].GetFullKeyLen();
+					assert((m_hashTable.ht[pos].minKey >> (64 - dlen * 8)) == (value >> (64 - dlen * 8)));
+					uint32_t child = (value >> (56 - dlen * 8)) & 255;
+					if (child < 255)
+					{
+						int lbChild = m_hashTable.ht[pos].LowerBoundChild(child + 1);
+						if (lbChild != -1) 
+						{
+							assert(lbChild != child);
+							// return the minimum value in lbChild subtree
+							//
+							uint64_t keyToFind = value & (~(255ULL << (56 - dlen * 8)));
+							keyToFind |= uint64_t(lbChild) << (56 - dlen * 8);
+							if (Config::x_enableStats)
+							{
+								numRoundTrips++;
+							}
+							return m_hashTable.GetLookupMustExistPromise(dlen + 1, keyToFind);
+						}
+					}
+					break;
+				}
+			}
+		}
+	}
+	
+_flat_mapping:
+	// We have reached the deepest flat level of the tree, which are stored in the flat bitarray instead of the hash table
+	// Check the flat levels bottom-up, for each level find the next sibling of the prefix of value, 
+	// and on success descend to the first child through the lower flat levels
+	//
+	{
+		uint64_t* flatLevels[4] = { m_root, m_treeDepth1, m_treeDepth2, m_treeDepth3 };
+		for (int depth = flatLcpLen; depth >= 0; depth--)
+		{
+			if (Config::x_enableStats)
+			{
+				numParentPathSteps++;
+			}
+			// the (depth+1)-byte prefix of value
+			//
+			uint64_t prefix = value >> (56 - 8 * depth);
+			if ((prefix & 255) < 255)
+			{
+				int lbChild = Bitmap256LowerBound(flatLevels[depth] + (prefix >> 8) * 4, (prefix & 255) + 1);
+				if (lbChild != -1)
+				{
+					prefix = ((prefix >> 8) << 8) | lbChild;
+					for (int d = depth + 1; d <= flatLcpLen; d++)
+					{
+						if (Config::x_enableStats)
+						{
+							// depth 2 and 3 bitmaps are not supposed to be in cache
+							//
+							if (d >= 2) numRoundTrips++;
+						}
+						int firstChild = Bitmap256LowerBound(flatLevels[d] + prefix * 4, 0 /*child*/);
+						assert(firstChild != -1);
+						prefix = (prefix << 8) | firstChild;
+					}
+					uint64_t keyToFind = prefix << (56 - 8 * flatLcpLen);
+					if (Config::x_enableStats)
+					{
+						numRoundTrips++;
+					}
+					if (m_hashTable.GetUpperLevelMirror() != nullptr)
+					{
+						UpperLevelMirror::Entry* entry = m_hashTable.GetUpperLevelMirror()->Find(keyToFind);
+						assert(entry != nullptr);
+						return Promise::FromValue(entry->minKey);
+					}
+					return m_hashTable.GetLookupMustExistPromise(flatLcpLen + 1, keyToFind);
+				}
+			}
+		}
+	}
+	// not found
+	//
+	found = false;
+	return Promise();
+}
+
+template<class Config>
+typename BasicMlpSet<Config>::Promise BasicMlpSet<Config>::LowerBound(uint64_t value)
+{
+	if (unlikely(m_hotKeyCache != nullptr))
+	{
+		uint64_t result;
+		bool found;
+		if (m_hotKeyCache->LookupLowerBound(value, result, found))
+		{
+			return found ? Promise::FromValue(result) : Promise();
+		}
+	}
+	// the caller holds the read guard if epoch-based reclamation is enabled (see EnableEpochReclamation)
+	//
+	if (unlikely(m_byteAlphabet != nullptr))
+	{
+		bool found;
+		uint64_t result = LowerBoundNoCache(value, found);
+		return found ? Promise::FromValue(result) : Promise();
+	}
+	bool found;
+	Promise p = LowerBoundInternal(value, found);
+	if (found) 
+	{
+		p.Prefetch();
+	}
+	return p;
+}
+
+template<class Config>
+uint64_t BasicMlpSet<Config>::LowerBound(uint64_t value, bool& found)
+{
+	bool epochReclamation = m_epochReclamation;
+	if (unlikely(epochReclamation))
+	{
+		EpochReclaimer::Enter();
+	}
+	uint64_t result;
+	if (unlikely(m_hotKeyCache != nullptr))
+	{
+		if (!m_hotKeyCache->LookupLowerBound(value, result, found))
+		{
+			result = LowerBoundNoCache(value, found);
+			m_hotKeyCache->StoreLowerBound(value, result, found);
+		}
+	}
+	else
+	{
+		result = LowerBoundNoCache(value, found);
+	}
+	if (unlikely(epochReclamation))
+	{
+		EpochReclaimer::Exit();
+	}
+	return result;
+}
+
+template<class Config>
+inline uint64_t ALWAYS_INLINE BasicMlpSet<Config>::LowerBoundNoCache(uint64_t value, bool& found)
+{
+	if (unlikely(m_byteAlphabet != nullptr))
+	{
+		uint64_t code;
+		if (!m_byteAlphabet->EncodeLowerBound(value, code))
+		{
+			found = false;
+			return 0xffffffffffffffffULL;
+		}
+		Promise p = LowerBoundInternal(code, found);
+		return found ? m_byteAlphabet->Decode(p.Resolve()) : 0xffffffffffffffffULL;
+	}
+	Promise p = LowerBoundInternal(value, found);
+	if (found) 
+	{
+		p.Prefetch();
+		return p.Resolve();
+	}
+	else
+	{
+		return 0xffffffffffffffffULL;
+	}
+}
+
+}	// namespace MlpSetUInt64
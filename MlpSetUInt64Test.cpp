@@ -8,6 +8,12 @@
 #include "WorkloadD.h"
 #include "gtest/gtest.h"
 
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <random>
+#include <thread>
+
 namespace {
 
 // Test of correctness of CuckooHash related logic
@@ -815,7 +821,2177 @@ TEST(MlpSetUInt64, LowerBoundCorrectness)
 		}
 	}
 }
+
+// Correctness test for MlpSet de-amortized insertion mode
+// Queries are interleaved with insertions so that they are executed while nodes are parked in stash
+//
+TEST(MlpSetUInt64, DeamortizedInsertCorrectness)
+{
+	const int N = 3000000;
+	printf("MlpSet de-amortized insertion test..\n");
+	MlpSetUInt64::MlpSet ms;
+	ms.Init(N);
+	ms.EnableDeamortizedInsert(2 /*stepsPerInsert*/);
+	StupidUInt64Trie::Trie st;
+	set<uint64_t> S;
+	int maxStashed = 0;
+	int numQueriesWithStash = 0;
+	rep(iter, 0, N - 1)
+	{
+		uint64_t key = 0;
+		if (rand() % 2 == 0)
+		{
+			rep(k, 0, 7) key = key * 256 + rand() % 256;
+		}
+		else
+		{
+			rep(k, 0, 1) key = key * 256 + rand() % 64 + 32;
+			rep(k, 2, 7) key = key * 256 + rand() % 5 + 48;
+		}
+		bool insExpected = S.insert(key).second;
+		bool insActual = ms.Insert(key);
+		ReleaseAssert(insExpected == insActual);
+		st.Insert(key);
+		
+		int stashed = ms.GetHtPtr()->GetStashedNodesCount();
+		maxStashed = max(maxStashed, stashed);
+		if (stashed > 0 || rand() % 8 == 0)
+		{
+			if (stashed > 0) numQueriesWithStash++;
+			uint64_t q = key;
+			if (rand() % 2 == 0) 
+			{
+				q += rand() % 65536 - 32768;
+			}
+			ReleaseAssert(ms.Exist(q) == (S.count(q) > 0));
+			set<uint64_t>::iterator it = S.lower_bound(q);
+			bool found;
+			uint64_t ret = ms.LowerBound(q, found);
+			ReleaseAssert(found == (it != S.end()));
+			if (found)
+			{
+				ReleaseAssert(*it == ret);
+			}
+		}
+		if (iter % (N / 10) == 0)
+		{
+			printf("%d%% completed\n", iter / (N / 10) * 10);
+		}
+	}
+	printf("Max # of stashed nodes = %d, %d queries executed with non-empty stash\n", maxStashed, numQueriesWithStash);
+	ReleaseAssert(maxStashed <= MlpSetUInt64::CuckooHashTable::x_stashSize);
+	
+	// drain the stash and validate the whole tree shape
+	//
+	ms.GetHtPtr()->ExecutePendingDisplacements(1000000);
+	ReleaseAssert(ms.GetHtPtr()->GetStashedNodesCount() == 0);
+	AssertTreeShapeEqualA(st, ms, true /*printDetail*/);
+}
+
+// Insert latency distribution of normal mode vs. de-amortized insertion mode
+//
+void InsertLatencyHistogramTestImpl(uint64_t* values, int n, int deamortizedSteps)
+{
+	printf("==== Insert latency, %s ====\n", 
+	       (deamortizedSteps == 0 ? "normal mode" : "de-amortized mode"));
+	uint32_t* latency = new uint32_t[n];
+	ReleaseAssert(latency != nullptr);
+	Auto(delete [] latency);
+	
+	MlpSetUInt64::MlpSet ms;
+	ms.Init(n + 1000);
+	if (deamortizedSteps > 0)
+	{
+		printf("De-amortized steps per insert = %d\n", deamortizedSteps);
+		ms.EnableDeamortizedInsert(deamortizedSteps);
+	}
+	
+	uint64_t totalCycles = 0;
+	double totalTime;
+	{
+		AutoTimer timer(&totalTime);
+		rep(i, 0, n - 1)
+		{
+			uint64_t start = __rdtsc();
+			ms.Insert(values[i]);
+			uint64_t end = __rdtsc();
+			latency[i] = min(end - start, uint64_t(0xffffffffU));
+			totalCycles += end - start;
+		}
+	}
+#ifdef ENABLE_STATS
+	ms.ReportStats();
+#endif
+	double nsPerCycle = totalTime * 1e9 / totalCycles;
+	sort(latency, latency + n);
+	auto report = [&](const char* name, uint32_t cycles)
+	{
+		printf("%8s: %10u cycles (%.0lf ns)\n", name, cycles, cycles * nsPerCycle);
+	};
+	report("p50", latency[int(n * 0.5)]);
+	report("p90", latency[int(n * 0.9)]);
+	report("p99", latency[int(n * 0.99)]);
+	report("p999", latency[int(n * 0.999)]);
+	report("p9999", latency[int(n * 0.9999)]);
+	report("max", latency[n - 1]);
+}
+
+TEST(MlpSetUInt64, InsertLatencyHistogram_16M)
+{
+	const int N = 16000000;
+	uint64_t* values = new uint64_t[N];
+	ReleaseAssert(values != nullptr);
+	Auto(delete [] values);
+	
+	// The harder (for us) distribution, WorkloadC/D style, with more nodes and displacements
+	//
+	printf("Generating data..\n");
+	rep(i, 0, N - 1)
+	{
+		uint64_t key = 0;
+		rep(k, 2, 7) key = key * 256 + rand() % 5 + 48;
+		rep(k, 0, 1) key = key * 256 + rand() % 64 + 32;
+		values[i] = key;
+	}
+	
+	InsertLatencyHistogramTestImpl(values, N, 0 /*deamortizedSteps*/);
+	InsertLatencyHistogramTestImpl(values, N, 2 /*deamortizedSteps*/);
+	InsertLatencyHistogramTestImpl(values, N, 4 /*deamortizedSteps*/);
+}
+
+// Correctness test for MlpSet small-set mode and its promotion to the full layout
+//
+TEST(MlpSetUInt64, SmallSetModeCorrectness)
+{
+	printf("MlpSet small-set mode test..\n");
+	const int numSets = 200;
+	rep(setId, 0, numSets - 1)
+	{
+		// most sets stay small, some are promoted
+		//
+		int numInserts = (setId % 4 == 0) ? rand() % 3000 : rand() % (MlpSetUInt64::MlpSet::x_smallSetMaxSize + 1);
+		int keyRange = (setId % 3 == 0) ? 1000 : 1000000000;
+		MlpSetUInt64::MlpSet ms;
+		ms.InitCompact(10000);
+		set<uint64_t> S;
+		auto genKey = [&]() -> uint64_t
+		{
+			if (rand() % 50 == 0) return 0xffffffffffffffffULL - rand() % 3;
+			if (rand() % 50 == 0) return rand() % 3;
+			uint64_t base = (setId % 2 == 0) ? 0x1234567800000000ULL : (uint64_t(rand()) << 40);
+			return base + rand() % keyRange;
+		};
+		rep(iter, 0, numInserts - 1)
+		{
+			uint64_t key = genKey();
+			bool insExpected = S.insert(key).second;
+			bool insActual = ms.Insert(key);
+			ReleaseAssert(insExpected == insActual);
+			ReleaseAssert(ms.IsSmallSet() == (S.size() <= MlpSetUInt64::MlpSet::x_smallSetMaxSize));
+			rep(ts, 0, 3)
+			{
+				uint64_t q = (rand() % 2 == 0) ? genKey() : key + rand() % 5 - 2;
+				ReleaseAssert(ms.Exist(q) == (S.count(q) > 0));
+				set<uint64_t>::iterator it = S.lower_bound(q);
+				bool found;
+				uint64_t ret = ms.LowerBound(q, found);
+				ReleaseAssert(found == (it != S.end()));
+				if (found)
+				{
+					ReleaseAssert(*it == ret);
+					MlpSetUInt64::MlpSet::Promise p = ms.LowerBound(q);
+					ReleaseAssert(p.IsValid() && p.Resolve() == ret);
+				}
+				else
+				{
+					ReleaseAssert(ret == 0xffffffffffffffffULL);
+				}
+			}
+		}
+	}
+	printf("Test complete.\n");
+}
+
+// Memory and throughput of many small sets, small-set mode vs. full layout
+//
+void SmallSetBenchmarkImpl(int setSize, int numSets, bool compact)
+{
+	printf("==== %d sets of size %d, %s ====\n", numSets, setSize, (compact ? "small-set mode" : "full layout"));
+	MlpSetUInt64::MlpSet* sets = new MlpSetUInt64::MlpSet[numSets];
+	ReleaseAssert(sets != nullptr);
+	Auto(delete [] sets);
+	
+	uint64_t totalKeys = uint64_t(setSize) * numSets;
+	vector<uint64_t> keys(totalKeys);
+	rep(i, 0, int(totalKeys) - 1)
+	{
+		uint64_t key = 0;
+		rep(k, 0, 7) key = key * 256 + rand() % 256;
+		keys[i] = key;
+	}
+	
+	double insertTime;
+	{
+		AutoTimer timer(&insertTime);
+		rep(i, 0, numSets - 1)
+		{
+			if (compact) 
+			{
+				sets[i].InitCompact(setSize);
+			}
+			else
+			{
+				sets[i].Init(setSize);
+			}
+			uint64_t* k = keys.data() + uint64_t(i) * setSize;
+			rep(j, 0, setSize - 1)
+			{
+				sets[i].Insert(k[j]);
+			}
+		}
+	}
+	uint64_t memory = 0;
+	rep(i, 0, numSets - 1)
+	{
+		memory += sets[i].GetMemoryFootprint();
+	}
+	
+	const int Q = 10000000;
+	vector<pair<int, uint64_t>> queries(Q);
+	rep(i, 0, Q - 1)
+	{
+		int setId = rand() % numSets;
+		if (rand() % 2 == 0)
+		{
+			queries[i] = make_pair(setId, keys[uint64_t(setId) * setSize + rand() % setSize]);
+		}
+		else
+		{
+			uint64_t key = 0;
+			rep(k, 0, 7) key = key * 256 + rand() % 256;
+			queries[i] = make_pair(setId, key);
+		}
+	}
+	double existTime, lowerBoundTime;
+	uint64_t checksum = 0;
+	{
+		AutoTimer timer(&existTime);
+		rep(i, 0, Q - 1)
+		{
+			checksum += sets[queries[i].first].Exist(queries[i].second);
+		}
+	}
+	{
+		AutoTimer timer(&lowerBoundTime);
+		rep(i, 0, Q - 1)
+		{
+			bool found;
+			checksum += sets[queries[i].first].LowerBound(queries[i].second, found);
+		}
+	}
+	printf("Memory: %.1lf MB total, %.1lf bytes/key\n", memory / 1048576.0, double(memory) / totalKeys);
+	printf("Insert: %.2lfM op/s, Exist: %.2lfM op/s, LowerBound: %.2lfM op/s (checksum %llu)\n", 
+	       totalKeys / insertTime / 1e6, Q / existTime / 1e6, Q / lowerBoundTime / 1e6, 
+	       static_cast<unsigned long long>(checksum));
+}
+
+TEST(MlpSetUInt64, SmallSetMemoryAndThroughput)
+{
+	// Each set in full layout costs ~2.4MB of hugepage memory, so only a limited number of them can be created
+	//
+	const int maxFullLayoutSets = 200;
+	int setSizes[] = { 1, 10, 100, 1000, 10000 };
+	for (int setSize : setSizes)
+	{
+		int numSets = min(1000000, 20000000 / setSize);
+		if (setSize > int(MlpSetUInt64::MlpSet::x_smallSetMaxSize))
+		{
+			numSets = min(numSets, maxFullLayoutSets);
+		}
+		SmallSetBenchmarkImpl(setSize, numSets, true /*compact*/);
+		SmallSetBenchmarkImpl(setSize, min(numSets, maxFullLayoutSets), false /*compact*/);
+	}
+}
+		
+// Generators for keys dense in their 4-byte prefixes (WorkloadA style) and sparse keys
+//
+uint64_t GenDenseKey()
+{
+	uint64_t key = 0;
+	rep(k, 0, 1) key = key * 256 + rand() % 64 + 32;
+	rep(k, 2, 7) key = key * 256 + rand() % 5 + 48;
+	return key;
+}
+
+uint64_t GenSparseKey()
+{
+	uint64_t key = 0;
+	rep(k, 0, 7) key = key * 256 + rand() % 256;
+	return key;
+}
+
+// Correctness test for MlpSet with 3 and 4 flat levels
+//
+TEST(MlpSetUInt64, FlatLevelsCorrectness)
+{
+	const int N = 1500000;
+	const int Q = 2000000;
+	
+	{
+		vector<uint64_t> dense, sparse;
+		rep(i, 0, 99999) 
+		{
+			dense.push_back(GenDenseKey());
+			sparse.push_back(GenSparseKey());
+		}
+		ReleaseAssert(MlpSetUInt64::MlpSet::ChooseNumFlatLevels(dense.data(), dense.size(), 1U << 24) == 4);
+		ReleaseAssert(MlpSetUInt64::MlpSet::ChooseNumFlatLevels(dense.data(), dense.size(), 1U << 20) == 3);
+		ReleaseAssert(MlpSetUInt64::MlpSet::ChooseNumFlatLevels(sparse.data(), sparse.size(), 1U << 24) == 3);
+	}
+	
+	rep(numFlatLevels, 3, 4)
+	{
+		printf("Testing %d flat levels..\n", numFlatLevels);
+		MlpSetUInt64::MlpSet ms;
+		ms.Init(N, numFlatLevels);
+		ReleaseAssert(ms.GetNumFlatLevels() == numFlatLevels);
+		set<uint64_t> S;
+		
+		// A mix of dense keys, sparse keys, and keys that only share 3-byte prefixes with others,
+		// so that we have splits right at and right below the flat levels
+		//
+		rep(i, 0, N - 1)
+		{
+			uint64_t key;
+			int kind = rand() % 3;
+			if (kind == 0) 
+			{
+				key = GenDenseKey();
+			}
+			else if (kind == 1)
+			{
+				key = GenSparseKey();
+			}
+			else
+			{
+				key = (GenDenseKey() & 0xffffff0000000000ULL) | (GenSparseKey() >> 24);
+			}
+			bool expected = S.insert(key).second;
+			bool actual = ms.Insert(key);
+			ReleaseAssert(expected == actual);
+		}
 		
+		rep(i, 0, Q - 1)
+		{
+			uint64_t key;
+			int kind = rand() % 3;
+			if (kind == 0)
+			{
+				key = GenDenseKey();
+			}
+			else if (kind == 1)
+			{
+				key = GenSparseKey();
+			}
+			else
+			{
+				// neighbors of existing keys
+				//
+				auto it = S.lower_bound(GenDenseKey() & 0xffffffff00000000ULL);
+				key = (it == S.end()) ? GenDenseKey() : *it + rand() % 3 - 1;
+			}
+			auto it = S.lower_bound(key);
+			ReleaseAssert(ms.Exist(key) == (it != S.end() && *it == key));
+			bool found;
+			uint64_t lb = ms.LowerBound(key, found);
+			ReleaseAssert(found == (it != S.end()));
+			if (found)
+			{
+				ReleaseAssert(lb == *it);
+			}
+		}
+	}
+}
+
+// Print the distribution of hash table node formats
+//
+void ReportNodeFormats(MlpSetUInt64::MlpSet& ms)
+{
+	MlpSetUInt64::CuckooHashTable* ht = ms.GetHtPtr();
+	uint64_t leaf = 0, list = 0, inlineBitMap = 0, neighborBitMap = 0, pointerBitMap = 0;
+	rep(i, 0, ht->htMask)
+	{
+		MlpSetUInt64::CuckooHashTableNode& nd = ht->ht[i];
+		if (!nd.IsOccupiedAndNode()) continue;
+		if (nd.IsLeaf()) leaf++;
+		else if (nd.IsUsingInternalChildMap()) list++;
+		else if (nd.IsInlineBitMap()) inlineBitMap++;
+		else if (nd.IsExternalPointerBitMap()) pointerBitMap++;
+		else neighborBitMap++;
+	}
+	printf("Node formats: %llu leaf, %llu internal list, %llu inline bitmap, %llu neighbor bitmap, %llu external pointer bitmap\n",
+	       (unsigned long long)leaf, (unsigned long long)list, (unsigned long long)inlineBitMap, 
+	       (unsigned long long)neighborBitMap, (unsigned long long)pointerBitMap);
+}
+
+// Throughput of 3 flat levels vs. 4 flat levels, on keys dense in 4-byte prefixes and on sparse keys
+// (also used to benchmark byte remapping mode)
+//
+void FlatLevelsBenchmarkImpl(WorkloadUInt64& workload, int numFlatLevels, bool byteRemap = false)
+{
+	printf("==== %d flat levels%s ====\n", numFlatLevels, (byteRemap ? ", byte remapping" : ""));
+	MlpSetUInt64::MlpSet ms;
+	ms.Init(workload.numInitialValues + 1000, numFlatLevels);
+	if (byteRemap)
+	{
+		ms.EnableByteRemap(workload.initialValues, min(workload.numInitialValues, uint64_t(100000)));
+	}
+	
+	printf("MlpSet populating initial values..\n");
+	{
+		AutoTimer timer;
+		rep(i, 0, workload.numInitialValues - 1)
+		{
+			ms.Insert(workload.initialValues[i]);
+		}
+	}
+	ReportNodeFormats(ms);
+	
+	printf("MlpSet executing workload..\n");
+	{
+		AutoTimer timer;
+		rep(i, 0, workload.numOperations - 1)
+		{
+			if (workload.operations[i].type == WorkloadOperationType::EXIST)
+			{
+				workload.results[i] = ms.Exist(workload.operations[i].key);
+			}
+			else
+			{
+				ReleaseAssert(workload.operations[i].type == WorkloadOperationType::LOWER_BOUND);
+				bool found;
+				workload.results[i] = ms.LowerBound(workload.operations[i].key, found);
+			}
+		}
+	}
+	rep(i, 0, workload.numOperations - 1)
+	{
+		ReleaseAssert(workload.results[i] == workload.expectedResults[i]);
+	}
+}
+
+void FlatLevelsBenchmarkAllModes(WorkloadUInt64& workload)
+{
+	const int sampleSize = 100000;
+	int chosen = MlpSetUInt64::MlpSet::ChooseNumFlatLevels(workload.initialValues, 
+	                                                       sampleSize, 
+	                                                       workload.numInitialValues + 1000);
+	printf("ChooseNumFlatLevels on a sample of %d keys chose %d flat levels\n", sampleSize, chosen);
+	FlatLevelsBenchmarkImpl(workload, 3);
+	FlatLevelsBenchmarkImpl(workload, 4);
+}
+
+TEST(MlpSetUInt64, FlatLevels_Dense_16M)
+{
+	printf("Generating workload WorkloadA 16M..\n");
+	WorkloadUInt64 workload = WorkloadA::GenWorkload16M();
+	Auto(workload.FreeMemory());
+	FlatLevelsBenchmarkAllModes(workload);
+	
+	workload.FreeMemory();
+	printf("Generating workload WorkloadB 16M..\n");
+	workload = WorkloadB::GenWorkload16M();
+	FlatLevelsBenchmarkAllModes(workload);
+}
+
+TEST(MlpSetUInt64, FlatLevels_Sparse_16M)
+{
+	const int N = 16000000;
+	const int Q = 20000000;
+	printf("Generating sparse workload 16M..\n");
+	WorkloadUInt64 workload;
+	workload.AllocateMemory(N, Q);
+	Auto(workload.FreeMemory());
+	rep(i, 0, N - 1)
+	{
+		workload.initialValues[i] = GenSparseKey();
+	}
+	rep(i, 0, Q - 1)
+	{
+		workload.operations[i].type = (i % 2 == 0) ? WorkloadOperationType::EXIST : WorkloadOperationType::LOWER_BOUND;
+		workload.operations[i].key = (rand() % 2 == 0) ? workload.initialValues[rand() % N] : GenSparseKey();
+	}
+	workload.PopulateExpectedResultsUsingStdSet();
+	FlatLevelsBenchmarkAllModes(workload);
+}
+
+// Correctness test for byte remapping mode
+//
+void ByteRemapCorrectnessTestImpl(bool compact)
+{
+	printf("Testing byte remapping mode, %s..\n", (compact ? "compact" : "full layout"));
+	const int N = 1000000;
+	const int Q = 2000000;
+	// Random alphabet for each depth, of 10 to 96 symbols
+	// depth 3 is dense enough so that nodes at depth 3 have more than 8 children
+	//
+	const int alphabetSize[8] = { 40, 20, 10, 50, 60, 30, 96, 64 };
+	vector<int> alphabet[8];
+	rep(d, 0, 7)
+	{
+		vector<int> all;
+		rep(b, 0, 255) all.push_back(b);
+		random_shuffle(all.begin(), all.end());
+		all.resize(alphabetSize[d]);
+		alphabet[d] = all;
+	}
+	auto genKey = [&]() -> uint64_t
+	{
+		uint64_t key = 0;
+		rep(d, 0, 7) key = key * 256 + alphabet[d][rand() % alphabet[d].size()];
+		return key;
+	};
+	
+	vector<uint64_t> sample;
+	rep(i, 0, 9999) sample.push_back(genKey());
+	
+	MlpSetUInt64::MlpSet ms;
+	if (compact)
+	{
+		ms.InitCompact(N + 10);
+	}
+	else
+	{
+		ms.Init(N + 10);
+	}
+	ms.EnableByteRemap(sample.data(), sample.size());
+	set<uint64_t> S;
+	rep(i, 0, N - 1)
+	{
+		uint64_t key = genKey();
+		// sometimes insert a key with a byte not in the alphabet, which triggers a rebuild
+		//
+		if (i == 100 || i == 1000 || i % 250000 == 249999)
+		{
+			key ^= uint64_t(rand() % 255 + 1) << (8 * (rand() % 8));
+		}
+		bool expected = S.insert(key).second;
+		bool actual = ms.Insert(key);
+		ReleaseAssert(expected == actual);
+	}
+	
+	rep(i, 0, Q - 1)
+	{
+		uint64_t key;
+		int kind = rand() % 3;
+		if (kind == 0)
+		{
+			key = genKey();
+		}
+		else if (kind == 1)
+		{
+			key = 0;
+			rep(k, 0, 7) key = key * 256 + rand() % 256;
+		}
+		else
+		{
+			key = genKey() + rand() % 5 - 2;
+		}
+		auto it = S.lower_bound(key);
+		ReleaseAssert(ms.Exist(key) == (it != S.end() && *it == key));
+		bool found;
+		uint64_t lb = ms.LowerBound(key, found);
+		ReleaseAssert(found == (it != S.end()));
+		if (found)
+		{
+			ReleaseAssert(lb == *it);
+		}
+		MlpSetUInt64::MlpSet::Promise p = ms.LowerBound(key);
+		ReleaseAssert(p.IsValid() == found);
+		if (found)
+		{
+			ReleaseAssert(p.Resolve() == *it);
+		}
+	}
+	ReportNodeFormats(ms);
+	if (!compact)
+	{
+		int numInlineBitMaps = 0;
+		MlpSetUInt64::CuckooHashTable* ht = ms.GetHtPtr();
+		rep(i, 0, ht->htMask)
+		{
+			MlpSetUInt64::CuckooHashTableNode& nd = ht->ht[i];
+			if (nd.IsOccupiedAndNode() && !nd.IsLeaf() && !nd.IsUsingInternalChildMap() && nd.IsInlineBitMap())
+			{
+				numInlineBitMaps++;
+			}
+		}
+		ReleaseAssert(numInlineBitMaps > 0);
+	}
+}
+
+TEST(MlpSetUInt64, ByteRemapCorrectness)
+{
+	ByteRemapCorrectnessTestImpl(false /*compact*/);
+	ByteRemapCorrectnessTestImpl(true /*compact*/);
+}
+
+// Node format distribution and throughput, with and without byte remapping
+//
+TEST(MlpSetUInt64, ByteRemap_16M)
+{
+	rep(w, 0, 3)
+	{
+		printf("Generating workload Workload%c 16M..\n", 'A' + w);
+		WorkloadUInt64 workload;
+		switch (w)
+		{
+			case 0: workload = WorkloadA::GenWorkload16M(); break;
+			case 1: workload = WorkloadB::GenWorkload16M(); break;
+			case 2: workload = WorkloadC::GenWorkload16M(); break;
+			default: workload = WorkloadD::GenWorkload16M(); break;
+		}
+		Auto(workload.FreeMemory());
+		FlatLevelsBenchmarkImpl(workload, 3 /*numFlatLevels*/, false /*byteRemap*/);
+		FlatLevelsBenchmarkImpl(workload, 3 /*numFlatLevels*/, true /*byteRemap*/);
+	}
+}
+
+// Check that the minvOffset of every node in the hash table points to the leaf holding its minKey
+// the stash must be empty
+//
+void AssertMinvOffsetValid(MlpSetUInt64::MlpSet& ms)
+{
+	MlpSetUInt64::CuckooHashTable* ht = ms.GetHtPtr();
+	ReleaseAssert(ht->GetStashedNodesCount() == 0);
+	int numNodes = 0;
+	rep(i, 0, int(ht->htMask))
+	{
+		MlpSetUInt64::CuckooHashTableNode& node = ht->ht[i];
+		if (node.IsOccupiedAndNode())
+		{
+			numNodes++;
+			uint32_t offset = node.minvOffset;
+			ReleaseAssert(offset <= ht->htMask);
+			MlpSetUInt64::CuckooHashTableNode& leaf = ht->ht[offset];
+			ReleaseAssert(leaf.IsOccupiedAndNode() && leaf.IsLeaf());
+			ReleaseAssert(leaf.minKey == node.minKey);
+			ReleaseAssert(!node.IsLeaf() || offset == uint32_t(i));
+		}
+	}
+	printf("minvOffset of %d nodes validated\n", numNodes);
+}
+
+TEST(MlpSetUInt64, MinvOffsetCorrectness)
+{
+	rep(deamortized, 0, 1)
+	{
+		printf("Testing minvOffset, %s..\n", (deamortized ? "de-amortized mode" : "normal mode"));
+		const int N = 2000000;
+		MlpSetUInt64::MlpSet ms;
+		ms.Init(N);
+		if (deamortized)
+		{
+			ms.EnableDeamortizedInsert(2 /*stepsPerInsert*/);
+		}
+		rep(iter, 0, N - 1)
+		{
+			// mix of sparse and dense keys, so that there are lots of splits and Cuckoo displacements
+			//
+			uint64_t key = (rand() % 2 == 0) ? GenSparseKey() : GenDenseKey();
+			ms.Insert(key);
+			if (iter % (N / 4) == N / 4 - 1)
+			{
+				ms.GetHtPtr()->ExecutePendingDisplacements(1000000);
+				AssertMinvOffsetValid(ms);
+			}
+		}
+	}
+}
+
+TEST(MlpSetUInt64, LeafFilterCorrectness)
+{
+	// a 1-bucket filter, so that the bucket overflows
+	//
+	MlpSetUInt64::LeafFilter filter;
+	filter.Init(16);
+	vector<uint64_t> keys;
+	rep(i, 0, 99)
+	{
+		keys.push_back(GenSparseKey());
+		filter.Add(keys.back(), 3 + i % 6);
+		rep(j, 0, i)
+		{
+			uint32_t r = filter.Query(keys[j]);
+			ReleaseAssert(r != 0);
+			ReleaseAssert((r & (1U << (2 + j % 6))) || (r & MlpSetUInt64::LeafFilter::x_unknown));
+		}
+	}
+	filter.Clear();
+	rep(i, 0, 99)
+	{
+		ReleaseAssert(filter.Query(keys[i]) == 0);
+	}
+	filter.Add(keys[0], 3);
+	filter.UpdateIndexLen(keys[0], 3, 5);
+	ReleaseAssert(filter.Query(keys[0]) & (1U << 4));
+}
+
+TEST(MlpSetUInt64, ExistFilterCorrectness)
+{
+	rep(mode, 0, 2)
+	{
+		const char* modeName[3] = { "full layout", "compact", "byte remapping" };
+		printf("Testing Exist filter, %s..\n", modeName[mode]);
+		const int N = 1000000;
+		MlpSetUInt64::MlpSet ms;
+		if (mode == 1)
+		{
+			ms.InitCompact(N);
+		}
+		else
+		{
+			ms.Init(N);
+		}
+		vector<uint64_t> sample;
+		rep(i, 0, 9999) sample.push_back(GenDenseKey());
+		if (mode == 2)
+		{
+			ms.EnableByteRemap(sample.data(), sample.size());
+		}
+		ms.EnableExistFilter();
+		set<uint64_t> S;
+		rep(i, 0, N - 1)
+		{
+			// dense keys share long prefixes, so that lots of leaves are moved to larger index lens by splits
+			//
+			uint64_t key = (rand() % 4 == 0) ? GenSparseKey() : GenDenseKey();
+			bool expected = S.insert(key).second;
+			ReleaseAssert(ms.Insert(key) == expected);
+			if (i % 4 == 0)
+			{
+				uint64_t q = (rand() % 2 == 0) ? GenDenseKey() : key + rand() % 5 - 2;
+				ReleaseAssert(ms.Exist(q) == (S.count(q) > 0));
+			}
+		}
+		for (uint64_t key : S)
+		{
+			ReleaseAssert(ms.Exist(key));
+		}
+		int numNegatives = 0;
+		rep(i, 0, N - 1)
+		{
+			uint64_t q = GenDenseKey();
+			bool expected = S.count(q) > 0;
+			ReleaseAssert(ms.Exist(q) == expected);
+			if (!expected) numNegatives++;
+		}
+		printf("%d negative queries validated\n", numNegatives);
+	}
+}
+
+// Exist throughput with and without the filter, at different miss ratios
+// The misses are generated by flipping low bits of existing keys, so they share long prefixes with existing keys
+//
+void ExistFilterBenchmarkImpl(WorkloadUInt64& workload)
+{
+	const int Q = 10000000;
+	const int numRatios = 6;
+	const int missRatios[numRatios] = { 0, 10, 30, 50, 70, 90 };
+	
+	vector<uint64_t> sortedValues(workload.initialValues, workload.initialValues + workload.numInitialValues);
+	sort(sortedValues.begin(), sortedValues.end());
+	vector<uint64_t> hits;
+	vector<uint64_t> misses;
+	rep(i, 0, Q - 1)
+	{
+		hits.push_back(workload.initialValues[rand() % workload.numInitialValues]);
+		while (true)
+		{
+			uint64_t key = workload.initialValues[rand() % workload.numInitialValues] ^ uint64_t(rand() % 65535 + 1);
+			if (!binary_search(sortedValues.begin(), sortedValues.end(), key))
+			{
+				misses.push_back(key);
+				break;
+			}
+		}
+	}
+	vector<uint64_t> queries(Q);
+	
+	rep(useFilter, 0, 1)
+	{
+		printf("==== %s ====\n", (useFilter ? "with Exist filter" : "without Exist filter"));
+		MlpSetUInt64::MlpSet ms;
+		ms.Init(workload.numInitialValues + 1000);
+		if (useFilter)
+		{
+			ms.EnableExistFilter();
+		}
+		printf("MlpSet populating initial values..\n");
+		{
+			AutoTimer timer;
+			rep(i, 0, workload.numInitialValues - 1)
+			{
+				ms.Insert(workload.initialValues[i]);
+			}
+		}
+		rep(r, 0, numRatios - 1)
+		{
+			rep(i, 0, Q - 1)
+			{
+				queries[i] = (rand() % 100 < missRatios[r]) ? misses[i] : hits[i];
+			}
+			printf("Miss ratio %d%%: ", missRatios[r]);
+			uint64_t numHits = 0;
+			{
+				AutoTimer timer;
+				rep(i, 0, Q - 1)
+				{
+					numHits += ms.Exist(queries[i]);
+				}
+			}
+			uint64_t expectedHits = 0;
+			rep(i, 0, Q - 1)
+			{
+				expectedHits += (queries[i] == hits[i]);
+			}
+			ReleaseAssert(numHits == expectedHits);
+		}
+	}
+}
+
+TEST(MlpSetUInt64, ExistFilter_A_16M)
+{
+	printf("Generating workload WorkloadA 16M..\n");
+	WorkloadUInt64 workload = WorkloadA::GenWorkload16M();
+	Auto(workload.FreeMemory());
+	ExistFilterBenchmarkImpl(workload);
+}
+
+TEST(MlpSetUInt64, ExistFilter_C_16M)
+{
+	printf("Generating workload WorkloadC 16M..\n");
+	WorkloadUInt64 workload = WorkloadC::GenWorkload16M();
+	Auto(workload.FreeMemory());
+	ExistFilterBenchmarkImpl(workload);
+}
+
+TEST(MlpSetUInt64, HotKeyCacheCorrectness)
+{
+	rep(compact, 0, 1)
+	{
+		printf("Testing hot key cache, %s..\n", (compact ? "compact" : "full layout"));
+		const int N = 500000;
+		MlpSetUInt64::MlpSet ms;
+		if (compact)
+		{
+			ms.InitCompact(N);
+		}
+		else
+		{
+			ms.Init(N);
+		}
+		// a tiny cache, so that replacement happens a lot
+		//
+		ms.EnableHotKeyCache(4096);
+		// queries are drawn from a small pool of hot keys, 
+		// and the inserted keys are drawn from a pool that overlaps with the hot keys
+		//
+		vector<uint64_t> hotKeys;
+		rep(i, 0, 999) hotKeys.push_back(GenDenseKey());
+		set<uint64_t> S;
+		rep(i, 0, N - 1)
+		{
+			if (rand() % 8 == 0)
+			{
+				uint64_t key = (rand() % 4 == 0) ? hotKeys[rand() % hotKeys.size()] : GenDenseKey();
+				ReleaseAssert(ms.Insert(key) == S.insert(key).second);
+			}
+			uint64_t q = hotKeys[rand() % hotKeys.size()];
+			int kind = rand() % 3;
+			set<uint64_t>::iterator it = S.lower_bound(q);
+			if (kind == 0)
+			{
+				ReleaseAssert(ms.Exist(q) == (it != S.end() && *it == q));
+			}
+			else if (kind == 1)
+			{
+				bool found;
+				uint64_t ret = ms.LowerBound(q, found);
+				ReleaseAssert(found == (it != S.end()));
+				if (found) ReleaseAssert(ret == *it);
+			}
+			else
+			{
+				MlpSetUInt64::MlpSet::Promise p = ms.LowerBound(q);
+				ReleaseAssert(p.IsValid() == (it != S.end()));
+				if (p.IsValid()) ReleaseAssert(p.Resolve() == *it);
+			}
+		}
+		MlpSetUInt64::HotKeyCache* cache = ms.GetHotKeyCache();
+		printf("Hit rate = %.1lf%%\n", 100.0 * cache->GetNumHits() / cache->GetNumLookups());
+	}
+}
+
+// Throughput of MlpSet with and without the hot key cache on Zipfian workloads
+//
+void HotKeyCacheBenchmarkImpl(WorkloadUInt64& workload)
+{
+	rep(useCache, 0, 1)
+	{
+		MlpSetUInt64::MlpSet ms;
+		ms.Init(workload.numInitialValues + 1000);
+		if (useCache)
+		{
+			ms.EnableHotKeyCache();
+		}
+		rep(i, 0, workload.numInitialValues - 1)
+		{
+			ms.Insert(workload.initialValues[i]);
+		}
+		printf("%s: ", (useCache ? "with hot key cache" : "without hot key cache"));
+		{
+			AutoTimer timer;
+			rep(i, 0, workload.numOperations - 1)
+			{
+				if (workload.operations[i].type == WorkloadOperationType::EXIST)
+				{
+					workload.results[i] = ms.Exist(workload.operations[i].key);
+				}
+				else
+				{
+					ReleaseAssert(workload.operations[i].type == WorkloadOperationType::LOWER_BOUND);
+					bool found;
+					workload.results[i] = ms.LowerBound(workload.operations[i].key, found);
+				}
+			}
+		}
+		rep(i, 0, workload.numOperations - 1)
+		{
+			ReleaseAssert(workload.results[i] == workload.expectedResults[i]);
+		}
+		if (useCache)
+		{
+			MlpSetUInt64::HotKeyCache* cache = ms.GetHotKeyCache();
+			printf("Hit rate = %.1lf%%\n", 100.0 * cache->GetNumHits() / cache->GetNumLookups());
+		}
+	}
+}
+
+TEST(MlpSetUInt64, HotKeyCache_Zipf_16M)
+{
+	const double skews[3] = { 0.8, 1.0, 1.2 };
+	rep(k, 0, 2)
+	{
+		{
+			printf("==== WorkloadA 16M, Zipfian skew %.1lf ====\n", skews[k]);
+			WorkloadUInt64 workload = WorkloadA::GenWorkload16MZipf(skews[k]);
+			Auto(workload.FreeMemory());
+			HotKeyCacheBenchmarkImpl(workload);
+		}
+		{
+			printf("==== WorkloadB 16M, Zipfian skew %.1lf ====\n", skews[k]);
+			WorkloadUInt64 workload = WorkloadB::GenWorkload16MZipf(skews[k]);
+			Auto(workload.FreeMemory());
+			HotKeyCacheBenchmarkImpl(workload);
+		}
+	}
+}
+
+// Dense keys in small hash tables used to hit Cuckoo displacement chains that run into a cycle
+//
+TEST(MlpSetUInt64, DenseKeysSmallTable)
+{
+	const int numSizes = 4;
+	const int sizes[numSizes] = { 10000, 30000, 100000, 300000 };
+	rep(k, 0, numSizes - 1)
+	{
+		rep(trial, 0, 3)
+		{
+			MlpSetUInt64::MlpSet ms;
+			ms.Init(sizes[k]);
+			set<uint64_t> S;
+			rep(i, 0, sizes[k] - 1)
+			{
+				uint64_t key = GenDenseKey();
+				ReleaseAssert(ms.Insert(key) == S.insert(key).second);
+			}
+			for (uint64_t key : S)
+			{
+				ReleaseAssert(ms.Exist(key));
+			}
+		}
+	}
+}
+
+TEST(MlpSetUInt64, ProbeStrategyCorrectness)
+{
+	const int N = 1000000;
+	const int Q = 1000000;
+	rep(mode, 0, 2)
+	{
+		// mode 0: 3 flat levels, mode 1: 4 flat levels, mode 2: de-amortized insertion
+		//
+		printf("Testing top-down probing, mode %d..\n", mode);
+		MlpSetUInt64::MlpSet ms;
+		ms.Init(N, (mode == 1) ? 4 : 3);
+		if (mode == 2)
+		{
+			ms.EnableDeamortizedInsert(2);
+		}
+		ms.SetProbeStrategy(MlpSetUInt64::CuckooHashTable::PROBE_TOP_DOWN);
+		set<uint64_t> S;
+		rep(i, 0, N - 1)
+		{
+			uint64_t key = (rand() % 2) ? GenDenseKey() : GenSparseKey();
+			ReleaseAssert(ms.Insert(key) == S.insert(key).second);
+		}
+		
+		// the answers must not depend on the strategy
+		//
+		rep(strategy, 0, 1)
+		{
+			ms.SetProbeStrategy(strategy ? MlpSetUInt64::CuckooHashTable::PROBE_TOP_DOWN :
+			                               MlpSetUInt64::CuckooHashTable::PROBE_ALL_LENGTHS);
+			rep(i, 0, Q - 1)
+			{
+				uint64_t key;
+				int kind = rand() % 3;
+				if (kind == 0)
+				{
+					key = GenDenseKey();
+				}
+				else if (kind == 1)
+				{
+					key = GenSparseKey();
+				}
+				else
+				{
+					set<uint64_t>::iterator it = S.lower_bound(GenSparseKey());
+					key = (it == S.end()) ? 0 : *it;
+				}
+				set<uint64_t>::iterator it = S.lower_bound(key);
+				ReleaseAssert(ms.Exist(key) == (it != S.end() && *it == key));
+				bool found;
+				uint64_t ret = ms.LowerBound(key, found);
+				ReleaseAssert(found == (it != S.end()));
+				if (found) ReleaseAssert(ret == *it);
+			}
+		}
+	}
+}
+
+// Throughput of the probe strategies on sets of different sizes, to find the crossover point
+//
+TEST(MlpSetUInt64, ProbeStrategy_SizeSweep)
+{
+	const int Q = 4000000;
+	const int numSizes = 7;
+	const int sizes[numSizes] = { 10000, 30000, 100000, 300000, 1000000, 3000000, 10000000 };
+	rep(dense, 0, 1)
+	{
+		rep(k, 0, numSizes - 1)
+		{
+			int n = sizes[k];
+			vector<uint64_t> keys;
+			rep(i, 0, n - 1)
+			{
+				keys.push_back(dense ? GenDenseKey() : GenSparseKey());
+			}
+			// half of the queries are existing keys
+			//
+			vector<uint64_t> queries;
+			rep(i, 0, Q - 1)
+			{
+				queries.push_back((i % 2) ? keys[rand() % n] : (dense ? GenDenseKey() : GenSparseKey()));
+			}
+			MlpSetUInt64::MlpSet ms;
+			ms.Init(n);
+			rep(i, 0, n - 1)
+			{
+				ms.Insert(keys[i]);
+			}
+			printf("==== %s keys, size %d, auto strategy = %s ====\n", 
+			       (dense ? "dense" : "sparse"), n, 
+			       (ms.GetProbeStrategy() == MlpSetUInt64::CuckooHashTable::PROBE_TOP_DOWN ? "top-down" : "all-lengths"));
+			uint64_t checksum[2][2];
+			rep(strategy, 0, 1)
+			{
+				ms.SetProbeStrategy(strategy ? MlpSetUInt64::CuckooHashTable::PROBE_TOP_DOWN :
+				                               MlpSetUInt64::CuckooHashTable::PROBE_ALL_LENGTHS);
+				double existTime, lowerBoundTime;
+				uint64_t sum = 0;
+				{
+					AutoTimer timer(&existTime);
+					rep(i, 0, Q - 1)
+					{
+						sum += ms.Exist(queries[i]);
+					}
+				}
+				checksum[strategy][0] = sum;
+				sum = 0;
+				{
+					AutoTimer timer(&lowerBoundTime);
+					rep(i, 0, Q - 1)
+					{
+						bool found;
+						sum += ms.LowerBound(queries[i], found);
+					}
+				}
+				checksum[strategy][1] = sum;
+				printf("%s: Exist %.1lf ns/op, LowerBound %.1lf ns/op\n", 
+				       (strategy ? "top-down" : "all-lengths"), existTime * 1e9 / Q, lowerBoundTime * 1e9 / Q);
+			}
+			ReleaseAssert(checksum[0][0] == checksum[1][0] && checksum[0][1] == checksum[1][1]);
+		}
+	}
+}
+
+void UpperLevelMirrorCheckQueries(MlpSetUInt64::MlpSet& ms, set<uint64_t>& S, int Q)
+{
+	rep(i, 0, Q - 1)
+	{
+		uint64_t key = (rand() % 2) ? GenDenseKey() : GenSparseKey();
+		set<uint64_t>::iterator it = S.lower_bound(key);
+		ReleaseAssert(ms.Exist(key) == (it != S.end() && *it == key));
+		bool found;
+		uint64_t ret = ms.LowerBound(key, found);
+		ReleaseAssert(found == (it != S.end()));
+		if (found) ReleaseAssert(ret == *it);
+		MlpSetUInt64::MlpSet::Promise p = ms.LowerBound(key);
+		ReleaseAssert(p.IsValid() == (it != S.end()));
+		if (p.IsValid()) ReleaseAssert(p.Resolve() == *it);
+	}
+}
+
+TEST(MlpSetUInt64, UpperLevelMirrorCorrectness)
+{
+	const int N = 1000000;
+	const int Q = 500000;
+	rep(numFlatLevels, 3, 4)
+	{
+		rep(strategy, 0, 1)
+		{
+			printf("Testing upper level mirror, %d flat levels, %s..\n", numFlatLevels, (strategy ? "top-down" : "all-lengths"));
+			MlpSetUInt64::MlpSet ms;
+			ms.Init(N + 10, numFlatLevels);
+			ms.SetProbeStrategy(strategy ? MlpSetUInt64::CuckooHashTable::PROBE_TOP_DOWN :
+			                               MlpSetUInt64::CuckooHashTable::PROBE_ALL_LENGTHS);
+			set<uint64_t> S;
+			rep(i, 0, N / 2 - 1)
+			{
+				uint64_t key = (rand() % 2) ? GenDenseKey() : GenSparseKey();
+				ReleaseAssert(ms.Insert(key) == S.insert(key).second);
+			}
+			ms.BuildUpperLevelMirror();
+			ReleaseAssert(ms.GetUpperLevelMirror() != nullptr);
+			UpperLevelMirrorCheckQueries(ms, S, Q);
+			
+			// the mirror is dropped by the first insertion, and rebuilt into the same memory if it fits
+			//
+			rep(i, N / 2, N - 1)
+			{
+				uint64_t key = (rand() % 2) ? GenDenseKey() : GenSparseKey();
+				ReleaseAssert(ms.Insert(key) == S.insert(key).second);
+			}
+			ReleaseAssert(ms.GetUpperLevelMirror() == nullptr);
+			UpperLevelMirrorCheckQueries(ms, S, Q);
+			ms.BuildUpperLevelMirror();
+			UpperLevelMirrorCheckQueries(ms, S, Q);
+		}
+	}
+}
+
+// Counts the LLC misses of the calling thread, if the hardware counters are available
+//
+struct LLCMissCounter
+{
+	LLCMissCounter()
+	{
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.size = sizeof(attr);
+		attr.config = PERF_COUNT_HW_CACHE_MISSES;
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		m_fd = syscall(__NR_perf_event_open, &attr, 0 /*pid*/, -1 /*cpu*/, -1 /*groupFd*/, 0 /*flags*/);
+	}
+	
+	~LLCMissCounter()
+	{
+		if (m_fd != -1) close(m_fd);
+	}
+	
+	bool IsAvailable() { return m_fd != -1; }
+	void Start()
+	{
+		if (m_fd != -1) { ioctl(m_fd, PERF_EVENT_IOC_RESET, 0); ioctl(m_fd, PERF_EVENT_IOC_ENABLE, 0); }
+	}
+	uint64_t Stop()
+	{
+		uint64_t count = 0;
+		if (m_fd != -1) 
+		{ 
+			ioctl(m_fd, PERF_EVENT_IOC_DISABLE, 0); 
+			ssize_t ret = read(m_fd, &count, sizeof(count));
+			ReleaseAssert(ret == sizeof(count));
+		}
+		return count;
+	}
+	
+	int m_fd;
+};
+
+// Throughput and LLC misses per operation of MlpSet with and without the upper level mirror
+//
+void UpperLevelMirrorBenchmarkImpl(WorkloadUInt64& workload)
+{
+	MlpSetUInt64::MlpSet ms;
+	ms.Init(workload.numInitialValues + 1000);
+	rep(i, 0, workload.numInitialValues - 1)
+	{
+		ms.Insert(workload.initialValues[i]);
+	}
+	rep(useMirror, 0, 1)
+	{
+		if (useMirror)
+		{
+			AutoTimer timer;
+			ms.BuildUpperLevelMirror();
+			printf("Mirror built, %u entries, %llu bytes\n", ms.GetUpperLevelMirror()->GetNumEntries(), 
+			       static_cast<unsigned long long>(ms.GetUpperLevelMirror()->GetMemoryFootprint()));
+		}
+		printf("%s: ", (useMirror ? "with mirror" : "without mirror"));
+		LLCMissCounter counter;
+		counter.Start();
+		{
+			AutoTimer timer;
+			rep(i, 0, workload.numOperations - 1)
+			{
+				if (workload.operations[i].type == WorkloadOperationType::EXIST)
+				{
+					workload.results[i] = ms.Exist(workload.operations[i].key);
+				}
+				else
+				{
+					ReleaseAssert(workload.operations[i].type == WorkloadOperationType::LOWER_BOUND);
+					bool found;
+					workload.results[i] = ms.LowerBound(workload.operations[i].key, found);
+				}
+			}
+		}
+		uint64_t misses = counter.Stop();
+		if (counter.IsAvailable())
+		{
+			printf("LLC misses per op = %.2lf\n", double(misses) / workload.numOperations);
+		}
+		else
+		{
+			printf("LLC miss counter not available\n");
+		}
+		rep(i, 0, workload.numOperations - 1)
+		{
+			ReleaseAssert(workload.results[i] == workload.expectedResults[i]);
+		}
+	}
+}
+
+TEST(MlpSetUInt64, UpperLevelMirror_16M)
+{
+	{
+		printf("==== WorkloadA 16M ====\n");
+		WorkloadUInt64 workload = WorkloadA::GenWorkload16M();
+		Auto(workload.FreeMemory());
+		UpperLevelMirrorBenchmarkImpl(workload);
+	}
+	{
+		printf("==== WorkloadB 16M ====\n");
+		WorkloadUInt64 workload = WorkloadB::GenWorkload16M();
+		Auto(workload.FreeMemory());
+		UpperLevelMirrorBenchmarkImpl(workload);
+	}
+	{
+		printf("==== WorkloadC 16M ====\n");
+		WorkloadUInt64 workload = WorkloadC::GenWorkload16M();
+		Auto(workload.FreeMemory());
+		UpperLevelMirrorBenchmarkImpl(workload);
+	}
+	{
+		printf("==== WorkloadD 16M ====\n");
+		WorkloadUInt64 workload = WorkloadD::GenWorkload16M();
+		Auto(workload.FreeMemory());
+		UpperLevelMirrorBenchmarkImpl(workload);
+	}
+}
+
+TEST(MlpSetUInt64, UpperLevelMirror_80M)
+{
+	{
+		printf("==== WorkloadA 80M ====\n");
+		WorkloadUInt64 workload = WorkloadA::GenWorkload80M();
+		Auto(workload.FreeMemory());
+		UpperLevelMirrorBenchmarkImpl(workload);
+	}
+	{
+		printf("==== WorkloadB 80M ====\n");
+		WorkloadUInt64 workload = WorkloadB::GenWorkload80M();
+		Auto(workload.FreeMemory());
+		UpperLevelMirrorBenchmarkImpl(workload);
+	}
+}
+
+const char* const x_probeKernelNames[3] = { "scalar", "AVX2", "AVX-512" };
+
+TEST(MlpSetUInt64, ProbeKernelCorrectness)
+{
+	const int N = 1000000;
+	const int Q = 500000;
+	MlpSetUInt64::CuckooHashTable::ProbeKernel defaultKernel = MlpSetUInt64::CuckooHashTable::GetProbeKernel();
+	Auto(MlpSetUInt64::CuckooHashTable::SetProbeKernel(defaultKernel));
+	rep(mode, 0, 2)
+	{
+		// mode 0: 3 flat levels, mode 1: 4 flat levels, mode 2: de-amortized insertion
+		//
+		MlpSetUInt64::MlpSet ms;
+		ms.Init(N, (mode == 1) ? 4 : 3);
+		if (mode == 2)
+		{
+			ms.EnableDeamortizedInsert(2);
+		}
+		ms.SetProbeStrategy(MlpSetUInt64::CuckooHashTable::PROBE_ALL_LENGTHS);
+		set<uint64_t> S;
+		rep(i, 0, N - 1)
+		{
+			uint64_t key = (rand() % 2) ? GenDenseKey() : GenSparseKey();
+			ReleaseAssert(ms.Insert(key) == S.insert(key).second);
+		}
+		rep(kernel, 0, 2)
+		{
+			MlpSetUInt64::CuckooHashTable::ProbeKernel k = MlpSetUInt64::CuckooHashTable::ProbeKernel(kernel);
+			if (!MlpSetUInt64::CuckooHashTable::IsProbeKernelSupported(k))
+			{
+				printf("Skipping %s kernel, not supported by CPU\n", x_probeKernelNames[kernel]);
+				continue;
+			}
+			printf("Testing %s kernel, mode %d..\n", x_probeKernelNames[kernel], mode);
+			MlpSetUInt64::CuckooHashTable::SetProbeKernel(k);
+			UpperLevelMirrorCheckQueries(ms, S, Q);
+		}
+	}
+}
+
+// Throughput of the tag compare kernels of QueryLCP
+//
+void ProbeKernelBenchmarkImpl(WorkloadUInt64& workload)
+{
+	MlpSetUInt64::CuckooHashTable::ProbeKernel defaultKernel = MlpSetUInt64::CuckooHashTable::GetProbeKernel();
+	Auto(MlpSetUInt64::CuckooHashTable::SetProbeKernel(defaultKernel));
+	MlpSetUInt64::MlpSet ms;
+	ms.Init(workload.numInitialValues + 1000);
+	ms.SetProbeStrategy(MlpSetUInt64::CuckooHashTable::PROBE_ALL_LENGTHS);
+	rep(i, 0, workload.numInitialValues - 1)
+	{
+		ms.Insert(workload.initialValues[i]);
+	}
+	rep(kernel, 0, 2)
+	{
+		MlpSetUInt64::CuckooHashTable::ProbeKernel k = MlpSetUInt64::CuckooHashTable::ProbeKernel(kernel);
+		if (!MlpSetUInt64::CuckooHashTable::IsProbeKernelSupported(k))
+		{
+			continue;
+		}
+		MlpSetUInt64::CuckooHashTable::SetProbeKernel(k);
+		printf("%s kernel: ", x_probeKernelNames[kernel]);
+		{
+			AutoTimer timer;
+			rep(i, 0, workload.numOperations - 1)
+			{
+				if (workload.operations[i].type == WorkloadOperationType::EXIST)
+				{
+					workload.results[i] = ms.Exist(workload.operations[i].key);
+				}
+				else
+				{
+					ReleaseAssert(workload.operations[i].type == WorkloadOperationType::LOWER_BOUND);
+					bool found;
+					workload.results[i] = ms.LowerBound(workload.operations[i].key, found);
+				}
+			}
+		}
+		rep(i, 0, workload.numOperations - 1)
+		{
+			ReleaseAssert(workload.results[i] == workload.expectedResults[i]);
+		}
+	}
+}
+
+TEST(MlpSetUInt64, ProbeKernel_16M)
+{
+	{
+		printf("==== WorkloadA 16M ====\n");
+		WorkloadUInt64 workload = WorkloadA::GenWorkload16M();
+		Auto(workload.FreeMemory());
+		ProbeKernelBenchmarkImpl(workload);
+	}
+	{
+		printf("==== WorkloadB 16M ====\n");
+		WorkloadUInt64 workload = WorkloadB::GenWorkload16M();
+		Auto(workload.FreeMemory());
+		ProbeKernelBenchmarkImpl(workload);
+	}
+	{
+		printf("==== WorkloadC 16M ====\n");
+		WorkloadUInt64 workload = WorkloadC::GenWorkload16M();
+		Auto(workload.FreeMemory());
+		ProbeKernelBenchmarkImpl(workload);
+	}
+	{
+		printf("==== WorkloadD 16M ====\n");
+		WorkloadUInt64 workload = WorkloadD::GenWorkload16M();
+		Auto(workload.FreeMemory());
+		ProbeKernelBenchmarkImpl(workload);
+	}
+}
+
+// Check that the vectorized all-prefix hashes agree with the scalar hash functions
+//
+template<class HashFamily>
+void HashArrayCheck(uint64_t key)
+{
+	__m128i out1, out2, out3, out4;
+	uint64_t out5;
+	HashFamily::HashArray(key, out1, out2, out3, out4, out5);
+	uint32_t h1[4], h2[4], h3[4], h4[4];
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(h1), out1);
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(h2), out2);
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(h3), out3);
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(h4), out4);
+	rep(len, 5, 8)
+	{
+		ReleaseAssert(h1[len - 5] == HashFamily::HashFn1(key, len));
+		ReleaseAssert(h2[len - 5] == HashFamily::HashFn2(key, len));
+		ReleaseAssert(h3[len - 5] == HashFamily::HashFn3(key, len));
+	}
+	ReleaseAssert(h4[0] == HashFamily::HashFn2(key, 3));
+	ReleaseAssert(h4[1] == HashFamily::HashFn2(key, 4));
+	ReleaseAssert(h4[2] == HashFamily::HashFn1(key, 3));
+	ReleaseAssert(h4[3] == HashFamily::HashFn1(key, 4));
+	ReleaseAssert(uint32_t(out5) == HashFamily::HashFn3(key, 3));
+	ReleaseAssert(uint32_t(out5 >> 32) == HashFamily::HashFn3(key, 4));
+	// the hashes only depend on the prefix
+	//
+	rep(len, 1, 7)
+	{
+		uint64_t other = key ^ (uint64_t(rand() % 255 + 1) << (8 * (7 - len - rand() % (8 - len))));
+		ReleaseAssert(HashFamily::HashFn1(key, len) == HashFamily::HashFn1(other, len));
+		ReleaseAssert(HashFamily::HashFn2(key, len) == HashFamily::HashFn2(other, len));
+		ReleaseAssert(HashFamily::HashFn3(key, len) == HashFamily::HashFn3(other, len));
+	}
+}
+
+// Check an MlpSet of the given configuration against std::set
+// If the configuration fixes the # of flat levels, only that # of flat levels is tested
+//
+template<class Config>
+void ConfigCorrectnessTestImpl()
+{
+	typedef MlpSetUInt64::BasicMlpSet<Config> Set;
+	const int N = 1000000;
+	const int Q = 500000;
+	rep(mode, 0, 2)
+	{
+		// mode 0: 3 flat levels, mode 1: 4 flat levels, mode 2: de-amortized insertion (default # of flat levels)
+		//
+		int numFlatLevels = (mode == 1) ? 4 : 3;
+		if (mode < 2 && Config::x_numFlatLevels != 0 && numFlatLevels != Config::x_numFlatLevels)
+		{
+			continue;
+		}
+		Set ms;
+		if (mode < 2)
+		{
+			ms.Init(N, numFlatLevels);
+		}
+		else
+		{
+			ms.Init(N);
+			ms.EnableDeamortizedInsert(2);
+		}
+		set<uint64_t> S;
+		rep(i, 0, N - 1)
+		{
+			int kind = rand() % 3;
+			uint64_t key = (kind == 0) ? GenDenseKey() : ((kind == 1) ? GenSparseKey() : uint64_t(rand()));
+			ReleaseAssert(ms.Insert(key) == S.insert(key).second);
+		}
+		rep(strategy, 0, 1)
+		{
+			ms.SetProbeStrategy(strategy ? MlpSetUInt64::CuckooHashTable::PROBE_TOP_DOWN :
+			                               MlpSetUInt64::CuckooHashTable::PROBE_ALL_LENGTHS);
+			rep(i, 0, Q - 1)
+			{
+				uint64_t key = (rand() % 2) ? GenDenseKey() : GenSparseKey();
+				set<uint64_t>::iterator it = S.lower_bound(key);
+				ReleaseAssert(ms.Exist(key) == (it != S.end() && *it == key));
+				bool found;
+				uint64_t ret = ms.LowerBound(key, found);
+				ReleaseAssert(found == (it != S.end()));
+				if (found) ReleaseAssert(ret == *it);
+				typename Set::Promise p = ms.LowerBound(key);
+				ReleaseAssert(p.IsValid() == (it != S.end()));
+				if (p.IsValid()) ReleaseAssert(p.Resolve() == *it);
+			}
+		}
+		// the statistics are collected if and only if the configuration enables them
+		//
+		uint32_t numQueryLcp = 0;
+		rep(k, 0, 8)
+		{
+			numQueryLcp += ms.GetHtPtr()->stats.m_lcpResultHistogram[k];
+		}
+		ReleaseAssert((numQueryLcp > 0) == Config::x_enableStats);
+	}
+}
+
+template<class HashFamily>
+void HashFamilyCorrectnessTestImpl(const char* name)
+{
+	printf("Testing %s..\n", name);
+	rep(i, 0, 999999)
+	{
+		HashArrayCheck<HashFamily>((i % 3 == 0) ? GenDenseKey() : ((i % 3 == 1) ? GenSparseKey() : uint64_t(i)));
+	}
+	ConfigCorrectnessTestImpl<MlpSetUInt64::MlpSetConfig<HashFamily> >();
+}
+
+TEST(MlpSetUInt64, HashFamilyCorrectness)
+{
+	HashFamilyCorrectnessTestImpl<MlpSetUInt64::XXHashFamily>("XXH32 family");
+	HashFamilyCorrectnessTestImpl<MlpSetUInt64::CRC32HashFamily>("CRC32 family");
+	HashFamilyCorrectnessTestImpl<MlpSetUInt64::MultiplyShiftHashFamily>("multiply-shift family");
+}
+
+// Collision and displacement quality of a hash family on all distinct prefixes (length 3 to 8) of a set of keys
+// The Cuckoo insertion is simulated on a table of 2 * RoundUpToNearestPowerOf2(# of prefixes) slots
+// (so the load factor is between 25% and 50%, like the MlpSet hash table).
+//
+template<class HashFamily>
+void HashFamilyQualityReportImpl(const char* name, vector<uint64_t>& keys)
+{
+	vector<pair<uint64_t, int> > items;
+	rep(len, 3, 8)
+	{
+		vector<uint64_t> prefixes;
+		rep(i, 0, int(keys.size()) - 1)
+		{
+			prefixes.push_back(keys[i] >> (64 - 8 * len) << (64 - 8 * len));
+		}
+		sort(prefixes.begin(), prefixes.end());
+		prefixes.resize(unique(prefixes.begin(), prefixes.end()) - prefixes.begin());
+		rep(i, 0, int(prefixes.size()) - 1)
+		{
+			items.push_back(make_pair(prefixes[i], len));
+		}
+	}
+	uint32_t n = items.size();
+	uint32_t numSlots = 2;
+	while (numSlots < n) numSlots *= 2;
+	numSlots *= 2;
+	uint32_t mask = numSlots - 1;
+	
+	vector<uint32_t> pos1(n), pos2(n), tag(n);
+	rep(i, 0, int(n) - 1)
+	{
+		pos1[i] = HashFamily::HashFn1(items[i].first, items[i].second) & mask;
+		pos2[i] = HashFamily::HashFn2(items[i].first, items[i].second) & mask;
+		tag[i] = HashFamily::HashFn3(items[i].first, items[i].second) & ((1 << 18) - 1);
+	}
+
+	// # of items whose 2 positions are the same, and # of pairs of items sharing both positions
+	//
+	uint64_t samePosition = 0;
+	vector<uint64_t> posPairs(n);
+	rep(i, 0, int(n) - 1)
+	{
+		samePosition += (pos1[i] == pos2[i]);
+		posPairs[i] = (uint64_t(min(pos1[i], pos2[i])) << 32) | max(pos1[i], pos2[i]);
+	}
+	sort(posPairs.begin(), posPairs.end());
+	uint64_t samePairs = 0;
+	uint64_t run = 1;
+	rep(i, 1, int(n))
+	{
+		if (i < int(n) && posPairs[i] == posPairs[i - 1])
+		{
+			run++;
+		}
+		else
+		{
+			samePairs += run * (run - 1) / 2;
+			run = 1;
+		}
+	}
+	// max load of a slot under the first function
+	//
+	vector<uint32_t> load(numSlots, 0);
+	uint32_t maxLoad = 0;
+	rep(i, 0, int(n) - 1)
+	{
+		maxLoad = max(maxLoad, ++load[pos1[i]]);
+	}
+
+	// Cuckoo insertion, evicting from the first position
+	//
+	const int maxChainLength = 1000;
+	vector<uint32_t> slots(numSlots, uint32_t(-1));
+	uint64_t displacements = 0;
+	int longestChain = 0;
+	int failures = 0;
+	rep(i, 0, int(n) - 1)
+	{
+		uint32_t cur = i;
+		if (slots[pos1[cur]] == uint32_t(-1)) { slots[pos1[cur]] = cur; continue; }
+		if (slots[pos2[cur]] == uint32_t(-1)) { slots[pos2[cur]] = cur; continue; }
+		uint32_t pos = pos1[cur];
+		int chain = 0;
+		while (true)
+		{
+			swap(cur, slots[pos]);
+			chain++;
+			if (cur == uint32_t(-1)) break;
+			if (chain > maxChainLength) { failures++; break; }
+			pos = (pos1[cur] == pos) ? pos2[cur] : pos1[cur];
+		}
+		displacements += chain;
+		longestChain = max(longestChain, chain);
+	}
+
+	// false positive rate of the 18-bit tag:
+	// compare each item with the other item stored in its first position (what a negative probe would see)
+	//
+	uint64_t tagCompares = 0;
+	uint64_t tagMatches = 0;
+	rep(i, 0, int(n) - 1)
+	{
+		uint32_t other = slots[pos1[i]];
+		if (other != uint32_t(-1) && other != uint32_t(i) && items[other].second == items[i].second)
+		{
+			tagCompares++;
+			tagMatches += (tag[other] == tag[i]);
+		}
+	}
+
+	double expectedSamePairs = double(n) * (n - 1) / 2 * 2 / (double(numSlots) * numSlots);
+	printf("%s: %u prefixes, load factor %.2lf\n", name, n, double(n) / numSlots);
+	printf("\tsame position for both functions: %llu (expected %.1lf)\n",
+	       static_cast<unsigned long long>(samePosition), double(n) / numSlots);
+	printf("\tpairs sharing both positions: %llu (expected %.1lf)\n",
+	       static_cast<unsigned long long>(samePairs), expectedSamePairs);
+	printf("\tmax slot load of first function: %u\n", maxLoad);
+	printf("\tdisplacements per insert: %.4lf, longest chain: %d, failures: %d\n",
+	       double(displacements) / n, longestChain, failures);
+	printf("\ttag false positive rate: %.2le (expected %.2le)\n",
+	       double(tagMatches) / max(tagCompares, uint64_t(1)), 1.0 / (1 << 18));
+}
+
+template<class HashFamily>
+void HashFamilyQualityReportAllKeySets(const char* name)
+{
+	const int N = 2000000;
+	printf("==== %s ====\n", name);
+	vector<uint64_t> keys;
+	rep(i, 0, N - 1) keys.push_back(GenSparseKey());
+	HashFamilyQualityReportImpl<HashFamily>("sparse keys", keys);
+	keys.clear();
+	rep(i, 0, N - 1) keys.push_back(GenDenseKey());
+	HashFamilyQualityReportImpl<HashFamily>("dense keys", keys);
+	keys.clear();
+	rep(i, 0, N - 1) keys.push_back(uint64_t(i));
+	HashFamilyQualityReportImpl<HashFamily>("sequential keys", keys);
+	keys.clear();
+	rep(i, 0, N - 1) keys.push_back(uint64_t(i) << 40);
+	HashFamilyQualityReportImpl<HashFamily>("sequential 3-byte prefixes", keys);
+}
+
+TEST(MlpSetUInt64, HashFamilyQualityReport)
+{
+	HashFamilyQualityReportAllKeySets<MlpSetUInt64::XXHashFamily>("XXH32 family");
+	HashFamilyQualityReportAllKeySets<MlpSetUInt64::CRC32HashFamily>("CRC32 family");
+	HashFamilyQualityReportAllKeySets<MlpSetUInt64::MultiplyShiftHashFamily>("multiply-shift family");
+}
+
+// Cost per key of computing all prefix hashes, vectorized (as in QueryLCP) and one hash function at a time
+//
+template<class HashFamily>
+void HashFamilyCostBenchmarkImpl(const char* name, vector<uint64_t>& keys)
+{
+	int n = keys.size();
+	__m128i acc = _mm_setzero_si128();
+	uint64_t acc5 = 0;
+	double vectorTime;
+	{
+		AutoTimer timer(&vectorTime);
+		rep(i, 0, n - 1)
+		{
+			__m128i out1, out2, out3, out4;
+			uint64_t out5;
+			HashFamily::HashArray(keys[i], out1, out2, out3, out4, out5);
+			acc = _mm_xor_si128(acc, _mm_xor_si128(_mm_xor_si128(out1, out2), _mm_xor_si128(out3, out4)));
+			acc5 ^= out5;
+		}
+	}
+
+	uint32_t acc2 = 0;
+	double scalarTime;
+	{
+		AutoTimer timer(&scalarTime);
+		rep(i, 0, n - 1)
+		{
+			rep(len, 3, 8)
+			{
+				acc2 ^= HashFamily::HashFn1(keys[i], len);
+				acc2 ^= HashFamily::HashFn2(keys[i], len);
+				acc2 ^= HashFamily::HashFn3(keys[i], len);
+			}
+		}
+	}
+	printf("%s: all-prefix vectorized %.2lf ns/key, scalar %.2lf ns/key (checksum %u)\n",
+	       name, vectorTime * 1e9 / n, scalarTime * 1e9 / n,
+	       uint32_t(_mm_extract_epi32(acc, 0) ^ _mm_extract_epi32(acc, 3) ^ acc5 ^ acc2));
+}
+
+TEST(MlpSetUInt64, HashFamilyCost)
+{
+	const int N = 16000000;
+	vector<uint64_t> keys;
+	rep(i, 0, N - 1) keys.push_back(GenSparseKey());
+	HashFamilyCostBenchmarkImpl<MlpSetUInt64::XXHashFamily>("XXH32 family", keys);
+	HashFamilyCostBenchmarkImpl<MlpSetUInt64::CRC32HashFamily>("CRC32 family", keys);
+	HashFamilyCostBenchmarkImpl<MlpSetUInt64::MultiplyShiftHashFamily>("multiply-shift family", keys);
+}
+
+// End-to-end throughput of MlpSet of a configuration
+//
+template<class Config>
+void ConfigBenchmarkImpl(WorkloadUInt64& workload, const char* name)
+{
+	printf("%s:\n", name);
+	MlpSetUInt64::BasicMlpSet<Config> ms;
+	ms.Init(workload.numInitialValues + 1000);
+	printf("MlpSet populating initial values.. ");
+	{
+		AutoTimer timer;
+		rep(i, 0, workload.numInitialValues - 1)
+		{
+			ms.Insert(workload.initialValues[i]);
+		}
+	}
+	printf("MlpSet executing workload.. ");
+	{
+		AutoTimer timer;
+		rep(i, 0, workload.numOperations - 1)
+		{
+			if (workload.operations[i].type == WorkloadOperationType::EXIST)
+			{
+				workload.results[i] = ms.Exist(workload.operations[i].key);
+			}
+			else
+			{
+				ReleaseAssert(workload.operations[i].type == WorkloadOperationType::LOWER_BOUND);
+				bool found;
+				workload.results[i] = ms.LowerBound(workload.operations[i].key, found);
+			}
+		}
+	}
+	rep(i, 0, workload.numOperations - 1)
+	{
+		ReleaseAssert(workload.results[i] == workload.expectedResults[i]);
+	}
+	if (Config::x_enableStats)
+	{
+		ms.ReportStats();
+	}
+}
+
+void HashFamilyBenchmarkAllFamilies(WorkloadUInt64& workload)
+{
+	ConfigBenchmarkImpl<MlpSetUInt64::MlpSetConfig<MlpSetUInt64::XXHashFamily> >(workload, "XXH32 family");
+	ConfigBenchmarkImpl<MlpSetUInt64::MlpSetConfig<MlpSetUInt64::CRC32HashFamily> >(workload, "CRC32 family");
+	ConfigBenchmarkImpl<MlpSetUInt64::MlpSetConfig<MlpSetUInt64::MultiplyShiftHashFamily> >(workload, "multiply-shift family");
+}
+
+TEST(MlpSetUInt64, HashFamily_16M)
+{
+	{
+		printf("==== WorkloadA 16M ====\n");
+		WorkloadUInt64 workload = WorkloadA::GenWorkload16M();
+		Auto(workload.FreeMemory());
+		HashFamilyBenchmarkAllFamilies(workload);
+	}
+	{
+		printf("==== WorkloadC 16M ====\n");
+		WorkloadUInt64 workload = WorkloadC::GenWorkload16M();
+		Auto(workload.FreeMemory());
+		HashFamilyBenchmarkAllFamilies(workload);
+	}
+}
+
+TEST(MlpSetUInt64, ConfigCorrectness)
+{
+	printf("Testing default configuration..\n");
+	ConfigCorrectnessTestImpl<MlpSetUInt64::DefaultMlpSetConfig>();
+	printf("Testing statistics configuration..\n");
+	ConfigCorrectnessTestImpl<MlpSetUInt64::StatsMlpSetConfig>();
+	printf("Testing 4 flat levels configuration..\n");
+	ConfigCorrectnessTestImpl<MlpSetUInt64::FourFlatLevelsMlpSetConfig>();
+	printf("Testing transparent hugepage configuration..\n");
+	ConfigCorrectnessTestImpl<MlpSetUInt64::TransparentHugePageMlpSetConfig>();
+}
+
+void ConfigBenchmarkAllConfigs(WorkloadUInt64& workload)
+{
+	ConfigBenchmarkImpl<MlpSetUInt64::DefaultMlpSetConfig>(workload, "default configuration");
+	ConfigBenchmarkImpl<MlpSetUInt64::StatsMlpSetConfig>(workload, "statistics configuration");
+	ConfigBenchmarkImpl<MlpSetUInt64::FourFlatLevelsMlpSetConfig>(workload, "4 flat levels configuration");
+	ConfigBenchmarkImpl<MlpSetUInt64::TransparentHugePageMlpSetConfig>(workload, "transparent hugepage configuration");
+}
+
+TEST(MlpSetUInt64, Config_16M)
+{
+	{
+		printf("==== WorkloadA 16M ====\n");
+		WorkloadUInt64 workload = WorkloadA::GenWorkload16M();
+		Auto(workload.FreeMemory());
+		ConfigBenchmarkAllConfigs(workload);
+	}
+	{
+		printf("==== WorkloadC 16M ====\n");
+		WorkloadUInt64 workload = WorkloadC::GenWorkload16M();
+		Auto(workload.FreeMemory());
+		ConfigBenchmarkAllConfigs(workload);
+	}
+}
+
+// Stand-ins for calling the query path out-of-line (as it was when it lived in MlpSetUInt64.cpp)
+//
+bool NO_INLINE MlpSetExistNotInlined(MlpSetUInt64::MlpSet& ms, uint64_t key)
+{
+	return ms.Exist(key);
+}
+
+uint64_t NO_INLINE MlpSetLowerBoundNotInlined(MlpSetUInt64::MlpSet& ms, uint64_t key, bool& found)
+{
+	return ms.LowerBound(key, found);
+}
+
+// A caller's tight query loop, with the queries inlined into the loop or not
+//
+template<bool inlined>
+uint64_t NO_INLINE MlpSetExistLoop(MlpSetUInt64::MlpSet& ms, const vector<uint64_t>& queries)
+{
+	uint64_t sum = 0;
+	rep(i, 0, int(queries.size()) - 1)
+	{
+		sum += inlined ? ms.Exist(queries[i]) : MlpSetExistNotInlined(ms, queries[i]);
+	}
+	return sum;
+}
+
+template<bool inlined>
+uint64_t NO_INLINE MlpSetLowerBoundLoop(MlpSetUInt64::MlpSet& ms, const vector<uint64_t>& queries)
+{
+	uint64_t sum = 0;
+	rep(i, 0, int(queries.size()) - 1)
+	{
+		bool found;
+		sum += inlined ? ms.LowerBound(queries[i], found) : MlpSetLowerBoundNotInlined(ms, queries[i], found);
+	}
+	return sum;
+}
+
+// Throughput of a caller's tight query loop, with Exist and LowerBound inlined into the loop vs. called out-of-line
+//
+void InlinedQueryBenchmarkImpl(int n, int q)
+{
+	printf("==== %d keys, %d queries ====\n", n, q);
+	MlpSetUInt64::MlpSet ms;
+	ms.Init(n + 1000);
+	vector<uint64_t> keys;
+	rep(i, 0, n - 1)
+	{
+		keys.push_back(GenSparseKey());
+		ms.Insert(keys.back());
+	}
+	// half of the queries are keys in the set
+	//
+	vector<uint64_t> queries;
+	rep(i, 0, q - 1)
+	{
+		queries.push_back((i % 2 == 0) ? keys[rand() % n] : GenSparseKey());
+	}
+
+	// the loops are run alternately for a few rounds, and the best time of each is reported
+	//
+	const int numRounds = 3;
+	double existTime[2] = { 1e100, 1e100 };
+	double lowerBoundTime[2] = { 1e100, 1e100 };
+	uint64_t existSum[2], lowerBoundSum[2];
+	rep(round, 0, numRounds - 1)
+	{
+		double t;
+		{
+			AutoTimer timer(&t);
+			existSum[0] = MlpSetExistLoop<false>(ms, queries);
+		}
+		existTime[0] = min(existTime[0], t);
+		{
+			AutoTimer timer(&t);
+			existSum[1] = MlpSetExistLoop<true>(ms, queries);
+		}
+		existTime[1] = min(existTime[1], t);
+		{
+			AutoTimer timer(&t);
+			lowerBoundSum[0] = MlpSetLowerBoundLoop<false>(ms, queries);
+		}
+		lowerBoundTime[0] = min(lowerBoundTime[0], t);
+		{
+			AutoTimer timer(&t);
+			lowerBoundSum[1] = MlpSetLowerBoundLoop<true>(ms, queries);
+		}
+		lowerBoundTime[1] = min(lowerBoundTime[1], t);
+		ReleaseAssert(existSum[0] == existSum[1]);
+		ReleaseAssert(lowerBoundSum[0] == lowerBoundSum[1]);
+	}
+	printf("Exist: inlined %.2lf ns/query, not inlined %.2lf ns/query\n", existTime[1] * 1e9 / q, existTime[0] * 1e9 / q);
+	printf("LowerBound: inlined %.2lf ns/query, not inlined %.2lf ns/query\n", lowerBoundTime[1] * 1e9 / q, lowerBoundTime[0] * 1e9 / q);
+}
+
+TEST(MlpSetUInt64, InlinedQueryBenchmark)
+{
+	// cache-resident set, where the call overhead is a visible part of the query cost
+	//
+	InlinedQueryBenchmarkImpl(10000, 10000000);
+	InlinedQueryBenchmarkImpl(16000000, 10000000);
+}
+
+// # of nodes (not bitmap slots) in the hash table of ms, including the stash
+//
+int CountHashTableNodes(MlpSetUInt64::MlpSet& ms)
+{
+	MlpSetUInt64::CuckooHashTable* ht = ms.GetHtPtr();
+	int numNodes = 0;
+	rep(i, 0, int(ht->htMask) + 6 + MlpSetUInt64::CuckooHashTableBase::x_stashRegionSlots)
+	{
+		numNodes += ht->ht[i].IsOccupiedAndNode();
+	}
+	return numNodes;
+}
+
+// Generate n keys mixing dense keys, sparse keys, and keys that only share 3-byte prefixes with others,
+// with some duplicates
+//
+vector<uint64_t> GenBulkLoadKeys(int n)
+{
+	vector<uint64_t> keys;
+	rep(i, 0, n - 1)
+	{
+		int kind = rand() % 4;
+		if (kind == 0)
+		{
+			keys.push_back(GenDenseKey());
+		}
+		else if (kind == 1)
+		{
+			keys.push_back(GenSparseKey());
+		}
+		else if (kind == 2)
+		{
+			keys.push_back((GenDenseKey() & 0xffffff0000000000ULL) | (GenSparseKey() >> 24));
+		}
+		else
+		{
+			keys.push_back(keys.empty() ? GenDenseKey() : keys[rand() % keys.size()]);
+		}
+	}
+	return keys;
+}
+
+// Bulk load ms with keys with numThreads threads, and check it against S, 
+// and against ms2 holding the same keys inserted one by one
+//
+void BulkLoadCheck(MlpSetUInt64::MlpSet& ms, MlpSetUInt64::MlpSet& ms2, set<uint64_t>& S, vector<uint64_t>& keys, int numThreads)
+{
+	ReleaseAssert(ms.BulkLoad(keys.data(), keys.size(), numThreads) == S.size());
+	ms.GetHtPtr()->ExecutePendingDisplacements(1000000);
+	AssertMinvOffsetValid(ms);
+	// the tree is canonical, so it has the same nodes as the one built by Insert
+	//
+	ReleaseAssert(CountHashTableNodes(ms) == CountHashTableNodes(ms2));
+	rep(i, 0, 999999)
+	{
+		uint64_t key;
+		if (rand() % 2 == 0)
+		{
+			key = keys[rand() % keys.size()] + rand() % 3 - 1;
+		}
+		else
+		{
+			key = (rand() % 2 == 0) ? GenDenseKey() : GenSparseKey();
+		}
+		auto it = S.lower_bound(key);
+		ReleaseAssert(ms.Exist(key) == (it != S.end() && *it == key));
+		bool found;
+		uint64_t lb = ms.LowerBound(key, found);
+		ReleaseAssert(found == (it != S.end()));
+		if (found)
+		{
+			ReleaseAssert(lb == *it);
+		}
+	}
+}
+
+TEST(MlpSetUInt64, BulkLoadCorrectness)
+{
+	const int N = 1000000;
+	vector<uint64_t> keys = GenBulkLoadKeys(N);
+	set<uint64_t> S(keys.begin(), keys.end());
+	
+	// check the tree shape against StupidTrie on a smaller set
+	//
+	{
+		vector<uint64_t> small(keys.begin(), keys.begin() + 20000);
+		StupidUInt64Trie::Trie st;
+		for (uint64_t key : small) st.Insert(key);
+		MlpSetUInt64::MlpSet ms;
+		ms.Init(small.size());
+		ms.BulkLoad(small.data(), small.size(), 4 /*numThreads*/);
+		AssertTreeShapeEqualA(st, ms, true /*printDetail*/);
+	}
+	
+	rep(numFlatLevels, 3, 4)
+	{
+		MlpSetUInt64::MlpSet ms2;
+		ms2.Init(N, numFlatLevels);
+		for (uint64_t key : keys) ms2.Insert(key);
+		
+		int threadCounts[3] = { 1, 3, 8 };
+		for (int numThreads : threadCounts)
+		{
+			printf("Testing %d flat levels, %d threads..\n", numFlatLevels, numThreads);
+			MlpSetUInt64::MlpSet ms;
+			ms.Init(N, numFlatLevels);
+			BulkLoadCheck(ms, ms2, S, keys, numThreads);
+		}
+		{
+			printf("Testing %d flat levels, de-amortized mode and exist filter..\n", numFlatLevels);
+			MlpSetUInt64::MlpSet ms;
+			ms.Init(N, numFlatLevels);
+			ms.EnableDeamortizedInsert(2 /*stepsPerInsert*/);
+			ms.EnableExistFilter();
+			BulkLoadCheck(ms, ms2, S, keys, 4 /*numThreads*/);
+		}
+	}
+	
+	// small sets: a set created in small-set mode is promoted by the bulk load, unless the keys fit in a small set
+	//
+	{
+		printf("Testing small sets..\n");
+		rep(n, 0, 600)
+		{
+			vector<uint64_t> small(keys.begin(), keys.begin() + n);
+			set<uint64_t> smallSet(small.begin(), small.end());
+			sort(small.begin(), small.end());
+			MlpSetUInt64::MlpSet ms;
+			ms.InitCompact(1000);
+			ReleaseAssert(ms.BulkLoadSorted(small.data(), small.size(), 2 /*numThreads*/) == smallSet.size());
+			ReleaseAssert(ms.IsSmallSet() == (n <= int(MlpSetUInt64::MlpSet::x_smallSetMaxSize)));
+			rep(i, 0, n - 1)
+			{
+				ReleaseAssert(ms.Exist(small[i]));
+			}
+			// the set keeps working with Insert after the bulk load
+			//
+			rep(i, n, n + 99)
+			{
+				ReleaseAssert(ms.Insert(keys[i]) == smallSet.insert(keys[i]).second);
+			}
+			for (uint64_t key : smallSet)
+			{
+				ReleaseAssert(ms.Exist(key));
+			}
+		}
+	}
+}
+
+// Time of Insert one by one vs. BulkLoad with 1 to 32 threads, on dense (WorkloadA distribution) and sparse keys
+//
+void BulkLoadScalingBenchmarkImpl(uint32_t n)
+{
+	std::mt19937_64 rng(n);
+	rep(dense, 0, 1)
+	{
+		printf("==== %u %s keys ====\n", n, dense ? "dense" : "sparse");
+		vector<uint64_t> keys(n);
+		rep(i, 0, int(n) - 1)
+		{
+			if (dense)
+			{
+				uint64_t key = 0;
+				rep(k, 0, 1) key = key * 256 + rng() % 64 + 32;
+				rep(k, 2, 7) key = key * 256 + rng() % 5 + 48;
+				keys[i] = key;
+			}
+			else
+			{
+				keys[i] = rng();
+			}
+		}
+		double insertTime;
+		{
+			MlpSetUInt64::MlpSet ms;
+			ms.Init(n);
+			AutoTimer timer(&insertTime);
+			for (uint64_t key : keys) ms.Insert(key);
+		}
+		printf("Insert: %.2lf s\n", insertTime);
+		double oneThreadTime = 0;
+		for (int numThreads = 1; numThreads <= 32; numThreads *= 2)
+		{
+			MlpSetUInt64::BasicMlpSet<MlpSetUInt64::StatsMlpSetConfig> ms;
+			ms.Init(n);
+			double t;
+			{
+				AutoTimer timer(&t);
+				ms.BulkLoad(keys.data(), n, numThreads);
+			}
+			if (numThreads == 1) oneThreadTime = t;
+			printf("BulkLoad, %d threads: %.2lf s, %.2lfx vs. 1 thread, %.2lfx vs. Insert, %.2lf%% of nodes placed serially\n",
+			       numThreads, t, oneThreadTime / t, insertTime / t, 
+			       100.0 * ms.stats.m_bulkLoadSerialNodeCount / ms.stats.m_bulkLoadNodeCount);
+		}
+	}
+}
+
+TEST(MlpSetUInt64, BulkLoadScaling_16M)
+{
+	printf("%d hardware threads\n", int(std::thread::hardware_concurrency()));
+	BulkLoadScalingBenchmarkImpl(16000000);
+}
+
+TEST(MlpSetUInt64, BulkLoadScaling_80M)
+{
+	printf("%d hardware threads\n", int(std::thread::hardware_concurrency()));
+	BulkLoadScalingBenchmarkImpl(80000000);
+}
+
+TEST(MlpSetUInt64, BulkLoadScaling_256M)
+{
+	printf("%d hardware threads\n", int(std::thread::hardware_concurrency()));
+	BulkLoadScalingBenchmarkImpl(256000000);
+}
+
 template<bool enforcedDep>
 void NO_INLINE MlpSetExecuteWorkload(WorkloadUInt64& workload)
 {
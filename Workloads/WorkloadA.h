@@ -10,5 +10,9 @@ WorkloadUInt64 GenWorkload16M();
 
 WorkloadUInt64 GenWorkload80M();
 
+// Same as GenWorkload16M, but the queried keys follow a Zipfian distribution with the given skew
+//
+WorkloadUInt64 GenWorkload16MZipf(double skew);
+
 }	// WorkloadA
  
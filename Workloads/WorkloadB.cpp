@@ -79,5 +79,48 @@ WorkloadUInt64 GenWorkload80M()
 	return workload;
 }
 
+// Same key distribution as GenWorkload16M
+//
+static uint64_t GenKey16M()
+{
+	uint64_t key = 0;
+	rep(k, 0, 1)
+	{
+		key = key * 256 + rand() % 64 + 32;
+	}
+	rep(k, 2, 7)
+	{
+		key = key * 256 + rand() % 5 + 48;
+	}
+	return key;
+}
+
+WorkloadUInt64 GenWorkload16MZipf(double skew)
+{
+	const int N = 16000000;
+	const int Q = 20000000;
+	WorkloadUInt64 workload;
+	workload.AllocateMemory(N, Q);
+	rep(i, 0, N-1)
+	{
+		workload.initialValues[i] = GenKey16M();
+	}
+	// The lower_bound keys are drawn from a pool of random keys, rank i being queryPool[i]
+	//
+	vector<uint64_t> queryPool(N);
+	rep(i, 0, N-1)
+	{
+		queryPool[i] = GenKey16M();
+	}
+	ZipfianGenerator zipf(N, skew);
+	rep(i, 0, Q-1)
+	{
+		workload.operations[i].type = WorkloadOperationType::LOWER_BOUND;
+		workload.operations[i].key = queryPool[zipf.Next()];
+	}
+	workload.PopulateExpectedResultsUsingStdSet();
+	return workload;
+}
+
 }	// namespace WorkloadB
 
@@ -119,3 +119,27 @@ void WorkloadUInt64::EnforceDependency()
 	printf("Completed enforcing dependency.\n");
 }
 
+ZipfianGenerator::ZipfianGenerator(uint64_t n, double skew)
+{
+	ReleaseAssert(n > 0);
+	cdf.resize(n);
+	double sum = 0;
+	rep(i, 0, n - 1)
+	{
+		sum += 1.0 / pow(double(i + 1), skew);
+		cdf[i] = sum;
+	}
+	rep(i, 0, n - 1)
+	{
+		cdf[i] /= sum;
+	}
+}
+
+uint64_t ZipfianGenerator::Next()
+{
+	// rand() only gives 31 bits, which is not enough resolution for the tail
+	//
+	double u = (double(rand()) * 2147483648.0 + double(rand())) / 4611686018427387904.0;
+	uint64_t rank = lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin();
+	return min(rank, uint64_t(cdf.size() - 1));
+}
@@ -39,3 +39,15 @@ struct WorkloadUInt64
 	
 };
 
+// Draws ranks in [0, n) from a Zipfian distribution with the given skew, rank 0 being the most frequent
+//
+struct ZipfianGenerator
+{
+	ZipfianGenerator(uint64_t n, double skew);
+	
+	uint64_t Next();
+	
+	// cdf[i] = P(rank <= i)
+	//
+	vector<double> cdf;
+};
@@ -1,6 +1,7 @@
 #include "dense_hash_set_wrapper.h"
 
 #include "common.h"
+#include "MlpSetHashFamily.h"
 // dense_hash_set is also using the macro rep
 #undef rep
 
@@ -54,54 +55,11 @@ struct Mallocator {
   };
 };
 
-namespace XXH
-{
-
-static const uint32_t XXH_SEED1 = 1192827283U;
-static const uint32_t XXH_SEED2 = 534897851U;
-
-static const uint32_t PRIME32_1 = 2654435761U;
-static const uint32_t PRIME32_2 = 2246822519U;
-static const uint32_t PRIME32_3 = 3266489917U;
-static const uint32_t PRIME32_4 = 668265263U;
-static const uint32_t PRIME32_5 = 374761393U;
-
-#define XXH_rotl32(x,r) ((x << r) | (x >> (32 - r)))
-
-uint32_t XXH32_avalanche(uint32_t h32)
-{
-    h32 ^= h32 >> 15;
-    h32 *= PRIME32_2;
-    h32 ^= h32 >> 13;
-    h32 *= PRIME32_3;
-    h32 ^= h32 >> 16;
-    return h32;
-}
-
-uint32_t XXH32_CoreLogic(uint64_t key, int32_t seed, uint32_t multiplier)
-{
-	uint32_t low = key;
-	uint32_t high = key >> 32;
-	uint32_t h32 = PRIME32_5 + seed + 8;
-	h32 ^= high * multiplier; 
-	h32 = XXH_rotl32(h32, 17) * PRIME32_4;
-	h32 ^= low * multiplier; 
-	h32 = XXH_rotl32(h32, 17) * PRIME32_4;
-	return XXH32_avalanche(h32);
-}
-
-uint32_t XXHashFn(uint64_t key)
-{
-	return XXH32_CoreLogic(key, 0 /*seed*/, PRIME32_3);
-}
-
-} // namespace XXH
-
 struct HashFn
 {
 	uint64_t operator()(const uint64_t& v) const
 	{
-		return XXH::XXHashFn(v);
+		return MlpSetUInt64::XXHashFamily::HashFn3(v, 8 /*len*/);
 	}
 };
 